@@ -13,4 +13,15 @@
 # WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 # See the License for the specific language governing permissions and
 # limitations under the License.
-from .layer_norm import FusedLayerNorm
+from .layer_norm import (
+    FusedLayerNorm,
+    FusedLayerNormLinear,
+    FusedRMSNorm,
+    fused_ada_layer_norm,
+    fused_grouped_layer_norm,
+    fused_layer_norm,
+    fused_layer_norm_fp8,
+    fused_layer_norm_inference,
+    fused_layer_norm_masked,
+    fused_layer_norm_streaming,
+)
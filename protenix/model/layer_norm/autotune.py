@@ -0,0 +1,237 @@
+# Copyright 2024 ByteDance and/or its affiliates.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Launch-configuration autotuner for the fused LayerNorm extension.
+
+The first time a (device arch, dtype, cols, rows bucket, affine mode) is seen, the
+forward and the backward are timed with every candidate launch (the built-in kernel
+choice, and the generic V2 kernels at several block sizes). The winners are handed to
+the extension and appended to a JSON cache next to the JIT build directory, so later
+processes on the same kind of GPU start with them and do not benchmark again.
+
+Tuning is opt-in with PROTENIX_LAYERNORM_AUTOTUNE=1, since it runs extra kernels the
+first time each shape is seen. The cached choices are applied either way.
+"""
+
+import json
+import logging
+import math
+import os
+import tempfile
+from typing import Any, Optional
+
+import torch
+
+logger = logging.getLogger(__name__)
+
+VARIANT_DEFAULT = 0  # block-per-row / register-cached / fused kernels where they apply
+VARIANT_GENERIC = 1  # always the V2 kernels, with the given threads_per_block
+
+# (variant, threads_per_block)
+CANDIDATES = [
+    (VARIANT_DEFAULT, 128),
+    (VARIANT_GENERIC, 64),
+    (VARIANT_GENERIC, 128),
+    (VARIANT_GENERIC, 256),
+    (VARIANT_GENERIC, 512),
+]
+
+DIRECTIONS = ("forward", "backward")
+
+
+def rows_bucket(rows: int) -> int:
+    """floor(log2(rows)), 0 for rows <= 1: how many rows there are matters to the best
+    launch (grid fill, the block-per-row switch), the exact count does not. Matches
+    RowsBucket in layer_norm_cuda_kernel.cu."""
+    return max(rows, 1).bit_length() - 1
+
+
+def _affine_suffix(has_gamma: bool, has_beta: bool) -> str:
+    return {
+        (False, False): "none_affine",
+        (False, True): "with_bias_affine",
+        (True, False): "with_weight_affine",
+        (True, True): "with_both_affine",
+    }[(has_gamma, has_beta)]
+
+
+class LayerNormAutotuner:
+    def __init__(
+        self, ext: Any, cache_path: str, enabled: Optional[bool] = None
+    ) -> None:
+        """
+        Args:
+            ext: the compiled fast_layer_norm_cuda_v2 module
+            cache_path (str) JSON file the tuned launches are read from and written to
+            enabled (bool, optional) whether unseen shapes are benchmarked; defaults to
+                PROTENIX_LAYERNORM_AUTOTUNE=1
+        """
+        self.ext = ext
+        self.cache_path = cache_path
+        if enabled is None:
+            enabled = os.environ.get("PROTENIX_LAYERNORM_AUTOTUNE", "0") == "1"
+        self.enabled = enabled
+        self.warmup = 3
+        self.iters = 10
+        # Keys tuned in this process or loaded from the cache.
+        self._known = set()
+        for key, entry in self._read_cache().items():
+            # Entries written before rows were part of the key are tuned again.
+            if "rows_bucket" not in entry:
+                continue
+            self._apply(entry)
+            self._known.add(key)
+
+    @staticmethod
+    def key(
+        arch: int,
+        dtype: torch.dtype,
+        cols: int,
+        bucket: int,
+        has_gamma: bool,
+        has_beta: bool,
+        direction: str,
+    ) -> str:
+        dtype_name = str(dtype).replace("torch.", "")
+        affine = f"{int(has_gamma)}{int(has_beta)}"
+        return f"sm{arch}/{dtype_name}/{cols}/r{bucket}/{affine}/{direction}"
+
+    def maybe_tune(
+        self,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        normalized_shape: torch.Size,
+        eps: float,
+    ) -> None:
+        """Tunes the launch for this input's shape class unless it is already known."""
+        if not self.enabled or not input.is_cuda or input.dtype not in (
+            torch.float32,
+            torch.float16,
+            torch.bfloat16,
+        ):
+            return
+        major, minor = torch.cuda.get_device_capability(input.device)
+        arch = major * 10 + minor
+        cols = math.prod(normalized_shape)
+        bucket = rows_bucket(input.numel() // cols if cols > 0 else 0)
+        has_gamma, has_beta = weight is not None, bias is not None
+        keys = {
+            direction: self.key(
+                arch, input.dtype, cols, bucket, has_gamma, has_beta, direction
+            )
+            for direction in DIRECTIONS
+        }
+        if all(key in self._known for key in keys.values()):
+            return
+        # Benchmarking would be recorded into the graph.
+        if torch.cuda.is_current_stream_capturing():
+            return
+        self._known.update(keys.values())
+
+        with torch.no_grad():
+            x = input.detach()
+            gamma = None if weight is None else weight.detach().to(x.dtype)
+            beta = None if bias is None else bias.detach().to(x.dtype)
+            params = [p for p in (gamma, beta) if p is not None]
+            suffix = _affine_suffix(has_gamma, has_beta)
+            forward = getattr(self.ext, f"forward_{suffix}")
+            backward = getattr(self.ext, f"backward_{suffix}")
+            _, mean, invvar = forward(x, normalized_shape, *params, eps)
+            # Timing does not depend on the values; x doubles as the output gradient.
+            runs = {
+                "forward": lambda: forward(x, normalized_shape, *params, eps),
+                "backward": lambda: backward(
+                    x, mean, invvar, x, normalized_shape, *params, eps
+                ),
+            }
+            entries = {}
+            for direction, run in runs.items():
+                entry = dict(
+                    arch=arch,
+                    dtype=str(x.dtype).replace("torch.", ""),
+                    cols=cols,
+                    rows_bucket=bucket,
+                    has_gamma=has_gamma,
+                    has_beta=has_beta,
+                    backward=direction == "backward",
+                )
+                timings = []
+                for variant, threads in CANDIDATES:
+                    self._apply(dict(entry, variant=variant, threads_per_block=threads))
+                    timings.append((self._time_us(run), variant, threads))
+                best_us, variant, threads_per_block = min(timings)
+                entry.update(variant=variant, threads_per_block=threads_per_block)
+                entry["us"] = best_us
+                self._apply(entry)
+                entries[keys[direction]] = entry
+                logger.info(
+                    f"LayerNorm autotune {keys[direction]}: variant={variant} "
+                    f"threads_per_block={threads_per_block} ({best_us:.1f} us)"
+                )
+        self._write_cache(entries)
+
+    def _apply(self, entry: dict) -> None:
+        self.ext.set_tuned_launch(
+            entry["arch"],
+            entry["dtype"],
+            entry["cols"],
+            entry["rows_bucket"],
+            entry["has_gamma"],
+            entry["has_beta"],
+            entry["backward"],
+            entry["variant"],
+            entry["threads_per_block"],
+        )
+
+    def _time_us(self, run) -> float:
+        for _ in range(self.warmup):
+            run()
+        start = torch.cuda.Event(enable_timing=True)
+        end = torch.cuda.Event(enable_timing=True)
+        start.record()
+        for _ in range(self.iters):
+            run()
+        end.record()
+        end.synchronize()
+        return start.elapsed_time(end) * 1e3 / self.iters
+
+    def _read_cache(self) -> dict:
+        try:
+            with open(self.cache_path) as f:
+                return json.load(f)
+        except FileNotFoundError:
+            return {}
+        except (OSError, ValueError) as e:
+            logger.warning(
+                f"Ignoring unreadable LayerNorm autotune cache {self.cache_path}: {e}"
+            )
+            return {}
+
+    def _write_cache(self, entries: dict) -> None:
+        # Merge with what other processes wrote meanwhile; os.replace keeps readers from
+        # ever seeing a partial file.
+        cache = self._read_cache()
+        cache.update(entries)
+        directory = os.path.dirname(self.cache_path) or "."
+        try:
+            with tempfile.NamedTemporaryFile(
+                "w", dir=directory, suffix=".tmp", delete=False
+            ) as f:
+                json.dump(cache, f, indent=1, sort_keys=True)
+            os.replace(f.name, self.cache_path)
+        except OSError as e:
+            logger.warning(
+                f"Could not write LayerNorm autotune cache {self.cache_path}: {e}"
+            )
@@ -0,0 +1,312 @@
+// Copyright 2024 ByteDance and/or its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// CPU LayerNorm behind the same bindings as the CUDA kernels: layer_norm_cuda.cpp sends CPU
+// tensors here. Rows are split over ATen's intra-op threads with at::parallel_for. Each row is
+// widened to fp32 once, its statistics come from a single-pass Welford over kLanes independent
+// lanes, and the per-row loops are compiled for AVX-512, AVX2 and baseline x86-64
+// (target_clones), the best of which is picked for the host CPU when the library is loaded.
+
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LN_CPU_MULTIVERSION \
+    __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", "default")))
+#else
+#define LN_CPU_MULTIVERSION
+#endif
+
+namespace layer_norm_cpu {
+
+// Welford lanes per row: element i goes to lane i % kLanes, so the lane update is one 512-bit
+// (or two 256-bit) vector operation and the lanes are merged once at the end of the row.
+constexpr int kLanes = 16;
+
+inline void WelfordMerge(float b_mean, float b_m2, float b_count, float* mean, float* m2,
+                         float* count) {
+    if (b_count == 0.f) return;
+    const float new_count = *count + b_count;
+    const float delta = b_mean - *mean;
+    *mean += delta * b_count / new_count;
+    *m2 += b_m2 + delta * delta * (*count) * b_count / new_count;
+    *count = new_count;
+}
+
+// Mean and biased variance of the n floats at x in one pass.
+LN_CPU_MULTIVERSION
+void RowMoments(const float* x, int64_t n, float* mean_out, float* var_out) {
+    float mean[kLanes] = {0.f};
+    float m2[kLanes] = {0.f};
+    const int64_t chunks = n / kLanes;
+    for (int64_t c = 0; c < chunks; ++c) {
+        const float inv_count = 1.f / static_cast<float>(c + 1);
+        const float* chunk = x + c * kLanes;
+        for (int l = 0; l < kLanes; ++l) {
+            const float delta = chunk[l] - mean[l];
+            mean[l] += delta * inv_count;
+            m2[l] += delta * (chunk[l] - mean[l]);
+        }
+    }
+    float row_mean = 0.f, row_m2 = 0.f, count = 0.f;
+    for (int l = 0; l < kLanes; ++l) {
+        WelfordMerge(mean[l], m2[l], static_cast<float>(chunks), &row_mean, &row_m2, &count);
+    }
+    for (int64_t i = chunks * kLanes; i < n; ++i) {
+        WelfordMerge(x[i], 0.f, 1.f, &row_mean, &row_m2, &count);
+    }
+    *mean_out = row_mean;
+    *var_out = row_m2 / static_cast<float>(n);
+}
+
+LN_CPU_MULTIVERSION
+void NormalizeRow(const float* x, int64_t n, float mean, float rstd, const float* gamma,
+                  const float* beta, float* y) {
+    for (int64_t i = 0; i < n; ++i) {
+        y[i] = (x[i] - mean) * rstd * gamma[i] + beta[i];
+    }
+}
+
+// Gradient of one row w.r.t. its input, plus its contribution to the weight/bias gradients,
+// which is added to dgamma/dbeta.
+LN_CPU_MULTIVERSION
+void BackwardRow(const float* x, const float* dy, const float* gamma, int64_t n, float mean,
+                 float rstd, float* dgamma, float* dbeta, float* dx) {
+    float sum_g = 0.f, sum_g_xhat = 0.f;
+#pragma omp simd reduction(+ : sum_g, sum_g_xhat)
+    for (int64_t i = 0; i < n; ++i) {
+        const float xhat = (x[i] - mean) * rstd;
+        const float g = dy[i] * gamma[i];
+        sum_g += g;
+        sum_g_xhat += g * xhat;
+        dgamma[i] += dy[i] * xhat;
+        dbeta[i] += dy[i];
+    }
+    const float inv_n = 1.f / static_cast<float>(n);
+    const float mean_g = sum_g * inv_n;
+    const float mean_g_xhat = sum_g_xhat * inv_n;
+    for (int64_t i = 0; i < n; ++i) {
+        const float xhat = (x[i] - mean) * rstd;
+        dx[i] = rstd * (dy[i] * gamma[i] - mean_g - xhat * mean_g_xhat);
+    }
+}
+
+LN_CPU_MULTIVERSION
+void Widen(const c10::BFloat16* src, float* dst, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) dst[i] = static_cast<float>(src[i]);
+}
+
+LN_CPU_MULTIVERSION
+void Widen(const c10::Half* src, float* dst, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) dst[i] = static_cast<float>(src[i]);
+}
+
+LN_CPU_MULTIVERSION
+void Narrow(const float* src, c10::BFloat16* dst, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) dst[i] = static_cast<c10::BFloat16>(src[i]);
+}
+
+LN_CPU_MULTIVERSION
+void Narrow(const float* src, c10::Half* dst, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) dst[i] = static_cast<c10::Half>(src[i]);
+}
+
+// A row of T as floats: the row itself for float, otherwise widened into buffer.
+template <typename T>
+const float* RowAsFloat(const T* row, float* buffer, int64_t n) {
+    if constexpr (std::is_same_v<T, float>) {
+        return row;
+    } else {
+        Widen(row, buffer, n);
+        return buffer;
+    }
+}
+
+// Where a float result row for the T row `row` is computed: in place for float, otherwise in
+// buffer and then StoreRow narrows it into row.
+template <typename T>
+float* RowResult(T* row, float* buffer) {
+    if constexpr (std::is_same_v<T, float>) {
+        return row;
+    } else {
+        return buffer;
+    }
+}
+
+template <typename T>
+void StoreRow(const float* result, T* row, int64_t n) {
+    if constexpr (!std::is_same_v<T, float>) Narrow(result, row, n);
+}
+
+template <typename P>
+std::vector<float> ParamsAsFloat(const P* param, int64_t n, float fill) {
+    std::vector<float> out(n, fill);
+    if (param != nullptr) {
+        for (int64_t i = 0; i < n; ++i) out[i] = static_cast<float>(param[i]);
+    }
+    return out;
+}
+
+// Rows per parallel_for task: about GRAIN_SIZE elements, so narrow rows are batched.
+inline int64_t GrainRows(int64_t cols) {
+    return std::max<int64_t>(1, at::internal::GRAIN_SIZE / std::max<int64_t>(cols, 1));
+}
+
+template <typename T, typename P>
+void LayerNormForward(const T* input, T* output, const P* gamma, const P* beta, float* mean,
+                      float* invvar, int64_t rows, int64_t cols, float epsilon) {
+    const std::vector<float> gamma_f = ParamsAsFloat(gamma, cols, 1.f);
+    const std::vector<float> beta_f = ParamsAsFloat(beta, cols, 0.f);
+    constexpr bool kWiden = !std::is_same_v<T, float>;
+    at::parallel_for(0, rows, GrainRows(cols), [&](int64_t begin, int64_t end) {
+        std::vector<float> x_buffer(kWiden ? cols : 0), y_buffer(kWiden ? cols : 0);
+        for (int64_t row = begin; row < end; ++row) {
+            const float* x = RowAsFloat(input + row * cols, x_buffer.data(), cols);
+            float row_mean, row_var;
+            RowMoments(x, cols, &row_mean, &row_var);
+            const float rstd = 1.f / std::sqrt(row_var + epsilon);
+            float* y = RowResult(output + row * cols, y_buffer.data());
+            NormalizeRow(x, cols, row_mean, rstd, gamma_f.data(), beta_f.data(), y);
+            StoreRow(y, output + row * cols, cols);
+            if (mean != nullptr) {
+                mean[row] = row_mean;
+                invvar[row] = rstd;
+            }
+        }
+    });
+}
+
+// mean == invvar == nullptr: the row statistics are recomputed from input. The weight/bias
+// gradients are summed per thread and the thread partials reduced at the end.
+template <typename T, typename P>
+void LayerNormBackward(const T* dout, const T* input, const float* mean, const float* invvar,
+                       const P* gamma, int64_t rows, int64_t cols, float epsilon, T* grad_input,
+                       P* grad_gamma, P* grad_beta) {
+    const std::vector<float> gamma_f = ParamsAsFloat(gamma, cols, 1.f);
+    const int num_threads = at::get_num_threads();
+    std::vector<float> part_dgamma(size_t(num_threads) * cols, 0.f);
+    std::vector<float> part_dbeta(size_t(num_threads) * cols, 0.f);
+    constexpr bool kWiden = !std::is_same_v<T, float>;
+    at::parallel_for(0, rows, GrainRows(cols), [&](int64_t begin, int64_t end) {
+        float* dgamma = part_dgamma.data() + size_t(at::get_thread_num()) * cols;
+        float* dbeta = part_dbeta.data() + size_t(at::get_thread_num()) * cols;
+        std::vector<float> x_buffer(kWiden ? cols : 0), dy_buffer(kWiden ? cols : 0),
+            dx_buffer(kWiden ? cols : 0);
+        for (int64_t row = begin; row < end; ++row) {
+            const float* x = RowAsFloat(input + row * cols, x_buffer.data(), cols);
+            const float* dy = RowAsFloat(dout + row * cols, dy_buffer.data(), cols);
+            float row_mean, rstd;
+            if (mean != nullptr) {
+                row_mean = mean[row];
+                rstd = invvar[row];
+            } else {
+                float row_var;
+                RowMoments(x, cols, &row_mean, &row_var);
+                rstd = 1.f / std::sqrt(row_var + epsilon);
+            }
+            float* dx = RowResult(grad_input + row * cols, dx_buffer.data());
+            BackwardRow(x, dy, gamma_f.data(), cols, row_mean, rstd, dgamma, dbeta, dx);
+            StoreRow(dx, grad_input + row * cols, cols);
+        }
+    });
+    for (int64_t col = 0; col < cols; ++col) {
+        float sum_gamma = 0.f, sum_beta = 0.f;
+        for (int t = 0; t < num_threads; ++t) {
+            sum_gamma += part_dgamma[size_t(t) * cols + col];
+            sum_beta += part_dbeta[size_t(t) * cols + col];
+        }
+        if (grad_gamma != nullptr) grad_gamma[col] = static_cast<P>(sum_gamma);
+        if (grad_beta != nullptr) grad_beta[col] = static_cast<P>(sum_beta);
+    }
+}
+
+// Calls f with a value of the activation type: float, at::Half or at::BFloat16.
+template <typename F>
+void DispatchActivationType(at::ScalarType type, const char* name, F&& f) {
+    switch (type) {
+        case at::ScalarType::Float: f(float()); break;
+        case at::ScalarType::Half: f(at::Half()); break;
+        case at::ScalarType::BFloat16: f(at::BFloat16()); break;
+        default: AT_ERROR(name, " not implemented for '", toString(type), "'");
+    }
+}
+
+// Calls f with a value of the parameter type: float, or the activation type T.
+template <typename T, typename F>
+void DispatchParamType(at::ScalarType param_type, F&& f) {
+    if (param_type == at::ScalarType::Float) {
+        f(float());
+    } else {
+        f(T());
+    }
+}
+
+template <typename P>
+const P* optional_ptr(const at::Tensor* t) {
+    return t != nullptr ? static_cast<const P*>(t->data_ptr()) : nullptr;
+}
+
+template <typename P>
+P* optional_mutable_ptr(at::Tensor* t) {
+    return t != nullptr ? static_cast<P*>(t->data_ptr()) : nullptr;
+}
+
+}  // namespace layer_norm_cpu
+
+// CPU counterpart of cuda_layer_norm, for contiguous [rows, cols] input. mean/invvar may be
+// NULL (inference).
+void cpu_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar, at::Tensor* input,
+                    int64_t rows, int64_t cols, at::Tensor* gamma, at::Tensor* beta,
+                    double epsilon) {
+    using namespace layer_norm_cpu;
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    DispatchActivationType(input->scalar_type(), "cpu_layer_norm", [&](auto activation) {
+        using T = decltype(activation);
+        DispatchParamType<T>(param_type, [&](auto param) {
+            using P = decltype(param);
+            LayerNormForward<T, P>(static_cast<const T*>(input->data_ptr()),
+                                   static_cast<T*>(output->data_ptr()), optional_ptr<P>(gamma),
+                                   optional_ptr<P>(beta), optional_mutable_ptr<float>(mean),
+                                   optional_mutable_ptr<float>(invvar), rows, cols,
+                                   float(epsilon));
+        });
+    });
+}
+
+// CPU counterpart of cuda_layer_norm_gradient; mean/invvar NULL recomputes the statistics.
+void cpu_layer_norm_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                             at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* gamma,
+                             at::Tensor* beta, double epsilon, at::Tensor* grad_input,
+                             at::Tensor* grad_gamma, at::Tensor* grad_beta) {
+    using namespace layer_norm_cpu;
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    DispatchActivationType(input->scalar_type(), "cpu_layer_norm_gradient", [&](auto activation) {
+        using T = decltype(activation);
+        DispatchParamType<T>(param_type, [&](auto param) {
+            using P = decltype(param);
+            LayerNormBackward<T, P>(
+                static_cast<const T*>(dout->data_ptr()), static_cast<const T*>(input->data_ptr()),
+                optional_ptr<float>(mean), optional_ptr<float>(invvar), optional_ptr<P>(gamma),
+                rows, cols, float(epsilon), static_cast<T*>(grad_input->data_ptr()),
+                optional_mutable_ptr<P>(grad_gamma), optional_mutable_ptr<P>(grad_beta));
+        });
+    });
+}
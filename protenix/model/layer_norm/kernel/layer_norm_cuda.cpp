@@ -11,16 +11,33 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 
+// Bindings of the fused LayerNorm. Builds without WITH_CUDA (the CppExtension of
+// torch_ext_compile.py, for hosts without a CUDA toolkit) keep only the plain LayerNorm forward
+// and backward, which run on CPU tensors through layer_norm_cpu.cpp.
+
 #include <torch/extension.h>
+#include <torch/library.h>
+#ifdef WITH_CUDA
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAGraphsC10Utils.h>
 #include <c10/cuda/CUDAGuard.h>
+#include <nvtx3/nvToolsExt.h>
+#endif
 
+#include <atomic>
 #include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
 #include <vector>
 #include <functional>
 
 #include "compat.h"
 
-void compute_n1_n2(at::Tensor input, at::IntArrayRef normalized_shape, int& n1, int& n2) {
+void compute_n1_n2(at::Tensor input, at::IntArrayRef normalized_shape, int64_t& n1, int64_t& n2) {
     int idiff = input.ndimension() - normalized_shape.size();
     n2 = 1;
     for (int i = 0; i < (int)normalized_shape.size(); ++i) {
@@ -33,7 +50,7 @@ void compute_n1_n2(at::Tensor input, at::IntArrayRef normalized_shape, int& n1,
     }
 }
 
-void check_args(at::Tensor input, at::IntArrayRef normalized_shape, int& n1, int& n2) {
+void check_args(at::Tensor input, at::IntArrayRef normalized_shape, int64_t& n1, int64_t& n2) {
     int64_t normalized_ndim = normalized_shape.size();
 
     if (normalized_ndim < 1) {
@@ -61,7 +78,7 @@ void check_args(at::Tensor input, at::IntArrayRef normalized_shape, int& n1, int
 }
 
 void cuda_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar, at::Tensor* input,
-                     int n1, int n2, at::IntArrayRef normalized_shape, at::Tensor* gamma,
+                     int64_t n1, int64_t n2, at::IntArrayRef normalized_shape, at::Tensor* gamma,
                      at::Tensor* beta, double epsilon);
 
 #define CHECK_CUDA(x) TORCH_CHECK(x.is_cuda(), #x " must be a CUDA tensor")
@@ -69,45 +86,302 @@ void cuda_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar, a
 #define CHECK_INPUT(x) \
     CHECK_CUDA(x);     \
     CHECK_CONTIGUOUS(x)
+// The plain LayerNorm forward and backward also run on CPU (layer_norm_cpu.cpp).
+#ifdef WITH_CUDA
+#define CHECK_CUDA_OR_CPU(x) \
+    TORCH_CHECK(x.is_cuda() || x.is_cpu(), #x " must be a CUDA or CPU tensor")
+#else
+#define CHECK_CUDA_OR_CPU(x) \
+    TORCH_CHECK(x.is_cpu(), #x " must be a CPU tensor: the extension was built without CUDA")
+#endif
+
+void cpu_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar, at::Tensor* input,
+                    int64_t rows, int64_t cols, at::Tensor* gamma, at::Tensor* beta,
+                    double epsilon);
+
+void cpu_layer_norm_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                             at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* gamma,
+                             at::Tensor* beta, double epsilon, at::Tensor* grad_input,
+                             at::Tensor* grad_gamma, at::Tensor* grad_beta);
+
+// Every operand of a call on the device of input, with contiguous parameters.
+void check_same_device(const at::Tensor& input, std::initializer_list<const at::Tensor*> others) {
+    for (const at::Tensor* t : others) {
+        if (t == NULL || !t->defined()) continue;
+        TORCH_CHECK(t->device() == input.device(), "expected every tensor on ", input.device(),
+                    ", got one on ", t->device());
+    }
+}
+
+// True when the normalized dimensions of t are packed innermost (row-major, unit stride) and
+// the rows tile t's storage without gaps, whatever the order of the outer dimensions, e.g. a
+// transposed view of a contiguous pair tensor. The kernels then see t as a contiguous
+// [n1, n2] buffer: LayerNorm works row by row, so the order of the rows in memory does not
+// matter as long as every per-element operand shares the layout.
+bool has_dense_rows(const at::Tensor& t, int64_t normalized_ndim) {
+    if (!t.is_non_overlapping_and_dense()) return false;
+    int64_t expected_stride = 1;
+    for (int64_t dim = t.dim() - 1; dim >= t.dim() - normalized_ndim; --dim) {
+        if (t.size(dim) != 1 && t.stride(dim) != expected_stride) return false;
+        expected_stride *= t.size(dim);
+    }
+    return true;
+}
+
+// t itself when has_dense_rows, otherwise a contiguous copy.
+at::Tensor with_dense_rows(const at::Tensor& t, int64_t normalized_ndim) {
+    return has_dense_rows(t, normalized_ndim) ? t : t.contiguous();
+}
+
+// t in the memory layout of ref (same shape), copied only when the strides differ.
+at::Tensor with_layout_of(const at::Tensor& t, const at::Tensor& ref) {
+    if (t.strides().equals(ref.strides())) return t;
+    return at::empty_like(ref, t.options()).copy_(t);
+}
+
+// gamma and beta share one dtype: that of the activations, or float32 (master parameters
+// next to half-precision activations, read without a cast and given fp32 gradients).
+void check_param_types(const at::Tensor& activation, at::Tensor* gamma, at::Tensor* beta) {
+    for (at::Tensor* param : {gamma, beta}) {
+        if (param == NULL) continue;
+        TORCH_CHECK(param->scalar_type() == activation.scalar_type() ||
+                        param->scalar_type() == at::ScalarType::Float,
+                    "LayerNorm parameters must be float32 or match the input dtype ",
+                    activation.scalar_type(), ", got ", param->scalar_type());
+    }
+    if (gamma != NULL && beta != NULL) {
+        TORCH_CHECK(gamma->scalar_type() == beta->scalar_type(),
+                    "LayerNorm weight and bias must have the same dtype, got ",
+                    gamma->scalar_type(), " and ", beta->scalar_type());
+    }
+}
+
+#ifdef WITH_CUDA
+std::string last_layer_norm_launch();
+
+// Profiling mode, on with PROTENIX_LAYERNORM_PROFILE=1 or set_profiling(true). Every
+// LayerNorm forward/backward is then wrapped in an NVTX range tagged with its shape and dtype,
+// with a mark inside naming the kernel and launch shape it dispatched to, and is timed with a
+// pair of CUDA events. The events are read back only when the stats are queried, so profiled
+// calls still do not synchronize with the host. Calls under CUDA graph capture are skipped.
+struct ProfiledCall {
+    std::string op;
+    int64_t rows;
+    int64_t cols;
+    std::string dtype;
+    std::string kernel;
+    int64_t bytes;  // minimum DRAM traffic: every operand read or written once
+    std::unique_ptr<at::cuda::CUDAEvent> start;
+    std::unique_ptr<at::cuda::CUDAEvent> end;
+};
+
+// Bounds the events kept alive between two queries.
+constexpr size_t kMaxProfiledCalls = 1 << 16;
+
+static std::atomic<bool> profiling_enabled{[] {
+    const char* env = std::getenv("PROTENIX_LAYERNORM_PROFILE");
+    return env != nullptr && std::string(env) == "1";
+}()};
+static std::mutex profiled_calls_mutex;
+static std::vector<ProfiledCall> profiled_calls;
 
+class ProfileScope {
+   public:
+    ProfileScope(const char* op, const at::Tensor& input, int64_t rows, int64_t cols,
+                 int64_t bytes) {
+        if (!profiling_enabled.load(std::memory_order_relaxed) ||
+            c10::cuda::currentStreamCaptureStatusMayInitCtx() !=
+                c10::cuda::CaptureStatus::None) {
+            return;
+        }
+        call_ = std::make_unique<ProfiledCall>();
+        call_->op = op;
+        call_->rows = rows;
+        call_->cols = cols;
+        call_->dtype = c10::toString(input.scalar_type());
+        call_->bytes = bytes;
+        call_->start = std::make_unique<at::cuda::CUDAEvent>(cudaEventDefault);
+        call_->end = std::make_unique<at::cuda::CUDAEvent>(cudaEventDefault);
+        std::stringstream tag;
+        tag << "LayerNorm " << op << " rows=" << rows << " cols=" << cols
+            << " dtype=" << call_->dtype;
+        nvtxRangePushA(tag.str().c_str());
+        call_->start->record();
+    }
+
+    // Drops the call, for a binding that hands the work to another profiled one instead.
+    void dismiss() {
+        if (!call_) return;
+        nvtxRangePop();
+        call_.reset();
+    }
+
+    ~ProfileScope() {
+        if (!call_) return;
+        call_->end->record();
+        call_->kernel = last_layer_norm_launch();
+        nvtxMarkA(call_->kernel.c_str());
+        nvtxRangePop();
+        std::lock_guard<std::mutex> lock(profiled_calls_mutex);
+        if (profiled_calls.size() < kMaxProfiledCalls) profiled_calls.push_back(std::move(*call_));
+    }
+
+   private:
+    std::unique_ptr<ProfiledCall> call_;
+};
+
+int64_t param_bytes(const at::Tensor* gamma, const at::Tensor* beta) {
+    int64_t bytes = 0;
+    for (const at::Tensor* param : {gamma, beta}) {
+        if (param != NULL) bytes += param->numel() * param->element_size();
+    }
+    return bytes;
+}
+
+int64_t param_bytes(const c10::optional<at::Tensor>& gamma,
+                    const c10::optional<at::Tensor>& beta) {
+    return param_bytes(gamma.has_value() ? &gamma.value() : NULL,
+                       beta.has_value() ? &beta.value() : NULL);
+}
+
+int64_t stats_bytes(int64_t rows) { return rows * int64_t(sizeof(float)); }
+
+void set_profiling(bool enabled) { profiling_enabled.store(enabled, std::memory_order_relaxed); }
+
+// One (op, rows, cols, dtype, kernel, bytes, elapsed_us) per profiled call since the last
+// reset, oldest first. Waits for the calls to finish on the device.
+std::vector<std::tuple<std::string, int64_t, int64_t, std::string, std::string, int64_t, double>>
+profile_stats() {
+    std::lock_guard<std::mutex> lock(profiled_calls_mutex);
+    std::vector<std::tuple<std::string, int64_t, int64_t, std::string, std::string, int64_t,
+                           double>>
+        stats;
+    stats.reserve(profiled_calls.size());
+    for (const ProfiledCall& call : profiled_calls) {
+        call.end->synchronize();
+        const double elapsed_us = 1e3 * call.start->elapsed_time(*call.end);
+        stats.emplace_back(call.op, call.rows, call.cols, call.dtype, call.kernel, call.bytes,
+                           elapsed_us);
+    }
+    return stats;
+}
+
+void reset_profile_stats() {
+    std::lock_guard<std::mutex> lock(profiled_calls_mutex);
+    profiled_calls.clear();
+}
+#endif  // WITH_CUDA
+
+// The output (and, in the backward, grad_input) is allocated in the layout of input, so a
+// permuted view is normalized without the copy a .contiguous() call would make.
 std::vector<at::Tensor> layer_norm_affine(at::Tensor input, at::IntArrayRef normalized_shape,
                                           at::Tensor *gamma, at::Tensor *beta, double epsilon) {
-    CHECK_INPUT(input);
+    CHECK_CUDA_OR_CPU(input);
     // CHECK_INPUT((*gamma));
     // CHECK_INPUT((*beta));
-    int n1, n2;
+    int64_t n1, n2;
     check_args(input, normalized_shape, n1, n2);
-
-    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+    check_param_types(input, gamma, beta);
+    check_same_device(input, {gamma, beta});
+    input = with_dense_rows(input, normalized_shape.size());
 
     at::Tensor output = at::empty_like(input, input.options().dtype(input.scalar_type()));
     at::Tensor mean = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
     at::Tensor invvar = at::empty_like(mean);
+    if (input.is_cpu()) {
+        cpu_layer_norm(&output, &mean, &invvar, &input, n1, n2, gamma, beta, epsilon);
+        return {output, mean, invvar};
+    }
 
+#ifdef WITH_CUDA
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    const ProfileScope profile("forward", input, n1, n2,
+                               2 * input.numel() * input.element_size() +
+                                   param_bytes(gamma, beta) + 2 * n1 * int64_t(sizeof(float)));
     cuda_layer_norm(&output, &mean, &invvar, &input, n1, n2, normalized_shape, gamma, beta, epsilon);
+#endif
 
     return {output, mean, invvar};
 }
 
+// Inference forward: no row statistics are stored (nothing to allocate for them), and the
+// output may be written into `out`, e.g. a chunk of a preallocated buffer, instead of a new
+// tensor. `out` must have the shape and dtype of input and its memory layout after
+// with_dense_rows, so a contiguous input takes a contiguous `out`.
+at::Tensor layer_norm_inference_affine(at::Tensor input, at::IntArrayRef normalized_shape,
+                                       c10::optional<at::Tensor> gamma,
+                                       c10::optional<at::Tensor> beta, double epsilon,
+                                       c10::optional<at::Tensor> out) {
+    CHECK_CUDA_OR_CPU(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    check_param_types(input, gamma_ptr, beta_ptr);
+    check_same_device(input, {gamma_ptr, beta_ptr});
+    input = with_dense_rows(input, normalized_shape.size());
+
+#ifdef WITH_CUDA
+    const at::cuda::OptionalCUDAGuard device_guard(
+        input.is_cuda() ? device_of(input) : c10::nullopt);
+#endif
+
+    at::Tensor output;
+    if (out.has_value()) {
+        output = *out;
+        TORCH_CHECK(output.device() == input.device() &&
+                        output.scalar_type() == input.scalar_type() &&
+                        output.sizes().equals(input.sizes()),
+                    "out must have the device, dtype and shape of input, but got ",
+                    output.scalar_type(), output.sizes());
+        TORCH_CHECK(output.strides().equals(input.strides()),
+                    "out must have the memory layout of input: strides ", input.strides(),
+                    ", got ", output.strides());
+    } else {
+        output = at::empty_like(input);
+    }
+    if (input.is_cpu()) {
+        cpu_layer_norm(&output, NULL, NULL, &input, n1, n2, gamma_ptr, beta_ptr, epsilon);
+        return output;
+    }
+#ifdef WITH_CUDA
+    const ProfileScope profile(
+        "forward_inference", input, n1, n2,
+        2 * input.numel() * input.element_size() + param_bytes(gamma_ptr, beta_ptr));
+    cuda_layer_norm(&output, NULL, NULL, &input, n1, n2, normalized_shape, gamma_ptr, beta_ptr,
+                    epsilon);
+#endif
+    return output;
+}
+
 void cuda_layer_norm_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
-                              at::Tensor* input, int n1, int n2, at::IntArrayRef normalized_shape,
+                              at::Tensor* input, int64_t n1, int64_t n2, at::IntArrayRef normalized_shape,
                               at::Tensor* gamma, at::Tensor* beta, double epsilon,
                               at::Tensor* grad_input, at::Tensor* grad_gamma,
-                              at::Tensor* grad_beta);
+                              at::Tensor* grad_beta, at::Tensor* grad_residual);
 
 std::vector<at::Tensor> layer_norm_gradient_affine(at::Tensor dout, at::Tensor mean,
                                                    at::Tensor invvar, at::Tensor input,
                                                    at::IntArrayRef normalized_shape,
                                                    at::Tensor* gamma, at::Tensor* beta,
-                                                   double epsilon) {
-    CHECK_INPUT(dout);
-    CHECK_INPUT(mean);
-    CHECK_INPUT(invvar);
-    CHECK_INPUT(input);
-    int n1, n2;
+                                                   double epsilon,
+                                                   at::Tensor* grad_residual = NULL) {
+    // Undefined mean/invvar: the forward did not save them and the backward recomputes them.
+    const bool has_stats = mean.defined();
+    CHECK_CUDA_OR_CPU(dout);
+    if (has_stats) {
+        CHECK_CONTIGUOUS(mean);
+        CHECK_CONTIGUOUS(invvar);
+    }
+    CHECK_CUDA_OR_CPU(input);
+    int64_t n1, n2;
     check_args(input, normalized_shape, n1, n2);
-
-    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+    check_param_types(dout, gamma, beta);
+    check_same_device(input, {&dout, &mean, &invvar, gamma, beta, grad_residual});
+    // Rows of dout have to be in the same memory order as the rows of input.
+    input = with_dense_rows(input, normalized_shape.size());
+    dout = with_layout_of(dout, input);
 
     at::Tensor grad_input = at::empty_like(input);
 
@@ -118,26 +392,1046 @@ std::vector<at::Tensor> layer_norm_gradient_affine(at::Tensor dout, at::Tensor m
     if (beta != NULL)
         grad_beta = at::empty_like(*beta);
 
+    if (input.is_cpu()) {
+        TORCH_CHECK(grad_residual == NULL, "the residual backward is CUDA-only");
+        TORCH_CHECK(dout.scalar_type() == input.scalar_type(),
+                    "dout must have the input dtype on CPU");
+        cpu_layer_norm_gradient(&dout, has_stats ? &mean : NULL, has_stats ? &invvar : NULL,
+                                &input, n1, n2, gamma, beta, epsilon, &grad_input,
+                                gamma != NULL ? &grad_gamma : NULL,
+                                beta != NULL ? &grad_beta : NULL);
+        return {grad_input, grad_gamma, grad_beta};
+    }
+
+#ifdef WITH_CUDA
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor* mean_ptr = has_stats ? &mean : NULL;
+    at::Tensor* invvar_ptr = has_stats ? &invvar : NULL;
+    // dout and input read, grad_input written; input once more when the stats are recomputed.
+    const int64_t activation_bytes = input.numel() * input.element_size();
+    const ProfileScope profile(
+        "backward", input, n1, n2,
+        (has_stats ? 3 : 4) * activation_bytes + 2 * param_bytes(gamma, beta) +
+            (has_stats ? 2 * n1 * int64_t(sizeof(float)) : 0));
     if (gamma != NULL) {
         if(beta != NULL) {
-            cuda_layer_norm_gradient(&dout, &mean, &invvar, &input, n1, n2, normalized_shape, gamma, beta,
-                             epsilon, &grad_input, &grad_gamma, &grad_beta);
+            cuda_layer_norm_gradient(&dout, mean_ptr, invvar_ptr, &input, n1, n2, normalized_shape, gamma, beta,
+                             epsilon, &grad_input, &grad_gamma, &grad_beta, grad_residual);
         } else {
-            cuda_layer_norm_gradient(&dout, &mean, &invvar, &input, n1, n2, normalized_shape, gamma, beta,
-                             epsilon, &grad_input, &grad_gamma, NULL);
+            cuda_layer_norm_gradient(&dout, mean_ptr, invvar_ptr, &input, n1, n2, normalized_shape, gamma, beta,
+                             epsilon, &grad_input, &grad_gamma, NULL, grad_residual);
         }
     } else {
         if(beta != NULL) {
-            cuda_layer_norm_gradient(&dout, &mean, &invvar, &input, n1, n2, normalized_shape, gamma, beta,
-                             epsilon, &grad_input, NULL, &grad_beta);
+            cuda_layer_norm_gradient(&dout, mean_ptr, invvar_ptr, &input, n1, n2, normalized_shape, gamma, beta,
+                             epsilon, &grad_input, NULL, &grad_beta, grad_residual);
         } else {
-            cuda_layer_norm_gradient(&dout, &mean, &invvar, &input, n1, n2, normalized_shape, gamma, beta,
-                             epsilon, &grad_input, NULL, NULL);
+            cuda_layer_norm_gradient(&dout, mean_ptr, invvar_ptr, &input, n1, n2, normalized_shape, gamma, beta,
+                             epsilon, &grad_input, NULL, NULL, grad_residual);
         }
     }
+#endif
     return {grad_input, grad_gamma, grad_beta};
 }
 
+#ifdef WITH_CUDA
+void cuda_rms_norm(at::Tensor* output, at::Tensor* invvar, at::Tensor* input, int64_t n1, int64_t n2,
+                   at::Tensor* gamma, double epsilon);
+
+void cuda_rms_norm_gradient(at::Tensor* dout, at::Tensor* invvar, at::Tensor* input, int64_t n1,
+                            int64_t n2, at::Tensor* gamma, at::Tensor* grad_input,
+                            at::Tensor* grad_gamma);
+
+// RMSNorm: output = input * rsqrt(mean(input^2) + epsilon) * gamma over normalized_shape.
+// Returns {output, invvar} with invvar the per-row 1 / rms.
+std::vector<at::Tensor> rms_norm_affine(at::Tensor input, at::IntArrayRef normalized_shape,
+                                        c10::optional<at::Tensor> gamma, double epsilon) {
+    CHECK_INPUT(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor output = at::empty_like(input);
+    at::Tensor invvar = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+    const ProfileScope profile("forward_rms", input, n1, n2,
+                               2 * input.numel() * input.element_size() +
+                                   param_bytes(gamma, c10::nullopt) + stats_bytes(n1));
+    cuda_rms_norm(&output, &invvar, &input, n1, n2, gamma.has_value() ? &gamma.value() : NULL,
+                  epsilon);
+    return {output, invvar};
+}
+
+std::vector<at::Tensor> rms_norm_gradient_affine(at::Tensor dout, at::Tensor invvar,
+                                                 at::Tensor input,
+                                                 at::IntArrayRef normalized_shape,
+                                                 c10::optional<at::Tensor> gamma) {
+    CHECK_INPUT(dout);
+    CHECK_INPUT(invvar);
+    CHECK_INPUT(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor grad_input = at::empty_like(input);
+    at::Tensor grad_gamma;
+    if (gamma.has_value()) grad_gamma = at::empty_like(*gamma);
+    const ProfileScope profile("backward_rms", input, n1, n2,
+                               3 * input.numel() * input.element_size() +
+                                   2 * param_bytes(gamma, c10::nullopt) + stats_bytes(n1));
+    cuda_rms_norm_gradient(&dout, &invvar, &input, n1, n2,
+                           gamma.has_value() ? &gamma.value() : NULL, &grad_input,
+                           gamma.has_value() ? &grad_gamma : NULL);
+    return {grad_input, grad_gamma};
+}
+
+void cuda_add_layer_norm(at::Tensor* output, at::Tensor* sum, at::Tensor* mean,
+                         at::Tensor* invvar, at::Tensor* residual, at::Tensor* update, int64_t n1,
+                         int64_t n2, at::IntArrayRef normalized_shape, at::Tensor* gamma,
+                         at::Tensor* beta, double epsilon);
+
+// Pre-norm residual update: sum = residual + update and output = LayerNorm(sum), written in
+// the same pass over the row. Returns {output, sum, mean, invvar}.
+std::vector<at::Tensor> add_layer_norm_affine(at::Tensor residual, at::Tensor update,
+                                              at::IntArrayRef normalized_shape,
+                                              c10::optional<at::Tensor> gamma,
+                                              c10::optional<at::Tensor> beta, double epsilon) {
+    CHECK_INPUT(residual);
+    CHECK_INPUT(update);
+    TORCH_CHECK(update.sizes().equals(residual.sizes()),
+                "update must have the shape of residual, but got ", update.sizes(), " and ",
+                residual.sizes());
+    TORCH_CHECK(update.scalar_type() == residual.scalar_type(),
+                "update and residual must have the same dtype");
+    int64_t n1, n2;
+    check_args(residual, normalized_shape, n1, n2);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(residual));
+
+    at::Tensor output = at::empty_like(residual);
+    at::Tensor sum = at::empty_like(residual);
+    at::Tensor mean = at::empty({n1}, residual.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+
+    // residual and update read, output and sum written.
+    const ProfileScope profile("forward_add", residual, n1, n2,
+                               4 * residual.numel() * residual.element_size() +
+                                   param_bytes(gamma, beta) + 2 * stats_bytes(n1));
+    cuda_add_layer_norm(&output, &sum, &mean, &invvar, &residual, &update, n1, n2,
+                        normalized_shape, gamma.has_value() ? &gamma.value() : NULL,
+                        beta.has_value() ? &beta.value() : NULL, epsilon);
+    return {output, sum, mean, invvar};
+}
+
+// Backward of add_layer_norm_affine. The gradient of the sum output (if it was used) is
+// merged into the LayerNorm input gradient by the input-grad kernel itself; the result is
+// the gradient of both residual and update.
+std::vector<at::Tensor> add_layer_norm_gradient_affine(
+    at::Tensor dout, c10::optional<at::Tensor> grad_sum, at::Tensor mean, at::Tensor invvar,
+    at::Tensor sum, at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, double epsilon) {
+    if (grad_sum.has_value()) {
+        CHECK_INPUT((*grad_sum));
+        TORCH_CHECK(grad_sum->sizes().equals(sum.sizes()) &&
+                        grad_sum->scalar_type() == sum.scalar_type(),
+                    "grad_sum must match the sum output in shape and dtype");
+    }
+    return layer_norm_gradient_affine(dout, mean, invvar, sum, normalized_shape,
+                                      gamma.has_value() ? &gamma.value() : NULL,
+                                      beta.has_value() ? &beta.value() : NULL, epsilon,
+                                      grad_sum.has_value() ? &grad_sum.value() : NULL);
+}
+
+#endif  // WITH_CUDA
+
+// Backward for a forward that saved only its input (FusedLayerNorm(save_stats=False)). The
+// row statistics are recomputed from input inside the backward, in the backward kernel itself
+// for the register-cached widths, so nothing but the input has to be kept for backward.
+std::vector<at::Tensor> layer_norm_gradient_recompute_stats_affine(
+    at::Tensor dout, at::Tensor input, at::IntArrayRef normalized_shape,
+    c10::optional<at::Tensor> gamma, c10::optional<at::Tensor> beta, double epsilon) {
+    return layer_norm_gradient_affine(dout, at::Tensor(), at::Tensor(), input, normalized_shape,
+                                      gamma.has_value() ? &gamma.value() : NULL,
+                                      beta.has_value() ? &beta.value() : NULL, epsilon);
+}
+
+#ifdef WITH_CUDA
+void cuda_layer_norm_gradient_fp32_param_grads(at::Tensor* dout, at::Tensor* mean,
+                                               at::Tensor* invvar, at::Tensor* input,
+                                               int64_t row, int64_t col, at::Tensor* gamma,
+                                               at::Tensor* beta, double epsilon,
+                                               at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                               at::Tensor* grad_beta, bool accumulate);
+
+void check_fp32_param_grad(const at::Tensor* param, const c10::optional<at::Tensor>& grad,
+                           const char* name) {
+    TORCH_CHECK((param != NULL) == grad.has_value(), name,
+                " must be given exactly when the parameter is");
+    if (param == NULL) return;
+    CHECK_INPUT((*grad));
+    TORCH_CHECK(grad->scalar_type() == at::ScalarType::Float, name,
+                " must be float32, got ", grad->scalar_type());
+    TORCH_CHECK(grad->sizes().equals(param->sizes()), name, " of shape ", grad->sizes(),
+                " for a parameter of shape ", param->sizes());
+}
+
+// Backward writing fp32 weight/bias gradients into grad_gamma/grad_beta (one per present
+// parameter, of its shape), added to their contents with accumulate. Returns grad_input.
+at::Tensor layer_norm_gradient_fp32_param_grads(
+    at::Tensor dout, at::Tensor mean, at::Tensor invvar, at::Tensor input,
+    at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, c10::optional<at::Tensor> grad_gamma,
+    c10::optional<at::Tensor> grad_beta, double epsilon, bool accumulate) {
+    CHECK_INPUT(mean);
+    CHECK_INPUT(invvar);
+    CHECK_CUDA(dout);
+    CHECK_CUDA(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    TORCH_CHECK(dout.scalar_type() == input.scalar_type(),
+                "dout must have the input dtype ", input.scalar_type(), ", got ",
+                dout.scalar_type());
+    input = with_dense_rows(input, normalized_shape.size());
+    dout = with_layout_of(dout, input);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    check_param_types(input, gamma_ptr, beta_ptr);
+    check_fp32_param_grad(gamma_ptr, grad_gamma, "grad_gamma");
+    check_fp32_param_grad(beta_ptr, grad_beta, "grad_beta");
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor grad_input = at::empty_like(input);
+    // The fp32 gradients are written, and read as well when accumulating.
+    const ProfileScope profile(
+        "backward_fp32_param_grads", input, n1, n2,
+        3 * input.numel() * input.element_size() + param_bytes(gamma, beta) +
+            (accumulate ? 2 : 1) * param_bytes(grad_gamma, grad_beta) + 2 * stats_bytes(n1));
+    cuda_layer_norm_gradient_fp32_param_grads(
+        &dout, &mean, &invvar, &input, n1, n2, gamma_ptr, beta_ptr, epsilon, &grad_input,
+        grad_gamma.has_value() ? &grad_gamma.value() : NULL,
+        grad_beta.has_value() ? &grad_beta.value() : NULL, accumulate);
+    return grad_input;
+}
+
+// Backward for gradient accumulation over micro-batches: the weight/bias gradients are added
+// in place to the fp32 buffers main_grad_gamma/main_grad_beta and only grad_input is
+// returned. The partial sums live in a reused workspace, so no parameter-gradient tensor is
+// allocated.
+at::Tensor layer_norm_gradient_main_grad_affine(
+    at::Tensor dout, at::Tensor mean, at::Tensor invvar, at::Tensor input,
+    at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, c10::optional<at::Tensor> main_grad_gamma,
+    c10::optional<at::Tensor> main_grad_beta, double epsilon) {
+    return layer_norm_gradient_fp32_param_grads(dout, mean, invvar, input, normalized_shape,
+                                                gamma, beta, main_grad_gamma, main_grad_beta,
+                                                epsilon, true);
+}
+
+// Backward for row-sharded (DAP / sequence-parallel) inputs: returns {grad_input, grad_gamma,
+// grad_beta} with the weight/bias gradients of this rank's rows only, in fp32 and not cast to
+// the parameter type, so they can be all-reduced across ranks before use.
+std::vector<at::Tensor> layer_norm_gradient_partial_affine(
+    at::Tensor dout, at::Tensor mean, at::Tensor invvar, at::Tensor input,
+    at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, double epsilon) {
+    const auto fp32 = input.options().dtype(at::ScalarType::Float);
+    c10::optional<at::Tensor> grad_gamma, grad_beta;
+    if (gamma.has_value()) grad_gamma = at::empty(gamma->sizes(), fp32);
+    if (beta.has_value()) grad_beta = at::empty(beta->sizes(), fp32);
+    at::Tensor grad_input =
+        layer_norm_gradient_fp32_param_grads(dout, mean, invvar, input, normalized_shape, gamma,
+                                             beta, grad_gamma, grad_beta, epsilon, false);
+    return {grad_input, grad_gamma.value_or(at::Tensor()), grad_beta.value_or(at::Tensor())};
+}
+
+void cuda_layer_norm_gradient_from_output(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                          at::Tensor* output, int64_t n1, int64_t n2, at::Tensor* gamma,
+                                          at::Tensor* beta, double epsilon,
+                                          at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                          at::Tensor* grad_beta);
+
+// LayerNorm that writes its output over input, for callers that no longer need the input.
+// Every forward kernel reads each element before the same thread overwrites it, so no extra
+// buffer is involved. Returns {mean, invvar}; the backward runs from the output (see below).
+std::vector<at::Tensor> layer_norm_inplace_affine(at::Tensor input,
+                                                  at::IntArrayRef normalized_shape,
+                                                  c10::optional<at::Tensor> gamma,
+                                                  c10::optional<at::Tensor> beta,
+                                                  double epsilon) {
+    CHECK_INPUT(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor mean = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+    const ProfileScope profile("forward_inplace", input, n1, n2,
+                               2 * input.numel() * input.element_size() +
+                                   param_bytes(gamma, beta) + 2 * stats_bytes(n1));
+    cuda_layer_norm(&input, &mean, &invvar, &input, n1, n2, normalized_shape,
+                    gamma.has_value() ? &gamma.value() : NULL,
+                    beta.has_value() ? &beta.value() : NULL, epsilon);
+    return {mean, invvar};
+}
+
+// Backward of layer_norm_inplace_affine from the saved output y: x_hat = (y - beta) / gamma,
+// with gamma clamped to a magnitude of at least epsilon, instead of (input - mean) * invvar.
+std::vector<at::Tensor> layer_norm_gradient_from_output_affine(
+    at::Tensor dout, at::Tensor mean, at::Tensor invvar, at::Tensor output,
+    at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, double epsilon) {
+    CHECK_INPUT(dout);
+    CHECK_INPUT(mean);
+    CHECK_INPUT(invvar);
+    CHECK_INPUT(output);
+    int64_t n1, n2;
+    check_args(output, normalized_shape, n1, n2);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(output));
+
+    at::Tensor grad_input = at::empty_like(output);
+    at::Tensor grad_gamma;
+    at::Tensor grad_beta;
+    if (gamma.has_value()) grad_gamma = at::empty_like(*gamma);
+    if (beta.has_value()) grad_beta = at::empty_like(*beta);
+
+    const ProfileScope profile("backward_from_output", output, n1, n2,
+                               3 * output.numel() * output.element_size() +
+                                   2 * param_bytes(gamma, beta) + 2 * stats_bytes(n1));
+    cuda_layer_norm_gradient_from_output(
+        &dout, &mean, &invvar, &output, n1, n2, gamma.has_value() ? &gamma.value() : NULL,
+        beta.has_value() ? &beta.value() : NULL, epsilon, &grad_input,
+        gamma.has_value() ? &grad_gamma : NULL, beta.has_value() ? &grad_beta : NULL);
+    return {grad_input, grad_gamma, grad_beta};
+}
+
+void cuda_layer_norm_save_xhat(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                               at::Tensor* xhat, at::Tensor* input, int64_t rows, int64_t cols,
+                               at::Tensor* gamma, at::Tensor* beta, double epsilon);
+
+void cuda_layer_norm_gradient_from_xhat(at::Tensor* dout, at::Tensor* xhat, at::Tensor* invvar,
+                                        int64_t rows, int64_t cols, at::Tensor* gamma,
+                                        at::Tensor* beta, at::Tensor* grad_input,
+                                        at::Tensor* grad_gamma, at::Tensor* grad_beta);
+
+// LayerNorm that also returns x_hat = (input - mean) * invvar in xhat_dtype (bfloat16, float16
+// or FP8), for a backward that keeps {xhat, invvar} alive instead of the input. Returns
+// {output, invvar, xhat}; xhat has the memory layout of output.
+std::vector<at::Tensor> layer_norm_save_xhat_affine(at::Tensor input,
+                                                    at::IntArrayRef normalized_shape,
+                                                    c10::optional<at::Tensor> gamma,
+                                                    c10::optional<at::Tensor> beta,
+                                                    double epsilon, at::ScalarType xhat_dtype) {
+    CHECK_CUDA(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    check_param_types(input, gamma_ptr, beta_ptr);
+    input = with_dense_rows(input, normalized_shape.size());
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor output = at::empty_like(input);
+    at::Tensor xhat = at::empty_like(input, input.options().dtype(xhat_dtype));
+    at::Tensor mean = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+    const ProfileScope profile("forward_save_xhat", input, n1, n2,
+                               2 * input.numel() * input.element_size() +
+                                   xhat.numel() * xhat.element_size() +
+                                   param_bytes(gamma, beta) + 2 * stats_bytes(n1));
+    cuda_layer_norm_save_xhat(&output, &mean, &invvar, &xhat, &input, n1, n2, gamma_ptr, beta_ptr,
+                              epsilon);
+    return {output, invvar, xhat};
+}
+
+// Backward of layer_norm_save_xhat_affine. Neither the input nor the row mean is needed.
+std::vector<at::Tensor> layer_norm_gradient_from_xhat_affine(at::Tensor dout, at::Tensor invvar,
+                                                             at::Tensor xhat,
+                                                             at::IntArrayRef normalized_shape,
+                                                             c10::optional<at::Tensor> gamma,
+                                                             c10::optional<at::Tensor> beta) {
+    CHECK_CUDA(dout);
+    CHECK_INPUT(invvar);
+    CHECK_CUDA(xhat);
+    int64_t n1, n2;
+    check_args(xhat, normalized_shape, n1, n2);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    check_param_types(dout, gamma_ptr, beta_ptr);
+    TORCH_CHECK(has_dense_rows(xhat, normalized_shape.size()),
+                "xhat must be the tensor returned by the forward");
+    TORCH_CHECK(invvar.numel() == n1, "invvar must have one entry per row");
+    dout = with_layout_of(dout, xhat);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(xhat));
+
+    at::Tensor grad_input = at::empty_like(xhat, dout.options());
+    at::Tensor grad_gamma;
+    at::Tensor grad_beta;
+    if (gamma_ptr != NULL) grad_gamma = at::empty_like(*gamma_ptr);
+    if (beta_ptr != NULL) grad_beta = at::empty_like(*beta_ptr);
+
+    // dout and xhat read, grad_input written.
+    const ProfileScope profile("backward_from_xhat", dout, n1, n2,
+                               2 * dout.numel() * dout.element_size() +
+                                   xhat.numel() * xhat.element_size() +
+                                   2 * param_bytes(gamma, beta) + stats_bytes(n1));
+    cuda_layer_norm_gradient_from_xhat(&dout, &xhat, &invvar, n1, n2, gamma_ptr, beta_ptr,
+                                       &grad_input, gamma_ptr != NULL ? &grad_gamma : NULL,
+                                       beta_ptr != NULL ? &grad_beta : NULL);
+    return {grad_input, grad_gamma, grad_beta};
+}
+
+void cuda_layer_norm_transposed(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                                at::Tensor* input, int64_t dim_i, int64_t dim_j, int64_t cols,
+                                at::Tensor* gamma, at::Tensor* beta, double epsilon);
+
+void cuda_layer_norm_gradient_transposed(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                         at::Tensor* input, int64_t dim_i, int64_t dim_j,
+                                         int64_t cols, at::Tensor* gamma, at::Tensor* beta,
+                                         at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                         at::Tensor* grad_beta);
+
+// LayerNorm over the last dim of [*, I, J, C] that returns {output, mean, invvar} with output
+// a contiguous [*, J, I, C], i.e. the normalized input transposed over dims -3 and -2. A
+// non-contiguous input is copied first.
+std::vector<at::Tensor> layer_norm_transposed_affine(at::Tensor input,
+                                                     c10::optional<at::Tensor> gamma,
+                                                     c10::optional<at::Tensor> beta,
+                                                     double epsilon) {
+    CHECK_CUDA(input);
+    TORCH_CHECK(input.dim() >= 3, "transposing LayerNorm expects [*, I, J, C], got ",
+                input.sizes());
+    int64_t n1, n2;
+    check_args(input, {input.size(-1)}, n1, n2);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    check_param_types(input, gamma_ptr, beta_ptr);
+    input = input.contiguous();
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor output = at::empty(input.transpose(-3, -2).sizes(), input.options());
+    at::Tensor mean = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+    const ProfileScope profile("forward_transposed", input, n1, n2,
+                               2 * input.numel() * input.element_size() +
+                                   param_bytes(gamma, beta) + 2 * stats_bytes(n1));
+    cuda_layer_norm_transposed(&output, &mean, &invvar, &input, input.size(-3), input.size(-2),
+                               n2, gamma_ptr, beta_ptr, epsilon);
+    return {output, mean, invvar};
+}
+
+// Backward of layer_norm_transposed_affine from dout of the output's [*, J, I, C] shape;
+// grad_input has the shape of input.
+std::vector<at::Tensor> layer_norm_gradient_transposed_affine(at::Tensor dout, at::Tensor mean,
+                                                              at::Tensor invvar, at::Tensor input,
+                                                              c10::optional<at::Tensor> gamma,
+                                                              c10::optional<at::Tensor> beta) {
+    CHECK_CUDA(dout);
+    CHECK_INPUT(mean);
+    CHECK_INPUT(invvar);
+    CHECK_INPUT(input);
+    TORCH_CHECK(dout.sizes().equals(input.transpose(-3, -2).sizes()),
+                "dout must have the transposed shape of input");
+    int64_t n1, n2;
+    check_args(input, {input.size(-1)}, n1, n2);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    check_param_types(input, gamma_ptr, beta_ptr);
+    dout = dout.to(input.scalar_type()).contiguous();
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor grad_input = at::empty_like(input);
+    at::Tensor grad_gamma;
+    at::Tensor grad_beta;
+    if (gamma_ptr != NULL) grad_gamma = at::empty_like(*gamma_ptr);
+    if (beta_ptr != NULL) grad_beta = at::empty_like(*beta_ptr);
+
+    const ProfileScope profile("backward_transposed", input, n1, n2,
+                               3 * input.numel() * input.element_size() +
+                                   2 * param_bytes(gamma, beta) + 2 * stats_bytes(n1));
+    cuda_layer_norm_gradient_transposed(&dout, &mean, &invvar, &input, input.size(-3),
+                                        input.size(-2), n2, gamma_ptr, beta_ptr, &grad_input,
+                                        gamma_ptr != NULL ? &grad_gamma : NULL,
+                                        beta_ptr != NULL ? &grad_beta : NULL);
+    return {grad_input, grad_gamma, grad_beta};
+}
+
+void cuda_layer_norm_epilogue(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                              at::Tensor* input, int64_t n1, int64_t n2, at::Tensor* gamma,
+                              at::Tensor* beta, double epsilon, at::Tensor* row_mask,
+                              at::Tensor* gate, double dropout_p, at::Tensor* rng_state);
+
+void cuda_layer_norm_epilogue_backward(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                       at::Tensor* input, int64_t n1, int64_t n2, at::Tensor* gamma,
+                                       at::Tensor* beta, at::Tensor* row_mask, at::Tensor* gate,
+                                       double dropout_p, at::Tensor* rng_state,
+                                       at::Tensor* grad_affine, at::Tensor* grad_gate);
+
+bool cuda_layer_norm_epilogue_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                       at::Tensor* input, int64_t n1, int64_t n2,
+                                       at::Tensor* gamma, at::Tensor* beta, at::Tensor* row_mask,
+                                       at::Tensor* gate, double dropout_p, at::Tensor* rng_state,
+                                       at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                       at::Tensor* grad_beta, at::Tensor* grad_gate);
+
+void check_epilogue_args(const at::Tensor& input, int64_t n1, const c10::optional<at::Tensor>& row_mask,
+                         const c10::optional<at::Tensor>& gate, double dropout_p) {
+    if (row_mask.has_value()) {
+        CHECK_INPUT((*row_mask));
+        TORCH_CHECK(row_mask->numel() == n1 && row_mask->scalar_type() == input.scalar_type(),
+                    "row_mask must have one element per normalized row and the input dtype");
+    }
+    if (gate.has_value()) {
+        CHECK_INPUT((*gate));
+        TORCH_CHECK(gate->sizes().equals(input.sizes()) &&
+                        gate->scalar_type() == input.scalar_type(),
+                    "gate must match the input in shape and dtype");
+    }
+    TORCH_CHECK(dropout_p >= 0.0 && dropout_p < 1.0, "dropout_p must be in [0, 1), got ",
+                dropout_p);
+}
+
+// LayerNorm whose output is multiplied, in the same kernel, by a per-row mask, an inverted
+// dropout mask and an elementwise gate (each optional):
+//     output = LayerNorm(input) * row_mask[..., None] * dropout * gate
+// The dropout mask is not stored; rng_state [2] (seed, offset) is returned instead and is all
+// the backward needs to regenerate it. Returns {output, mean, invvar, rng_state}.
+std::vector<at::Tensor> layer_norm_epilogue_affine(
+    at::Tensor input, at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, c10::optional<at::Tensor> row_mask,
+    c10::optional<at::Tensor> gate, double dropout_p, double epsilon) {
+    CHECK_INPUT(input);
+    TORCH_CHECK(normalized_shape.size() == 1,
+                "layer_norm_epilogue expects a 1-D normalized_shape");
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    check_epilogue_args(input, n1, row_mask, gate, dropout_p);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor output = at::empty_like(input);
+    at::Tensor mean = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+    at::Tensor rng_state = at::zeros({2}, input.options().dtype(at::ScalarType::Long));
+
+    const int64_t activation_bytes = input.numel() * input.element_size();
+    const ProfileScope profile(
+        "forward_epilogue", input, n1, n2,
+        (gate.has_value() ? 3 : 2) * activation_bytes + param_bytes(gamma, beta) +
+            (row_mask.has_value() ? n1 * input.element_size() : 0) + 2 * stats_bytes(n1));
+    cuda_layer_norm_epilogue(&output, &mean, &invvar, &input, n1, n2,
+                             gamma.has_value() ? &gamma.value() : NULL,
+                             beta.has_value() ? &beta.value() : NULL, epsilon,
+                             row_mask.has_value() ? &row_mask.value() : NULL,
+                             gate.has_value() ? &gate.value() : NULL, dropout_p, &rng_state);
+    return {output, mean, invvar, rng_state};
+}
+
+// Backward of layer_norm_epilogue_affine. Returns {grad_input, grad_gamma, grad_beta,
+// grad_gate}; the row mask is treated as a constant.
+std::vector<at::Tensor> layer_norm_epilogue_gradient_affine(
+    at::Tensor dout, at::Tensor mean, at::Tensor invvar, at::Tensor input,
+    at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, c10::optional<at::Tensor> row_mask,
+    c10::optional<at::Tensor> gate, double dropout_p, at::Tensor rng_state, double epsilon) {
+    CHECK_INPUT(dout);
+    CHECK_INPUT(input);
+    CHECK_INPUT(rng_state);
+    TORCH_CHECK(dout.scalar_type() == input.scalar_type(),
+                "dout must have the input dtype");
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    check_epilogue_args(input, n1, row_mask, gate, dropout_p);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor grad_gate;
+    if (gate.has_value()) grad_gate = at::empty_like(input);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    const int64_t activation_bytes = input.numel() * input.element_size();
+    const int64_t row_mask_bytes = row_mask.has_value() ? n1 * input.element_size() : 0;
+    {
+        // One sweep: dout and input read, grad_input written, gate read and grad_gate written,
+        // the parameters read and their gradients written.
+        at::Tensor grad_input = at::empty_like(input);
+        at::Tensor grad_gamma, grad_beta;
+        if (gamma_ptr != NULL) grad_gamma = at::empty_like(*gamma_ptr);
+        if (beta_ptr != NULL) grad_beta = at::empty_like(*beta_ptr);
+        ProfileScope profile(
+            "backward_epilogue", input, n1, n2,
+            (gate.has_value() ? 5 : 3) * activation_bytes + 2 * param_bytes(gamma, beta) +
+                row_mask_bytes + 2 * stats_bytes(n1));
+        if (cuda_layer_norm_epilogue_gradient(
+                &dout, &mean, &invvar, &input, n1, n2, gamma_ptr, beta_ptr,
+                row_mask.has_value() ? &row_mask.value() : NULL,
+                gate.has_value() ? &gate.value() : NULL, dropout_p, &rng_state, &grad_input,
+                gamma_ptr != NULL ? &grad_gamma : NULL, beta_ptr != NULL ? &grad_beta : NULL,
+                &grad_gate)) {
+            return {grad_input, grad_gamma, grad_beta, grad_gate};
+        }
+        profile.dismiss();
+    }
+
+    // Rows wider than the row-wise backward: the gradient of the affine output goes through
+    // memory, and the LayerNorm backward below is profiled on its own.
+    at::Tensor grad_affine = at::empty_like(input);
+    {
+        // dout and input read, grad_affine written, gate read and grad_gate written.
+        const ProfileScope profile(
+            "backward_epilogue", input, n1, n2,
+            (gate.has_value() ? 5 : 3) * activation_bytes + param_bytes(gamma, beta) +
+                row_mask_bytes + 2 * stats_bytes(n1));
+        cuda_layer_norm_epilogue_backward(&dout, &mean, &invvar, &input, n1, n2, gamma_ptr,
+                                          beta_ptr, row_mask.has_value() ? &row_mask.value() : NULL,
+                                          gate.has_value() ? &gate.value() : NULL, dropout_p,
+                                          &rng_state, &grad_affine, &grad_gate);
+    }
+
+    std::vector<at::Tensor> grads = layer_norm_gradient_affine(
+        grad_affine, mean, invvar, input, normalized_shape, gamma_ptr, beta_ptr, epsilon);
+    return {grads[0], grads[1], grads[2], grad_gate};
+}
+
+void cuda_layer_norm_indexed(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                             at::Tensor* input, at::Tensor* row_index, int64_t cols,
+                             at::Tensor* gamma, at::Tensor* beta, double epsilon);
+
+bool cuda_layer_norm_gradient_indexed(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                      at::Tensor* input, at::Tensor* row_index, int64_t cols,
+                                      at::Tensor* gamma, at::Tensor* beta,
+                                      at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                      at::Tensor* grad_beta);
+
+// The values of row_index are range-checked by the kernels (a device-side assert), which saves
+// reading them back here; the fallback of the backward gets the same check from index_select.
+void check_row_index(const at::Tensor& row_index, const at::Tensor& input, int64_t n1) {
+    CHECK_INPUT(row_index);
+    TORCH_CHECK(row_index.dim() == 1 && row_index.scalar_type() == at::ScalarType::Long,
+                "row_index must be a 1-D int64 tensor");
+    TORCH_CHECK(row_index.device() == input.device(), "row_index must be on the input device");
+    TORCH_CHECK(row_index.numel() <= n1, "row_index lists ", row_index.numel(),
+                " rows, but the input has only ", n1);
+}
+
+// LayerNorm of the active rows only, for padded batches: row_index lists the rows (of the
+// input flattened to [n1, n2]) to normalize, each at most once and in range; the others are
+// neither read nor normalized and are zero in the output. The launch is sized to the active
+// rows, and mean/invvar are compact, [row_index.numel()].
+std::vector<at::Tensor> layer_norm_indexed_affine(at::Tensor input,
+                                                  at::IntArrayRef normalized_shape,
+                                                  c10::optional<at::Tensor> gamma,
+                                                  c10::optional<at::Tensor> beta,
+                                                  at::Tensor row_index, double epsilon) {
+    CHECK_INPUT(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    check_row_index(row_index, input, n1);
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    check_param_types(input, gamma_ptr, beta_ptr);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor output = at::zeros_like(input);
+    at::Tensor mean = at::empty({row_index.numel()}, input.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+    // The active rows are read and written, plus the index itself.
+    const int64_t active_rows = row_index.numel();
+    const ProfileScope profile("forward_indexed", input, active_rows, n2,
+                               2 * active_rows * n2 * input.element_size() +
+                                   active_rows * int64_t(sizeof(int64_t)) +
+                                   param_bytes(gamma, beta) + 2 * stats_bytes(active_rows));
+    cuda_layer_norm_indexed(&output, &mean, &invvar, &input, &row_index, n2, gamma_ptr, beta_ptr,
+                            epsilon);
+    return {output, mean, invvar};
+}
+
+// Backward of layer_norm_indexed_affine, launched over the active rows only; grad_input is zero
+// on the inactive rows and grad_gamma/grad_beta sum over the active rows. Rows too wide for
+// the row-wise kernel fall back to gathering the active rows through the regular backward.
+std::vector<at::Tensor> layer_norm_indexed_gradient_affine(
+    at::Tensor dout, at::Tensor mean, at::Tensor invvar, at::Tensor input,
+    at::IntArrayRef normalized_shape, c10::optional<at::Tensor> gamma,
+    c10::optional<at::Tensor> beta, at::Tensor row_index, double epsilon) {
+    CHECK_CUDA(dout);
+    CHECK_INPUT(input);
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    check_row_index(row_index, input, n1);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor grad_input = at::zeros_like(input);
+    if (row_index.numel() == 0) {
+        return {grad_input, gamma.has_value() ? at::zeros_like(*gamma) : at::Tensor(),
+                beta.has_value() ? at::zeros_like(*beta) : at::Tensor()};
+    }
+    at::Tensor* gamma_ptr = gamma.has_value() ? &gamma.value() : NULL;
+    at::Tensor* beta_ptr = beta.has_value() ? &beta.value() : NULL;
+    at::Tensor dout_ = dout.contiguous();
+    at::Tensor grad_gamma, grad_beta;
+    if (gamma_ptr != NULL) grad_gamma = at::empty_like(*gamma_ptr);
+    if (beta_ptr != NULL) grad_beta = at::empty_like(*beta_ptr);
+    const int64_t active_rows = row_index.numel();
+    ProfileScope profile("backward_indexed", input, active_rows, n2,
+                         3 * active_rows * n2 * input.element_size() +
+                             active_rows * int64_t(sizeof(int64_t)) +
+                             2 * param_bytes(gamma, beta) + 2 * stats_bytes(active_rows));
+    if (cuda_layer_norm_gradient_indexed(&dout_, &mean, &invvar, &input, &row_index, n2,
+                                         gamma_ptr, beta_ptr, &grad_input,
+                                         gamma_ptr != NULL ? &grad_gamma : NULL,
+                                         beta_ptr != NULL ? &grad_beta : NULL)) {
+        return {grad_input, grad_gamma, grad_beta};
+    }
+    // The fallback is profiled as the regular backward of the gathered rows.
+    profile.dismiss();
+    const std::vector<int64_t> row_shape = {n2};
+    at::Tensor input_rows = input.view({n1, n2}).index_select(0, row_index);
+    at::Tensor dout_rows = dout_.view({n1, n2}).index_select(0, row_index);
+    std::vector<at::Tensor> grads = layer_norm_gradient_affine(
+        dout_rows, mean, invvar, input_rows, row_shape, gamma_ptr, beta_ptr, epsilon);
+    grad_input.view({n1, n2}).index_copy_(0, row_index, grads[0]);
+    return {grad_input, grads[1], grads[2]};
+}
+
+void cuda_ada_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                         at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* scale,
+                         at::Tensor* shift, double epsilon);
+
+void cuda_ada_layer_norm_backward(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                  at::Tensor* input, int64_t rows, int64_t cols,
+                                  at::Tensor* scale, at::Tensor* grad_normalized,
+                                  at::Tensor* grad_scale);
+
+bool cuda_ada_layer_norm_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                  at::Tensor* input, int64_t rows, int64_t cols,
+                                  at::Tensor* scale, at::Tensor* grad_input,
+                                  at::Tensor* grad_scale);
+
+void check_ada_layer_norm_args(const at::Tensor& input, const at::Tensor& scale,
+                               const at::Tensor& shift) {
+    for (const at::Tensor* t : {&scale, &shift}) {
+        CHECK_INPUT((*t));
+        TORCH_CHECK(t->sizes().equals(input.sizes()) && t->scalar_type() == input.scalar_type(),
+                    "adaptive LayerNorm scale and shift must have the shape and dtype of input");
+    }
+}
+
+// Adaptive LayerNorm over the last dimension: sigmoid(scale) * x_hat + shift with scale and
+// shift of the input's shape (the per-row conditioning, already projected).
+std::vector<at::Tensor> ada_layer_norm_affine(at::Tensor input, at::IntArrayRef normalized_shape,
+                                              at::Tensor scale, at::Tensor shift,
+                                              double epsilon) {
+    CHECK_INPUT(input);
+    TORCH_CHECK(normalized_shape.size() == 1,
+                "ada_layer_norm expects a 1-D normalized_shape");
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    check_ada_layer_norm_args(input, scale, shift);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor output = at::empty_like(input);
+    at::Tensor mean = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+    // input, scale and shift read, output written.
+    const ProfileScope profile("forward_ada", input, n1, n2,
+                               4 * input.numel() * input.element_size() + 2 * stats_bytes(n1));
+    cuda_ada_layer_norm(&output, &mean, &invvar, &input, n1, n2, &scale, &shift, epsilon);
+    return {output, mean, invvar};
+}
+
+// Backward of ada_layer_norm_affine. Returns {grad_input, grad_scale}; the gradient of shift
+// is dout.
+std::vector<at::Tensor> ada_layer_norm_gradient_affine(at::Tensor dout, at::Tensor mean,
+                                                       at::Tensor invvar, at::Tensor input,
+                                                       at::IntArrayRef normalized_shape,
+                                                       at::Tensor scale, double epsilon) {
+    CHECK_INPUT(dout);
+    CHECK_INPUT(mean);
+    CHECK_INPUT(invvar);
+    CHECK_INPUT(input);
+    TORCH_CHECK(dout.scalar_type() == input.scalar_type(), "dout must have the input dtype");
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    check_ada_layer_norm_args(input, scale, dout);
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor grad_scale = at::empty_like(input);
+    const int64_t activation_bytes = input.numel() * input.element_size();
+    {
+        // One sweep: dout, input and scale read, grad_input and grad_scale written.
+        at::Tensor grad_input = at::empty_like(input);
+        ProfileScope profile("backward_ada", input, n1, n2,
+                             5 * activation_bytes + 2 * stats_bytes(n1));
+        if (cuda_ada_layer_norm_gradient(&dout, &mean, &invvar, &input, n1, n2, &scale,
+                                         &grad_input, &grad_scale)) {
+            return {grad_input, grad_scale};
+        }
+        profile.dismiss();
+    }
+
+    // Rows wider than the row-wise backward: grad_normalized goes through memory.
+    at::Tensor grad_normalized = at::empty_like(input);
+    {
+        // The AdaLN kernel only; the LayerNorm backward below is profiled on its own. dout,
+        // input and scale read, grad_normalized and grad_scale written.
+        const ProfileScope profile("backward_ada", input, n1, n2,
+                                   5 * activation_bytes + 2 * stats_bytes(n1));
+        cuda_ada_layer_norm_backward(&dout, &mean, &invvar, &input, n1, n2, &scale,
+                                     &grad_normalized, &grad_scale);
+    }
+    std::vector<at::Tensor> grads = layer_norm_gradient_affine(
+        grad_normalized, mean, invvar, input, normalized_shape, NULL, NULL, epsilon);
+    return {grads[0], grad_scale};
+}
+
+void cuda_layer_norm_fp8(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                         at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* gamma,
+                         at::Tensor* beta, double epsilon, at::Tensor* scale,
+                         at::Tensor* scale_out);
+
+// LayerNorm that quantizes its output to FP8 in the same launch. `output` is preallocated by
+// the caller in the target FP8 dtype. Without `scale` every row gets its own scale and the
+// returned tensor holds the per-row dequantization factors [n1]; with a per-tensor `scale` [1]
+// the returned tensor is the amax [1] of this call, for the caller's delayed-scaling history.
+std::vector<at::Tensor> layer_norm_fp8_affine(at::Tensor input, at::IntArrayRef normalized_shape,
+                                              c10::optional<at::Tensor> gamma,
+                                              c10::optional<at::Tensor> beta, at::Tensor output,
+                                              c10::optional<at::Tensor> scale, double epsilon) {
+    CHECK_INPUT(input);
+    CHECK_INPUT(output);
+    TORCH_CHECK(normalized_shape.size() == 1, "layer_norm_fp8 expects a 1-D normalized_shape");
+    TORCH_CHECK(output.sizes().equals(input.sizes()),
+                "output must have the shape of input, but got ", output.sizes());
+    int64_t n1, n2;
+    check_args(input, normalized_shape, n1, n2);
+    if (scale.has_value()) {
+        CHECK_INPUT((*scale));
+        TORCH_CHECK(scale->numel() == 1 && scale->scalar_type() == at::ScalarType::Float,
+                    "scale must be a float32 tensor with one element");
+    }
+
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(input));
+
+    at::Tensor mean = at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+    at::Tensor invvar = at::empty_like(mean);
+    at::Tensor scale_out = scale.has_value() ? at::zeros({1}, mean.options()) : at::empty_like(mean);
+
+    const ProfileScope profile("forward_fp8", input, n1, n2,
+                               input.numel() * input.element_size() +
+                                   output.numel() * output.element_size() +
+                                   param_bytes(gamma, beta) + 2 * stats_bytes(n1) +
+                                   stats_bytes(scale_out.numel()));
+    cuda_layer_norm_fp8(&output, &mean, &invvar, &input, n1, n2,
+                        gamma.has_value() ? &gamma.value() : NULL,
+                        beta.has_value() ? &beta.value() : NULL, epsilon,
+                        scale.has_value() ? &scale.value() : NULL, &scale_out);
+    return {output, mean, invvar, scale_out};
+}
+
+void cuda_grouped_layer_norm(const std::vector<at::Tensor>& inputs,
+                             const std::vector<at::Tensor*>& gammas,
+                             const std::vector<at::Tensor*>& betas,
+                             const std::vector<double>& epsilons, std::vector<at::Tensor>& outputs,
+                             std::vector<at::Tensor>& means, std::vector<at::Tensor>& invvars);
+
+void cuda_grouped_layer_norm_gradient(
+    const std::vector<at::Tensor>& douts, const std::vector<at::Tensor>& means,
+    const std::vector<at::Tensor>& invvars, const std::vector<at::Tensor>& inputs,
+    const std::vector<at::Tensor*>& gammas, const std::vector<double>& epsilons,
+    std::vector<at::Tensor>& grad_inputs, const std::vector<at::Tensor*>& grad_gammas,
+    const std::vector<at::Tensor*>& grad_betas);
+
+// Pointers to the given optional tensors, null where a task has none.
+std::vector<at::Tensor*> optional_tensor_ptrs(std::vector<c10::optional<at::Tensor>>& tensors) {
+    std::vector<at::Tensor*> ptrs;
+    for (auto& t : tensors) ptrs.push_back(t.has_value() ? &t.value() : NULL);
+    return ptrs;
+}
+
+// Validates the tasks of a grouped call: one dtype and device for all of them, and gamma/beta
+// (when given) of the width of their input. Returns the inputs made contiguous.
+std::vector<at::Tensor> check_grouped_args(const std::vector<at::Tensor>& inputs,
+                                           std::vector<c10::optional<at::Tensor>>& gammas,
+                                           std::vector<c10::optional<at::Tensor>>& betas,
+                                           const std::vector<double>& epsilons) {
+    const size_t n = inputs.size();
+    TORCH_CHECK(n > 0, "grouped LayerNorm needs at least one input");
+    TORCH_CHECK(gammas.size() == n && betas.size() == n && epsilons.size() == n,
+                "grouped LayerNorm expects one weight, bias and eps per input");
+    std::vector<at::Tensor> contiguous;
+    for (size_t i = 0; i < n; ++i) {
+        CHECK_CUDA(inputs[i]);
+        TORCH_CHECK(inputs[i].dim() >= 1, "grouped LayerNorm input ", i, " is a scalar");
+        TORCH_CHECK(inputs[i].scalar_type() == inputs[0].scalar_type() &&
+                        inputs[i].device() == inputs[0].device(),
+                    "grouped LayerNorm inputs must share one dtype and device");
+        for (c10::optional<at::Tensor>* param : {&gammas[i], &betas[i]}) {
+            if (!param->has_value()) continue;
+            TORCH_CHECK((*param)->numel() == inputs[i].size(-1) &&
+                            (*param)->scalar_type() == inputs[i].scalar_type() &&
+                            (*param)->device() == inputs[i].device(),
+                        "grouped LayerNorm parameters of input ", i,
+                        " must be of its width, dtype and device");
+            **param = (*param)->contiguous();
+        }
+        contiguous.push_back(inputs[i].contiguous());
+    }
+    return contiguous;
+}
+
+// LayerNorm over the last dimension of every input, all in one launch (per 24 inputs).
+// Returns {outputs, means, invvars}.
+std::vector<std::vector<at::Tensor>> grouped_layer_norm_affine(
+    std::vector<at::Tensor> inputs, std::vector<c10::optional<at::Tensor>> gammas,
+    std::vector<c10::optional<at::Tensor>> betas, std::vector<double> epsilons) {
+    inputs = check_grouped_args(inputs, gammas, betas, epsilons);
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(inputs[0]));
+
+    std::vector<at::Tensor> outputs, means, invvars;
+    int64_t total_rows = 0;
+    int64_t bytes = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const at::Tensor& input = inputs[i];
+        outputs.push_back(at::empty_like(input));
+        const int64_t rows = input.size(-1) == 0 ? 0 : input.numel() / input.size(-1);
+        means.push_back(at::empty({rows}, input.options().dtype(at::ScalarType::Float)));
+        invvars.push_back(at::empty_like(means.back()));
+        total_rows += rows;
+        bytes += 2 * input.numel() * input.element_size() + param_bytes(gammas[i], betas[i]) +
+                 2 * stats_bytes(rows);
+    }
+    // Recorded with the total rows of the group and the width of its first input.
+    const ProfileScope profile("forward_grouped", inputs[0], total_rows, inputs[0].size(-1),
+                               bytes);
+    cuda_grouped_layer_norm(inputs, optional_tensor_ptrs(gammas), optional_tensor_ptrs(betas),
+                            epsilons, outputs, means, invvars);
+    return {outputs, means, invvars};
+}
+
+// Backward of grouped_layer_norm_affine. Returns {grad_inputs, grad_gammas, grad_betas}, with
+// undefined (None) gradients for the parameters a task does not have.
+std::vector<std::vector<at::Tensor>> grouped_layer_norm_gradient_affine(
+    std::vector<at::Tensor> douts, std::vector<at::Tensor> means, std::vector<at::Tensor> invvars,
+    std::vector<at::Tensor> inputs, std::vector<c10::optional<at::Tensor>> gammas,
+    std::vector<c10::optional<at::Tensor>> betas, std::vector<double> epsilons) {
+    inputs = check_grouped_args(inputs, gammas, betas, epsilons);
+    TORCH_CHECK(douts.size() == inputs.size() && means.size() == inputs.size() &&
+                    invvars.size() == inputs.size(),
+                "grouped LayerNorm backward expects one dout, mean and invvar per input");
+    const at::cuda::OptionalCUDAGuard device_guard(device_of(inputs[0]));
+
+    std::vector<at::Tensor> grad_inputs, grad_gammas(inputs.size()), grad_betas(inputs.size());
+    std::vector<at::Tensor*> grad_gamma_ptrs(inputs.size(), NULL);
+    std::vector<at::Tensor*> grad_beta_ptrs(inputs.size(), NULL);
+    int64_t total_rows = 0;
+    int64_t bytes = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        TORCH_CHECK(douts[i].sizes().equals(inputs[i].sizes()) &&
+                        douts[i].scalar_type() == inputs[i].scalar_type(),
+                    "grouped LayerNorm dout ", i, " must match its input");
+        douts[i] = douts[i].contiguous();
+        CHECK_INPUT(means[i]);
+        CHECK_INPUT(invvars[i]);
+        grad_inputs.push_back(at::empty_like(inputs[i]));
+        if (gammas[i].has_value()) {
+            grad_gammas[i] = at::empty_like(*gammas[i]);
+            grad_gamma_ptrs[i] = &grad_gammas[i];
+        }
+        if (betas[i].has_value()) {
+            grad_betas[i] = at::empty_like(*betas[i]);
+            grad_beta_ptrs[i] = &grad_betas[i];
+        }
+        total_rows += means[i].numel();
+        bytes += 3 * inputs[i].numel() * inputs[i].element_size() +
+                 2 * param_bytes(gammas[i], betas[i]) + 2 * stats_bytes(means[i].numel());
+    }
+    const ProfileScope profile("backward_grouped", inputs[0], total_rows, inputs[0].size(-1),
+                               bytes);
+    cuda_grouped_layer_norm_gradient(douts, means, invvars, inputs, optional_tensor_ptrs(gammas),
+                                     epsilons, grad_inputs, grad_gamma_ptrs, grad_beta_ptrs);
+    return {grad_inputs, grad_gammas, grad_betas};
+}
+
+
+void set_tuned_launch(int64_t arch, at::ScalarType dtype, int64_t cols, int64_t rows_bucket,
+                      bool has_gamma, bool has_beta, bool backward, int64_t variant,
+                      int64_t threads_per_block);
+
+void clear_tuned_launches();
+
+at::ScalarType scalar_type_from_name(const std::string& name) {
+    if (name == "float32") return at::ScalarType::Float;
+    if (name == "float16") return at::ScalarType::Half;
+    if (name == "bfloat16") return at::ScalarType::BFloat16;
+    TORCH_CHECK(false, "LayerNorm autotuning is not supported for dtype ", name);
+}
+#endif  // WITH_CUDA
+
+// Dispatcher entry points (torch.ops.protenix_layer_norm.*), so torch.compile can trace
+// through the fused LayerNorm instead of breaking the graph at the pybind call. Their fake
+// (shape) kernels and the autograd formula are registered from layer_norm.py. The outputs
+// follow the layout rule of layer_norm_affine (input's strides when has_dense_rows, else
+// contiguous), which the fake kernels mirror; the absent parameter gradients are returned
+// as empty tensors, since an op cannot return None.
+std::tuple<at::Tensor, at::Tensor, at::Tensor> layer_norm_op(
+    const at::Tensor& input, at::IntArrayRef normalized_shape,
+    const c10::optional<at::Tensor>& weight, const c10::optional<at::Tensor>& bias,
+    double epsilon) {
+    at::Tensor gamma = weight.has_value() ? *weight : at::Tensor();
+    at::Tensor beta = bias.has_value() ? *bias : at::Tensor();
+    std::vector<at::Tensor> outputs =
+        layer_norm_affine(input, normalized_shape, gamma.defined() ? &gamma : NULL,
+                          beta.defined() ? &beta : NULL, epsilon);
+    return {outputs[0], outputs[1], outputs[2]};
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> layer_norm_backward_op(
+    const at::Tensor& dout, const at::Tensor& mean, const at::Tensor& invvar,
+    const at::Tensor& input, at::IntArrayRef normalized_shape,
+    const c10::optional<at::Tensor>& weight, const c10::optional<at::Tensor>& bias,
+    double epsilon) {
+    at::Tensor gamma = weight.has_value() ? *weight : at::Tensor();
+    at::Tensor beta = bias.has_value() ? *bias : at::Tensor();
+    std::vector<at::Tensor> grads = layer_norm_gradient_affine(
+        dout, mean, invvar, input, normalized_shape,
+        gamma.defined() ? &gamma : NULL, beta.defined() ? &beta : NULL, epsilon);
+    for (at::Tensor& grad : grads) {
+        if (!grad.defined()) grad = at::empty({0}, input.options());
+    }
+    return {grads[0], grads[1], grads[2]};
+}
+
+TORCH_LIBRARY(protenix_layer_norm, m) {
+    m.def("layer_norm(Tensor input, int[] normalized_shape, Tensor? weight, Tensor? bias, "
+          "float eps) -> (Tensor, Tensor, Tensor)");
+    m.def("layer_norm_backward(Tensor dout, Tensor mean, Tensor invvar, Tensor input, "
+          "int[] normalized_shape, Tensor? weight, Tensor? bias, float eps) "
+          "-> (Tensor, Tensor, Tensor)");
+}
+
+#ifdef WITH_CUDA
+TORCH_LIBRARY_IMPL(protenix_layer_norm, CUDA, m) {
+    m.impl("layer_norm", &layer_norm_op);
+    m.impl("layer_norm_backward", &layer_norm_backward_op);
+}
+#endif
+
+TORCH_LIBRARY_IMPL(protenix_layer_norm, CPU, m) {
+    m.impl("layer_norm", &layer_norm_op);
+    m.impl("layer_norm_backward", &layer_norm_backward_op);
+}
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     m.def("forward_none_affine", [](at::Tensor input, at::IntArrayRef normalized_shape, double epsilon) {
@@ -156,6 +1450,9 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         return layer_norm_affine(input, normalized_shape, gamma, beta, epsilon);
     }, "LayerNorm forward (CUDA)");
 
+    m.def("forward_inference", &layer_norm_inference_affine,
+          "LayerNorm forward without saved statistics, optionally into out (CUDA)");
+
     m.def("backward_none_affine", [](at::Tensor dout, at::Tensor mean, at::Tensor invvar, at::Tensor input,
                                      at::IntArrayRef normalized_shape, double epsilon) {
         return layer_norm_gradient_affine(dout, mean, invvar, input, normalized_shape, NULL, NULL, epsilon);
@@ -176,4 +1473,90 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
                                      at::IntArrayRef normalized_shape, at::Tensor *gamma, at::Tensor *beta, double epsilon) {
         return layer_norm_gradient_affine(dout, mean, invvar, input, normalized_shape, gamma, beta, epsilon);
     }, "LayerNorm backward (CUDA)");
+
+    m.def("backward_recompute_stats", &layer_norm_gradient_recompute_stats_affine,
+          "LayerNorm backward recomputing the row statistics from the input (CUDA)");
+
+#ifdef WITH_CUDA
+    m.def("backward_main_grad", &layer_norm_gradient_main_grad_affine,
+          "LayerNorm backward adding the weight/bias gradients to fp32 main-grad buffers (CUDA)");
+
+    m.def("backward_partial", &layer_norm_gradient_partial_affine,
+          "LayerNorm backward with the unreduced fp32 weight/bias gradients of this rank (CUDA)");
+
+    m.def("forward_rms_norm", &rms_norm_affine, "RMSNorm forward (CUDA)");
+
+    m.def("backward_rms_norm", &rms_norm_gradient_affine, "RMSNorm backward (CUDA)");
+
+    m.def("forward_inplace_affine", &layer_norm_inplace_affine,
+          "LayerNorm forward writing the output over the input (CUDA)");
+
+    m.def("backward_from_output_affine", &layer_norm_gradient_from_output_affine,
+          "LayerNorm backward from the saved output (CUDA)");
+
+    m.def("forward_save_xhat", &layer_norm_save_xhat_affine,
+          "LayerNorm forward that also returns x_hat in a compact dtype (CUDA)");
+
+    m.def("backward_from_xhat", &layer_norm_gradient_from_xhat_affine,
+          "LayerNorm backward from the saved compact x_hat and invvar (CUDA)");
+
+    m.def("forward_transposed", &layer_norm_transposed_affine,
+          "LayerNorm forward writing [*, J, I, C] from an [*, I, J, C] input (CUDA)");
+
+    m.def("backward_transposed", &layer_norm_gradient_transposed_affine,
+          "LayerNorm backward from the [*, J, I, C] output gradient (CUDA)");
+
+    m.def("forward_add_layer_norm", &add_layer_norm_affine,
+          "Residual add followed by LayerNorm forward (CUDA)");
+
+    m.def("backward_add_layer_norm", &add_layer_norm_gradient_affine,
+          "Residual add followed by LayerNorm backward (CUDA)");
+
+    m.def("forward_grouped", &grouped_layer_norm_affine,
+          "LayerNorm forward of several independent inputs in one launch (CUDA)");
+
+    m.def("backward_grouped", &grouped_layer_norm_gradient_affine,
+          "LayerNorm backward of several independent inputs in one launch (CUDA)");
+
+    m.def("forward_epilogue", &layer_norm_epilogue_affine,
+          "LayerNorm forward with mask/dropout/gate epilogue (CUDA)");
+
+    m.def("backward_epilogue", &layer_norm_epilogue_gradient_affine,
+          "LayerNorm backward with mask/dropout/gate epilogue (CUDA)");
+
+    m.def("forward_indexed", &layer_norm_indexed_affine,
+          "LayerNorm forward of the rows listed in row_index only (CUDA)");
+
+    m.def("backward_indexed", &layer_norm_indexed_gradient_affine,
+          "LayerNorm backward of the rows listed in row_index only (CUDA)");
+
+    m.def("forward_ada_layer_norm", &ada_layer_norm_affine,
+          "Adaptive LayerNorm forward with per-element sigmoid scale and shift (CUDA)");
+
+    m.def("backward_ada_layer_norm", &ada_layer_norm_gradient_affine,
+          "Adaptive LayerNorm backward (CUDA)");
+
+    m.def("forward_fp8", &layer_norm_fp8_affine, "LayerNorm forward with FP8 output (CUDA)");
+
+    m.def("set_tuned_launch",
+          [](int64_t arch, const std::string& dtype, int64_t cols, int64_t rows_bucket,
+             bool has_gamma, bool has_beta, bool backward, int64_t variant,
+             int64_t threads_per_block) {
+              set_tuned_launch(arch, scalar_type_from_name(dtype), cols, rows_bucket, has_gamma,
+                               has_beta, backward, variant, threads_per_block);
+          },
+          "Override the LayerNorm launch choice for one (arch, dtype, cols, rows bucket, affine, "
+          "direction)");
+
+    m.def("clear_tuned_launches", &clear_tuned_launches,
+          "Drop every LayerNorm launch override");
+
+    m.def("set_profiling", &set_profiling,
+          "Turn the NVTX/CUDA-event profiling of every LayerNorm call on or off");
+
+    m.def("profile_stats", &profile_stats,
+          "(op, rows, cols, dtype, kernel, bytes, elapsed_us) of every profiled call");
+
+    m.def("reset_profile_stats", &reset_profile_stats, "Drop the recorded profiling stats");
+#endif
 }
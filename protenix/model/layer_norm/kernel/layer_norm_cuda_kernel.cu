@@ -16,14 +16,30 @@
 #include <cooperative_groups.h>
 #include <cuda.h>
 #include <cuda_runtime.h>
+#include <curand_kernel.h>
 #include <torch/extension.h>
+#include <array>
+#include <atomic>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
 
 #include <THC/THCDeviceUtils.cuh>
 
 #include "ATen/ATen.h"
 #include "ATen/AccumulateType.h"
 #include "ATen/cuda/CUDAContext.h"
+#include "ATen/cuda/CUDAGeneratorImpl.h"
+#include "ATen/cuda/CUDAGraphsUtils.cuh"
+#include "ATen/cuda/PhiloxUtils.cuh"
+#include "c10/cuda/CUDAException.h"
+#include "c10/cuda/CUDAMacros.h"
+#include "c10/util/Float8_e4m3fn.h"
+#include "c10/util/Float8_e5m2.h"
 #include "compat.h"
 #include "type_shim.h"
 
@@ -72,6 +88,12 @@ __inline__ __device__ void WelfordWarpAllReduce(float thread_mean, float thread_
     }
 }
 
+__inline__ __device__ void warp_sum_reduce(float &val, int syc_thread_num) {
+    for(int mask = syc_thread_num/2; mask >= 1; mask /= 2) {
+        val += __shfl_xor_sync(0xffffffff, val, mask);
+    }
+}
+
 extern __shared__ float shared_data[];
 template <typename T>
 __global__ void LayerNormForward(T* input, T* output, T* gamma, T* beta, float* mean,
@@ -142,376 +164,1803 @@ int find_opt_threads(int M, int elements_per_thread) {
     return 32;
 }
 
+// Thread blocks of block_size threads the current device keeps resident at once.
+inline long max_resident_blocks(int block_size) {
+    const auto* props = at::cuda::getCurrentDeviceProperties();
+    return static_cast<long>(props->multiProcessorCount) *
+           (props->maxThreadsPerMultiProcessor / block_size);
+}
+
+// Launch shape of the VecType (V2) kernels: the widest vector access that divides the row,
+// a power-of-two group of threads per row and threads_per_block threads per block (128 unless
+// the autotuner picked another size). Rows whose byte size is
+// not even a multiple of 4 (odd half/bfloat16 widths) still use 16-byte accesses; the kernels
+// peel the unaligned head and tail of every row with scalar accesses (V2RowSplit).
+//
+// Every V2 kernel walks the rows grid-stride, one row group (blockDim.y rows) per block at a
+// time, so a grid capped at one wave of resident blocks still covers all rows. Every row group
+// of a block runs the same iterations and rows past the end only skip their memory accesses,
+// so the warp shuffles of the row reductions stay converged.
+struct V2LaunchConfig {
+    int vec_size;  // bytes per vector access
+    dim3 grid;
+    dim3 block;
+};
+
+inline V2LaunchConfig GetV2LaunchConfig(long rows, long cols, int element_size,
+                                        int threads_per_block = 128) {
+    const long total_bytes = cols * element_size;
+    int vec_size = 16;
+    if (total_bytes % 16 == 0) {
+        vec_size = 16;
+    } else if (total_bytes % 8 == 0) {
+        vec_size = 8;
+    } else if (total_bytes % 4 == 0) {
+        vec_size = 4;
+    }
+    const int threads_per_row = find_opt_threads(cols, vec_size / element_size);
+    const int rows_per_block = threads_per_block / threads_per_row;
+    long num_blocks = (rows + rows_per_block - 1) / rows_per_block;
+    if (rows * cols > std::numeric_limits<int32_t>::max()) {
+        // Very large tensors (e.g. the pair tensor at several thousand tokens): one wave of
+        // resident blocks that walks the rows grid-stride.
+        num_blocks = std::min(num_blocks, max_resident_blocks(threads_per_block));
+    }
+    return {vec_size, dim3(num_blocks), dim3(threads_per_row, rows_per_block)};
+}
+
+// Calls f with a value of the VecType that moves vec_size bytes of T: float4, float2, float,
+// or T itself for any other size.
+template <typename T, typename F>
+void DispatchVecType(int vec_size, F&& f) {
+    switch (vec_size) {
+        case 16: f(float4()); break;
+        case 8: f(float2()); break;
+        case 4: f(float()); break;
+        default: f(T()); break;
+    }
+}
+
+template <typename T, int N>
+struct alignas(sizeof(T) * N) AlignedVector {
+    T val[N];
+};
+
+// N consecutive gamma/beta values as float. The parameter type P is either the activation type
+// or float (fp32 master parameters with half/bfloat16 activations); the load is vectorized when
+// the address allows it.
+template <int N, typename P>
+__device__ __forceinline__ void load_params(float* dst, const P* src) {
+    if (reinterpret_cast<uintptr_t>(src) % sizeof(AlignedVector<P, N>) == 0) {
+        const AlignedVector<P, N> vec = *reinterpret_cast<const AlignedVector<P, N>*>(src);
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] = static_cast<float>(vec.val[i]);
+    } else {
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] = static_cast<float>(src[i]);
+    }
+}
+
+// Columns of one row as seen by the V2 kernels: a scalar head up to the first VecType-aligned
+// element, a body of aligned VecType accesses and a scalar tail. Sliced views and widths whose
+// byte size is not a multiple of sizeof(VecType) start rows at different alignments, so the split
+// is per row. A row past the end is given zero columns.
 template <typename T, typename VecType>
-__global__ void LayerNormForwardV2(T* input, T* output, T* gamma, T* beta,
+struct V2RowSplit {
+    static constexpr int ELEMENTS_PER_VEC = sizeof(VecType) / sizeof(T);
+    long head;
+    long body_vecs;
+    long cols;
+
+    __device__ __forceinline__ V2RowSplit(const T* row_ptr, long row_cols) : cols(row_cols) {
+        const long misalign =
+            (reinterpret_cast<uintptr_t>(row_ptr) % sizeof(VecType)) / sizeof(T);
+        head = misalign == 0 ? 0 : min(cols, ELEMENTS_PER_VEC - misalign);
+        body_vecs = (cols - head) / ELEMENTS_PER_VEC;
+    }
+    __device__ __forceinline__ long vec_col(long v) const { return head + v * ELEMENTS_PER_VEC; }
+    __device__ __forceinline__ long num_scalars() const {
+        return cols - body_vecs * ELEMENTS_PER_VEC;
+    }
+    // Column of the i-th scalar element: the head first, then the tail.
+    __device__ __forceinline__ long scalar_col(long i) const {
+        return i < head ? i : i + body_vecs * ELEMENTS_PER_VEC;
+    }
+};
+
+// VecType access to an operand that is not the row the split was computed from (gamma/beta, or a
+// tensor whose base pointer has a different alignment): vectorized when the address allows it,
+// element by element otherwise.
+template <typename VecType, typename T>
+__device__ __forceinline__ VecType load_vec(const T* ptr) {
+    if (reinterpret_cast<uintptr_t>(ptr) % sizeof(VecType) == 0) {
+        return *reinterpret_cast<const VecType*>(ptr);
+    }
+    VecType vec;
+    T* vals = reinterpret_cast<T*>(&vec);
+#pragma unroll
+    for (int i = 0; i < int(sizeof(VecType) / sizeof(T)); ++i) vals[i] = ptr[i];
+    return vec;
+}
+
+template <typename VecType, typename T>
+__device__ __forceinline__ void store_vec(T* ptr, const VecType& vec) {
+    if (reinterpret_cast<uintptr_t>(ptr) % sizeof(VecType) == 0) {
+        *reinterpret_cast<VecType*>(ptr) = vec;
+        return;
+    }
+    const T* vals = reinterpret_cast<const T*>(&vec);
+#pragma unroll
+    for (int i = 0; i < int(sizeof(VecType) / sizeof(T)); ++i) ptr[i] = vals[i];
+}
+
+template <typename T, typename VecType, typename P = T>
+__global__ void LayerNormForwardV2(T* input, T* output, const P* gamma, const P* beta,
                                    float* mean, float* invvar, long rows,
                                    long cols, float epsilon) {
     constexpr int ELEMENTS_PER_THREAD = sizeof(VecType) / sizeof(T);
 
     const long tid = threadIdx.x;
-    const long row = blockIdx.x * blockDim.y + threadIdx.y;
-    T* row_input_ptr = input + row * cols;
-    T* row_output_ptr = output + row * cols;
-    if (row >= rows) return;
-
     const bool has_gamma = gamma != nullptr;
     const bool has_beta = beta != nullptr;
 
-    const long ELEMENTS_PER_BLOCK = blockDim.x * ELEMENTS_PER_THREAD;
-    long TOTAL_BLOCKS = cols / ELEMENTS_PER_BLOCK;
+    // Grid-stride row-group loop of the V2 kernels (see V2LaunchConfig).
+    for (long row_base = static_cast<long>(blockIdx.x) * blockDim.y; row_base < rows;
+         row_base += static_cast<long>(gridDim.x) * blockDim.y) {
+        const long row = row_base + threadIdx.y;
+        T* row_input_ptr = input + row * cols;
+        T* row_output_ptr = output + row * cols;
+        const V2RowSplit<T, VecType> split(row_input_ptr, row < rows ? cols : 0);
+
+        float thread_mean = 0.f, thread_m2 = 0.f, thread_count = 0.f;
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            VecType vec = *reinterpret_cast<VecType*>(row_input_ptr + split.vec_col(v));
+            T* vals = reinterpret_cast<T*>(&vec);
+            #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                WelfordOnline(static_cast<float>(vals[i]), &thread_mean, &thread_m2, &thread_count);
+            }
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            WelfordOnline(static_cast<float>(row_input_ptr[split.scalar_col(i)]), &thread_mean,
+                          &thread_m2, &thread_count);
+        }
 
-    {
-        const long REMAINING_ELEMENTS = cols % ELEMENTS_PER_BLOCK;
-        const long REMAINING_VECTORS = REMAINING_ELEMENTS / ELEMENTS_PER_THREAD;
-        if(tid < REMAINING_VECTORS) ++TOTAL_BLOCKS;
-    }
+        float row_mean, warp_m2, warp_count;
+        WelfordWarpAllReduce(thread_mean, thread_m2, thread_count, &row_mean, &warp_m2, &warp_count, blockDim.x);
+        float row_inv_var = rsqrt(max(warp_m2 / warp_count, 0.f) + epsilon);
 
-    float thread_mean = 0.f, thread_m2 = 0.f, thread_count = 0.f;
-        for (int block = 0; block < TOTAL_BLOCKS; ++block) {
-        const long base_idx = block * ELEMENTS_PER_BLOCK + tid * ELEMENTS_PER_THREAD;
-        VecType vec = *reinterpret_cast<VecType*>(row_input_ptr + base_idx);
-        T* vals = reinterpret_cast<T*>(&vec);
-        #pragma unroll
-        for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
-            WelfordOnline(static_cast<float>(vals[i]), &thread_mean, &thread_m2, &thread_count);
+        if (tid == 0 && row < rows && mean != nullptr) {
+            mean[row] = row_mean;
+            invvar[row] = row_inv_var;
+        }
+
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            const long col = split.vec_col(v);
+            VecType vec = *reinterpret_cast<VecType*>(row_input_ptr + col);
+            VecType vec_out;
+            float gamma_vals[ELEMENTS_PER_THREAD], beta_vals[ELEMENTS_PER_THREAD];
+            if (has_gamma) load_params<ELEMENTS_PER_THREAD>(gamma_vals, gamma + col);
+            if (has_beta) load_params<ELEMENTS_PER_THREAD>(beta_vals, beta + col);
+            T* vals = reinterpret_cast<T*>(&vec);
+            T* vals_out = reinterpret_cast<T*>(&vec_out);
+
+            #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                float normalized = (static_cast<float>(vals[i]) - row_mean) * row_inv_var;
+                if (has_gamma) normalized *= gamma_vals[i];
+                if (has_beta) normalized += beta_vals[i];
+                vals_out[i] = static_cast<T>(normalized);
+            }
+
+            store_vec(row_output_ptr + col, vec_out);
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            const long col = split.scalar_col(i);
+            float normalized = (static_cast<float>(row_input_ptr[col]) - row_mean) * row_inv_var;
+            if (has_gamma) normalized *= static_cast<float>(gamma[col]);
+            if (has_beta) normalized += static_cast<float>(beta[col]);
+            row_output_ptr[col] = static_cast<T>(normalized);
         }
     }
+}
 
-    float row_mean, warp_m2, warp_count;
-    WelfordWarpAllReduce(thread_mean, thread_m2, thread_count, &row_mean, &warp_m2, &warp_count, blockDim.x);
-    float row_inv_var = rsqrt(max(warp_m2 / warp_count, 0.f) + epsilon);
+// RMSNorm counterpart of LayerNormForwardV2: y = x * rsqrt(mean(x^2) + eps) * gamma. The row
+// reduction is a single sum of squares, there is no mean and no Welford merge. Rows past the
+// end still take part in the shuffles, so the whole row group stays converged.
+template <typename T, typename VecType>
+__global__ void RMSNormForwardV2(const T* __restrict__ input, T* __restrict__ output,
+                                 const T* __restrict__ gamma, float* __restrict__ invvar,
+                                 long rows, long cols, float epsilon) {
+    constexpr int ELEMENTS_PER_THREAD = sizeof(VecType) / sizeof(T);
+    const long tid = threadIdx.x;
+    // Grid-stride row-group loop of the V2 kernels (see V2LaunchConfig).
+    for (long row_base = static_cast<long>(blockIdx.x) * blockDim.y; row_base < rows;
+         row_base += static_cast<long>(gridDim.x) * blockDim.y) {
+        const long row = row_base + threadIdx.y;
+        const bool row_valid = row < rows;
+        const T* row_input_ptr = input + row * cols;
+        T* row_output_ptr = output + row * cols;
+        const V2RowSplit<T, VecType> split(row_input_ptr, row_valid ? cols : 0);
+
+        float thread_sq_sum = 0.f;
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            VecType vec = *reinterpret_cast<const VecType*>(row_input_ptr + split.vec_col(v));
+            const T* vals = reinterpret_cast<const T*>(&vec);
+    #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                const float val = static_cast<float>(vals[i]);
+                thread_sq_sum += val * val;
+            }
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            const float val = static_cast<float>(row_input_ptr[split.scalar_col(i)]);
+            thread_sq_sum += val * val;
+        }
+        warp_sum_reduce(thread_sq_sum, blockDim.x);
+        const float row_inv_rms = rsqrtf(thread_sq_sum / cols + epsilon);
+        if (row_valid && tid == 0) invvar[row] = row_inv_rms;
+
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            const long col = split.vec_col(v);
+            VecType vec = *reinterpret_cast<const VecType*>(row_input_ptr + col);
+            VecType vec_gamma;
+            if (gamma != nullptr) vec_gamma = load_vec<VecType>(gamma + col);
+            VecType vec_out;
+            const T* vals = reinterpret_cast<const T*>(&vec);
+            const T* gamma_vals = reinterpret_cast<const T*>(&vec_gamma);
+            T* vals_out = reinterpret_cast<T*>(&vec_out);
+    #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                float normalized = static_cast<float>(vals[i]) * row_inv_rms;
+                if (gamma != nullptr) normalized *= static_cast<float>(gamma_vals[i]);
+                vals_out[i] = static_cast<T>(normalized);
+            }
+            store_vec(row_output_ptr + col, vec_out);
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            const long col = split.scalar_col(i);
+            float normalized = static_cast<float>(row_input_ptr[col]) * row_inv_rms;
+            if (gamma != nullptr) normalized *= static_cast<float>(gamma[col]);
+            row_output_ptr[col] = static_cast<T>(normalized);
+        }
+    }
+}
 
-    if (tid == 0) {
-        mean[row] = row_mean;
-        invvar[row] = row_inv_var;
+// Loads N consecutive elements of a row and converts them to float.
+template <typename T>
+struct DirectLoad {
+    const T* src;
+    long row_stride;
+
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        const AlignedVector<T, N> vec =
+            *reinterpret_cast<const AlignedVector<T, N>*>(src + row * row_stride + col);
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] = static_cast<float>(vec.val[i]);
     }
+};
 
-    for (int block = 0; block < TOTAL_BLOCKS; ++block) {
-        const long base_idx = block * ELEMENTS_PER_BLOCK + tid * ELEMENTS_PER_THREAD;
-        VecType vec = *reinterpret_cast<VecType*>(row_input_ptr + base_idx);
-        VecType vec_out;
-        T* vals = reinterpret_cast<T*>(&vec);
-        T* vals_out = reinterpret_cast<T*>(&vec_out);
+// Rounds N float values to T and stores them in a row.
+template <typename T>
+struct DirectStore {
+    T* dst;
+    long row_stride;
 
-        VecType vec_gamma;
-        if (has_gamma) {
-            vec_gamma = *reinterpret_cast<VecType*>(gamma + base_idx);
-        } else {
-            T default_gamma[ELEMENTS_PER_THREAD];
-            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i)
-                default_gamma[i] = static_cast<T>(1.0f);
-            vec_gamma = *reinterpret_cast<VecType*>(default_gamma);
+    template <int N>
+    __device__ __forceinline__ void store(const float* vals, long row, long col) const {
+        AlignedVector<T, N> vec;
+#pragma unroll
+        for (int i = 0; i < N; ++i) vec.val[i] = static_cast<T>(vals[i]);
+        *reinterpret_cast<AlignedVector<T, N>*>(dst + row * row_stride + col) = vec;
+    }
+};
+
+// Loads residual + update, rounds the sum to T and writes it back to sum, so a pre-norm block
+// updates its residual stream in the same pass that normalizes it. The rounded value is the
+// one that gets normalized, which keeps the forward consistent with a backward from sum.
+template <typename T>
+struct AddLoad {
+    const T* residual;
+    const T* update;
+    T* sum;
+    long row_stride;
+
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        const long offset = row * row_stride + col;
+        const AlignedVector<T, N> residual_vec =
+            *reinterpret_cast<const AlignedVector<T, N>*>(residual + offset);
+        const AlignedVector<T, N> update_vec =
+            *reinterpret_cast<const AlignedVector<T, N>*>(update + offset);
+        AlignedVector<T, N> sum_vec;
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            sum_vec.val[i] = static_cast<T>(static_cast<float>(residual_vec.val[i]) +
+                                            static_cast<float>(update_vec.val[i]));
+            dst[i] = static_cast<float>(sum_vec.val[i]);
         }
+        *reinterpret_cast<AlignedVector<T, N>*>(sum + offset) = sum_vec;
+    }
+};
 
-        VecType vec_beta;
-        if (has_beta) {
-            vec_beta = *reinterpret_cast<VecType*>(beta + base_idx);
-        } else {
-            T default_beta[ELEMENTS_PER_THREAD];
-            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i)
-                default_beta[i] = static_cast<T>(0.0f);
-            vec_beta = *reinterpret_cast<VecType*>(default_beta);
+// Applies the optional gamma/beta affine transform to N normalized values and stores them.
+// gamma/beta are of type P (see load_params).
+template <typename T, typename P = T>
+struct AffineStore {
+    T* dst;
+    long row_stride;
+    const P* gamma;
+    const P* beta;
+
+    template <int N>
+    __device__ __forceinline__ void store(const float* normalized, long row, long col) const {
+        AlignedVector<T, N> out;
+        float gamma_vals[N], beta_vals[N];
+        if (gamma != nullptr) load_params<N>(gamma_vals, gamma + col);
+        if (beta != nullptr) load_params<N>(beta_vals, beta + col);
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            float y = normalized[i];
+            if (gamma != nullptr) y *= gamma_vals[i];
+            if (beta != nullptr) y += beta_vals[i];
+            out.val[i] = static_cast<T>(y);
         }
+        *reinterpret_cast<AlignedVector<T, N>*>(dst + row * row_stride + col) = out;
+    }
+};
 
-        T* gamma_vals = reinterpret_cast<T*>(&vec_gamma);
-        T* beta_vals = reinterpret_cast<T*>(&vec_beta);
+// Elementwise ops that commonly follow a LayerNorm in Protenix, applied to the affine output
+// before it is rounded and stored: a per-row mask broadcast over the normalized dimension
+// (e.g. the pair mask), inverted dropout, and a multiply by a second tensor (a gate). The
+// dropout mask is never materialized; it is a function of (seed, offset, element index)
+// through stateless Philox, so the backward regenerates it from the two saved integers.
+template <typename T>
+struct Epilogue {
+    const T* row_mask;        // [rows] or nullptr
+    const T* gate;            // [rows, cols] or nullptr
+    long cols;
+    uint32_t drop_threshold;  // an element is dropped when its 32-bit random is below; 0: off
+    float drop_scale;         // 1 / (1 - p)
+    at::PhiloxCudaState philox;
+
+    // Product of the row mask and the dropout factor for N consecutive elements of a row,
+    // i.e. every multiplier except the gate.
+    template <int N>
+    __device__ __forceinline__ void scale(float* factors, long row, long col) const {
+        const float mask = row_mask != nullptr ? static_cast<float>(row_mask[row]) : 1.f;
+#pragma unroll
+        for (int i = 0; i < N; ++i) factors[i] = mask;
+        if (drop_threshold == 0) return;
+
+        const auto seeds = at::cuda::philox::unpack(philox);
+        const uint64_t seed = std::get<0>(seeds);
+        const uint64_t offset = std::get<1>(seeds);
+        const uint2 key = make_uint2(static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32));
+        const uint64_t first = static_cast<uint64_t>(row) * cols + col;
+        uint4 random;
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            // One Philox call yields the randoms of four consecutive elements.
+            const uint64_t idx = first + i;
+            if (i == 0 || idx % 4 == 0) {
+                const uint64_t group = idx / 4;
+                random = curand_Philox4x32_10(
+                    make_uint4(static_cast<uint32_t>(group), static_cast<uint32_t>(group >> 32),
+                               static_cast<uint32_t>(offset), static_cast<uint32_t>(offset >> 32)),
+                    key);
+            }
+            const uint32_t r = idx % 4 == 0   ? random.x
+                               : idx % 4 == 1 ? random.y
+                               : idx % 4 == 2 ? random.z
+                                              : random.w;
+            factors[i] *= r < drop_threshold ? 0.f : drop_scale;
+        }
+    }
+};
 
-        #pragma unroll
-        for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
-            float normalized = (static_cast<float>(vals[i]) - row_mean) * row_inv_var;
-            normalized = normalized * static_cast<float>(gamma_vals[i])
-                       + static_cast<float>(beta_vals[i]);
-            vals_out[i] = static_cast<T>(normalized);
+// Affine transform followed by the epilogue. The first thread of the grid also records the
+// unpacked Philox seed/offset in rng_state[2] so the backward can replay the dropout mask.
+template <typename T>
+struct EpilogueStore {
+    T* dst;
+    long row_stride;
+    const T* gamma;
+    const T* beta;
+    Epilogue<T> epilogue;
+    int64_t* rng_state;
+
+    template <int N>
+    __device__ __forceinline__ void store(const float* normalized, long row, long col) const {
+        AlignedVector<T, N> out;
+        AlignedVector<T, N> gamma_vec;
+        AlignedVector<T, N> beta_vec;
+        AlignedVector<T, N> gate_vec;
+        const long offset = row * row_stride + col;
+        if (gamma != nullptr) gamma_vec = *reinterpret_cast<const AlignedVector<T, N>*>(gamma + col);
+        if (beta != nullptr) beta_vec = *reinterpret_cast<const AlignedVector<T, N>*>(beta + col);
+        if (epilogue.gate != nullptr) {
+            gate_vec = *reinterpret_cast<const AlignedVector<T, N>*>(epilogue.gate + offset);
+        }
+        float factors[N];
+        epilogue.template scale<N>(factors, row, col);
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            float y = normalized[i];
+            if (gamma != nullptr) y *= static_cast<float>(gamma_vec.val[i]);
+            if (beta != nullptr) y += static_cast<float>(beta_vec.val[i]);
+            y *= factors[i];
+            if (epilogue.gate != nullptr) y *= static_cast<float>(gate_vec.val[i]);
+            out.val[i] = static_cast<T>(y);
+        }
+        *reinterpret_cast<AlignedVector<T, N>*>(dst + offset) = out;
+        if (epilogue.drop_threshold != 0 && row == 0 && col == 0) {
+            const auto seeds = at::cuda::philox::unpack(epilogue.philox);
+            rng_state[0] = static_cast<int64_t>(std::get<0>(seeds));
+            rng_state[1] = static_cast<int64_t>(std::get<1>(seeds));
         }
+    }
+};
 
-        *reinterpret_cast<VecType*>(row_output_ptr + base_idx) = vec_out;
+// dout of the LayerNorm backward under the epilogue: the gradient of the stored output taken
+// back through the gate, the dropout and the row mask as the backward reads it, so the
+// gradient of the affine output is never written. The gate gradient needs the affine output,
+// which write_grad_gate rebuilds from the x_hat the backward already holds.
+template <typename T>
+struct EpilogueGradLoad {
+    const T* grad_output;
+    long row_stride;
+    const T* gamma;
+    const T* beta;
+    Epilogue<T> epilogue;
+    T* grad_gate;  // [rows, cols], written when epilogue.gate != nullptr
+
+    // dout * row mask * dropout, i.e. the gradient of the gated product.
+    template <int N>
+    __device__ __forceinline__ void load_ungated(float* dst, long row, long col) const {
+        const AlignedVector<T, N> dout_vec = *reinterpret_cast<const AlignedVector<T, N>*>(
+            grad_output + row * row_stride + col);
+        epilogue.template scale<N>(dst, row, col);
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] *= static_cast<float>(dout_vec.val[i]);
     }
-}
 
-void cuda_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar, at::Tensor* input,
-                     int rows, int cols, at::IntArrayRef normalized_shape, at::Tensor* gamma,
-                     at::Tensor* beta, double epsilon) {
-    // Get element byte size
-    const auto dtype = output->dtype();
-    int element_size;
-    if (dtype == torch::kFloat32) {
-        element_size = 4;
-    } else if (dtype == torch::kFloat16 || dtype == torch::kBFloat16) {
-        element_size = 2;
-    } else {
-        throw std::runtime_error("Unsupported data type");
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        load_ungated<N>(dst, row, col);
+        if (epilogue.gate == nullptr) return;
+        const AlignedVector<T, N> gate_vec = *reinterpret_cast<const AlignedVector<T, N>*>(
+            epilogue.gate + row * row_stride + col);
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] *= static_cast<float>(gate_vec.val[i]);
     }
 
-    // Calculate total bytes and check alignment
-    const int total_bytes = cols * element_size;
-    int vec_size = 0;
-    if (total_bytes % 16 == 0) {
-        vec_size = 16;
-    } else if (total_bytes % 8 == 0) {
-        vec_size = 8;
-    } else if (total_bytes % 4 == 0) {
-        vec_size = 4;
-    } else {
-        vec_size = 2;
+    // grad_gate = dout * row mask * dropout * (gamma * x_hat + beta). dout was just read by
+    // load, so the second read is served from cache.
+    template <int N>
+    __device__ __forceinline__ void write_grad_gate(const float* xhat, long row, long col) const {
+        if (epilogue.gate == nullptr) return;
+        float grad[N], gamma_vals[N], beta_vals[N];
+        load_ungated<N>(grad, row, col);
+        if (gamma != nullptr) load_params<N>(gamma_vals, gamma + col);
+        if (beta != nullptr) load_params<N>(beta_vals, beta + col);
+        AlignedVector<T, N> grad_gate_vec;
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            float y = xhat[i];
+            if (gamma != nullptr) y *= gamma_vals[i];
+            if (beta != nullptr) y += beta_vals[i];
+            grad_gate_vec.val[i] = static_cast<T>(grad[i] * y);
+        }
+        *reinterpret_cast<AlignedVector<T, N>*>(grad_gate + row * row_stride + col) =
+            grad_gate_vec;
     }
+};
 
-    // Calculate elements per thread
-    const int elements_per_thread = vec_size / element_size;
-    const int threads_per_row = find_opt_threads(cols, elements_per_thread);
+// Hands a DOUT_LOAD the x_hat of N elements it loaded, once per element, for loads whose
+// operands have a gradient of their own. A no-op but for EpilogueGradLoad and AdaLNGradLoad.
+template <int N, typename LOAD>
+__device__ __forceinline__ void finish_dout(const LOAD&, const float*, long, long) {}
 
-    // Configure kernel parameters
-    const int threads_per_block = 128;
-    const int rows_per_block = threads_per_block / threads_per_row;
-    const dim3 grid((rows + rows_per_block - 1) / rows_per_block);
-    const dim3 block(threads_per_row, rows_per_block);
+template <int N, typename T>
+__device__ __forceinline__ void finish_dout(const EpilogueGradLoad<T>& dout, const float* xhat,
+                                            long row, long col) {
+    dout.template write_grad_gate<N>(xhat, row, col);
+}
 
-    // Type dispatch
-    if (dtype == torch::kFloat32) {
-        if (vec_size == 16) {
-            LayerNormForwardV2<float, float4><<<grid, block>>>(
-                static_cast<float*>(input->data_ptr()),
-                static_cast<float*>(output->data_ptr()),
-                gamma ? static_cast<float*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<float*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 8) {
-            LayerNormForwardV2<float, float2><<<grid, block>>>(
-                static_cast<float*>(input->data_ptr()),
-                static_cast<float*>(output->data_ptr()),
-                gamma ? static_cast<float*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<float*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 4) {
-            LayerNormForwardV2<float, float><<<grid, block>>>(
-                static_cast<float*>(input->data_ptr()),
-                static_cast<float*>(output->data_ptr()),
-                gamma ? static_cast<float*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<float*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        }
-    }
-    else if (dtype == torch::kFloat16) {
-                if (vec_size == 16) {  // Use float4 to handle half type (8 elements)
-            LayerNormForwardV2<at::Half, float4><<<grid, block>>>(
-                static_cast<at::Half*>(input->data_ptr()),
-                static_cast<at::Half*>(output->data_ptr()),
-                gamma ? static_cast<at::Half*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::Half*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 8) {  // float2 to handle 4 half elements
-            LayerNormForwardV2<at::Half, float2><<<grid, block>>>(
-                static_cast<at::Half*>(input->data_ptr()),
-                static_cast<at::Half*>(output->data_ptr()),
-                gamma ? static_cast<at::Half*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::Half*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 4) {  // float to handle 2 half elements
-            LayerNormForwardV2<at::Half, float><<<grid, block>>>(
-                static_cast<at::Half*>(input->data_ptr()),
-                static_cast<at::Half*>(output->data_ptr()),
-                gamma ? static_cast<at::Half*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::Half*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 2) {
-            LayerNormForwardV2<at::Half, at::Half><<<grid, block>>>(
-                static_cast<at::Half*>(input->data_ptr()),
-                static_cast<at::Half*>(output->data_ptr()),
-                gamma ? static_cast<at::Half*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::Half*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        }
-    }
-    else if (dtype == torch::kBFloat16) {
-        if (vec_size == 16) {
-            LayerNormForwardV2<at::BFloat16, float4><<<grid, block>>>(
-                static_cast<at::BFloat16*>(input->data_ptr()),
-                static_cast<at::BFloat16*>(output->data_ptr()),
-                gamma ? static_cast<at::BFloat16*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::BFloat16*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 8) {
-            LayerNormForwardV2<at::BFloat16, float2><<<grid, block>>>(
-                static_cast<at::BFloat16*>(input->data_ptr()),
-                static_cast<at::BFloat16*>(output->data_ptr()),
-                gamma ? static_cast<at::BFloat16*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::BFloat16*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 4) {
-            LayerNormForwardV2<at::BFloat16, float><<<grid, block>>>(
-                static_cast<at::BFloat16*>(input->data_ptr()),
-                static_cast<at::BFloat16*>(output->data_ptr()),
-                gamma ? static_cast<at::BFloat16*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::BFloat16*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
-        } else if (vec_size == 2) {
-            LayerNormForwardV2<at::BFloat16, at::BFloat16><<<grid, block>>>(
-                static_cast<at::BFloat16*>(input->data_ptr()),
-                static_cast<at::BFloat16*>(output->data_ptr()),
-                gamma ? static_cast<at::BFloat16*>(gamma->data_ptr()) : nullptr,
-                beta ? static_cast<at::BFloat16*>(beta->data_ptr()) : nullptr,
-                static_cast<float*>(mean->data_ptr()),
-                static_cast<float*>(invvar->data_ptr()),
-                long(rows), long(cols), float(epsilon)
-            );
+// Adaptive LayerNorm (AF3 Algorithm 26): the scale and shift are per element, [rows, cols]
+// tensors computed from the conditioning, and the scale passes through a sigmoid,
+//     y = sigmoid(scale) * x_hat + shift.
+template <typename T>
+struct AdaLNStore {
+    T* dst;
+    long row_stride;
+    const T* scale;  // pre-sigmoid
+    const T* shift;
+
+    template <int N>
+    __device__ __forceinline__ void store(const float* normalized, long row, long col) const {
+        const long offset = row * row_stride + col;
+        const AlignedVector<T, N> scale_vec =
+            *reinterpret_cast<const AlignedVector<T, N>*>(scale + offset);
+        const AlignedVector<T, N> shift_vec =
+            *reinterpret_cast<const AlignedVector<T, N>*>(shift + offset);
+        AlignedVector<T, N> out;
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            const float gate = 1.f / (1.f + __expf(-static_cast<float>(scale_vec.val[i])));
+            out.val[i] =
+                static_cast<T>(gate * normalized[i] + static_cast<float>(shift_vec.val[i]));
         }
+        *reinterpret_cast<AlignedVector<T, N>*>(dst + offset) = out;
     }
-}
+};
 
+// dout of the unaffine LayerNorm backward under AdaLNStore: dy * sigmoid(scale), applied as
+// the backward reads it. write_grad_scale emits grad_scale = dy * x_hat * sigmoid'(scale) from
+// the x_hat the backward holds; the shift gradient is dy itself.
 template <typename T>
-struct SharedMemory;
+struct AdaLNGradLoad {
+    const T* grad_output;
+    long row_stride;
+    const T* scale;  // pre-sigmoid
+    T* grad_scale;
+
+    // dy and sigmoid(scale) of N consecutive elements.
+    template <int N>
+    __device__ __forceinline__ void load_gated(float* dy, float* gate, long row,
+                                               long col) const {
+        const long offset = row * row_stride + col;
+        const AlignedVector<T, N> dout_vec =
+            *reinterpret_cast<const AlignedVector<T, N>*>(grad_output + offset);
+        const AlignedVector<T, N> scale_vec =
+            *reinterpret_cast<const AlignedVector<T, N>*>(scale + offset);
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            dy[i] = static_cast<float>(dout_vec.val[i]);
+            gate[i] = 1.f / (1.f + __expf(-static_cast<float>(scale_vec.val[i])));
+        }
+    }
 
-template <>
-struct SharedMemory<float> {
-    __device__ float* getPointer() {
-        extern __shared__ float s_float[];
-        return s_float;
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        float gate[N];
+        load_gated<N>(dst, gate, row, col);
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] *= gate[i];
+    }
+
+    // dout and scale were just read by load, so the second read is served from cache.
+    template <int N>
+    __device__ __forceinline__ void write_grad_scale(const float* xhat, long row,
+                                                     long col) const {
+        float dy[N], gate[N];
+        load_gated<N>(dy, gate, row, col);
+        AlignedVector<T, N> grad_scale_vec;
+#pragma unroll
+        for (int i = 0; i < N; ++i) {
+            grad_scale_vec.val[i] = static_cast<T>(dy[i] * xhat[i] * gate[i] * (1.f - gate[i]));
+        }
+        *reinterpret_cast<AlignedVector<T, N>*>(grad_scale + row * row_stride + col) =
+            grad_scale_vec;
     }
 };
 
-template<typename T>
-__inline__ __device__ T WarpReduce(T val) {
-  for (int mask = 16; mask > 0; mask /= 2) { val += __shfl_xor_sync(0xffffffff, val, mask); }
-  return val;
+template <int N, typename T>
+__device__ __forceinline__ void finish_dout(const AdaLNGradLoad<T>& dout, const float* xhat,
+                                            long row, long col) {
+    dout.template write_grad_scale<N>(xhat, row, col);
 }
 
-constexpr int tile_size = 32;
-constexpr int num_per_block = 4;
-constexpr int block_dim_x = 32;
-constexpr int block_dim_y = 32 / num_per_block;
+// Restrict a load/store functor to a subset of the rows: row r of the launch is row
+// row_index[r] of the tensor. The kernels are launched over the active rows only and their
+// statistics are compact, one entry per active row. An index outside [0, num_rows), num_rows
+// being the rows of the tensor, trips a device-side assert instead of accessing out of bounds;
+// checking on the host would need a synchronizing min/max of row_index on every call.
+__device__ __forceinline__ long checked_row(const int64_t* row_index, long row, long num_rows) {
+    const long index = row_index[row];
+    CUDA_KERNEL_ASSERT(index >= 0 && index < num_rows && "row_index out of range");
+    return index;
+}
 
-template <typename T, typename V>
-__global__ void LayerNormParamGradStep1(int rows, int cols, const V* __restrict__ dy,
-                                        const T* __restrict__ x, const float* __restrict__ mean,
-                                        const float* __restrict__ inv_var,
-                                        float* __restrict__ tmp_gamma_diff, float* __restrict__ tmp_beta_diff) {
-  __shared__ float dgamma[32][33];
-  __shared__ float dbeta[32][33];
-  float dgamma_sum[num_per_block];
-  float dbeta_sum[num_per_block];
+template <typename LOAD>
+struct IndexedLoad {
+    LOAD inner;
+    const int64_t* row_index;
+    long num_rows;
+
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        inner.template load<N>(dst, checked_row(row_index, row, num_rows), col);
+    }
+};
+
+template <typename STORE>
+struct IndexedStore {
+    STORE inner;
+    const int64_t* row_index;
+    long num_rows;
+
+    template <int N>
+    __device__ __forceinline__ void store(const float* normalized, long row, long col) const {
+        inner.template store<N>(normalized, checked_row(row_index, row, num_rows), col);
+    }
+};
+
+// Row (b, i, j) of a [B, I, J] grid of rows is row (b, j, i) of the transposed [B, J, I] grid.
+// Every row keeps its elements contiguous, so only the row offset changes and the accesses
+// within a row stay coalesced.
+struct RowTranspose {
+    long dim_i;
+    long dim_j;
+
+    __device__ __forceinline__ long operator()(long row) const {
+        const long plane = dim_i * dim_j;
+        const long b = row / plane;
+        const long i = (row - b * plane) / dim_j;
+        const long j = row - b * plane - i * dim_j;
+        return b * plane + j * dim_i + i;
+    }
+};
+
+// Read/write the row (b, j, i) of the transposed layout for row (b, i, j) of the launch.
+template <typename LOAD>
+struct TransposedLoad {
+    LOAD inner;
+    RowTranspose transpose;
+
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        inner.template load<N>(dst, transpose(row), col);
+    }
+};
+
+template <typename STORE>
+struct TransposedStore {
+    STORE inner;
+    RowTranspose transpose;
+
+    template <int N>
+    __device__ __forceinline__ void store(const float* normalized, long row, long col) const {
+        inner.template store<N>(normalized, transpose(row), col);
+    }
+};
+
+constexpr int kRegCachedThreadsPerBlock = 128;
+
+constexpr int reg_cached_threads_per_row(int vecs_per_row) {
+    int threads = 1;
+    while (threads < vecs_per_row && threads < WarpSize) threads *= 2;
+    return threads;
+}
+
+// Launch geometry of the register-cached kernels: a power-of-two group of threads per row,
+// each holding VECS_PER_THREAD packs of the row.
+template <int COLS, int PACK>
+struct RegCachedShape {
+    static_assert(COLS % PACK == 0, "COLS must be a multiple of the pack size");
+    static constexpr int VECS_PER_ROW = COLS / PACK;
+    static constexpr int THREADS_PER_ROW = reg_cached_threads_per_row(VECS_PER_ROW);
+    static constexpr int VECS_PER_THREAD = (VECS_PER_ROW + THREADS_PER_ROW - 1) / THREADS_PER_ROW;
+    static constexpr int ROWS_PER_BLOCK = kRegCachedThreadsPerBlock / THREADS_PER_ROW;
+};
+
+// Loads this thread's slice of a row into registers and normalizes it in place. Mean and
+// variance are computed with two register passes (sum, then sum of squared deviations),
+// which is as stable as Welford and cheaper. Every thread of the row group has to call this,
+// including those whose row is out of range, because the reductions shuffle across the group.
+template <int COLS, int PACK, typename LOAD>
+__device__ __forceinline__ void RegCachedLoadAndNormalize(
+    const LOAD& load, float (&buf)[RegCachedShape<COLS, PACK>::VECS_PER_THREAD][PACK], long row,
+    bool row_valid, float epsilon, float* row_mean, float* row_inv_var) {
+    using Shape = RegCachedShape<COLS, PACK>;
+    const int tid = threadIdx.x;
+
+    float thread_sum = 0.f;
 #pragma unroll
-  for (int index = 0; index < num_per_block; ++index) {
-    dgamma_sum[index] = 0;
-    dbeta_sum[index] = 0;
-  }
-  const int col_id = blockIdx.x * blockDim.x + threadIdx.x;
-  if (col_id < cols) {
-    for (int i = blockIdx.y * tile_size + threadIdx.y; i < rows; i += tile_size * gridDim.y) {
+    for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+        const int vec_idx = v * Shape::THREADS_PER_ROW + tid;
+        if (row_valid && vec_idx < Shape::VECS_PER_ROW) {
+            load.template load<PACK>(buf[v], row, vec_idx * PACK);
+        } else {
 #pragma unroll
-      for (int index = 0; index < num_per_block; ++index) {
-        int row_id = i + index * blockDim.y;
-        if (row_id < rows) {
-          int offset = row_id * cols + col_id;
-          const float dy_val = static_cast<float>(dy[offset]);
-          const float x_val = static_cast<float>(x[offset]);
-          const float mean_val = mean[row_id];
-          const float inv_var_val = inv_var[row_id];
-          dgamma_sum[index] += dy_val * (x_val - mean_val) * inv_var_val;
-          dbeta_sum[index] += dy_val;
+            for (int i = 0; i < PACK; ++i) buf[v][i] = 0.f;
         }
-      }
-    }
-  }
-#pragma unroll
-  for (int index = 0; index < num_per_block; ++index) {
-    dgamma[index * blockDim.y + threadIdx.y][threadIdx.x] = dgamma_sum[index];
-    dbeta[index * blockDim.y + threadIdx.y][threadIdx.x] = dbeta_sum[index];
-  }
-  __syncthreads();
 #pragma unroll
-  for (int index = 0; index < num_per_block; ++index) {
-    const int col_id = blockIdx.x * blockDim.x + threadIdx.y + index * blockDim.y;
-    if (col_id < cols) {
-      float gamma_sum = dgamma[threadIdx.x][threadIdx.y + index * blockDim.y];
-      float beta_sum = dbeta[threadIdx.x][threadIdx.y + index * blockDim.y];
-      float global_dgamma = WarpReduce<float>(gamma_sum);
-      float global_dbeta = WarpReduce<float>(beta_sum);
-      if (threadIdx.x == 0) {
-        const int offset = blockIdx.y * cols + col_id;
-        tmp_gamma_diff[offset] = global_dgamma;
-        tmp_beta_diff[offset] = global_dbeta;
-      }
+        for (int i = 0; i < PACK; ++i) thread_sum += buf[v][i];
     }
-  }
-}
+    warp_sum_reduce(thread_sum, Shape::THREADS_PER_ROW);
+    *row_mean = thread_sum / COLS;
 
-template <typename T, typename V>
-__global__ void LayerNormGammaGradStep1(int rows, int cols, const V* __restrict__ dy,
-                                        const T* __restrict__ x, const float* __restrict__ mean,
-                                        const float* __restrict__ inv_var, float* __restrict__ tmp_gamma_diff) {
-  __shared__ float dgamma[32][33];
-  float dgamma_sum[num_per_block];
+    float thread_sq_sum = 0.f;
 #pragma unroll
-  for (int index = 0; index < num_per_block; ++index) {
-    dgamma_sum[index] = 0;
-  }
-  const int col_id = blockIdx.x * blockDim.x + threadIdx.x;
-  if (col_id < cols) {
-    for (int i = blockIdx.y * tile_size + threadIdx.y; i < rows; i += tile_size * gridDim.y) {
+    for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+        if (v * Shape::THREADS_PER_ROW + tid < Shape::VECS_PER_ROW) {
 #pragma unroll
-      for (int index = 0; index < num_per_block; ++index) {
-        int row_id = i + index * blockDim.y;
-        if (row_id < rows) {
-          int offset = row_id * cols + col_id;
-          const float dy_val = static_cast<float>(dy[offset]);
-          const float x_val = static_cast<float>(x[offset]);
-          const float mean_val = mean[row_id];
-          const float inv_var_val = inv_var[row_id];
-          dgamma_sum[index] += dy_val * (x_val - mean_val) * inv_var_val;
+            for (int i = 0; i < PACK; ++i) {
+                buf[v][i] -= *row_mean;
+                thread_sq_sum += buf[v][i] * buf[v][i];
+            }
         }
-      }
     }
-  }
+    warp_sum_reduce(thread_sq_sum, Shape::THREADS_PER_ROW);
+    *row_inv_var = rsqrtf(thread_sq_sum / COLS + epsilon);
+
 #pragma unroll
-  for (int index = 0; index < num_per_block; ++index) {
-    dgamma[index * blockDim.y + threadIdx.y][threadIdx.x] = dgamma_sum[index];
-  }
-  __syncthreads();
+    for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
 #pragma unroll
-  for (int index = 0; index < num_per_block; ++index) {
-    const int col_id = blockIdx.x * blockDim.x + threadIdx.y + index * blockDim.y;
+        for (int i = 0; i < PACK; ++i) buf[v][i] *= *row_inv_var;
+    }
+}
+
+// Single-pass forward for rows whose width is known at compile time. Each thread keeps its
+// slice of the row in registers between the statistics and the output phase, so every
+// element is read from global memory exactly once. __launch_bounds__ lifts the file-wide
+// -maxrregcount cap for this kernel; without it the cached row would spill to local memory
+// for the wider instantiations.
+// Row groups are walked grid-stride, blocks advancing together so the group shuffles in
+// RegCachedLoadAndNormalize always see the whole group.
+template <int COLS, int PACK, typename LOAD, typename STORE>
+__global__ void __launch_bounds__(kRegCachedThreadsPerBlock)
+LayerNormForwardRegCached(LOAD load, STORE store, float* mean, float* invvar, long rows,
+                          float epsilon) {
+    using Shape = RegCachedShape<COLS, PACK>;
+    const int tid = threadIdx.x;
+    for (long row_base = static_cast<long>(blockIdx.x) * blockDim.y; row_base < rows;
+         row_base += static_cast<long>(gridDim.x) * blockDim.y) {
+        const long row = row_base + threadIdx.y;
+        const bool row_valid = row < rows;
+
+        float buf[Shape::VECS_PER_THREAD][PACK];
+        float row_mean, row_inv_var;
+        RegCachedLoadAndNormalize<COLS, PACK>(load, buf, row, row_valid, epsilon, &row_mean,
+                                              &row_inv_var);
+
+        if (!row_valid) continue;
+        if (tid == 0 && mean != nullptr) {
+            mean[row] = row_mean;
+            invvar[row] = row_inv_var;
+        }
+#pragma unroll
+        for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+            const int vec_idx = v * Shape::THREADS_PER_ROW + tid;
+            if (vec_idx < Shape::VECS_PER_ROW) {
+                store.template store<PACK>(buf[v], row, vec_idx * PACK);
+            }
+        }
+    }
+}
+
+// The kernel the last LayerNorm forward or backward on this thread dispatched to, for the
+// profiling mode of the extension (layer_norm_cuda.cpp). Recording it is a few stores.
+struct LaunchRecord {
+    const char* kernel = "none";
+    int vec_size = 0;  // bytes per vector access of the V2 kernels, 0 for the others
+    dim3 grid;
+    dim3 block;
+};
+static thread_local LaunchRecord last_launch;
+
+inline void RecordLaunch(const char* kernel) { last_launch = {kernel, 0, dim3(), dim3()}; }
+
+inline void RecordLaunch(const char* kernel, const V2LaunchConfig& config) {
+    last_launch = {kernel, config.vec_size, config.grid, config.block};
+}
+
+std::string last_layer_norm_launch() {
+    std::ostringstream out;
+    out << last_launch.kernel;
+    if (last_launch.vec_size != 0) {
+        out << " vec=" << last_launch.vec_size << "B grid=" << last_launch.grid.x
+            << " block=" << last_launch.block.x << "x" << last_launch.block.y;
+    }
+    return out.str();
+}
+
+template <int COLS, typename T, typename LOAD, typename STORE>
+void LaunchLayerNormForwardRegCached(const LOAD& load, const STORE& store, float* mean,
+                                     float* invvar, long rows, float epsilon,
+                                     cudaStream_t stream) {
+    constexpr int PACK = 16 / sizeof(T);
+    using Shape = RegCachedShape<COLS, PACK>;
+    long num_blocks = (rows + Shape::ROWS_PER_BLOCK - 1) / Shape::ROWS_PER_BLOCK;
+    if (rows * COLS > std::numeric_limits<int32_t>::max()) {
+        num_blocks = std::min(num_blocks, max_resident_blocks(kRegCachedThreadsPerBlock));
+    }
+    const dim3 grid(num_blocks);
+    const dim3 block(Shape::THREADS_PER_ROW, Shape::ROWS_PER_BLOCK);
+    LayerNormForwardRegCached<COLS, PACK><<<grid, block, 0, stream>>>(load, store, mean, invvar,
+                                                                      rows, epsilon);
+    RecordLaunch("reg_cached");
+}
+
+inline bool is_aligned(const void* ptr, size_t alignment) {
+    return reinterpret_cast<uintptr_t>(ptr) % alignment == 0;
+}
+
+// Calls f with std::integral_constant<int, cols> when cols is one of the widths that have
+// register-cached kernels (c_m, c_z, c_s, c_token, ... in Protenix). Returns false otherwise.
+template <typename F>
+bool DispatchRegCachedCols(long cols, F&& f) {
+    switch (cols) {
+        case 32: f(std::integral_constant<int, 32>()); return true;
+        case 64: f(std::integral_constant<int, 64>()); return true;
+        case 128: f(std::integral_constant<int, 128>()); return true;
+        case 256: f(std::integral_constant<int, 256>()); return true;
+        case 384: f(std::integral_constant<int, 384>()); return true;
+        case 512: f(std::integral_constant<int, 512>()); return true;
+        case 768: f(std::integral_constant<int, 768>()); return true;
+        case 1024: f(std::integral_constant<int, 1024>()); return true;
+        default: return false;
+    }
+}
+
+// Dispatches to the register-cached forward when cols has a specialization and every pointer
+// the load and store functors access (ptrs, nullptr entries are skipped) allows 16-byte
+// vector access. Returns false when the caller has to fall back to another kernel.
+template <typename T, typename LOAD, typename STORE>
+bool TryLayerNormForwardRegCached(const LOAD& load, const STORE& store,
+                                  std::initializer_list<const void*> ptrs, float* mean,
+                                  float* invvar, long rows, long cols, float epsilon,
+                                  cudaStream_t stream) {
+    for (const void* ptr : ptrs) {
+        if (ptr != nullptr && !is_aligned(ptr, 16)) return false;
+    }
+    return DispatchRegCachedCols(cols, [&](auto cols_constant) {
+        LaunchLayerNormForwardRegCached<decltype(cols_constant)::value, T>(
+            load, store, mean, invvar, rows, epsilon, stream);
+    });
+}
+
+// Widest pack (in elements, at most 16 bytes) that divides cols and keeps every pointer aligned.
+template <typename T>
+int GetPackSize(long cols, std::initializer_list<const void*> ptrs) {
+    int pack_size = 16 / sizeof(T);
+    for (; pack_size > 1; pack_size /= 2) {
+        bool ok = cols % pack_size == 0;
+        for (const void* ptr : ptrs) {
+            if (ptr != nullptr && !is_aligned(ptr, pack_size * sizeof(T))) ok = false;
+        }
+        if (ok) break;
+    }
+    return pack_size;
+}
+
+// Calls f with std::integral_constant<int, pack_size>; only packs of at most 16 bytes are
+// instantiated for T.
+template <typename T, typename F>
+void DispatchPackSize(int pack_size, F&& f) {
+    if constexpr (16 / sizeof(T) >= 8) {
+        if (pack_size == 8) return f(std::integral_constant<int, 8>());
+    }
+    if (pack_size == 4) return f(std::integral_constant<int, 4>());
+    if (pack_size == 2) return f(std::integral_constant<int, 2>());
+    f(std::integral_constant<int, 1>());
+}
+
+constexpr int kBlockPerRowThreads = 256;
+constexpr long kBlockPerRowMinCols = 384;
+constexpr long kRegCachedMaxCols = 1024;
+// The block forward caches its row in shared memory as float. Near this cap the cache plus
+// the static shared memory of the block reduction passes 48 KB, see OptInDynamicSharedMemory.
+constexpr long kBlockPerRowMaxCachedCols = 48 * 1024 / sizeof(float);
+
+// One warp per row stops scaling once a thread walks a long serial loop, or when there are
+// too few rows to give every SM a few warps (small-batch inference on the single rep).
+inline bool use_block_per_row(long rows, long cols) {
+    if (cols < kBlockPerRowMinCols) return false;
+    if (cols > kRegCachedMaxCols) return true;
+    return rows < 4L * at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+}
+
+inline int block_per_row_threads(long num_packs) {
+    const long warps = (num_packs + WarpSize - 1) / WarpSize;
+    return static_cast<int>(std::min<long>(warps * WarpSize, kBlockPerRowThreads));
+}
+
+// A launch may use at most 48 KB of static plus dynamic shared memory unless the kernel opts in
+// to more. Only the widest rows get near the limit, so the attribute query stays off the
+// common path.
+template <typename Kernel>
+void OptInDynamicSharedMemory(Kernel* kernel, size_t dynamic_bytes) {
+    constexpr size_t kDefaultSharedBytes = 48 * 1024;
+    constexpr size_t kStaticSharedSlack = 1024;
+    if (dynamic_bytes + kStaticSharedSlack <= kDefaultSharedBytes) return;
+    cudaFuncAttributes attributes;
+    C10_CUDA_CHECK(cudaFuncGetAttributes(&attributes, kernel));
+    if (attributes.sharedSizeBytes + dynamic_bytes <= kDefaultSharedBytes) return;
+    C10_CUDA_CHECK(cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize,
+                                        static_cast<int>(dynamic_bytes)));
+}
+
+// Merges per-thread Welford states across all warps of the block through shared memory.
+// Every thread receives the row statistics. blockDim.x must be a multiple of WarpSize.
+__inline__ __device__ void WelfordBlockAllReduce(float thread_mean, float thread_m2,
+                                                 float thread_count, float* mean, float* m2,
+                                                 float* count) {
+    __shared__ float shared_mean[WarpSize];
+    __shared__ float shared_m2[WarpSize];
+    __shared__ float shared_count[WarpSize];
+    __shared__ float result[3];
+    const int lane_id = threadIdx.x % WarpSize;
+    const int warp_id = threadIdx.x / WarpSize;
+    const int num_warps = blockDim.x / WarpSize;
+
+    float warp_mean, warp_m2, warp_count;
+    WelfordWarpAllReduce(thread_mean, thread_m2, thread_count, &warp_mean, &warp_m2,
+                         &warp_count);
+    if (lane_id == 0) {
+        shared_mean[warp_id] = warp_mean;
+        shared_m2[warp_id] = warp_m2;
+        shared_count[warp_id] = warp_count;
+    }
+    __syncthreads();
+    if (warp_id == 0) {
+        const bool has_warp = lane_id < num_warps;
+        WelfordWarpAllReduce(has_warp ? shared_mean[lane_id] : 0.f,
+                             has_warp ? shared_m2[lane_id] : 0.f,
+                             has_warp ? shared_count[lane_id] : 0.f, &warp_mean, &warp_m2,
+                             &warp_count);
+        if (lane_id == 0) {
+            result[0] = warp_mean;
+            result[1] = warp_m2;
+            result[2] = warp_count;
+        }
+    }
+    __syncthreads();
+    *mean = result[0];
+    *m2 = result[1];
+    *count = result[2];
+}
+
+// Sums val across the thread block; every thread receives the total.
+__inline__ __device__ float BlockAllReduceSum(float val) {
+    __shared__ float shared[WarpSize];
+    __shared__ float result;
+    const int lane_id = threadIdx.x % WarpSize;
+    const int warp_id = threadIdx.x / WarpSize;
+    const int num_warps = blockDim.x / WarpSize;
+
+    warp_sum_reduce(val, WarpSize);
+    if (lane_id == 0) shared[warp_id] = val;
+    __syncthreads();
+    if (warp_id == 0) {
+        val = lane_id < num_warps ? shared[lane_id] : 0.f;
+        warp_sum_reduce(val, WarpSize);
+        if (lane_id == 0) result = val;
+    }
+    __syncthreads();
+    return result;
+}
+
+// Block-per-row forward for wide rows. The row is staged in shared memory while the Welford
+// statistics are accumulated, so global memory is still read once per element. The cache is
+// laid out pack-major so consecutive threads hit consecutive banks.
+template <int PACK, typename LOAD, typename STORE>
+__global__ void __launch_bounds__(kBlockPerRowThreads)
+LayerNormForwardBlock(LOAD load, STORE store, float* mean, float* invvar, long cols,
+                      float epsilon) {
+    float* row_cache = shared_data;
+    const long row = blockIdx.x;
+    const long num_packs = cols / PACK;
+
+    float thread_mean = 0.f, thread_m2 = 0.f, thread_count = 0.f;
+    for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+        float vals[PACK];
+        load.template load<PACK>(vals, row, pack * PACK);
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            row_cache[i * num_packs + pack] = vals[i];
+            WelfordOnline(vals[i], &thread_mean, &thread_m2, &thread_count);
+        }
+    }
+
+    float row_mean, row_m2, row_count;
+    WelfordBlockAllReduce(thread_mean, thread_m2, thread_count, &row_mean, &row_m2, &row_count);
+    const float row_inv_var = rsqrtf(max(row_m2 / row_count, 0.f) + epsilon);
+    if (threadIdx.x == 0 && mean != nullptr) {
+        mean[row] = row_mean;
+        invvar[row] = row_inv_var;
+    }
+
+    // Each thread reads back only the slots it wrote, so no barrier is needed here.
+    for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+        float vals[PACK];
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            vals[i] = (row_cache[i * num_packs + pack] - row_mean) * row_inv_var;
+        }
+        store.template store<PACK>(vals, row, pack * PACK);
+    }
+}
+
+// Block-per-row forward for any width whose row fits the shared-memory cache. ptrs lists every
+// pointer the functors access; the pack size is the widest all of them allow.
+template <typename T, typename LOAD, typename STORE>
+bool TryLayerNormForwardBlock(const LOAD& load, const STORE& store,
+                              std::initializer_list<const void*> ptrs, float* mean,
+                              float* invvar, long rows, long cols, float epsilon,
+                              cudaStream_t stream) {
+    if (cols > kBlockPerRowMaxCachedCols) return false;
+    const int pack_size = GetPackSize<T>(cols, ptrs);
+    DispatchPackSize<T>(pack_size, [&](auto pack) {
+        constexpr int PACK = decltype(pack)::value;
+        const int threads = block_per_row_threads(cols / PACK);
+        const size_t shared_bytes = cols * sizeof(float);
+        OptInDynamicSharedMemory(LayerNormForwardBlock<PACK, LOAD, STORE>, shared_bytes);
+        LayerNormForwardBlock<PACK><<<dim3(rows), threads, shared_bytes, stream>>>(
+            load, store, mean, invvar, cols, epsilon);
+    });
+    RecordLaunch("block_per_row");
+    return true;
+}
+
+template <typename T>
+struct Fp8Traits;
+
+template <>
+struct Fp8Traits<c10::Float8_e4m3fn> {
+    static constexpr float kMax = 448.f;
+};
+
+template <>
+struct Fp8Traits<c10::Float8_e5m2> {
+    static constexpr float kMax = 57344.f;
+};
+
+// Rounds a normalized value to the saved x_hat type S. FP8 saturates instead of overflowing
+// to NaN; |x_hat| stays far below the range of the 16-bit types.
+template <typename S>
+__device__ __forceinline__ S to_saved_xhat(float v) {
+    if constexpr (std::is_same_v<S, c10::Float8_e4m3fn> || std::is_same_v<S, c10::Float8_e5m2>) {
+        v = fminf(fmaxf(v, -Fp8Traits<S>::kMax), Fp8Traits<S>::kMax);
+    }
+    return static_cast<S>(v);
+}
+
+// Also writes the normalized values, rounded to S, to xhat for a backward that works from
+// x_hat and invvar instead of the input (see cuda_layer_norm_gradient_from_xhat).
+template <typename S, typename STORE>
+struct SaveXHatStore {
+    STORE inner;
+    S* xhat;
+    long row_stride;
+
+    template <int N>
+    __device__ __forceinline__ void store(const float* normalized, long row, long col) const {
+        AlignedVector<S, N> xhat_vec;
+#pragma unroll
+        for (int i = 0; i < N; ++i) xhat_vec.val[i] = to_saved_xhat<S>(normalized[i]);
+        *reinterpret_cast<AlignedVector<S, N>*>(xhat + row * row_stride + col) = xhat_vec;
+        inner.template store<N>(normalized, row, col);
+    }
+};
+
+// Calls f with a value of the C++ type of a saved x_hat dtype.
+template <typename F>
+void DispatchSavedXHatType(at::ScalarType type, F&& f) {
+    switch (type) {
+        case at::ScalarType::BFloat16: f(at::BFloat16()); break;
+        case at::ScalarType::Half: f(at::Half()); break;
+        case at::ScalarType::Float8_e4m3fn: f(c10::Float8_e4m3fn()); break;
+        case at::ScalarType::Float8_e5m2: f(c10::Float8_e5m2()); break;
+        default:
+            AT_ERROR("saved x_hat must be bfloat16, float16, float8_e4m3fn or float8_e5m2, got ",
+                     toString(type));
+    }
+}
+
+__inline__ __device__ float warp_max_reduce(float val, int syc_thread_num) {
+    for (int mask = syc_thread_num / 2; mask >= 1; mask /= 2) {
+        val = fmaxf(val, __shfl_xor_sync(0xffffffff, val, mask));
+    }
+    return val;
+}
+
+// Register-cached forward that writes FP8. The affine output of a whole row sits in
+// registers before anything is stored, so its amax is known without another pass.
+// ROW_SCALE: each row is scaled by kMax / amax(row) and 1 / scale goes to scale_out[row].
+// Otherwise the caller's per-tensor scale is used (delayed scaling) and the amax of this
+// call is max-reduced into scale_out[0] for the next iteration's scale. Blocks walk the rows
+// grid-stride so that only one atomic per block is issued.
+template <int COLS, int PACK, typename T, typename OutT, bool ROW_SCALE>
+__global__ void __launch_bounds__(kRegCachedThreadsPerBlock)
+LayerNormForwardFp8(DirectLoad<T> load, OutT* output, const T* gamma, const T* beta,
+                    float* mean, float* invvar, const float* scale, float* scale_out, long rows,
+                    float epsilon) {
+    using Shape = RegCachedShape<COLS, PACK>;
+    constexpr float kFp8Max = Fp8Traits<OutT>::kMax;
+    const int tid = threadIdx.x;
+    const long row_step = static_cast<long>(gridDim.x) * blockDim.y;
+
+    float thread_amax = 0.f;
+    for (long row_base = static_cast<long>(blockIdx.x) * blockDim.y; row_base < rows;
+         row_base += row_step) {
+        const long row = row_base + threadIdx.y;
+        const bool row_valid = row < rows;
+
+        float buf[Shape::VECS_PER_THREAD][PACK];
+        float row_mean, row_inv_var;
+        RegCachedLoadAndNormalize<COLS, PACK>(load, buf, row, row_valid, epsilon, &row_mean,
+                                              &row_inv_var);
+
+        float row_amax = 0.f;
+#pragma unroll
+        for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+            const int vec_idx = v * Shape::THREADS_PER_ROW + tid;
+            if (row_valid && vec_idx < Shape::VECS_PER_ROW) {
+                const long col = vec_idx * PACK;
+                AlignedVector<T, PACK> gamma_vec;
+                AlignedVector<T, PACK> beta_vec;
+                if (gamma != nullptr) {
+                    gamma_vec = *reinterpret_cast<const AlignedVector<T, PACK>*>(gamma + col);
+                }
+                if (beta != nullptr) {
+                    beta_vec = *reinterpret_cast<const AlignedVector<T, PACK>*>(beta + col);
+                }
+#pragma unroll
+                for (int i = 0; i < PACK; ++i) {
+                    if (gamma != nullptr) buf[v][i] *= static_cast<float>(gamma_vec.val[i]);
+                    if (beta != nullptr) buf[v][i] += static_cast<float>(beta_vec.val[i]);
+                    row_amax = fmaxf(row_amax, fabsf(buf[v][i]));
+                }
+            }
+        }
+
+        float out_scale;
+        if constexpr (ROW_SCALE) {
+            row_amax = warp_max_reduce(row_amax, Shape::THREADS_PER_ROW);
+            out_scale = row_amax > 0.f ? kFp8Max / row_amax : 1.f;
+        } else {
+            thread_amax = fmaxf(thread_amax, row_amax);
+            out_scale = *scale;
+        }
+
+        if (row_valid) {
+            if (tid == 0) {
+                mean[row] = row_mean;
+                invvar[row] = row_inv_var;
+                if constexpr (ROW_SCALE) scale_out[row] = 1.f / out_scale;
+            }
+#pragma unroll
+            for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+                const int vec_idx = v * Shape::THREADS_PER_ROW + tid;
+                if (vec_idx < Shape::VECS_PER_ROW) {
+                    AlignedVector<OutT, PACK> out;
+#pragma unroll
+                    for (int i = 0; i < PACK; ++i) {
+                        // Saturate: a stale per-tensor scale may push values past the range.
+                        const float q = fminf(fmaxf(buf[v][i] * out_scale, -kFp8Max), kFp8Max);
+                        out.val[i] = static_cast<OutT>(q);
+                    }
+                    OutT* out_ptr = output + row * COLS + vec_idx * PACK;
+                    *reinterpret_cast<AlignedVector<OutT, PACK>*>(out_ptr) = out;
+                }
+            }
+        }
+    }
+
+    if constexpr (!ROW_SCALE) {
+        __shared__ float shared_amax[kRegCachedThreadsPerBlock / WarpSize];
+        const int linear_tid = threadIdx.y * blockDim.x + threadIdx.x;
+        thread_amax = warp_max_reduce(thread_amax, WarpSize);
+        if (linear_tid % WarpSize == 0) shared_amax[linear_tid / WarpSize] = thread_amax;
+        __syncthreads();
+        if (linear_tid == 0) {
+            float block_amax = 0.f;
+            for (int w = 0; w < blockDim.x * blockDim.y / WarpSize; ++w) {
+                block_amax = fmaxf(block_amax, shared_amax[w]);
+            }
+            // Non-negative floats order the same way as their bit patterns.
+            atomicMax(reinterpret_cast<int*>(scale_out), __float_as_int(block_amax));
+        }
+    }
+}
+
+template <typename T, typename OutT>
+bool TryLayerNormForwardFp8(const T* input, OutT* output, const T* gamma, const T* beta,
+                            float* mean, float* invvar, const float* scale, float* scale_out,
+                            long rows, long cols, float epsilon, cudaStream_t stream) {
+    if (!is_aligned(input, 16) || (gamma != nullptr && !is_aligned(gamma, 16)) ||
+        (beta != nullptr && !is_aligned(beta, 16)) ||
+        !is_aligned(output, 16 / sizeof(T))) {
+        return false;
+    }
+    const long resident_blocks = max_resident_blocks(kRegCachedThreadsPerBlock);
+    return DispatchRegCachedCols(cols, [&](auto cols_constant) {
+        constexpr int COLS = decltype(cols_constant)::value;
+        constexpr int PACK = 16 / sizeof(T);
+        using Shape = RegCachedShape<COLS, PACK>;
+        const long needed_blocks = (rows + Shape::ROWS_PER_BLOCK - 1) / Shape::ROWS_PER_BLOCK;
+        const dim3 grid(std::max(1L, std::min(needed_blocks, resident_blocks)));
+        const dim3 block(Shape::THREADS_PER_ROW, Shape::ROWS_PER_BLOCK);
+        DirectLoad<T> load{input, COLS};
+        if (scale == nullptr) {
+            LayerNormForwardFp8<COLS, PACK, T, OutT, true><<<grid, block, 0, stream>>>(
+                load, output, gamma, beta, mean, invvar, scale, scale_out, rows, epsilon);
+        } else {
+            LayerNormForwardFp8<COLS, PACK, T, OutT, false><<<grid, block, 0, stream>>>(
+                load, output, gamma, beta, mean, invvar, scale, scale_out, rows, epsilon);
+        }
+        RecordLaunch("fp8_reg_cached");
+    });
+}
+
+// Launch choices recorded by the Python autotuner (autotune.py) for one (device arch, dtype,
+// cols, rows bucket, affine mode, direction). Shapes without an entry keep the built-in
+// heuristics. The best launch moves with the row count (how full the grid is, the
+// block-per-row switch), so rows are part of the key, coarsened to floor(log2(rows)).
+enum class LaunchVariant : int {
+    kDefault = 0,  // block-per-row / register-cached / fused kernels where they apply
+    kGeneric = 1,  // always the V2 kernels
+};
+
+struct TunedLaunch {
+    LaunchVariant variant = LaunchVariant::kDefault;
+    int threads_per_block = 128;  // of the V2 kernels
+};
+
+static std::mutex tuned_launch_mutex;
+static std::unordered_map<uint64_t, TunedLaunch> tuned_launches;
+static std::atomic<bool> has_tuned_launches{false};
+
+// Same bucketing as autotune.rows_bucket.
+inline int RowsBucket(int64_t rows) { return rows <= 1 ? 0 : 63 - __builtin_clzll(rows); }
+
+inline uint64_t TunedLaunchKey(int64_t arch, at::ScalarType dtype, int64_t cols,
+                               int64_t rows_bucket, bool has_gamma, bool has_beta,
+                               bool backward) {
+    return (static_cast<uint64_t>(arch) << 48) | (static_cast<uint64_t>(dtype) << 40) |
+           (static_cast<uint64_t>(has_gamma) << 39) | (static_cast<uint64_t>(has_beta) << 38) |
+           (static_cast<uint64_t>(backward) << 37) |
+           ((static_cast<uint64_t>(rows_bucket) & 63) << 31) |
+           (static_cast<uint64_t>(cols) & ((uint64_t(1) << 31) - 1));
+}
+
+// The device properties are cached by ATen, so the lookup issues no device query. Without any
+// tuned entry it is a single atomic load.
+TunedLaunch LookupTunedLaunch(at::ScalarType dtype, int64_t rows, int64_t cols, bool has_gamma,
+                              bool has_beta, bool backward) {
+    if (!has_tuned_launches.load(std::memory_order_acquire)) return {};
+    const auto* props = at::cuda::getCurrentDeviceProperties();
+    const uint64_t key = TunedLaunchKey(props->major * 10 + props->minor, dtype, cols,
+                                        RowsBucket(rows), has_gamma, has_beta, backward);
+    std::lock_guard<std::mutex> lock(tuned_launch_mutex);
+    const auto it = tuned_launches.find(key);
+    return it == tuned_launches.end() ? TunedLaunch{} : it->second;
+}
+
+void set_tuned_launch(int64_t arch, at::ScalarType dtype, int64_t cols, int64_t rows_bucket,
+                      bool has_gamma, bool has_beta, bool backward, int64_t variant,
+                      int64_t threads_per_block) {
+    TORCH_CHECK(rows_bucket >= 0 && rows_bucket < 64, "rows_bucket must be in [0, 64), got ",
+                rows_bucket);
+    TORCH_CHECK(variant == static_cast<int>(LaunchVariant::kDefault) ||
+                    variant == static_cast<int>(LaunchVariant::kGeneric),
+                "unknown LayerNorm launch variant ", variant);
+    TORCH_CHECK(threads_per_block >= 32 && threads_per_block <= 1024 &&
+                    (threads_per_block & (threads_per_block - 1)) == 0,
+                "threads_per_block must be a power of two in [32, 1024], got ", threads_per_block);
+    std::lock_guard<std::mutex> lock(tuned_launch_mutex);
+    tuned_launches[TunedLaunchKey(arch, dtype, cols, rows_bucket, has_gamma, has_beta,
+                                  backward)] = {
+        static_cast<LaunchVariant>(variant), static_cast<int>(threads_per_block)};
+    has_tuned_launches.store(true, std::memory_order_release);
+}
+
+void clear_tuned_launches() {
+    std::lock_guard<std::mutex> lock(tuned_launch_mutex);
+    tuned_launches.clear();
+    has_tuned_launches.store(false, std::memory_order_release);
+}
+
+
+// mean == invvar == NULL: inference, the row statistics are not stored.
+void cuda_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar, at::Tensor* input,
+                     int64_t rows, int64_t cols, at::IntArrayRef normalized_shape, at::Tensor* gamma,
+                     at::Tensor* beta, double epsilon) {
+    // All launches go to the current PyTorch stream and the dispatch below issues no device
+    // queries or synchronization, which keeps the op CUDA-graph capturable.
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+    // Get element byte size
+    const auto dtype = output->dtype();
+    int element_size;
+    if (dtype == torch::kFloat32) {
+        element_size = 4;
+    } else if (dtype == torch::kFloat16 || dtype == torch::kBFloat16) {
+        element_size = 2;
+    } else {
+        throw std::runtime_error("Unsupported data type");
+    }
+
+    const TunedLaunch tuned =
+        LookupTunedLaunch(input->scalar_type(), rows, cols, gamma != nullptr, beta != nullptr,
+                          false);
+    bool launched = false;
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    if (tuned.variant == LaunchVariant::kDefault) {
+        DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+            input->scalar_type(), param_type, "cuda_layer_norm",
+            const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+            scalar_t* output_ptr = static_cast<scalar_t*>(output->data_ptr());
+            const param_t* gamma_ptr = gamma ? static_cast<const param_t*>(gamma->data_ptr()) : nullptr;
+            const param_t* beta_ptr = beta ? static_cast<const param_t*>(beta->data_ptr()) : nullptr;
+            float* mean_ptr = mean ? static_cast<float*>(mean->data_ptr()) : nullptr;
+            float* invvar_ptr = invvar ? static_cast<float*>(invvar->data_ptr()) : nullptr;
+            const DirectLoad<scalar_t> load{input_ptr, cols};
+            const AffineStore<scalar_t, param_t> store{output_ptr, cols, gamma_ptr, beta_ptr};
+            if (use_block_per_row(rows, cols)) {
+                // Wide rows, or too few rows to fill the GPU with one warp per row
+                launched = TryLayerNormForwardBlock<scalar_t>(
+                    load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr}, mean_ptr, invvar_ptr,
+                    long(rows), long(cols), float(epsilon), stream);
+            }
+            if (!launched) {
+                // Rows that fit in registers are read from global memory once
+                launched = TryLayerNormForwardRegCached<scalar_t>(
+                    load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr}, mean_ptr, invvar_ptr,
+                    long(rows), long(cols), float(epsilon), stream);
+            });
+    }
+    if (launched) {
+        C10_CUDA_KERNEL_LAUNCH_CHECK();
+        return;
+    }
+
+    const V2LaunchConfig config =
+        GetV2LaunchConfig(rows, cols, element_size, tuned.threads_per_block);
+    RecordLaunch("v2", config);
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        input->scalar_type(), param_type, "cuda_layer_norm",
+        DispatchVecType<scalar_t>(config.vec_size, [&](auto vec) {
+            LayerNormForwardV2<scalar_t, decltype(vec), param_t>
+                <<<config.grid, config.block, 0, stream>>>(
+                static_cast<scalar_t*>(input->data_ptr()),
+                static_cast<scalar_t*>(output->data_ptr()),
+                gamma ? static_cast<const param_t*>(gamma->data_ptr()) : nullptr,
+                beta ? static_cast<const param_t*>(beta->data_ptr()) : nullptr,
+                mean ? static_cast<float*>(mean->data_ptr()) : nullptr,
+                invvar ? static_cast<float*>(invvar->data_ptr()) : nullptr, long(rows),
+                long(cols), float(epsilon));
+        });)
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// RMSNorm over the last dimension; invvar receives the per-row 1 / rms for the backward. Uses
+// the same VecType dispatch and launch shape as the generic LayerNorm forward.
+void cuda_rms_norm(at::Tensor* output, at::Tensor* invvar, at::Tensor* input, int64_t rows, int64_t cols,
+                   at::Tensor* gamma, double epsilon) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const V2LaunchConfig config = GetV2LaunchConfig(rows, cols, input->element_size());
+    RecordLaunch("rms_v2", config);
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_rms_norm",
+        DispatchVecType<scalar_t>(config.vec_size, [&](auto vec) {
+            RMSNormForwardV2<scalar_t, decltype(vec)><<<config.grid, config.block, 0, stream>>>(
+                static_cast<const scalar_t*>(input->data_ptr()),
+                static_cast<scalar_t*>(output->data_ptr()),
+                gamma ? static_cast<const scalar_t*>(gamma->data_ptr()) : nullptr,
+                invvar->data_ptr<float>(), long(rows), long(cols), float(epsilon));
+        });)
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// sum = residual + update; output = LayerNorm(sum), in one pass as in the epilogue: the
+// register-cached kernel where it applies and the block-per-row kernel for every other width
+// it caches. Only rows wider than that (or misaligned) add first and normalize the sum.
+void cuda_add_layer_norm(at::Tensor* output, at::Tensor* sum, at::Tensor* mean,
+                         at::Tensor* invvar, at::Tensor* residual, at::Tensor* update, int64_t rows,
+                         int64_t cols, at::IntArrayRef normalized_shape, at::Tensor* gamma,
+                         at::Tensor* beta, double epsilon) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    bool launched = false;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        residual->scalar_type(), "cuda_add_layer_norm",
+        const scalar_t* residual_ptr = static_cast<const scalar_t*>(residual->data_ptr());
+        const scalar_t* update_ptr = static_cast<const scalar_t*>(update->data_ptr());
+        scalar_t* sum_ptr = static_cast<scalar_t*>(sum->data_ptr());
+        scalar_t* output_ptr = static_cast<scalar_t*>(output->data_ptr());
+        const scalar_t* gamma_ptr = gamma ? static_cast<const scalar_t*>(gamma->data_ptr()) : nullptr;
+        const scalar_t* beta_ptr = beta ? static_cast<const scalar_t*>(beta->data_ptr()) : nullptr;
+        float* mean_ptr = static_cast<float*>(mean->data_ptr());
+        float* invvar_ptr = static_cast<float*>(invvar->data_ptr());
+        const AddLoad<scalar_t> load{residual_ptr, update_ptr, sum_ptr, cols};
+        const AffineStore<scalar_t> store{output_ptr, cols, gamma_ptr, beta_ptr};
+        if (!use_block_per_row(rows, cols)) {
+            launched = TryLayerNormForwardRegCached<scalar_t>(
+                load, store, {residual_ptr, update_ptr, sum_ptr, output_ptr, gamma_ptr, beta_ptr},
+                mean_ptr, invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+        }
+        if (!launched) {
+            launched = TryLayerNormForwardBlock<scalar_t>(
+                load, store, {residual_ptr, update_ptr, sum_ptr, output_ptr, gamma_ptr, beta_ptr},
+                mean_ptr, invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+        });
+    if (launched) {
+        C10_CUDA_KERNEL_LAUNCH_CHECK();
+        return;
+    }
+    at::add_out(*sum, *residual, *update);
+    cuda_layer_norm(output, mean, invvar, sum, rows, cols, normalized_shape, gamma, beta,
+                    epsilon);
+}
+
+// Dropout threshold on the 32-bit Philox output for drop probability p.
+inline uint32_t dropout_threshold(double p) {
+    return static_cast<uint32_t>(std::min(p * 4294967296.0, 4294967295.0));
+}
+
+template <typename T>
+Epilogue<T> make_epilogue(at::Tensor* row_mask, at::Tensor* gate, long cols, double dropout_p,
+                          const at::PhiloxCudaState& philox) {
+    const uint32_t threshold = dropout_threshold(dropout_p);
+    return Epilogue<T>{row_mask ? static_cast<const T*>(row_mask->data_ptr()) : nullptr,
+                       gate ? static_cast<const T*>(gate->data_ptr()) : nullptr,
+                       cols,
+                       threshold,
+                       threshold != 0 ? static_cast<float>(1.0 / (1.0 - dropout_p)) : 1.f,
+                       philox};
+}
+
+// LayerNorm followed by the row mask / dropout / gate epilogue in the same kernel. Uses the
+// register-cached kernel where it applies and the block-per-row kernel, which takes any pack
+// size, for every other width. The dropout seed/offset are written to rng_state[2].
+void cuda_layer_norm_epilogue(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                              at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* gamma,
+                              at::Tensor* beta, double epsilon, at::Tensor* row_mask,
+                              at::Tensor* gate, double dropout_p, at::Tensor* rng_state) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    at::PhiloxCudaState philox;
+    if (dropout_threshold(dropout_p) != 0) {
+        auto* gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+            c10::nullopt, at::cuda::detail::getDefaultCUDAGenerator());
+        std::lock_guard<std::mutex> lock(gen->mutex_);
+        // Every element consumes one 32-bit random of its own Philox counter.
+        philox = gen->philox_cuda_state(4);
+    }
+    bool launched = false;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_layer_norm_epilogue",
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        scalar_t* output_ptr = static_cast<scalar_t*>(output->data_ptr());
+        const scalar_t* gamma_ptr = gamma ? static_cast<const scalar_t*>(gamma->data_ptr()) : nullptr;
+        const scalar_t* beta_ptr = beta ? static_cast<const scalar_t*>(beta->data_ptr()) : nullptr;
+        float* mean_ptr = static_cast<float*>(mean->data_ptr());
+        float* invvar_ptr = static_cast<float*>(invvar->data_ptr());
+        const Epilogue<scalar_t> epilogue =
+            make_epilogue<scalar_t>(row_mask, gate, cols, dropout_p, philox);
+        const DirectLoad<scalar_t> load{input_ptr, cols};
+        const EpilogueStore<scalar_t> store{output_ptr, cols, gamma_ptr, beta_ptr, epilogue,
+                                            rng_state->data_ptr<int64_t>()};
+        if (!use_block_per_row(rows, cols)) {
+            launched = TryLayerNormForwardRegCached<scalar_t>(
+                load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr, epilogue.gate},
+                mean_ptr, invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+        }
+        if (!launched) {
+            launched = TryLayerNormForwardBlock<scalar_t>(
+                load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr, epilogue.gate},
+                mean_ptr, invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+        });
+    TORCH_CHECK(launched, "LayerNorm epilogues support rows of at most ",
+                kBlockPerRowMaxCachedCols, " elements, got ", cols);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// LayerNorm of the rows listed in row_index (int64, [active_rows]) only; the other rows of
+// output are left untouched. mean/invvar are [active_rows].
+void cuda_layer_norm_indexed(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                             at::Tensor* input, at::Tensor* row_index, int64_t cols,
+                             at::Tensor* gamma, at::Tensor* beta, double epsilon) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const long active_rows = row_index->numel();
+    if (active_rows == 0) return;
+    const long rows = input->numel() / cols;
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    bool launched = false;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        input->scalar_type(), param_type, "cuda_layer_norm_indexed",
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        scalar_t* output_ptr = static_cast<scalar_t*>(output->data_ptr());
+        const param_t* gamma_ptr = gamma ? static_cast<const param_t*>(gamma->data_ptr()) : nullptr;
+        const param_t* beta_ptr = beta ? static_cast<const param_t*>(beta->data_ptr()) : nullptr;
+        const int64_t* row_index_ptr = row_index->data_ptr<int64_t>();
+        float* mean_ptr = mean->data_ptr<float>();
+        float* invvar_ptr = invvar->data_ptr<float>();
+        const IndexedLoad<DirectLoad<scalar_t>> load{{input_ptr, cols}, row_index_ptr, rows};
+        const IndexedStore<AffineStore<scalar_t, param_t>> store{
+            {output_ptr, cols, gamma_ptr, beta_ptr}, row_index_ptr, rows};
+        if (!use_block_per_row(active_rows, cols)) {
+            launched = TryLayerNormForwardRegCached<scalar_t>(
+                load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr}, mean_ptr, invvar_ptr,
+                active_rows, long(cols), float(epsilon), stream);
+        }
+        if (!launched) {
+            launched = TryLayerNormForwardBlock<scalar_t>(
+                load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr}, mean_ptr, invvar_ptr,
+                active_rows, long(cols), float(epsilon), stream);
+        });
+    TORCH_CHECK(launched, "Row-indexed LayerNorm supports rows of at most ",
+                kBlockPerRowMaxCachedCols, " elements, got ", cols);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// LayerNorm that also stores x_hat = (x - mean) * invvar, rounded to the dtype of xhat (of the
+// input's shape), from the same registers it normalizes; the backward then reads xhat and
+// invvar in place of the input (cuda_layer_norm_gradient_from_xhat).
+void cuda_layer_norm_save_xhat(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                               at::Tensor* xhat, at::Tensor* input, int64_t rows, int64_t cols,
+                               at::Tensor* gamma, at::Tensor* beta, double epsilon) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    bool launched = false;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        input->scalar_type(), param_type, "cuda_layer_norm_save_xhat",
+        DispatchSavedXHatType(xhat->scalar_type(), [&](auto saved) {
+            using S = decltype(saved);
+            const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+            scalar_t* output_ptr = static_cast<scalar_t*>(output->data_ptr());
+            S* xhat_ptr = static_cast<S*>(xhat->data_ptr());
+            const param_t* gamma_ptr =
+                gamma ? static_cast<const param_t*>(gamma->data_ptr()) : nullptr;
+            const param_t* beta_ptr =
+                beta ? static_cast<const param_t*>(beta->data_ptr()) : nullptr;
+            float* mean_ptr = mean->data_ptr<float>();
+            float* invvar_ptr = invvar->data_ptr<float>();
+            const DirectLoad<scalar_t> load{input_ptr, cols};
+            const SaveXHatStore<S, AffineStore<scalar_t, param_t>> store{
+                {output_ptr, cols, gamma_ptr, beta_ptr}, xhat_ptr, cols};
+            if (!use_block_per_row(rows, cols)) {
+                launched = TryLayerNormForwardRegCached<scalar_t>(
+                    load, store, {input_ptr, output_ptr, xhat_ptr, gamma_ptr, beta_ptr},
+                    mean_ptr, invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+            }
+            if (!launched) {
+                launched = TryLayerNormForwardBlock<scalar_t>(
+                    load, store, {input_ptr, output_ptr, xhat_ptr, gamma_ptr, beta_ptr},
+                    mean_ptr, invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+            }
+        }););
+    TORCH_CHECK(launched, "LayerNorm with a saved x_hat supports rows of at most ",
+                kBlockPerRowMaxCachedCols, " elements, got ", cols);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// LayerNorm over the last dim of a contiguous [B, I, J, cols] input that writes its output as a
+// contiguous [B, J, I, cols] tensor, for the column-wise ops that would otherwise transpose
+// the normalized pair tensor. mean/invvar are in the row order of the input.
+void cuda_layer_norm_transposed(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                                at::Tensor* input, int64_t dim_i, int64_t dim_j, int64_t cols,
+                                at::Tensor* gamma, at::Tensor* beta, double epsilon) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const long rows = cols > 0 ? input->numel() / cols : 0;
+    if (rows == 0) return;
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    bool launched = false;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        input->scalar_type(), param_type, "cuda_layer_norm_transposed",
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        scalar_t* output_ptr = static_cast<scalar_t*>(output->data_ptr());
+        const param_t* gamma_ptr = gamma ? static_cast<const param_t*>(gamma->data_ptr()) : nullptr;
+        const param_t* beta_ptr = beta ? static_cast<const param_t*>(beta->data_ptr()) : nullptr;
+        float* mean_ptr = mean->data_ptr<float>();
+        float* invvar_ptr = invvar->data_ptr<float>();
+        const DirectLoad<scalar_t> load{input_ptr, cols};
+        const TransposedStore<AffineStore<scalar_t, param_t>> store{
+            {output_ptr, cols, gamma_ptr, beta_ptr}, {dim_i, dim_j}};
+        if (!use_block_per_row(rows, cols)) {
+            launched = TryLayerNormForwardRegCached<scalar_t>(
+                load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr}, mean_ptr, invvar_ptr,
+                rows, long(cols), float(epsilon), stream);
+        }
+        if (!launched) {
+            launched = TryLayerNormForwardBlock<scalar_t>(
+                load, store, {input_ptr, output_ptr, gamma_ptr, beta_ptr}, mean_ptr, invvar_ptr,
+                rows, long(cols), float(epsilon), stream);
+        });
+    TORCH_CHECK(launched, "Transposing LayerNorm supports rows of at most ",
+                kBlockPerRowMaxCachedCols, " elements, got ", cols);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// Adaptive LayerNorm forward, y = sigmoid(scale) * x_hat + shift with [rows, cols] scale and
+// shift, in one pass. Same kernel choice as the epilogue forward.
+void cuda_ada_layer_norm(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                         at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* scale,
+                         at::Tensor* shift, double epsilon) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    bool launched = false;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_ada_layer_norm",
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        scalar_t* output_ptr = static_cast<scalar_t*>(output->data_ptr());
+        const scalar_t* scale_ptr = static_cast<const scalar_t*>(scale->data_ptr());
+        const scalar_t* shift_ptr = static_cast<const scalar_t*>(shift->data_ptr());
+        float* mean_ptr = static_cast<float*>(mean->data_ptr());
+        float* invvar_ptr = static_cast<float*>(invvar->data_ptr());
+        const DirectLoad<scalar_t> load{input_ptr, cols};
+        const AdaLNStore<scalar_t> store{output_ptr, cols, scale_ptr, shift_ptr};
+        if (!use_block_per_row(rows, cols)) {
+            launched = TryLayerNormForwardRegCached<scalar_t>(
+                load, store, {input_ptr, output_ptr, scale_ptr, shift_ptr}, mean_ptr,
+                invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+        }
+        if (!launched) {
+            launched = TryLayerNormForwardBlock<scalar_t>(
+                load, store, {input_ptr, output_ptr, scale_ptr, shift_ptr}, mean_ptr,
+                invvar_ptr, long(rows), long(cols), float(epsilon), stream);
+        });
+    TORCH_CHECK(launched, "Adaptive LayerNorm supports rows of at most ",
+                kBlockPerRowMaxCachedCols, " elements, got ", cols);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// scale == NULL selects per-row scaling (scale_out is [rows], receives 1 / scale);
+// otherwise scale is the per-tensor scale and scale_out[0] accumulates the amax.
+void cuda_layer_norm_fp8(at::Tensor* output, at::Tensor* mean, at::Tensor* invvar,
+                         at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* gamma,
+                         at::Tensor* beta, double epsilon, at::Tensor* scale,
+                         at::Tensor* scale_out) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const float* scale_ptr = scale ? scale->data_ptr<float>() : nullptr;
+    float* scale_out_ptr = scale_out->data_ptr<float>();
+    bool launched = false;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_layer_norm_fp8",
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        const scalar_t* gamma_ptr = gamma ? static_cast<const scalar_t*>(gamma->data_ptr()) : nullptr;
+        const scalar_t* beta_ptr = beta ? static_cast<const scalar_t*>(beta->data_ptr()) : nullptr;
+        if (output->scalar_type() == at::ScalarType::Float8_e4m3fn) {
+            launched = TryLayerNormForwardFp8<scalar_t, c10::Float8_e4m3fn>(
+                input_ptr, static_cast<c10::Float8_e4m3fn*>(output->data_ptr()), gamma_ptr,
+                beta_ptr, mean->data_ptr<float>(), invvar->data_ptr<float>(), scale_ptr,
+                scale_out_ptr, long(rows), long(cols), float(epsilon), stream);
+        } else if (output->scalar_type() == at::ScalarType::Float8_e5m2) {
+            launched = TryLayerNormForwardFp8<scalar_t, c10::Float8_e5m2>(
+                input_ptr, static_cast<c10::Float8_e5m2*>(output->data_ptr()), gamma_ptr,
+                beta_ptr, mean->data_ptr<float>(), invvar->data_ptr<float>(), scale_ptr,
+                scale_out_ptr, long(rows), long(cols), float(epsilon), stream);
+        } else {
+            AT_ERROR("FP8 LayerNorm output must be float8_e4m3fn or float8_e5m2, got ",
+                     toString(output->scalar_type()));
+        });
+    TORCH_CHECK(launched, "FP8 LayerNorm output needs cols in {32, 64, 128, 256, 384, 512, 768, "
+                "1024} and 16-byte aligned input/gamma/beta, got cols=", cols);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+template <typename T>
+struct SharedMemory;
+
+template <>
+struct SharedMemory<float> {
+    __device__ float* getPointer() {
+        extern __shared__ float s_float[];
+        return s_float;
+    }
+};
+
+template<typename T>
+__inline__ __device__ T WarpReduce(T val) {
+  for (int mask = 16; mask > 0; mask /= 2) { val += __shfl_xor_sync(0xffffffff, val, mask); }
+  return val;
+}
+
+constexpr int tile_size = 32;
+constexpr int num_per_block = 4;
+constexpr int block_dim_x = 32;
+constexpr int block_dim_y = 32 / num_per_block;
+
+template <typename T, typename V>
+__global__ void LayerNormParamGradStep1(long rows, long cols, const V* __restrict__ dy,
+                                        const T* __restrict__ x, const float* __restrict__ mean,
+                                        const float* __restrict__ inv_var,
+                                        float* __restrict__ tmp_gamma_diff, float* __restrict__ tmp_beta_diff) {
+  __shared__ float dgamma[32][33];
+  __shared__ float dbeta[32][33];
+  float dgamma_sum[num_per_block];
+  float dbeta_sum[num_per_block];
+#pragma unroll
+  for (int index = 0; index < num_per_block; ++index) {
+    dgamma_sum[index] = 0;
+    dbeta_sum[index] = 0;
+  }
+  const int col_id = blockIdx.x * blockDim.x + threadIdx.x;
+  if (col_id < cols) {
+    for (long i = blockIdx.y * tile_size + threadIdx.y; i < rows; i += tile_size * gridDim.y) {
+#pragma unroll
+      for (int index = 0; index < num_per_block; ++index) {
+        const long row_id = i + index * blockDim.y;
+        if (row_id < rows) {
+          const long offset = row_id * cols + col_id;
+          const float dy_val = static_cast<float>(dy[offset]);
+          const float x_val = static_cast<float>(x[offset]);
+          const float mean_val = mean[row_id];
+          const float inv_var_val = inv_var[row_id];
+          dgamma_sum[index] += dy_val * (x_val - mean_val) * inv_var_val;
+          dbeta_sum[index] += dy_val;
+        }
+      }
+    }
+  }
+#pragma unroll
+  for (int index = 0; index < num_per_block; ++index) {
+    dgamma[index * blockDim.y + threadIdx.y][threadIdx.x] = dgamma_sum[index];
+    dbeta[index * blockDim.y + threadIdx.y][threadIdx.x] = dbeta_sum[index];
+  }
+  __syncthreads();
+#pragma unroll
+  for (int index = 0; index < num_per_block; ++index) {
+    const int col_id = blockIdx.x * blockDim.x + threadIdx.y + index * blockDim.y;
     if (col_id < cols) {
       float gamma_sum = dgamma[threadIdx.x][threadIdx.y + index * blockDim.y];
+      float beta_sum = dbeta[threadIdx.x][threadIdx.y + index * blockDim.y];
       float global_dgamma = WarpReduce<float>(gamma_sum);
+      float global_dbeta = WarpReduce<float>(beta_sum);
       if (threadIdx.x == 0) {
         const int offset = blockIdx.y * cols + col_id;
         tmp_gamma_diff[offset] = global_dgamma;
+        tmp_beta_diff[offset] = global_dbeta;
       }
     }
   }
 }
 
+// mean == nullptr: RMSNorm, where x_hat = x * inv_var.
 template <typename T, typename V>
-__global__ void LayerNormBetaGradStep1(int rows, int cols, const V* __restrict__ dy,
+__global__ void LayerNormGammaGradStep1(long rows, long cols, const V* __restrict__ dy,
+                                        const T* __restrict__ x, const float* __restrict__ mean,
+                                        const float* __restrict__ inv_var, float* __restrict__ tmp_gamma_diff) {
+  __shared__ float dgamma[32][33];
+  float dgamma_sum[num_per_block];
+#pragma unroll
+  for (int index = 0; index < num_per_block; ++index) {
+    dgamma_sum[index] = 0;
+  }
+  const int col_id = blockIdx.x * blockDim.x + threadIdx.x;
+  if (col_id < cols) {
+    for (long i = blockIdx.y * tile_size + threadIdx.y; i < rows; i += tile_size * gridDim.y) {
+#pragma unroll
+      for (int index = 0; index < num_per_block; ++index) {
+        const long row_id = i + index * blockDim.y;
+        if (row_id < rows) {
+          const long offset = row_id * cols + col_id;
+          const float dy_val = static_cast<float>(dy[offset]);
+          const float x_val = static_cast<float>(x[offset]);
+          const float mean_val = mean != nullptr ? mean[row_id] : 0.f;
+          const float inv_var_val = inv_var[row_id];
+          dgamma_sum[index] += dy_val * (x_val - mean_val) * inv_var_val;
+        }
+      }
+    }
+  }
+#pragma unroll
+  for (int index = 0; index < num_per_block; ++index) {
+    dgamma[index * blockDim.y + threadIdx.y][threadIdx.x] = dgamma_sum[index];
+  }
+  __syncthreads();
+#pragma unroll
+  for (int index = 0; index < num_per_block; ++index) {
+    const int col_id = blockIdx.x * blockDim.x + threadIdx.y + index * blockDim.y;
+    if (col_id < cols) {
+      float gamma_sum = dgamma[threadIdx.x][threadIdx.y + index * blockDim.y];
+      float global_dgamma = WarpReduce<float>(gamma_sum);
+      if (threadIdx.x == 0) {
+        const int offset = blockIdx.y * cols + col_id;
+        tmp_gamma_diff[offset] = global_dgamma;
+      }
+    }
+  }
+}
+
+template <typename T, typename V>
+__global__ void LayerNormBetaGradStep1(long rows, long cols, const V* __restrict__ dy,
                                         const T* __restrict__ x, const float* __restrict__ mean,
                                         const float* __restrict__ inv_var, float* __restrict__ tmp_beta_diff) {
   __shared__ float dbeta[32][33];
@@ -522,12 +1971,12 @@ __global__ void LayerNormBetaGradStep1(int rows, int cols, const V* __restrict__
   }
   const int col_id = blockIdx.x * blockDim.x + threadIdx.x;
   if (col_id < cols) {
-    for (int i = blockIdx.y * tile_size + threadIdx.y; i < rows; i += tile_size * gridDim.y) {
+    for (long i = blockIdx.y * tile_size + threadIdx.y; i < rows; i += tile_size * gridDim.y) {
 #pragma unroll
       for (int index = 0; index < num_per_block; ++index) {
-        int row_id = i + index * blockDim.y;
+        const long row_id = i + index * blockDim.y;
         if (row_id < rows) {
-          int offset = row_id * cols + col_id;
+          const long offset = row_id * cols + col_id;
           const float dy_val = static_cast<float>(dy[offset]);
           dbeta_sum[index] += dy_val;
         }
@@ -555,8 +2004,8 @@ __global__ void LayerNormBetaGradStep1(int rows, int cols, const V* __restrict__
 
 template <typename V>
 __global__ void LayerNormParamGradStep2(const float* part_grad_gamma, const float* part_grad_beta,
-                                        const int part_size, const int row, const int col,
-                                        V* grad_gamma, V* grad_beta) {
+                                        const int part_size, const int col, V* grad_gamma,
+                                        V* grad_beta, bool accumulate) {
     // sum partial gradients for gamma and beta
     SharedMemory<float> shared;
     float* buf = shared.getPointer();
@@ -592,6 +2041,10 @@ __global__ void LayerNormParamGradStep2(const float* part_grad_gamma, const floa
         }
         // write out fully summed gradients
         if (threadIdx.y == 0) {
+            if (accumulate) {
+                sum_gamma += static_cast<float>(grad_gamma[i2]);
+                sum_beta += static_cast<float>(grad_beta[i2]);
+            }
             grad_gamma[i2] = sum_gamma;
             grad_beta[i2] = sum_beta;
         }
@@ -599,7 +2052,8 @@ __global__ void LayerNormParamGradStep2(const float* part_grad_gamma, const floa
 }
 
 template <typename V>
-__global__ void LayerNormGammaGradStep2(const float* part_grad_gamma, const int part_size, const int row, const int col, V* grad_gamma) {
+__global__ void LayerNormGammaGradStep2(const float* part_grad_gamma, const int part_size,
+                                        const int col, V* grad_gamma, bool accumulate) {
     // sum partial gradients for gamma and beta
     SharedMemory<float> shared;
     float* buf = shared.getPointer();
@@ -629,13 +2083,15 @@ __global__ void LayerNormGammaGradStep2(const float* part_grad_gamma, const int
         }
         // write out fully summed gradients
         if (threadIdx.y == 0) {
+            if (accumulate) sum_gamma += static_cast<float>(grad_gamma[i2]);
             grad_gamma[i2] = sum_gamma;
         }
     }
 }
 
 template <typename V>
-__global__ void LayerNormBetaGradStep2(const float* part_grad_beta, const int part_size, const int row, const int col, V* grad_beta) {
+__global__ void LayerNormBetaGradStep2(const float* part_grad_beta, const int part_size,
+                                       const int col, V* grad_beta, bool accumulate) {
     // sum partial gradients for gamma and beta
     SharedMemory<float> shared;
     float* buf = shared.getPointer();
@@ -665,330 +2121,1764 @@ __global__ void LayerNormBetaGradStep2(const float* part_grad_beta, const int pa
         }
         // write out fully summed gradients
         if (threadIdx.y == 0) {
+            if (accumulate) sum_beta += static_cast<float>(grad_beta[i2]);
             grad_beta[i2] = sum_beta;
         }
     }
-}
+}
+
+template <typename T, typename V>
+__global__ void LayerNormInputGrad(const V* __restrict__ dout, const T* __restrict__ input,
+                                   const int rows, const int cols, const float* __restrict__ mean,
+                                   const float* __restrict__ invvar, float epsilon, const V* gamma,
+                                   T* grad_input) {
+    int WarpPerBlock = blockDim.x / WarpSize;
+    int thread_idx = threadIdx.x;
+    int warp_idx = thread_idx / WarpSize;
+    int lane_idx = thread_idx % WarpSize;
+
+    float* shared_dout = shared_data + warp_idx*cols;
+    float* shared_input = shared_data + WarpPerBlock*cols + warp_idx*cols;
+    float* shared_gamma = shared_data + 2*WarpPerBlock*cols;
+    int row_stride = gridDim.x*WarpPerBlock;
+    for(int row = blockIdx.x*WarpPerBlock+warp_idx; row < rows; row += row_stride) {
+        float mean_r = mean[row];
+        float invvar_r = invvar[row];
+        // load dout, input and gamma
+        long long data_offset = (long long)(row) * cols;
+        const V* dout_r = dout + data_offset;
+        const T* input_r = input + data_offset;
+        T* grad_input_r = grad_input + data_offset;
+#pragma unroll
+        for(int col = lane_idx; col < cols; col += WarpSize) {
+            shared_dout[col] = float(dout_r[col]);
+            shared_input[col] = float(input_r[col]);
+        }
+        if(warp_idx == 0) {
+#pragma unroll
+            for(int col = lane_idx; col < cols; col += WarpSize) {
+                shared_gamma[col] = gamma != NULL ? float(gamma[col]) : 1.0f;
+            }
+        }
+        __syncthreads();
+
+        float gamma_dout = 0.0;
+        float gamma_dout_input_mean = 0.0;
+        // reduction, gamma*dout and gamma*dout*(input-mean)
+#pragma unroll
+        for(int col = lane_idx; col < cols; col += WarpSize) {
+            float temp = shared_gamma[col] * shared_dout[col];
+            gamma_dout += temp;
+            gamma_dout_input_mean += temp * (shared_input[col] - mean_r);
+        }
+        float global_gamma_dout = WarpReduce<float>(gamma_dout);
+        float global_gamma_dout_input_mean = WarpReduce<float>(gamma_dout_input_mean);
+
+        float part3_temp_value = global_gamma_dout_input_mean * invvar_r * invvar_r * invvar_r / cols;
+        float part2 = global_gamma_dout * invvar_r / cols;
+#pragma unroll
+        for(int col = lane_idx; col < cols; col += WarpSize) {
+            float part1 = shared_gamma[col] * shared_dout[col] * invvar_r;
+            float part3 = (shared_input[col] - mean_r) * part3_temp_value;
+            grad_input_r[col] = part1 - part2 - part3;
+        }
+    }
+}
+
+template <typename T, typename VecType, typename P = T>
+__global__ void LayerNormInputGradV2(T* __restrict__ grad_output,
+                                     T* __restrict__ input,
+                                     long rows, long cols,
+                                     float* __restrict__ mean,
+                                     float* __restrict__ invvar,
+                                     float epsilon, const P* gamma,
+                                     T* grad_input,
+                                     const T* __restrict__ grad_residual) {
+    constexpr int ELEMENTS_PER_THREAD = sizeof(VecType) / sizeof(T);
+    const int tid = threadIdx.x;
+    const bool has_gamma = gamma != nullptr;
+    // Grid-stride row-group loop of the V2 kernels (see V2LaunchConfig).
+    for (long row_base = static_cast<long>(blockIdx.x) * blockDim.y; row_base < rows;
+         row_base += static_cast<long>(gridDim.x) * blockDim.y) {
+        const long row = row_base + threadIdx.y;
+        const float mean_val = row < rows ? mean[row] : 0.f;
+        const float invvar_val = row < rows ? invvar[row] : 0.f;
+
+        T* grad_output_row = grad_output + row * cols;
+        T* input_row = input + row * cols;
+        const V2RowSplit<T, VecType> split(input_row, row < rows ? cols : 0);
+
+        float gamma_mul_grad_output = 0.0;
+        float gamma_mul_grad_output_input_mean = 0.0;
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            const long col = split.vec_col(v);
+            float gamma_vals[ELEMENTS_PER_THREAD];
+            if (has_gamma) load_params<ELEMENTS_PER_THREAD>(gamma_vals, gamma + col);
+            VecType grad_output_vec = load_vec<VecType>(grad_output_row + col);
+            VecType input_vec = *reinterpret_cast<VecType*>(input_row + col);
+
+            T* grad_output_vals = reinterpret_cast<T*>(&grad_output_vec);
+            T* input_vals = reinterpret_cast<T*>(&input_vec);
+
+            #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                float gamma_dout = static_cast<float>(grad_output_vals[i]);
+                if (has_gamma) gamma_dout *= gamma_vals[i];
+                gamma_mul_grad_output += gamma_dout;
+                gamma_mul_grad_output_input_mean +=
+                    gamma_dout * (static_cast<float>(input_vals[i]) - mean_val);
+            }
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            const long col = split.scalar_col(i);
+            float gamma_dout = static_cast<float>(grad_output_row[col]);
+            if (has_gamma) gamma_dout *= static_cast<float>(gamma[col]);
+            gamma_mul_grad_output += gamma_dout;
+            gamma_mul_grad_output_input_mean +=
+                gamma_dout * (static_cast<float>(input_row[col]) - mean_val);
+        }
+        warp_sum_reduce(gamma_mul_grad_output, blockDim.x);
+        warp_sum_reduce(gamma_mul_grad_output_input_mean, blockDim.x);
+
+        // Phase 2: Calculate common coefficients
+        const float k1 = gamma_mul_grad_output * invvar_val / cols;
+        const float k2 = gamma_mul_grad_output_input_mean * invvar_val * invvar_val * invvar_val / cols;
+
+        T* grad_input_row = grad_input + row * cols;
+        const T* grad_residual_row = grad_residual != nullptr ? grad_residual + row * cols : nullptr;
+        // Phase 3: Vectorized write back gradients
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            const long col = split.vec_col(v);
+
+            // Reload necessary data
+            VecType grad_vec = load_vec<VecType>(grad_output_row + col);
+            VecType input_vec = *reinterpret_cast<const VecType*>(input_row + col);
+            float gamma_vals[ELEMENTS_PER_THREAD];
+            if (has_gamma) load_params<ELEMENTS_PER_THREAD>(gamma_vals, gamma + col);
+            VecType grad_residual_vec;
+            if (grad_residual_row != nullptr) {
+                grad_residual_vec = load_vec<VecType>(grad_residual_row + col);
+            }
+            T* grad_vals = reinterpret_cast<T*>(&grad_vec);
+            T* input_vals = reinterpret_cast<T*>(&input_vec);
+            T* grad_residual_vals = reinterpret_cast<T*>(&grad_residual_vec);
+
+            // Calculate gradient
+            VecType grad_input_vec;
+            T* grad_input_vals = reinterpret_cast<T*>(&grad_input_vec);
+
+            #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                const float grad_val = static_cast<float>(grad_vals[i]);
+                const float input_val = static_cast<float>(input_vals[i]);
+                const float gamma_val = has_gamma ? gamma_vals[i] : 1.f;
+
+                float grad = gamma_val * grad_val * invvar_val;
+                grad -= k1;
+                grad -= (input_val - mean_val) * k2;
+                if (grad_residual_row != nullptr) grad += static_cast<float>(grad_residual_vals[i]);
+                grad_input_vals[i] = static_cast<T>(grad);
+            }
+
+            // Vectorized storage
+            store_vec(grad_input_row + col, grad_input_vec);
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            const long col = split.scalar_col(i);
+            const float gamma_val = has_gamma ? static_cast<float>(gamma[col]) : 1.f;
+            float grad = gamma_val * static_cast<float>(grad_output_row[col]) * invvar_val;
+            grad -= k1;
+            grad -= (static_cast<float>(input_row[col]) - mean_val) * k2;
+            if (grad_residual_row != nullptr) grad += static_cast<float>(grad_residual_row[col]);
+            grad_input_row[col] = static_cast<T>(grad);
+        }
+    }
+}
+
+// RMSNorm input gradient with x_hat = x * inv_rms:
+//     grad_input = inv_rms * (gamma * dout - x_hat * mean(gamma * dout * x_hat))
+// One row reduction; the second sweep re-reads the row like LayerNormInputGradV2.
+template <typename T, typename VecType>
+__global__ void RMSNormInputGradV2(const T* __restrict__ grad_output,
+                                   const T* __restrict__ input, long rows, long cols,
+                                   const float* __restrict__ invvar,
+                                   const T* __restrict__ gamma, T* __restrict__ grad_input) {
+    constexpr int ELEMENTS_PER_THREAD = sizeof(VecType) / sizeof(T);
+    const long tid = threadIdx.x;
+    // Grid-stride row-group loop of the V2 kernels (see V2LaunchConfig).
+    for (long row_base = static_cast<long>(blockIdx.x) * blockDim.y; row_base < rows;
+         row_base += static_cast<long>(gridDim.x) * blockDim.y) {
+        const long row = row_base + threadIdx.y;
+        const bool row_valid = row < rows;
+        const T* grad_output_row = grad_output + row * cols;
+        const T* input_row = input + row * cols;
+        T* grad_input_row = grad_input + row * cols;
+        const float invvar_val = row_valid ? invvar[row] : 0.f;
+        const V2RowSplit<T, VecType> split(input_row, row_valid ? cols : 0);
+
+        float sum_gamma_dout_input = 0.f;
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            const long col = split.vec_col(v);
+            VecType grad_vec = load_vec<VecType>(grad_output_row + col);
+            VecType input_vec = *reinterpret_cast<const VecType*>(input_row + col);
+            VecType gamma_vec;
+            if (gamma != nullptr) gamma_vec = load_vec<VecType>(gamma + col);
+            const T* grad_vals = reinterpret_cast<const T*>(&grad_vec);
+            const T* input_vals = reinterpret_cast<const T*>(&input_vec);
+            const T* gamma_vals = reinterpret_cast<const T*>(&gamma_vec);
+    #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                float gamma_dout = static_cast<float>(grad_vals[i]);
+                if (gamma != nullptr) gamma_dout *= static_cast<float>(gamma_vals[i]);
+                sum_gamma_dout_input += gamma_dout * static_cast<float>(input_vals[i]);
+            }
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            const long col = split.scalar_col(i);
+            float gamma_dout = static_cast<float>(grad_output_row[col]);
+            if (gamma != nullptr) gamma_dout *= static_cast<float>(gamma[col]);
+            sum_gamma_dout_input += gamma_dout * static_cast<float>(input_row[col]);
+        }
+        warp_sum_reduce(sum_gamma_dout_input, blockDim.x);
+        const float k = sum_gamma_dout_input * invvar_val * invvar_val * invvar_val / cols;
+
+        for (long v = tid; v < split.body_vecs; v += blockDim.x) {
+            const long col = split.vec_col(v);
+            VecType grad_vec = load_vec<VecType>(grad_output_row + col);
+            VecType input_vec = *reinterpret_cast<const VecType*>(input_row + col);
+            VecType gamma_vec;
+            if (gamma != nullptr) gamma_vec = load_vec<VecType>(gamma + col);
+            const T* grad_vals = reinterpret_cast<const T*>(&grad_vec);
+            const T* input_vals = reinterpret_cast<const T*>(&input_vec);
+            const T* gamma_vals = reinterpret_cast<const T*>(&gamma_vec);
+            VecType grad_input_vec;
+            T* grad_input_vals = reinterpret_cast<T*>(&grad_input_vec);
+    #pragma unroll
+            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
+                float gamma_dout = static_cast<float>(grad_vals[i]);
+                if (gamma != nullptr) gamma_dout *= static_cast<float>(gamma_vals[i]);
+                grad_input_vals[i] = static_cast<T>(gamma_dout * invvar_val -
+                                                    static_cast<float>(input_vals[i]) * k);
+            }
+            store_vec(grad_input_row + col, grad_input_vec);
+        }
+        for (long i = tid; i < split.num_scalars(); i += blockDim.x) {
+            const long col = split.scalar_col(i);
+            float gamma_dout = static_cast<float>(grad_output_row[col]);
+            if (gamma != nullptr) gamma_dout *= static_cast<float>(gamma[col]);
+            grad_input_row[col] =
+                static_cast<T>(gamma_dout * invvar_val - static_cast<float>(input_row[col]) * k);
+        }
+    }
+}
+
+// Block-per-row counterpart of LayerNormInputGradV2 for wide rows. The two row reductions are
+// merged across warps in shared memory; the second sweep re-reads the row, which the first
+// sweep has just pulled into L1/L2.
+// grad_residual (optional) is the gradient that reached the input through a residual branch
+// (the sum output of add_layer_norm); it is added in the store instead of in a separate pass.
+template <int PACK, typename T, typename P = T>
+__global__ void __launch_bounds__(kBlockPerRowThreads)
+LayerNormInputGradBlock(const T* __restrict__ grad_output, const T* __restrict__ input,
+                        long cols, const float* __restrict__ mean,
+                        const float* __restrict__ invvar, const P* __restrict__ gamma,
+                        T* __restrict__ grad_input, const T* __restrict__ grad_residual) {
+    using Vec = AlignedVector<T, PACK>;
+    const long row = blockIdx.x;
+    const long num_packs = cols / PACK;
+    const T* grad_output_row = grad_output + row * cols;
+    const T* input_row = input + row * cols;
+    T* grad_input_row = grad_input + row * cols;
+    const float mean_val = mean[row];
+    const float invvar_val = invvar[row];
+
+    float sum_gamma_dout = 0.f;
+    float sum_gamma_dout_input_mean = 0.f;
+    for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+        const long col = pack * PACK;
+        const Vec dout_vec = *reinterpret_cast<const Vec*>(grad_output_row + col);
+        const Vec input_vec = *reinterpret_cast<const Vec*>(input_row + col);
+        float gamma_vals[PACK];
+        if (gamma != nullptr) load_params<PACK>(gamma_vals, gamma + col);
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            float gamma_dout = static_cast<float>(dout_vec.val[i]);
+            if (gamma != nullptr) gamma_dout *= gamma_vals[i];
+            sum_gamma_dout += gamma_dout;
+            sum_gamma_dout_input_mean +=
+                gamma_dout * (static_cast<float>(input_vec.val[i]) - mean_val);
+        }
+    }
+    sum_gamma_dout = BlockAllReduceSum(sum_gamma_dout);
+    sum_gamma_dout_input_mean = BlockAllReduceSum(sum_gamma_dout_input_mean);
+
+    const float k1 = sum_gamma_dout * invvar_val / cols;
+    const float k2 = sum_gamma_dout_input_mean * invvar_val * invvar_val * invvar_val / cols;
+    for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+        const long col = pack * PACK;
+        const Vec dout_vec = *reinterpret_cast<const Vec*>(grad_output_row + col);
+        const Vec input_vec = *reinterpret_cast<const Vec*>(input_row + col);
+        float gamma_vals[PACK];
+        if (gamma != nullptr) load_params<PACK>(gamma_vals, gamma + col);
+        Vec grad_residual_vec;
+        if (grad_residual != nullptr) {
+            grad_residual_vec = *reinterpret_cast<const Vec*>(grad_residual + row * cols + col);
+        }
+        Vec grad_input_vec;
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            float gamma_dout = static_cast<float>(dout_vec.val[i]);
+            if (gamma != nullptr) gamma_dout *= gamma_vals[i];
+            float grad = gamma_dout * invvar_val - k1 -
+                         (static_cast<float>(input_vec.val[i]) - mean_val) * k2;
+            if (grad_residual != nullptr) grad += static_cast<float>(grad_residual_vec.val[i]);
+            grad_input_vec.val[i] = static_cast<T>(grad);
+        }
+        *reinterpret_cast<Vec*>(grad_input_row + col) = grad_input_vec;
+    }
+}
+
+template <typename T, typename P = T>
+void LaunchLayerNormInputGradBlock(const T* grad_output, const T* input, long rows, long cols,
+                                   const float* mean, const float* invvar, const P* gamma,
+                                   T* grad_input, const T* grad_residual, cudaStream_t stream) {
+    const int pack_size =
+        GetPackSize<T>(cols, {grad_output, input, grad_input, grad_residual});
+    DispatchPackSize<T>(pack_size, [&](auto pack) {
+        constexpr int PACK = decltype(pack)::value;
+        const int threads = block_per_row_threads(cols / PACK);
+        LayerNormInputGradBlock<PACK, T, P><<<dim3(rows), threads, 0, stream>>>(
+            grad_output, input, cols, mean, invvar, gamma, grad_input, grad_residual);
+    });
+}
+
+// Reduces the [part_size, cols] partial gamma/beta gradients over part_size. Either partial
+// may be nullptr when the corresponding parameter does not exist. With accumulate the sums
+// are added to grad_gamma/grad_beta instead of overwriting them.
+template <typename V>
+void LaunchParamGradStep2(const float* part_grad_gamma, const float* part_grad_beta,
+                          int part_size, int cols, V* grad_gamma, V* grad_beta,
+                          cudaStream_t stream, bool accumulate = false) {
+    const dim3 threads3(32, 8, 1);
+    const dim3 blocks3((cols + 32 - 1) / 32, 1, 1);
+    const int nshared3 = threads3.x * threads3.y * sizeof(float);
+    if (part_grad_gamma != nullptr && part_grad_beta != nullptr) {
+        LayerNormParamGradStep2<<<blocks3, threads3, nshared3, stream>>>(
+            part_grad_gamma, part_grad_beta, part_size, cols, grad_gamma, grad_beta, accumulate);
+    } else if (part_grad_gamma != nullptr) {
+        LayerNormGammaGradStep2<<<blocks3, threads3, nshared3, stream>>>(
+            part_grad_gamma, part_size, cols, grad_gamma, accumulate);
+    } else if (part_grad_beta != nullptr) {
+        LayerNormBetaGradStep2<<<blocks3, threads3, nshared3, stream>>>(
+            part_grad_beta, part_size, cols, grad_beta, accumulate);
+    }
+}
+
+// Float scratch of at least numel elements for the partial parameter gradients of a backward.
+// It is kept per device and stream and only grows, so the backward stops allocating once the
+// largest shape has been seen; work on one stream is ordered, so consecutive backwards can
+// share it. Under CUDA graph capture a fresh buffer from the graph's pool is returned instead.
+at::Tensor ParamGradWorkspace(const at::Tensor& like, int64_t numel) {
+    const auto options = like.options().dtype(at::ScalarType::Float);
+    if (at::cuda::currentStreamCaptureStatusMayInitCtx() != at::cuda::CaptureStatus::None) {
+        return at::empty({numel}, options);
+    }
+    // Never destroyed: freeing CUDA memory from static destructors at exit is unsafe.
+    static std::mutex mutex;
+    static auto* workspaces = new std::map<std::pair<int, int64_t>, at::Tensor>();
+    const c10::cuda::CUDAStream stream = at::cuda::getCurrentCUDAStream(like.get_device());
+    std::lock_guard<std::mutex> lock(mutex);
+    at::Tensor& workspace = (*workspaces)[{stream.device_index(), stream.id()}];
+    if (!workspace.defined() || workspace.numel() < numel) {
+        workspace = at::Tensor();  // lets the allocator reuse the old block
+        workspace = at::empty({numel}, options);
+    }
+    return workspace;
+}
+
+// Keeps |v| >= eps with the sign of v, so dividing an output by gamma stays finite.
+__device__ __forceinline__ float clamp_by_magnitude(float v, float eps) {
+    return v >= 0.f ? fmaxf(v, eps) : fminf(v, -eps);
+}
+
+// Sums each thread's per-column accumulators over the row groups of the block (shared memory)
+// and writes the block's partial to part[blockIdx.x]. Must be called by the whole block.
+template <int COLS, int PACK>
+__device__ __forceinline__ void RegCachedWritePartials(
+    const float (&acc)[RegCachedShape<COLS, PACK>::VECS_PER_THREAD][PACK], float* cache,
+    float* __restrict__ part) {
+    using Shape = RegCachedShape<COLS, PACK>;
+#pragma unroll
+    for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+        const int vec_idx = v * Shape::THREADS_PER_ROW + threadIdx.x;
+        if (vec_idx < Shape::VECS_PER_ROW) {
+#pragma unroll
+            for (int i = 0; i < PACK; ++i) {
+                cache[threadIdx.y * COLS + vec_idx * PACK + i] = acc[v][i];
+            }
+        }
+    }
+    __syncthreads();
+    const int linear_tid = threadIdx.y * blockDim.x + threadIdx.x;
+    for (int col = linear_tid; col < COLS; col += kRegCachedThreadsPerBlock) {
+        float sum = 0.f;
+#pragma unroll
+        for (int y = 0; y < Shape::ROWS_PER_BLOCK; ++y) sum += cache[y * COLS + col];
+        part[static_cast<long>(blockIdx.x) * COLS + col] = sum;
+    }
+    __syncthreads();
+}
+
+// Single-sweep backward for the register-cached widths. A row group holds its slice of dout
+// and of the input in registers, computes grad_input from them, and each thread accumulates
+// the gamma/beta gradient of the columns it owns over every row its group visits (blocks
+// walk the rows grid-stride). dout and input are therefore read once for both gradients; the
+// per-block partials only need the small column reduction of LaunchParamGradStep2.
+// With mean == nullptr (a forward that did not save its statistics) the row statistics are
+// recomputed from the input already held in registers, the same two-pass way the
+// register-cached forward computes them.
+// With FROM_OUTPUT, `input` is the saved LayerNorm output y instead (an in-place forward) and
+// x_hat = (y - beta) / gamma; only invvar is read then. gamma/beta are of type P. dout is
+// read through DOUT_LOAD (DirectLoad, or EpilogueGradLoad / AdaLNGradLoad, which finish_dout
+// completes once x_hat is known).
+template <int COLS, int PACK, typename T, typename DOUT_LOAD, typename P, bool FROM_OUTPUT>
+__global__ void __launch_bounds__(kRegCachedThreadsPerBlock)
+LayerNormBackwardFused(DOUT_LOAD dout, const T* __restrict__ input,
+                       const float* __restrict__ mean, const float* __restrict__ invvar,
+                       const P* __restrict__ gamma, const P* __restrict__ beta,
+                       const T* __restrict__ grad_residual, long rows, float epsilon,
+                       T* __restrict__ grad_input, float* __restrict__ part_grad_gamma,
+                       float* __restrict__ part_grad_beta) {
+    using Shape = RegCachedShape<COLS, PACK>;
+    using InputVec = AlignedVector<T, PACK>;
+    __shared__ float cache[Shape::ROWS_PER_BLOCK * COLS];
+    const int tid = threadIdx.x;
+    const long row_step = static_cast<long>(gridDim.x) * blockDim.y;
+
+    float gamma_vals[Shape::VECS_PER_THREAD][PACK];
+    float beta_vals[Shape::VECS_PER_THREAD][PACK];
+    float dgamma[Shape::VECS_PER_THREAD][PACK];
+    float dbeta[Shape::VECS_PER_THREAD][PACK];
+#pragma unroll
+    for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+        const int vec_idx = v * Shape::THREADS_PER_ROW + tid;
+        const bool has_gamma = gamma != nullptr && vec_idx < Shape::VECS_PER_ROW;
+        const bool has_beta = FROM_OUTPUT && beta != nullptr && vec_idx < Shape::VECS_PER_ROW;
+        if (has_gamma) load_params<PACK>(gamma_vals[v], gamma + vec_idx * PACK);
+        if (has_beta) load_params<PACK>(beta_vals[v], beta + vec_idx * PACK);
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            if (!has_gamma) gamma_vals[v][i] = 1.f;
+            if (!has_beta) beta_vals[v][i] = 0.f;
+            dgamma[v][i] = 0.f;
+            dbeta[v][i] = 0.f;
+        }
+    }
 
-template <typename T, typename V>
-__global__ void LayerNormInputGrad(const V* __restrict__ dout, const T* __restrict__ input,
-                                   const int rows, const int cols, const float* __restrict__ mean,
-                                   const float* __restrict__ invvar, float epsilon, const V* gamma,
-                                   T* grad_input) {
-    int WarpPerBlock = blockDim.x / WarpSize;
-    int thread_idx = threadIdx.x;
-    int warp_idx = thread_idx / WarpSize;
-    int lane_idx = thread_idx % WarpSize;
+    for (long row_base = static_cast<long>(blockIdx.x) * blockDim.y; row_base < rows;
+         row_base += row_step) {
+        const long row = row_base + threadIdx.y;
+        const bool row_valid = row < rows;
 
-    float* shared_dout = shared_data + warp_idx*cols;
-    float* shared_input = shared_data + WarpPerBlock*cols + warp_idx*cols;
-    float* shared_gamma = shared_data + 2*WarpPerBlock*cols;
-    int row_stride = gridDim.x*WarpPerBlock;
-    for(int row = blockIdx.x*WarpPerBlock+warp_idx; row < rows; row += row_stride) {
-        float mean_r = mean[row];
-        float invvar_r = invvar[row];
-        // load dout, input and gamma
-        long long data_offset = (long long)(row) * cols;
-        const V* dout_r = dout + data_offset;
-        const T* input_r = input + data_offset;
-        T* grad_input_r = grad_input + data_offset;
+        // x_hat holds the raw input until the statistics are known.
+        float dy[Shape::VECS_PER_THREAD][PACK];
+        float x_hat[Shape::VECS_PER_THREAD][PACK];
+        float thread_sum = 0.f;
 #pragma unroll
-        for(int col = lane_idx; col < cols; col += WarpSize) {
-            shared_dout[col] = float(dout_r[col]);
-            shared_input[col] = float(input_r[col]);
+        for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+            const int vec_idx = v * Shape::THREADS_PER_ROW + tid;
+            if (row_valid && vec_idx < Shape::VECS_PER_ROW) {
+                const long offset = row * COLS + vec_idx * PACK;
+                dout.template load<PACK>(dy[v], row, vec_idx * PACK);
+                const InputVec input_vec = *reinterpret_cast<const InputVec*>(input + offset);
+#pragma unroll
+                for (int i = 0; i < PACK; ++i) {
+                    x_hat[v][i] = static_cast<float>(input_vec.val[i]);
+                    thread_sum += x_hat[v][i];
+                }
+            } else {
+#pragma unroll
+                for (int i = 0; i < PACK; ++i) dy[v][i] = x_hat[v][i] = 0.f;
+            }
         }
-        if(warp_idx == 0) {
+
+        float mean_val, invvar_val;
+        if (FROM_OUTPUT || mean != nullptr) {
+            mean_val = row_valid && !FROM_OUTPUT ? mean[row] : 0.f;
+            invvar_val = row_valid ? invvar[row] : 0.f;
+        } else {
+            warp_sum_reduce(thread_sum, Shape::THREADS_PER_ROW);
+            mean_val = thread_sum / COLS;
+            float thread_sq_sum = 0.f;
 #pragma unroll
-            for(int col = lane_idx; col < cols; col += WarpSize) {
-                shared_gamma[col] = gamma != NULL ? float(gamma[col]) : 1.0f;
+            for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+                if (v * Shape::THREADS_PER_ROW + tid < Shape::VECS_PER_ROW) {
+#pragma unroll
+                    for (int i = 0; i < PACK; ++i) {
+                        const float diff = x_hat[v][i] - mean_val;
+                        thread_sq_sum += diff * diff;
+                    }
+                }
             }
+            warp_sum_reduce(thread_sq_sum, Shape::THREADS_PER_ROW);
+            invvar_val = rsqrtf(thread_sq_sum / COLS + epsilon);
         }
-        __syncthreads();
 
-        float gamma_dout = 0.0;
-        float gamma_dout_input_mean = 0.0;
-        // reduction, gamma*dout and gamma*dout*(input-mean)
+        float sum_gamma_dy = 0.f;
+        float sum_gamma_dy_x_hat = 0.f;
 #pragma unroll
-        for(int col = lane_idx; col < cols; col += WarpSize) {
-            float temp = shared_gamma[col] * shared_dout[col];
-            gamma_dout += temp;
-            gamma_dout_input_mean += temp * (shared_input[col] - mean_r);
+        for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+#pragma unroll
+            for (int i = 0; i < PACK; ++i) {
+                if (FROM_OUTPUT) {
+                    x_hat[v][i] = (x_hat[v][i] - beta_vals[v][i]) /
+                                  clamp_by_magnitude(gamma_vals[v][i], epsilon);
+                } else {
+                    x_hat[v][i] = (x_hat[v][i] - mean_val) * invvar_val;
+                }
+                const float gamma_dy = gamma_vals[v][i] * dy[v][i];
+                sum_gamma_dy += gamma_dy;
+                sum_gamma_dy_x_hat += gamma_dy * x_hat[v][i];
+            }
         }
-        float global_gamma_dout = WarpReduce<float>(gamma_dout);
-        float global_gamma_dout_input_mean = WarpReduce<float>(gamma_dout_input_mean);
+        warp_sum_reduce(sum_gamma_dy, Shape::THREADS_PER_ROW);
+        warp_sum_reduce(sum_gamma_dy_x_hat, Shape::THREADS_PER_ROW);
+        const float mean_gamma_dy = sum_gamma_dy / COLS;
+        const float mean_gamma_dy_x_hat = sum_gamma_dy_x_hat / COLS;
 
-        float part3_temp_value = global_gamma_dout_input_mean * invvar_r * invvar_r * invvar_r / cols;
-        float part2 = global_gamma_dout * invvar_r / cols;
 #pragma unroll
-        for(int col = lane_idx; col < cols; col += WarpSize) {
-            float part1 = shared_gamma[col] * shared_dout[col] * invvar_r;
-            float part3 = (shared_input[col] - mean_r) * part3_temp_value;
-            grad_input_r[col] = part1 - part2 - part3;
+        for (int v = 0; v < Shape::VECS_PER_THREAD; ++v) {
+            const int vec_idx = v * Shape::THREADS_PER_ROW + tid;
+            if (row_valid && vec_idx < Shape::VECS_PER_ROW) {
+                const long offset = row * COLS + vec_idx * PACK;
+                finish_dout<PACK>(dout, x_hat[v], row, vec_idx * PACK);
+                InputVec residual_vec;
+                if (grad_residual != nullptr) {
+                    residual_vec = *reinterpret_cast<const InputVec*>(grad_residual + offset);
+                }
+                InputVec grad_input_vec;
+#pragma unroll
+                for (int i = 0; i < PACK; ++i) {
+                    float grad = invvar_val * (gamma_vals[v][i] * dy[v][i] - mean_gamma_dy -
+                                               x_hat[v][i] * mean_gamma_dy_x_hat);
+                    if (grad_residual != nullptr) grad += static_cast<float>(residual_vec.val[i]);
+                    grad_input_vec.val[i] = static_cast<T>(grad);
+                    dgamma[v][i] += dy[v][i] * x_hat[v][i];
+                    dbeta[v][i] += dy[v][i];
+                }
+                *reinterpret_cast<InputVec*>(grad_input + offset) = grad_input_vec;
+            }
         }
     }
-}
 
-__inline__ __device__ void warp_sum_reduce(float &val, int syc_thread_num) {
-    for(int mask = syc_thread_num/2; mask >= 1; mask /= 2) {
-        val += __shfl_xor_sync(0xffffffff, val, mask);
+    if (part_grad_gamma != nullptr) {
+        RegCachedWritePartials<COLS, PACK>(dgamma, cache, part_grad_gamma);
+    }
+    if (part_grad_beta != nullptr) {
+        RegCachedWritePartials<COLS, PACK>(dbeta, cache, part_grad_beta);
     }
 }
 
-template <typename T, typename VecType>
-__global__ void LayerNormInputGradV2(T* __restrict__ grad_output,
-                                     T* __restrict__ input,
-                                     int rows, int cols,
-                                     float* __restrict__ mean,
-                                     float* __restrict__ invvar,
-                                     float epsilon, T* gamma,
-                                     T* grad_input) {
-    constexpr int ELEMENTS_PER_THREAD = sizeof(VecType) / sizeof(T);
-    const int tid = threadIdx.x;
-    const int row = blockIdx.x * blockDim.y + threadIdx.y;
-    if (row >= rows) return;
-    const int ELEMENTS_PER_BLOCK = blockDim.x * ELEMENTS_PER_THREAD;
-    int TOTAL_BLOCKS = cols / ELEMENTS_PER_BLOCK;
-    const int REMAINING_ELEMENTS = cols % ELEMENTS_PER_BLOCK;
-    const int REMAINING_VECTORS = REMAINING_ELEMENTS / ELEMENTS_PER_THREAD;
-    if (tid < REMAINING_VECTORS) ++TOTAL_BLOCKS;
+// TryLayerNormBackwardFused with dout read through a DOUT_LOAD functor, whose pointers the
+// caller has checked for full-width vector access (dout_aligned).
+template <typename T, typename P, typename G, typename DOUT_LOAD>
+bool TryLayerNormBackwardFusedLoad(const DOUT_LOAD& dout, bool dout_aligned, const float* mean,
+                                   const float* invvar, const at::Tensor& input, long rows,
+                                   long cols, const P* gamma, const P* beta, float epsilon,
+                                   T* grad_input, G* grad_gamma, G* grad_beta,
+                                   const T* grad_residual, cudaStream_t stream,
+                                   bool from_output = false,
+                                   bool accumulate_param_grad = false) {
+    constexpr int PACK = 16 / sizeof(T);
+    const T* input_ptr = static_cast<const T*>(input.data_ptr());
+    // gamma/beta go through load_params, which needs no particular alignment.
+    if (!dout_aligned || !is_aligned(input_ptr, 16) || !is_aligned(grad_input, 16) ||
+        (grad_residual != nullptr && !is_aligned(grad_residual, 16))) {
+        return false;
+    }
+    const long resident_blocks = max_resident_blocks(kRegCachedThreadsPerBlock);
+    return DispatchRegCachedCols(cols, [&](auto cols_constant) {
+        constexpr int COLS = decltype(cols_constant)::value;
+        using Shape = RegCachedShape<COLS, PACK>;
+        const long needed_blocks = (rows + Shape::ROWS_PER_BLOCK - 1) / Shape::ROWS_PER_BLOCK;
+        const int part_size =
+            static_cast<int>(std::max(1L, std::min(needed_blocks, resident_blocks)));
+        const int64_t part_numel = int64_t(part_size) * COLS;
+        at::Tensor part_grad = ParamGradWorkspace(input, 2 * part_numel);
+        float* part_gamma_ptr = gamma != nullptr ? part_grad.data_ptr<float>() : nullptr;
+        float* part_beta_ptr = beta != nullptr ? part_grad.data_ptr<float>() + part_numel : nullptr;
+
+        const dim3 block(Shape::THREADS_PER_ROW, Shape::ROWS_PER_BLOCK);
+        if (from_output) {
+            LayerNormBackwardFused<COLS, PACK, T, DOUT_LOAD, P, true>
+                <<<dim3(part_size), block, 0, stream>>>(
+                    dout, input_ptr, mean, invvar, gamma, beta, grad_residual, rows, epsilon,
+                    grad_input, part_gamma_ptr, part_beta_ptr);
+        } else {
+            LayerNormBackwardFused<COLS, PACK, T, DOUT_LOAD, P, false>
+                <<<dim3(part_size), block, 0, stream>>>(
+                    dout, input_ptr, mean, invvar, gamma, beta, grad_residual, rows, epsilon,
+                    grad_input, part_gamma_ptr, part_beta_ptr);
+        }
+        LaunchParamGradStep2<G>(part_gamma_ptr, part_beta_ptr, part_size, int(cols), grad_gamma,
+                                grad_beta, stream, accumulate_param_grad);
+    });
+}
 
-    const float mean_val = mean[row];
-    const float invvar_val = invvar[row];
+// Runs the fused backward (grad_input plus gamma/beta) when cols has a register-cached
+// specialization and the operands allow full-width vector access. Returns false otherwise.
+// With from_output, `input` holds the forward's output (see LayerNormBackwardFused).
+// G is the type of grad_gamma/grad_beta, which accumulate_param_grad adds to (see
+// HostLayerNormGradient).
+template <typename T, typename V, typename P = V, typename G = P>
+bool TryLayerNormBackwardFused(const V* dout, const float* mean, const float* invvar,
+                               const at::Tensor& input, long rows, long cols, const P* gamma,
+                               const P* beta, float epsilon, T* grad_input, G* grad_gamma,
+                               G* grad_beta, const T* grad_residual, cudaStream_t stream,
+                               bool from_output = false, bool accumulate_param_grad = false) {
+    constexpr int PACK = 16 / sizeof(T);
+    return TryLayerNormBackwardFusedLoad<T, P, G>(
+        DirectLoad<V>{dout, cols}, is_aligned(dout, PACK * sizeof(V)), mean, invvar, input, rows,
+        cols, gamma, beta, epsilon, grad_input, grad_gamma, grad_beta, grad_residual, stream,
+        from_output, accumulate_param_grad);
+}
 
-    T* grad_output_row = grad_output + row * cols;
-    T* input_row = input + row * cols;
+// Block-per-row Welford statistics of each row, for a backward whose forward did not save
+// them and that cannot recompute them in its own kernel.
+template <int PACK, typename T>
+__global__ void __launch_bounds__(kBlockPerRowThreads)
+LayerNormRowStats(const T* __restrict__ input, long cols, float epsilon, float* __restrict__ mean,
+                  float* __restrict__ invvar) {
+    const long row = blockIdx.x;
+    const DirectLoad<T> load{input, cols};
+    float thread_mean = 0.f, thread_m2 = 0.f, thread_count = 0.f;
+    for (long pack = threadIdx.x; pack < cols / PACK; pack += blockDim.x) {
+        float vals[PACK];
+        load.template load<PACK>(vals, row, pack * PACK);
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            WelfordOnline(vals[i], &thread_mean, &thread_m2, &thread_count);
+        }
+    }
+    float row_mean, row_m2, row_count;
+    WelfordBlockAllReduce(thread_mean, thread_m2, thread_count, &row_mean, &row_m2, &row_count);
+    if (threadIdx.x == 0) {
+        mean[row] = row_mean;
+        invvar[row] = rsqrtf(max(row_m2 / row_count, 0.f) + epsilon);
+    }
+}
 
-    float gamma_mul_grad_output = 0.0;
-    float gamma_mul_grad_output_input_mean = 0.0;
-    const bool has_gamma = gamma != nullptr;
-    for (int block = 0; block < TOTAL_BLOCKS; ++block) {
-        const int base_idx = block * ELEMENTS_PER_BLOCK + tid * ELEMENTS_PER_THREAD;
+template <typename T>
+void LaunchLayerNormRowStats(const T* input, long rows, long cols, float epsilon, float* mean,
+                             float* invvar, cudaStream_t stream) {
+    DispatchPackSize<T>(GetPackSize<T>(cols, {input}), [&](auto pack) {
+        constexpr int PACK = decltype(pack)::value;
+        const int threads = block_per_row_threads(cols / PACK);
+        LayerNormRowStats<PACK, T><<<dim3(rows), threads, 0, stream>>>(input, cols, epsilon,
+                                                                      mean, invvar);
+    });
+}
 
-        VecType gamma_vec;
-        if (has_gamma) {
-            gamma_vec = *reinterpret_cast<VecType*>(gamma + base_idx);
-        } else {
-            T default_gamma[ELEMENTS_PER_THREAD];
-            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i)
-                default_gamma[i] = static_cast<T>(1.0f);
-            gamma_vec = *reinterpret_cast<VecType*>(default_gamma);
+// Rebuilds the input of an in-place forward from its output and the saved statistics,
+//     x = (y - beta) / gamma / invvar + mean,
+// for the backward kernels that read the input itself. gamma is clamped as in the fused
+// backward.
+template <int PACK, typename T, typename V>
+__global__ void LayerNormInputFromOutput(const T* __restrict__ output,
+                                         const float* __restrict__ mean,
+                                         const float* __restrict__ invvar,
+                                         const V* __restrict__ gamma, const V* __restrict__ beta,
+                                         long rows, long cols, float epsilon,
+                                         T* __restrict__ input) {
+    using Vec = AlignedVector<T, PACK>;
+    using ParamVec = AlignedVector<V, PACK>;
+    const long packs_per_row = cols / PACK;
+    const long num_packs = rows * packs_per_row;
+    for (long pack = static_cast<long>(blockIdx.x) * blockDim.x + threadIdx.x; pack < num_packs;
+         pack += static_cast<long>(gridDim.x) * blockDim.x) {
+        const long row = pack / packs_per_row;
+        const long col = (pack % packs_per_row) * PACK;
+        const long offset = row * cols + col;
+        const Vec output_vec = *reinterpret_cast<const Vec*>(output + offset);
+        ParamVec gamma_vec, beta_vec;
+        if (gamma != nullptr) gamma_vec = *reinterpret_cast<const ParamVec*>(gamma + col);
+        if (beta != nullptr) beta_vec = *reinterpret_cast<const ParamVec*>(beta + col);
+        const float mean_val = mean[row];
+        const float std_val = 1.f / invvar[row];
+        Vec input_vec;
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            float x_hat = static_cast<float>(output_vec.val[i]);
+            if (beta != nullptr) x_hat -= static_cast<float>(beta_vec.val[i]);
+            if (gamma != nullptr) {
+                x_hat /= clamp_by_magnitude(static_cast<float>(gamma_vec.val[i]), epsilon);
+            }
+            input_vec.val[i] = static_cast<T>(x_hat * std_val + mean_val);
         }
-        VecType grad_output_vec = *reinterpret_cast<VecType*>(grad_output_row + base_idx);
-        VecType input_vec = *reinterpret_cast<VecType*>(input_row + base_idx);
-
-        T* gamma_vals = reinterpret_cast<T*>(&gamma_vec);
-        T* grad_output_vals = reinterpret_cast<T*>(&grad_output_vec);
+        *reinterpret_cast<Vec*>(input + offset) = input_vec;
+    }
+}
 
-        #pragma unroll
-        for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
-            gamma_mul_grad_output +=  gamma_vals[i] * grad_output_vals[i];
+template <typename T, typename V>
+void LaunchLayerNormInputFromOutput(const T* output, const float* mean, const float* invvar,
+                                    const V* gamma, const V* beta, long rows, long cols,
+                                    float epsilon, T* input, cudaStream_t stream) {
+    // The pack has to keep both the activation and the parameter operands aligned.
+    int pack_size = GetPackSize<T>(cols, {output, input});
+    pack_size = std::min(pack_size, GetPackSize<V>(cols, {gamma, beta}));
+    const auto* props = at::cuda::getCurrentDeviceProperties();
+    DispatchPackSize<T>(pack_size, [&](auto pack) {
+        constexpr int PACK = decltype(pack)::value;
+        constexpr int kThreads = 256;
+        const long num_packs = rows * (cols / PACK);
+        const long max_blocks = static_cast<long>(props->multiProcessorCount) *
+                                (props->maxThreadsPerMultiProcessor / kThreads);
+        const long blocks =
+            std::max(1L, std::min((num_packs + kThreads - 1) / kThreads, max_blocks));
+        LayerNormInputFromOutput<PACK, T, V><<<dim3(blocks), kThreads, 0, stream>>>(
+            output, mean, invvar, gamma, beta, rows, cols, epsilon, input);
+    });
 }
 
-        T* input_vals = reinterpret_cast<T*>(&input_vec);
-        #pragma unroll
-        for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
-            gamma_mul_grad_output_input_mean += gamma_vals[i] * grad_output_vals[i] * (input_vals[i] - mean_val);
+
+// Backward of the adaptive LayerNorm epilogue: grad_normalized = dy * sigmoid(scale) feeds the
+// unaffine LayerNorm backward, grad_scale = dy * x_hat * sigmoid'(scale). The shift gradient
+// is dy itself and needs no kernel. Only for rows too wide for cuda_ada_layer_norm_gradient.
+template <int PACK, typename T>
+__global__ void AdaLayerNormBackward(const T* __restrict__ grad_output,
+                                     const T* __restrict__ input, const float* __restrict__ mean,
+                                     const float* __restrict__ invvar,
+                                     const T* __restrict__ scale, long rows, long cols,
+                                     T* __restrict__ grad_normalized, T* __restrict__ grad_scale) {
+    using Vec = AlignedVector<T, PACK>;
+    const long packs_per_row = cols / PACK;
+    const long num_packs = rows * packs_per_row;
+    for (long pack = static_cast<long>(blockIdx.x) * blockDim.x + threadIdx.x; pack < num_packs;
+         pack += static_cast<long>(gridDim.x) * blockDim.x) {
+        const long row = pack / packs_per_row;
+        const long offset = row * cols + (pack % packs_per_row) * PACK;
+        const Vec dout_vec = *reinterpret_cast<const Vec*>(grad_output + offset);
+        const Vec input_vec = *reinterpret_cast<const Vec*>(input + offset);
+        const Vec scale_vec = *reinterpret_cast<const Vec*>(scale + offset);
+        const float mean_val = mean[row];
+        const float invvar_val = invvar[row];
+        Vec grad_normalized_vec, grad_scale_vec;
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            const float dy = static_cast<float>(dout_vec.val[i]);
+            const float gate = 1.f / (1.f + __expf(-static_cast<float>(scale_vec.val[i])));
+            const float x_hat = (static_cast<float>(input_vec.val[i]) - mean_val) * invvar_val;
+            grad_normalized_vec.val[i] = static_cast<T>(dy * gate);
+            grad_scale_vec.val[i] = static_cast<T>(dy * x_hat * gate * (1.f - gate));
         }
+        *reinterpret_cast<Vec*>(grad_normalized + offset) = grad_normalized_vec;
+        *reinterpret_cast<Vec*>(grad_scale + offset) = grad_scale_vec;
     }
-    warp_sum_reduce(gamma_mul_grad_output, blockDim.x);
-    warp_sum_reduce(gamma_mul_grad_output_input_mean, blockDim.x);
-
-    // Phase 2: Calculate common coefficients
-    const float k1 = gamma_mul_grad_output * invvar_val / cols;
-    const float k2 = gamma_mul_grad_output_input_mean * invvar_val * invvar_val * invvar_val / cols;
+}
 
-    T* grad_input_row = grad_input + row * cols;
-    // Phase 3: Vectorized write back gradients
-    for (int block = 0; block < TOTAL_BLOCKS; ++block) {
-        const int base_idx = block * ELEMENTS_PER_BLOCK + tid * ELEMENTS_PER_THREAD;
-
-    // Reload necessary data
-    VecType grad_vec = *reinterpret_cast<const VecType*>(grad_output_row + base_idx);
-        VecType input_vec = *reinterpret_cast<const VecType*>(input_row + base_idx);
-        VecType gamma_vec;
-        if (has_gamma) {
-            gamma_vec = *reinterpret_cast<VecType*>(gamma + base_idx);
+// Backward of the epilogue: maps the gradient of the stored output to the gradient of the
+// affine LayerNorm output (for the usual LayerNorm backward) and computes the gate gradient.
+// The latter needs the affine output, which is recomputed from the input and the saved
+// statistics instead of being kept alive from the forward.
+template <int PACK, typename T>
+__global__ void LayerNormEpilogueBackward(const T* __restrict__ grad_output,
+                                          const T* __restrict__ input,
+                                          const float* __restrict__ mean,
+                                          const float* __restrict__ invvar,
+                                          const T* __restrict__ gamma,
+                                          const T* __restrict__ beta, Epilogue<T> epilogue,
+                                          long rows, long cols, T* __restrict__ grad_affine,
+                                          T* __restrict__ grad_gate) {
+    using Vec = AlignedVector<T, PACK>;
+    const long packs_per_row = cols / PACK;
+    const long num_packs = rows * packs_per_row;
+    for (long pack = static_cast<long>(blockIdx.x) * blockDim.x + threadIdx.x; pack < num_packs;
+         pack += static_cast<long>(gridDim.x) * blockDim.x) {
+        const long row = pack / packs_per_row;
+        const long col = (pack % packs_per_row) * PACK;
+        const long offset = row * cols + col;
+        const Vec dout_vec = *reinterpret_cast<const Vec*>(grad_output + offset);
+        float factors[PACK];
+        epilogue.template scale<PACK>(factors, row, col);
+
+        Vec grad_affine_vec;
+        if (epilogue.gate == nullptr) {
+#pragma unroll
+            for (int i = 0; i < PACK; ++i) {
+                grad_affine_vec.val[i] =
+                    static_cast<T>(static_cast<float>(dout_vec.val[i]) * factors[i]);
+            }
         } else {
-            T default_gamma[ELEMENTS_PER_THREAD];
-            for (int i = 0; i < ELEMENTS_PER_THREAD; ++i)
-                default_gamma[i] = static_cast<T>(1.0f);
-            gamma_vec = *reinterpret_cast<VecType*>(default_gamma);
-        }
-        T* grad_vals = reinterpret_cast<T*>(&grad_vec);
-        T* input_vals = reinterpret_cast<T*>(&input_vec);
-        T* gamma_vals = reinterpret_cast<T*>(&gamma_vec);
-
-        // Calculate gradient
-        VecType grad_input_vec;
-        T* grad_input_vals = reinterpret_cast<T*>(&grad_input_vec);
-
-        #pragma unroll
-        for (int i = 0; i < ELEMENTS_PER_THREAD; ++i) {
-            const float grad_val = static_cast<float>(grad_vals[i]);
-            const float input_val = static_cast<float>(input_vals[i]);
-            const float gamma_val = static_cast<float>(gamma_vals[i]);
-
-            float grad = gamma_val * grad_val * invvar_val;
-            grad -= k1;
-            grad -= (input_val - mean_val) * k2;
-            grad_input_vals[i] = static_cast<T>(grad);
+            const Vec gate_vec = *reinterpret_cast<const Vec*>(epilogue.gate + offset);
+            const Vec input_vec = *reinterpret_cast<const Vec*>(input + offset);
+            Vec gamma_vec, beta_vec, grad_gate_vec;
+            if (gamma != nullptr) gamma_vec = *reinterpret_cast<const Vec*>(gamma + col);
+            if (beta != nullptr) beta_vec = *reinterpret_cast<const Vec*>(beta + col);
+            const float mean_val = mean[row];
+            const float invvar_val = invvar[row];
+#pragma unroll
+            for (int i = 0; i < PACK; ++i) {
+                const float grad = static_cast<float>(dout_vec.val[i]) * factors[i];
+                float y = (static_cast<float>(input_vec.val[i]) - mean_val) * invvar_val;
+                if (gamma != nullptr) y *= static_cast<float>(gamma_vec.val[i]);
+                if (beta != nullptr) y += static_cast<float>(beta_vec.val[i]);
+                grad_affine_vec.val[i] = static_cast<T>(grad * static_cast<float>(gate_vec.val[i]));
+                grad_gate_vec.val[i] = static_cast<T>(grad * y);
+            }
+            *reinterpret_cast<Vec*>(grad_gate + offset) = grad_gate_vec;
         }
-
-        // Vectorized storage
-        *reinterpret_cast<VecType*>(grad_input_row + base_idx) = grad_input_vec;
+        *reinterpret_cast<Vec*>(grad_affine + offset) = grad_affine_vec;
     }
 }
 
+// Number of LayerNormParamGradStep1 blocks the device can keep resident. The occupancy query
+// and the SM count only depend on the device and the kernel instantiation, so they are
+// computed once per device instead of on every backward call.
+template <typename T, typename V>
+int MaxResidentParamGradBlocks(int device) {
+    static std::array<std::atomic<int>, C10_COMPILE_TIME_MAX_GPUS> cache;
+    int num_blocks = cache[device].load(std::memory_order_relaxed);
+    if (num_blocks == 0) {
+        const int block_size = block_dim_x * block_dim_y;
+        int max_active_blocks = 0;
+        C10_CUDA_CHECK(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+            &max_active_blocks, LayerNormParamGradStep1<T, V>, block_size, 0));
+        const int sm_count = at::cuda::getDeviceProperties(device)->multiProcessorCount;
+        num_blocks = std::max(max_active_blocks * sm_count, 1);
+        cache[device].store(num_blocks, std::memory_order_relaxed);
+    }
+    return num_blocks;
+}
 
 template <typename T, typename V>
-int GetGirdDimY(const int64_t num_instances, const int64_t norm_size) {
-    const int grid_dim_x = (norm_size + tile_size - 1) / tile_size;
-    const int max_grid_dim_y = (num_instances + tile_size - 1) / tile_size;
-    const int block_size = block_dim_x * block_dim_y;
-    int max_active_blocks = 0;
-    cudaOccupancyMaxActiveBlocksPerMultiprocessor(
-        &max_active_blocks, LayerNormParamGradStep1<T, V>, block_size, 0);
+int GetGirdDimY(const int64_t num_instances, const int64_t norm_size, int device) {
+    const int64_t grid_dim_x = (norm_size + tile_size - 1) / tile_size;
+    // Row tiles are counted in 64 bits; the partial count is capped by the resident blocks.
+    const int64_t max_grid_dim_y = (num_instances + tile_size - 1) / tile_size;
     int waves = 1;
-    int dev;
-    cudaGetDevice(&dev);
-    int sm_count;
-    cudaDeviceGetAttribute(&sm_count, cudaDevAttrMultiProcessorCount, dev);
-    int num_blocks = max_active_blocks * sm_count * waves;
-    int grid_dim_y = std::min(max_grid_dim_y, static_cast<int>(num_blocks / grid_dim_x));
-    return std::max(grid_dim_y, 1);
+    int num_blocks = MaxResidentParamGradBlocks<T, V>(device) * waves;
+    const int64_t grid_dim_y = std::min<int64_t>(max_grid_dim_y, num_blocks / grid_dim_x);
+    return static_cast<int>(std::max<int64_t>(grid_dim_y, 1));
 }
 
-template <typename T, typename V>
-void HostLayerNormGradient(const V* dout, const float* mean, const float* invvar, at::Tensor* input, int row,
-                           int col, const V* gamma, const V* beta, double epsilon, T* grad_input,
-                           V* grad_gamma, V* grad_beta) {
+// grad_gamma/grad_beta are of type G: P, or an fp32 main-grad buffer the gradients are added
+// to when accumulate_param_grad is set.
+template <typename T, typename V, typename P = V, typename G = P>
+void HostLayerNormGradient(const V* dout, const float* mean, const float* invvar, at::Tensor* input, int64_t row,
+                           int64_t col, const P* gamma, const P* beta, double epsilon, T* grad_input,
+                           G* grad_gamma, G* grad_beta, const T* grad_residual,
+                           bool accumulate_param_grad = false) {
     auto stream = at::cuda::getCurrentCUDAStream().stream();
+    const TunedLaunch tuned = LookupTunedLaunch(c10::CppTypeToScalarType<T>::value, row, col,
+                                                gamma != NULL, beta != NULL, true);
+    const bool use_default = tuned.variant == LaunchVariant::kDefault;
+
+    // Rows that fit in registers: one sweep over dout and input for all three gradients.
+    if (use_default && !use_block_per_row(row, col) &&
+        TryLayerNormBackwardFused<T, V, P, G>(dout, mean, invvar, *input, row, col, gamma, beta,
+                                              float(epsilon), grad_input, grad_gamma, grad_beta,
+                                              grad_residual, stream, false,
+                                              accumulate_param_grad)) {
+        RecordLaunch("fused_reg_cached");
+        C10_CUDA_KERNEL_LAUNCH_CHECK();
+        return;
+    }
+
+    // mean == NULL: the forward did not save its statistics. The fused kernel recomputes them
+    // in registers; every other path needs them up front, which costs one extra read of input.
+    at::Tensor recomputed_mean, recomputed_invvar;
+    if (mean == NULL) {
+        recomputed_mean = at::empty({row}, input->options().dtype(at::ScalarType::Float));
+        recomputed_invvar = at::empty_like(recomputed_mean);
+        LaunchLayerNormRowStats<T>(input->DATA_PTR<T>(), row, col, float(epsilon),
+                                   recomputed_mean.DATA_PTR<float>(),
+                                   recomputed_invvar.DATA_PTR<float>(), stream);
+        mean = recomputed_mean.DATA_PTR<float>();
+        invvar = recomputed_invvar.DATA_PTR<float>();
+    }
 
     if (gamma != NULL && beta != NULL) {
         // compute grad_gamma(j) and grad_beta(j)
-        const int part_size = GetGirdDimY<T, V>(row, col);
+        const int part_size = GetGirdDimY<T, V>(row, col, input->get_device());
         const int grid_dim_x = (col + tile_size - 1) / tile_size;
         const int grid_dim_y = part_size;
 
-        at::Tensor part_grad_gamma = at::empty({part_size, col}, input->options().dtype(at::ScalarType::Float));
-        at::Tensor part_grad_beta = at::empty_like(part_grad_gamma);
-        LayerNormParamGradStep1<T, V><<<dim3(grid_dim_x, grid_dim_y), dim3(32, 32 / num_per_block)>>>(
-            row, col, dout, input->DATA_PTR<T>(), mean, invvar, part_grad_gamma.DATA_PTR<float>(), part_grad_beta.DATA_PTR<float>()
+        at::Tensor part_grad = ParamGradWorkspace(*input, 2 * part_size * col);
+        float* part_grad_gamma = part_grad.DATA_PTR<float>();
+        float* part_grad_beta = part_grad_gamma + part_size * col;
+        LayerNormParamGradStep1<T, V><<<dim3(grid_dim_x, grid_dim_y), dim3(32, 32 / num_per_block), 0, stream>>>(
+            row, col, dout, input->DATA_PTR<T>(), mean, invvar, part_grad_gamma, part_grad_beta
         );
 
-        const dim3 threads3(32, 8, 1);
-        const dim3 blocks3((col + 32 - 1) / 32, 1, 1);
-        const int nshared3 = threads3.x * threads3.y * sizeof(float);
-        LayerNormParamGradStep2<<<blocks3, threads3, nshared3, stream>>>(
-            part_grad_gamma.DATA_PTR<float>(), part_grad_beta.DATA_PTR<float>(), part_size, row, col,
-            grad_gamma, grad_beta);
+        LaunchParamGradStep2<G>(part_grad_gamma, part_grad_beta, part_size, col, grad_gamma,
+                                grad_beta, stream, accumulate_param_grad);
     } else if (gamma != NULL && beta == NULL) {
         // compute grad_gamma(j) and grad_beta(j)
-        const int part_size = GetGirdDimY<T, V>(row, col);
+        const int part_size = GetGirdDimY<T, V>(row, col, input->get_device());
         const int grid_dim_x = (col + tile_size - 1) / tile_size;
         const int grid_dim_y = part_size;
 
-        at::Tensor part_grad_gamma = at::empty({part_size, col}, input->options().dtype(at::ScalarType::Float));
-        LayerNormGammaGradStep1<T, V><<<dim3(grid_dim_x, grid_dim_y), dim3(32, 32 / num_per_block)>>>(
+        at::Tensor part_grad_gamma = ParamGradWorkspace(*input, part_size * col);
+        LayerNormGammaGradStep1<T, V><<<dim3(grid_dim_x, grid_dim_y), dim3(32, 32 / num_per_block), 0, stream>>>(
             row, col, dout, input->DATA_PTR<T>(), mean, invvar, part_grad_gamma.DATA_PTR<float>());
 
-        const dim3 threads3(32, 8, 1);
-        const dim3 blocks3((col + 32 - 1) / 32, 1, 1);
-        const int nshared3 = threads3.x * threads3.y * sizeof(float);
-        LayerNormGammaGradStep2<<<blocks3, threads3, nshared3, stream>>>(
-            part_grad_gamma.DATA_PTR<float>(), part_size, row, col, grad_gamma);
+        LaunchParamGradStep2<G>(part_grad_gamma.DATA_PTR<float>(), nullptr, part_size, col,
+                                grad_gamma, static_cast<G*>(nullptr), stream,
+                                accumulate_param_grad);
     } else if (gamma == NULL && beta!= NULL) {
         // compute grad_gamma(j) and grad_beta(j)
-        const int part_size = GetGirdDimY<T, V>(row, col);
+        const int part_size = GetGirdDimY<T, V>(row, col, input->get_device());
         const int grid_dim_x = (col + tile_size - 1) / tile_size;
         const int grid_dim_y = part_size;
 
-        at::Tensor part_grad_beta = at::empty({part_size, col}, input->options().dtype(at::ScalarType::Float));
-        LayerNormBetaGradStep1<T, V><<<dim3(grid_dim_x, grid_dim_y), dim3(32, 32 / num_per_block)>>>(
+        at::Tensor part_grad_beta = ParamGradWorkspace(*input, part_size * col);
+        LayerNormBetaGradStep1<T, V><<<dim3(grid_dim_x, grid_dim_y), dim3(32, 32 / num_per_block), 0, stream>>>(
             row, col, dout, input->DATA_PTR<T>(), mean, invvar, part_grad_beta.DATA_PTR<float>()
         );
 
-        const dim3 threads3(32, 8, 1);
-        const dim3 blocks3((col + 32 - 1) / 32, 1, 1);
-        const int nshared3 = threads3.x * threads3.y * sizeof(float);
-        LayerNormBetaGradStep2<<<blocks3, threads3, nshared3, stream>>>(
-            part_grad_beta.DATA_PTR<float>(), part_size, row, col, grad_beta);
-    }
-
-    // Get element byte size
-    const auto dtype = input->dtype();
-    int element_size;
-    if (dtype == torch::kFloat32) {
-        element_size = 4;
-    } else if (dtype == torch::kFloat16 || dtype == torch::kBFloat16) {
-        element_size = 2;
-    } else {
-        throw std::runtime_error("Unsupported data type");
+        LaunchParamGradStep2<G>(nullptr, part_grad_beta.DATA_PTR<float>(), part_size, col,
+                                static_cast<G*>(nullptr), grad_beta, stream,
+                                accumulate_param_grad);
     }
 
-    // Calculate total bytes and check alignment
-    const int total_bytes = col * element_size;
-    int vec_size = 0;
-    if (total_bytes % 16 == 0) {
-        vec_size = 16;
-    } else if (total_bytes % 8 == 0) {
-        vec_size = 8;
-    } else if (total_bytes % 4 == 0) {
-        vec_size = 4;
-    } else {
-        vec_size = 2;
+    if (use_default && use_block_per_row(row, col)) {
+        LaunchLayerNormInputGradBlock<T, P>((const T*)dout, input->DATA_PTR<T>(), row, col, mean,
+                                            invvar, gamma, grad_input, grad_residual, stream);
+        RecordLaunch("block_per_row");
+        C10_CUDA_KERNEL_LAUNCH_CHECK();
+        return;
     }
 
-    // Calculate elements per thread
-    const int elements_per_thread = vec_size / element_size;
-    const int threads_per_row = find_opt_threads(col, elements_per_thread);
-
-    // Configure kernel parameters
-    const int threads_per_block = 128;
-    const int rows_per_block = threads_per_block / threads_per_row;
-    const dim3 grid((row + rows_per_block - 1) / rows_per_block);
-    const dim3 block(threads_per_row, rows_per_block);
-    if (dtype == torch::kFloat32) {
-    if (vec_size == 16)
-        LayerNormInputGradV2<float, float4><<<grid, block>>>((float*)dout, input->DATA_PTR<float>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (float*)gamma, (float*)grad_input);
-    else if(vec_size == 8)
-        LayerNormInputGradV2<float, float2><<<grid, block>>>((float*)dout, input->DATA_PTR<float>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (float*)gamma, (float*)grad_input);
-    else if(vec_size == 4)
-        LayerNormInputGradV2<float, float><<<grid, block>>>((float*)dout, input->DATA_PTR<float>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (float*)gamma, (float*)grad_input);
-    } else if (dtype == torch::kFloat16) {
-    if (vec_size == 16)
-        LayerNormInputGradV2<at::Half, float4><<<grid, block>>>((at::Half*)dout, input->DATA_PTR<at::Half>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::Half*)gamma, (at::Half*)grad_input);
-    else if(vec_size == 8)
-        LayerNormInputGradV2<at::Half, float2><<<grid, block>>>((at::Half*)dout, input->DATA_PTR<at::Half>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::Half*)gamma, (at::Half*)grad_input);
-    else if(vec_size == 4)
-        LayerNormInputGradV2<at::Half, float><<<grid, block>>>((at::Half*)dout, input->DATA_PTR<at::Half>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::Half*)gamma, (at::Half*)grad_input);
-    else if(vec_size == 2)
-        LayerNormInputGradV2<at::Half, at::Half><<<grid, block>>>((at::Half*)dout, input->DATA_PTR<at::Half>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::Half*)gamma, (at::Half*)grad_input);
-    } else {
-    if (vec_size == 16)
-        LayerNormInputGradV2<at::BFloat16, float4><<<grid, block>>>((at::BFloat16*)dout, input->DATA_PTR<at::BFloat16>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::BFloat16*)gamma, (at::BFloat16*)grad_input);
-    else if(vec_size == 8)
-        LayerNormInputGradV2<at::BFloat16, float2><<<grid, block>>>((at::BFloat16*)dout, input->DATA_PTR<at::BFloat16>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::BFloat16*)gamma, (at::BFloat16*)grad_input);
-    else if(vec_size == 4)
-        LayerNormInputGradV2<at::BFloat16, float><<<grid, block>>>((at::BFloat16*)dout, input->DATA_PTR<at::BFloat16>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::BFloat16*)gamma, (at::BFloat16*)grad_input);
-    else if(vec_size == 2)
-        LayerNormInputGradV2<at::BFloat16, at::BFloat16><<<grid, block>>>((at::BFloat16*)dout, input->DATA_PTR<at::BFloat16>(), row, col, (float*)mean, (float*)invvar, float(epsilon), (at::BFloat16*)gamma, (at::BFloat16*)grad_input);
-    }
+    const V2LaunchConfig config =
+        GetV2LaunchConfig(row, col, sizeof(T), tuned.threads_per_block);
+    RecordLaunch("v2", config);
+    DispatchVecType<T>(config.vec_size, [&](auto vec) {
+        LayerNormInputGradV2<T, decltype(vec), P><<<config.grid, config.block, 0, stream>>>(
+            (T*)dout, input->DATA_PTR<T>(), row, col, (float*)mean, (float*)invvar,
+            float(epsilon), gamma, grad_input, grad_residual);
+    });
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
 }
 
 void cuda_layer_norm_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
-                              at::Tensor* input, int row, int col, at::IntArrayRef normalized_shape,
+                              at::Tensor* input, int64_t row, int64_t col, at::IntArrayRef normalized_shape,
                               at::Tensor* gamma, at::Tensor* beta, double epsilon,
                               at::Tensor* grad_input, at::Tensor* grad_gamma,
-                              at::Tensor* grad_beta) {
+                              at::Tensor* grad_beta, at::Tensor* grad_residual) {
     using namespace at;
+    // fp32 gamma/beta with half-precision activations: the parameter gradients stay fp32.
+    const at::Tensor* param = gamma != NULL ? gamma : beta;
+    if (param != NULL && param->scalar_type() == at::ScalarType::Float &&
+        dout->scalar_type() != at::ScalarType::Float) {
+        DISPATCH_HALF_AND_BFLOAT(
+            input->scalar_type(), "cuda_layer_norm_gradient_kernel",
+            HostLayerNormGradient<scalar_t, scalar_t, float>(
+                dout->DATA_PTR<scalar_t>(), mean != NULL ? mean->DATA_PTR<float>() : NULL,
+                invvar != NULL ? invvar->DATA_PTR<float>() : NULL, input, row, col,
+                gamma != NULL ? gamma->DATA_PTR<float>() : NULL,
+                beta != NULL ? beta->DATA_PTR<float>() : NULL, epsilon,
+                grad_input->DATA_PTR<scalar_t>(),
+                gamma != NULL ? grad_gamma->DATA_PTR<float>() : NULL,
+                beta != NULL ? grad_beta->DATA_PTR<float>() : NULL,
+                grad_residual != NULL ? grad_residual->DATA_PTR<scalar_t>() : NULL);)
+        return;
+    }
     DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
         input->scalar_type(), dout->scalar_type(), "cuda_layer_norm_gradient_kernel",
-        HostLayerNormGradient(dout->DATA_PTR<scalar_t_out>(), mean->DATA_PTR<float>(),
-                              invvar->DATA_PTR<float>(), input, row, col,
+        HostLayerNormGradient(dout->DATA_PTR<scalar_t_out>(),
+                              mean != NULL ? mean->DATA_PTR<float>() : NULL,
+                              invvar != NULL ? invvar->DATA_PTR<float>() : NULL, input, row, col,
                               gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL,
                               beta != NULL ? beta->DATA_PTR<scalar_t_out>() : NULL, epsilon,
                               grad_input->DATA_PTR<scalar_t_in>(),
                               gamma != NULL ? grad_gamma->DATA_PTR<scalar_t_out>() : NULL,
-                              beta != NULL ? grad_beta->DATA_PTR<scalar_t_out>() : NULL);)
+                              beta != NULL ? grad_beta->DATA_PTR<scalar_t_out>() : NULL,
+                              grad_residual != NULL ? grad_residual->DATA_PTR<scalar_t_in>() : NULL);)
+}
+
+// Backward with fp32 grad_gamma/grad_beta whatever the parameter type. With accumulate they
+// are added to the buffers by the final reduction of the partials (main-grad accumulation)
+// instead of overwriting them. dout has the input's type.
+void cuda_layer_norm_gradient_fp32_param_grads(at::Tensor* dout, at::Tensor* mean,
+                                               at::Tensor* invvar, at::Tensor* input,
+                                               int64_t row, int64_t col, at::Tensor* gamma,
+                                               at::Tensor* beta, double epsilon,
+                                               at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                               at::Tensor* grad_beta, bool accumulate) {
+    const at::ScalarType param_type =
+        gamma != NULL ? gamma->scalar_type() : beta != NULL ? beta->scalar_type() : input->scalar_type();
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        input->scalar_type(), param_type, "cuda_layer_norm_gradient_fp32_param_grads",
+        HostLayerNormGradient<scalar_t, scalar_t, param_t, float>(
+            dout->DATA_PTR<scalar_t>(), mean->DATA_PTR<float>(), invvar->DATA_PTR<float>(), input,
+            row, col, gamma != NULL ? gamma->DATA_PTR<param_t>() : NULL,
+            beta != NULL ? beta->DATA_PTR<param_t>() : NULL, epsilon,
+            grad_input->DATA_PTR<scalar_t>(),
+            gamma != NULL ? grad_gamma->DATA_PTR<float>() : NULL,
+            beta != NULL ? grad_beta->DATA_PTR<float>() : NULL, NULL, accumulate);)
+}
+
+
+// Backward of an in-place forward, which kept its output instead of its input. The fused
+// register-cached backward derives x_hat from the output directly; every other path first
+// rebuilds the input into a transient buffer and then runs the regular backward on it.
+template <typename T, typename V>
+void HostLayerNormGradientFromOutput(const V* dout, const float* mean, const float* invvar,
+                                     at::Tensor* output, int64_t row, int64_t col, const V* gamma,
+                                     const V* beta, double epsilon, T* grad_input,
+                                     V* grad_gamma, V* grad_beta) {
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+    if (!use_block_per_row(row, col) &&
+        TryLayerNormBackwardFused<T, V>(dout, mean, invvar, *output, row, col, gamma, beta,
+                                        float(epsilon), grad_input, grad_gamma, grad_beta,
+                                        nullptr, stream, /*from_output=*/true)) {
+        RecordLaunch("fused_reg_cached");
+        C10_CUDA_KERNEL_LAUNCH_CHECK();
+        return;
+    }
+    at::Tensor input = at::empty_like(*output);
+    LaunchLayerNormInputFromOutput<T, V>(output->DATA_PTR<T>(), mean, invvar, gamma, beta, row,
+                                         col, float(epsilon), input.DATA_PTR<T>(), stream);
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    HostLayerNormGradient<T, V>(dout, mean, invvar, &input, row, col, gamma, beta, epsilon,
+                                grad_input, grad_gamma, grad_beta, nullptr);
+}
+
+void cuda_layer_norm_gradient_from_output(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                          at::Tensor* output, int64_t row, int64_t col,
+                                          at::Tensor* gamma, at::Tensor* beta, double epsilon,
+                                          at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                          at::Tensor* grad_beta) {
+    using namespace at;
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+        output->scalar_type(), dout->scalar_type(), "cuda_layer_norm_gradient_from_output",
+        HostLayerNormGradientFromOutput(dout->DATA_PTR<scalar_t_out>(), mean->DATA_PTR<float>(),
+                                        invvar->DATA_PTR<float>(), output, row, col,
+                                        gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL,
+                                        beta != NULL ? beta->DATA_PTR<scalar_t_out>() : NULL,
+                                        epsilon, grad_input->DATA_PTR<scalar_t_in>(),
+                                        gamma != NULL ? grad_gamma->DATA_PTR<scalar_t_out>() : NULL,
+                                        beta != NULL ? grad_beta->DATA_PTR<scalar_t_out>() : NULL);)
+}
+
+// The row-wise backward keeps one float gamma and one beta partial per column of the row in
+// shared memory; near the cap it needs OptInDynamicSharedMemory for BlockAllReduceSum's share.
+constexpr long kRowwiseBackwardMaxCols = 48 * 1024 / (2 * sizeof(float));
+
+// x_hat of a row, as saved by cuda_layer_norm_save_xhat.
+template <typename S>
+struct SavedXHatLoad {
+    const S* xhat;
+    long row_stride;
+
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        const AlignedVector<S, N> vec =
+            *reinterpret_cast<const AlignedVector<S, N>*>(xhat + row * row_stride + col);
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] = static_cast<float>(vec.val[i]);
+    }
+};
+
+// x_hat of a row recomputed from the input and the saved row statistics. The statistics are
+// indexed by the launch row even when LOAD remaps the input rows (IndexedLoad).
+template <typename T, typename LOAD = DirectLoad<T>>
+struct NormalizedInputLoad {
+    LOAD input;
+    const float* mean;
+    const float* invvar;
+
+    template <int N>
+    __device__ __forceinline__ void load(float* dst, long row, long col) const {
+        input.template load<N>(dst, row, col);
+        const float mean_val = mean[row];
+        const float invvar_val = invvar[row];
+#pragma unroll
+        for (int i = 0; i < N; ++i) dst[i] = (dst[i] - mean_val) * invvar_val;
+    }
+};
+
+// Row-wise backward from x_hat:
+//     grad_input = invvar * (g - mean(g) - x_hat * mean(g * x_hat)),  g = gamma * dout,
+// and grad_gamma = sum(dout * x_hat), grad_beta = sum(dout) over the rows. XHAT_LOAD yields the
+// x_hat of a row (SavedXHatLoad, NormalizedInputLoad) and DOUT_LOAD its output gradient, which
+// may be stored in another row order (TransposedLoad) or come through an epilogue
+// (EpilogueGradLoad, AdaLNGradLoad; finish_dout runs in the first sweep); GRAD_STORE writes
+// grad_input, in the row order of x_hat (DirectStore) or remapped like it (IndexedStore).
+// Blocks walk the rows grid-stride. A column pack always belongs to the same thread,
+// which accumulates its gamma/beta partials in shared memory (pack-major, like the forward's
+// row cache) without atomics; the block's partials go to part_grad_gamma/part_grad_beta
+// [blockIdx.x] (nullptr: no parameter).
+template <int PACK, typename P, typename DOUT_LOAD, typename XHAT_LOAD, typename GRAD_STORE>
+__global__ void __launch_bounds__(kBlockPerRowThreads)
+LayerNormBackwardRowwise(DOUT_LOAD dout, XHAT_LOAD xhat, const float* __restrict__ invvar,
+                         const P* __restrict__ gamma, long rows, long cols, GRAD_STORE grad_input,
+                         float* __restrict__ part_grad_gamma, float* __restrict__ part_grad_beta) {
+    const long num_packs = cols / PACK;
+    float* dgamma = shared_data;
+    float* dbeta = shared_data + cols;
+    for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            dgamma[i * num_packs + pack] = 0.f;
+            dbeta[i * num_packs + pack] = 0.f;
+        }
+    }
+
+    for (long row = blockIdx.x; row < rows; row += gridDim.x) {
+        float sum_gamma_dout = 0.f;
+        float sum_gamma_dout_xhat = 0.f;
+        for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+            const long col = pack * PACK;
+            float dout_vals[PACK], xhat_vals[PACK], gamma_vals[PACK];
+            dout.template load<PACK>(dout_vals, row, col);
+            xhat.template load<PACK>(xhat_vals, row, col);
+            finish_dout<PACK>(dout, xhat_vals, row, col);
+            if (gamma != nullptr) load_params<PACK>(gamma_vals, gamma + col);
+#pragma unroll
+            for (int i = 0; i < PACK; ++i) {
+                const float gamma_dout =
+                    gamma != nullptr ? dout_vals[i] * gamma_vals[i] : dout_vals[i];
+                sum_gamma_dout += gamma_dout;
+                sum_gamma_dout_xhat += gamma_dout * xhat_vals[i];
+                dgamma[i * num_packs + pack] += dout_vals[i] * xhat_vals[i];
+                dbeta[i * num_packs + pack] += dout_vals[i];
+            }
+        }
+        sum_gamma_dout = BlockAllReduceSum(sum_gamma_dout);
+        sum_gamma_dout_xhat = BlockAllReduceSum(sum_gamma_dout_xhat);
+
+        const float invvar_val = invvar[row];
+        const float k1 = sum_gamma_dout / cols;
+        const float k2 = sum_gamma_dout_xhat / cols;
+        for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+            const long col = pack * PACK;
+            float dout_vals[PACK], xhat_vals[PACK], gamma_vals[PACK], grad_vals[PACK];
+            dout.template load<PACK>(dout_vals, row, col);
+            xhat.template load<PACK>(xhat_vals, row, col);
+            if (gamma != nullptr) load_params<PACK>(gamma_vals, gamma + col);
+#pragma unroll
+            for (int i = 0; i < PACK; ++i) {
+                const float gamma_dout =
+                    gamma != nullptr ? dout_vals[i] * gamma_vals[i] : dout_vals[i];
+                grad_vals[i] = invvar_val * (gamma_dout - k1 - xhat_vals[i] * k2);
+            }
+            grad_input.template store<PACK>(grad_vals, row, col);
+        }
+    }
+
+    for (long pack = threadIdx.x; pack < num_packs; pack += blockDim.x) {
+#pragma unroll
+        for (int i = 0; i < PACK; ++i) {
+            const long col = pack * PACK + i;
+            if (part_grad_gamma != nullptr) {
+                part_grad_gamma[blockIdx.x * cols + col] = dgamma[i * num_packs + pack];
+            }
+            if (part_grad_beta != nullptr) {
+                part_grad_beta[blockIdx.x * cols + col] = dbeta[i * num_packs + pack];
+            }
+        }
+    }
+}
+
+// Launches LayerNormBackwardRowwise and the gamma/beta reduction of its partials. ptrs lists
+// every pointer the load and store functors access; the pack is the widest all allow.
+template <typename T, typename P, typename DOUT_LOAD, typename XHAT_LOAD, typename GRAD_STORE>
+void LaunchLayerNormBackwardRowwise(const DOUT_LOAD& dout, const XHAT_LOAD& xhat,
+                                    std::initializer_list<const void*> ptrs,
+                                    const float* invvar, const at::Tensor& like, long rows,
+                                    long cols, const P* gamma, const P* beta,
+                                    const GRAD_STORE& grad_input, P* grad_gamma, P* grad_beta,
+                                    cudaStream_t stream) {
+    TORCH_CHECK(cols <= kRowwiseBackwardMaxCols, "this LayerNorm backward supports rows of at ",
+                "most ", kRowwiseBackwardMaxCols, " elements, got ", cols);
+    const int pack_size = GetPackSize<T>(cols, ptrs);
+    DispatchPackSize<T>(pack_size, [&](auto pack) {
+        constexpr int PACK = decltype(pack)::value;
+        const int threads = block_per_row_threads(cols / PACK);
+        const int part_size =
+            static_cast<int>(std::max(1L, std::min<long>(rows, max_resident_blocks(threads))));
+        const int64_t part_numel = int64_t(part_size) * cols;
+        at::Tensor part_grad = ParamGradWorkspace(like, 2 * part_numel);
+        float* part_gamma_ptr = gamma != nullptr ? part_grad.data_ptr<float>() : nullptr;
+        float* part_beta_ptr = beta != nullptr ? part_grad.data_ptr<float>() + part_numel : nullptr;
+        const size_t shared_bytes = 2 * cols * sizeof(float);
+        OptInDynamicSharedMemory(
+            LayerNormBackwardRowwise<PACK, P, DOUT_LOAD, XHAT_LOAD, GRAD_STORE>, shared_bytes);
+        LayerNormBackwardRowwise<PACK, P>
+            <<<dim3(part_size), threads, shared_bytes, stream>>>(
+                dout, xhat, invvar, gamma, rows, cols, grad_input, part_gamma_ptr,
+                part_beta_ptr);
+        LaunchParamGradStep2<P>(part_gamma_ptr, part_beta_ptr, part_size, int(cols), grad_gamma,
+                                grad_beta, stream);
+    });
+    RecordLaunch("rowwise");
+}
+
+// Backward of cuda_layer_norm_save_xhat from the saved xhat and invvar; the input and mean
+// are not read.
+void cuda_layer_norm_gradient_from_xhat(at::Tensor* dout, at::Tensor* xhat, at::Tensor* invvar,
+                                        int64_t rows, int64_t cols, at::Tensor* gamma,
+                                        at::Tensor* beta, at::Tensor* grad_input,
+                                        at::Tensor* grad_gamma, at::Tensor* grad_beta) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : dout->scalar_type();
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        dout->scalar_type(), param_type, "cuda_layer_norm_gradient_from_xhat",
+        DispatchSavedXHatType(xhat->scalar_type(), [&](auto saved) {
+            using S = decltype(saved);
+            const scalar_t* dout_ptr = dout->DATA_PTR<scalar_t>();
+            const S* xhat_ptr = static_cast<const S*>(xhat->data_ptr());
+            scalar_t* grad_input_ptr = grad_input->DATA_PTR<scalar_t>();
+            LaunchLayerNormBackwardRowwise<scalar_t, param_t>(
+                DirectLoad<scalar_t>{dout_ptr, cols}, SavedXHatLoad<S>{xhat_ptr, cols},
+                {dout_ptr, xhat_ptr, grad_input_ptr}, invvar->DATA_PTR<float>(), *dout, rows,
+                cols, gamma != NULL ? gamma->DATA_PTR<param_t>() : NULL,
+                beta != NULL ? beta->DATA_PTR<param_t>() : NULL,
+                DirectStore<scalar_t>{grad_input_ptr, cols},
+                gamma != NULL ? grad_gamma->DATA_PTR<param_t>() : NULL,
+                beta != NULL ? grad_beta->DATA_PTR<param_t>() : NULL, stream);
+        }););
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// Backward of cuda_layer_norm_transposed: dout is in the transposed [B, J, I] row order, the
+// input, statistics and grad_input in the [B, I, J] order of the forward's input.
+void cuda_layer_norm_gradient_transposed(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                         at::Tensor* input, int64_t dim_i, int64_t dim_j,
+                                         int64_t cols, at::Tensor* gamma, at::Tensor* beta,
+                                         at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                         at::Tensor* grad_beta) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const long rows = cols > 0 ? input->numel() / cols : 0;
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        input->scalar_type(), param_type, "cuda_layer_norm_gradient_transposed",
+        const scalar_t* dout_ptr = dout->DATA_PTR<scalar_t>();
+        const scalar_t* input_ptr = input->DATA_PTR<scalar_t>();
+        scalar_t* grad_input_ptr = grad_input->DATA_PTR<scalar_t>();
+        const TransposedLoad<DirectLoad<scalar_t>> dout_load{{dout_ptr, cols},
+                                                             {dim_i, dim_j}};
+        const NormalizedInputLoad<scalar_t> xhat_load{
+            {input_ptr, cols}, mean->DATA_PTR<float>(), invvar->DATA_PTR<float>()};
+        LaunchLayerNormBackwardRowwise<scalar_t, param_t>(
+            dout_load, xhat_load, {dout_ptr, input_ptr, grad_input_ptr},
+            invvar->DATA_PTR<float>(), *input, rows, cols,
+            gamma != NULL ? gamma->DATA_PTR<param_t>() : NULL,
+            beta != NULL ? beta->DATA_PTR<param_t>() : NULL,
+            DirectStore<scalar_t>{grad_input_ptr, cols},
+            gamma != NULL ? grad_gamma->DATA_PTR<param_t>() : NULL,
+            beta != NULL ? grad_beta->DATA_PTR<param_t>() : NULL, stream););
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// Backward of cuda_layer_norm_indexed, launched over the active rows only: dout, the input and
+// grad_input are accessed at row_index[r], the compact statistics at r. The inactive rows of
+// grad_input are not written (the caller zeroes them). Returns false, launching nothing, for
+// rows wider than the row-wise backward supports.
+bool cuda_layer_norm_gradient_indexed(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                      at::Tensor* input, at::Tensor* row_index, int64_t cols,
+                                      at::Tensor* gamma, at::Tensor* beta,
+                                      at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                      at::Tensor* grad_beta) {
+    if (cols > kRowwiseBackwardMaxCols) return false;
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const long active_rows = row_index->numel();
+    const long rows = input->numel() / cols;
+    const at::ScalarType param_type =
+        gamma ? gamma->scalar_type() : beta ? beta->scalar_type() : input->scalar_type();
+    DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(
+        input->scalar_type(), param_type, "cuda_layer_norm_gradient_indexed",
+        const scalar_t* dout_ptr = dout->DATA_PTR<scalar_t>();
+        const scalar_t* input_ptr = input->DATA_PTR<scalar_t>();
+        scalar_t* grad_input_ptr = grad_input->DATA_PTR<scalar_t>();
+        const int64_t* row_index_ptr = row_index->data_ptr<int64_t>();
+        const IndexedLoad<DirectLoad<scalar_t>> dout_load{
+            {dout_ptr, cols}, row_index_ptr, rows};
+        const NormalizedInputLoad<scalar_t, IndexedLoad<DirectLoad<scalar_t>>> xhat_load{
+            {{input_ptr, cols}, row_index_ptr, rows}, mean->DATA_PTR<float>(),
+            invvar->DATA_PTR<float>()};
+        const IndexedStore<DirectStore<scalar_t>> grad_store{
+            {grad_input_ptr, cols}, row_index_ptr, rows};
+        LaunchLayerNormBackwardRowwise<scalar_t, param_t>(
+            dout_load, xhat_load, {dout_ptr, input_ptr, grad_input_ptr},
+            invvar->DATA_PTR<float>(), *input, active_rows, cols,
+            gamma != NULL ? gamma->DATA_PTR<param_t>() : NULL,
+            beta != NULL ? beta->DATA_PTR<param_t>() : NULL, grad_store,
+            gamma != NULL ? grad_gamma->DATA_PTR<param_t>() : NULL,
+            beta != NULL ? grad_beta->DATA_PTR<param_t>() : NULL, stream););
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    return true;
+}
+
+// Backward of cuda_rms_norm. grad_gamma reuses the LayerNorm gamma reduction with a zero mean.
+void cuda_rms_norm_gradient(at::Tensor* dout, at::Tensor* invvar, at::Tensor* input, int64_t rows,
+                            int64_t cols, at::Tensor* gamma, at::Tensor* grad_input,
+                            at::Tensor* grad_gamma) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const V2LaunchConfig config = GetV2LaunchConfig(rows, cols, input->element_size());
+    RecordLaunch("rms_v2", config);
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_rms_norm_gradient",
+        const scalar_t* dout_ptr = static_cast<const scalar_t*>(dout->data_ptr());
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        const scalar_t* gamma_ptr =
+            gamma ? static_cast<const scalar_t*>(gamma->data_ptr()) : nullptr;
+        const float* invvar_ptr = invvar->data_ptr<float>();
+        if (gamma != NULL) {
+            const int part_size = GetGirdDimY<scalar_t, scalar_t>(rows, cols, input->get_device());
+            const int grid_dim_x = (cols + tile_size - 1) / tile_size;
+            at::Tensor part_grad_gamma =
+                at::empty({part_size, cols}, input->options().dtype(at::ScalarType::Float));
+            LayerNormGammaGradStep1<scalar_t, scalar_t>
+                <<<dim3(grid_dim_x, part_size), dim3(32, 32 / num_per_block), 0, stream>>>(
+                    rows, cols, dout_ptr, input_ptr, nullptr, invvar_ptr,
+                    part_grad_gamma.DATA_PTR<float>());
+            LaunchParamGradStep2<scalar_t>(part_grad_gamma.DATA_PTR<float>(), nullptr, part_size,
+                                           cols, static_cast<scalar_t*>(grad_gamma->data_ptr()),
+                                           nullptr, stream);
+        }
+        DispatchVecType<scalar_t>(config.vec_size, [&](auto vec) {
+            RMSNormInputGradV2<scalar_t, decltype(vec)><<<config.grid, config.block, 0, stream>>>(
+                dout_ptr, input_ptr, long(rows), long(cols), invvar_ptr, gamma_ptr,
+                static_cast<scalar_t*>(grad_input->data_ptr()));
+        });)
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// grad_affine receives the gradient w.r.t. the LayerNorm output before the epilogue, grad_gate
+// (if gate != NULL) the gradient w.r.t. the gate. rng_state is the one the forward wrote.
+// The first half of the two-pass backward for rows too wide for
+// cuda_layer_norm_epilogue_gradient.
+void cuda_layer_norm_epilogue_backward(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                       at::Tensor* input, int64_t rows, int64_t cols, at::Tensor* gamma,
+                                       at::Tensor* beta, at::Tensor* row_mask, at::Tensor* gate,
+                                       double dropout_p, at::Tensor* rng_state,
+                                       at::Tensor* grad_affine, at::Tensor* grad_gate) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    at::PhiloxCudaState philox;
+    if (dropout_threshold(dropout_p) != 0) {
+        // Read the seed/offset from device memory, so no host sync is needed.
+        int64_t* rng_state_ptr = rng_state->data_ptr<int64_t>();
+        philox = at::PhiloxCudaState(rng_state_ptr, rng_state_ptr + 1, 0);
+    }
+    const auto* props = at::cuda::getCurrentDeviceProperties();
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_layer_norm_epilogue_backward",
+        const scalar_t* dout_ptr = static_cast<const scalar_t*>(dout->data_ptr());
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        const scalar_t* gamma_ptr = gamma ? static_cast<const scalar_t*>(gamma->data_ptr()) : nullptr;
+        const scalar_t* beta_ptr = beta ? static_cast<const scalar_t*>(beta->data_ptr()) : nullptr;
+        scalar_t* grad_affine_ptr = static_cast<scalar_t*>(grad_affine->data_ptr());
+        scalar_t* grad_gate_ptr = gate ? static_cast<scalar_t*>(grad_gate->data_ptr()) : nullptr;
+        const Epilogue<scalar_t> epilogue =
+            make_epilogue<scalar_t>(row_mask, gate, cols, dropout_p, philox);
+        const int pack_size = GetPackSize<scalar_t>(
+            cols, {dout_ptr, input_ptr, gamma_ptr, beta_ptr, epilogue.gate, grad_affine_ptr,
+                   grad_gate_ptr});
+        DispatchPackSize<scalar_t>(pack_size, [&](auto pack) {
+            constexpr int PACK = decltype(pack)::value;
+            constexpr int kThreads = 256;
+            const long num_packs = long(rows) * (cols / PACK);
+            const long max_blocks = static_cast<long>(props->multiProcessorCount) *
+                                    (props->maxThreadsPerMultiProcessor / kThreads);
+            const long blocks = std::max(1L, std::min((num_packs + kThreads - 1) / kThreads,
+                                                      max_blocks));
+            LayerNormEpilogueBackward<PACK, scalar_t><<<dim3(blocks), kThreads, 0, stream>>>(
+                dout_ptr, input_ptr, mean->data_ptr<float>(), invvar->data_ptr<float>(),
+                gamma_ptr, beta_ptr, epilogue, long(rows), long(cols), grad_affine_ptr,
+                grad_gate_ptr);
+        });)
+    RecordLaunch("epilogue_backward");
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// Backward of cuda_layer_norm_epilogue in one sweep: the LayerNorm backward reads dout
+// through EpilogueGradLoad, so the gradient of the affine output is never stored, and writes
+// grad_gate (if gate != NULL) as it visits the rows. Uses the fused register-cached backward
+// where it applies and the row-wise backward for the other widths; returns false, launching
+// nothing, for rows wider than the latter supports (see cuda_layer_norm_epilogue_backward).
+bool cuda_layer_norm_epilogue_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                       at::Tensor* input, int64_t rows, int64_t cols,
+                                       at::Tensor* gamma, at::Tensor* beta, at::Tensor* row_mask,
+                                       at::Tensor* gate, double dropout_p, at::Tensor* rng_state,
+                                       at::Tensor* grad_input, at::Tensor* grad_gamma,
+                                       at::Tensor* grad_beta, at::Tensor* grad_gate) {
+    if (cols > kRowwiseBackwardMaxCols) return false;
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    at::PhiloxCudaState philox;
+    if (dropout_threshold(dropout_p) != 0) {
+        int64_t* rng_state_ptr = rng_state->data_ptr<int64_t>();
+        philox = at::PhiloxCudaState(rng_state_ptr, rng_state_ptr + 1, 0);
+    }
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_layer_norm_epilogue_gradient",
+        const scalar_t* dout_ptr = static_cast<const scalar_t*>(dout->data_ptr());
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        const scalar_t* gamma_ptr =
+            gamma ? static_cast<const scalar_t*>(gamma->data_ptr()) : nullptr;
+        const scalar_t* beta_ptr =
+            beta ? static_cast<const scalar_t*>(beta->data_ptr()) : nullptr;
+        scalar_t* grad_input_ptr = static_cast<scalar_t*>(grad_input->data_ptr());
+        scalar_t* grad_gamma_ptr = gamma ? static_cast<scalar_t*>(grad_gamma->data_ptr()) : nullptr;
+        scalar_t* grad_beta_ptr = beta ? static_cast<scalar_t*>(grad_beta->data_ptr()) : nullptr;
+        scalar_t* grad_gate_ptr = gate ? static_cast<scalar_t*>(grad_gate->data_ptr()) : nullptr;
+        const float* mean_ptr = mean->data_ptr<float>();
+        const float* invvar_ptr = invvar->data_ptr<float>();
+        const EpilogueGradLoad<scalar_t> dout_load{
+            dout_ptr, cols, gamma_ptr, beta_ptr,
+            make_epilogue<scalar_t>(row_mask, gate, cols, dropout_p, philox), grad_gate_ptr};
+        const bool dout_aligned = is_aligned(dout_ptr, 16) &&
+                                  (gate == NULL || (is_aligned(gate->data_ptr(), 16) &&
+                                                    is_aligned(grad_gate_ptr, 16)));
+        if (!use_block_per_row(rows, cols) &&
+            TryLayerNormBackwardFusedLoad<scalar_t, scalar_t, scalar_t>(
+                dout_load, dout_aligned, mean_ptr, invvar_ptr, *input, long(rows), long(cols),
+                gamma_ptr, beta_ptr, 0.f, grad_input_ptr, grad_gamma_ptr, grad_beta_ptr,
+                static_cast<const scalar_t*>(nullptr), stream)) {
+            RecordLaunch("fused_reg_cached");
+        } else {
+            // gamma/beta go through load_params and need no particular alignment.
+            LaunchLayerNormBackwardRowwise<scalar_t, scalar_t>(
+                dout_load, NormalizedInputLoad<scalar_t>{{input_ptr, cols}, mean_ptr, invvar_ptr},
+                {dout_ptr, input_ptr, dout_load.epilogue.gate, grad_gate_ptr, grad_input_ptr},
+                invvar_ptr, *input, long(rows), long(cols), gamma_ptr, beta_ptr,
+                DirectStore<scalar_t>{grad_input_ptr, cols}, grad_gamma_ptr, grad_beta_ptr,
+                stream);
+        });
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    return true;
+}
+
+// Backward of cuda_ada_layer_norm in one sweep: the unaffine LayerNorm backward reads dout
+// through AdaLNGradLoad and writes grad_scale as it visits the rows, the same kernel choice as
+// cuda_layer_norm_epilogue_gradient. Returns false, launching nothing, for rows wider than the
+// row-wise backward supports (see cuda_ada_layer_norm_backward).
+bool cuda_ada_layer_norm_gradient(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                  at::Tensor* input, int64_t rows, int64_t cols,
+                                  at::Tensor* scale, at::Tensor* grad_input,
+                                  at::Tensor* grad_scale) {
+    if (cols > kRowwiseBackwardMaxCols) return false;
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_ada_layer_norm_gradient",
+        const scalar_t* dout_ptr = static_cast<const scalar_t*>(dout->data_ptr());
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        const scalar_t* scale_ptr = static_cast<const scalar_t*>(scale->data_ptr());
+        scalar_t* grad_input_ptr = static_cast<scalar_t*>(grad_input->data_ptr());
+        scalar_t* grad_scale_ptr = static_cast<scalar_t*>(grad_scale->data_ptr());
+        scalar_t* no_param_grad = nullptr;
+        const float* mean_ptr = mean->data_ptr<float>();
+        const float* invvar_ptr = invvar->data_ptr<float>();
+        const AdaLNGradLoad<scalar_t> dout_load{dout_ptr, cols, scale_ptr, grad_scale_ptr};
+        const bool dout_aligned = is_aligned(dout_ptr, 16) && is_aligned(scale_ptr, 16) &&
+                                  is_aligned(grad_scale_ptr, 16);
+        if (!use_block_per_row(rows, cols) &&
+            TryLayerNormBackwardFusedLoad<scalar_t, scalar_t, scalar_t>(
+                dout_load, dout_aligned, mean_ptr, invvar_ptr, *input, long(rows), long(cols),
+                static_cast<const scalar_t*>(nullptr), static_cast<const scalar_t*>(nullptr),
+                0.f, grad_input_ptr, no_param_grad, no_param_grad,
+                static_cast<const scalar_t*>(nullptr), stream)) {
+            RecordLaunch("fused_reg_cached");
+        } else {
+            LaunchLayerNormBackwardRowwise<scalar_t, scalar_t>(
+                dout_load, NormalizedInputLoad<scalar_t>{{input_ptr, cols}, mean_ptr, invvar_ptr},
+                {dout_ptr, input_ptr, scale_ptr, grad_scale_ptr, grad_input_ptr}, invvar_ptr,
+                *input, long(rows), long(cols), static_cast<const scalar_t*>(nullptr),
+                static_cast<const scalar_t*>(nullptr), DirectStore<scalar_t>{grad_input_ptr, cols},
+                no_param_grad, no_param_grad, stream);
+        });
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+    return true;
+}
+
+void cuda_ada_layer_norm_backward(at::Tensor* dout, at::Tensor* mean, at::Tensor* invvar,
+                                  at::Tensor* input, int64_t rows, int64_t cols,
+                                  at::Tensor* scale, at::Tensor* grad_normalized,
+                                  at::Tensor* grad_scale) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        input->scalar_type(), "cuda_ada_layer_norm_backward",
+        const scalar_t* dout_ptr = static_cast<const scalar_t*>(dout->data_ptr());
+        const scalar_t* input_ptr = static_cast<const scalar_t*>(input->data_ptr());
+        const scalar_t* scale_ptr = static_cast<const scalar_t*>(scale->data_ptr());
+        scalar_t* grad_normalized_ptr = static_cast<scalar_t*>(grad_normalized->data_ptr());
+        scalar_t* grad_scale_ptr = static_cast<scalar_t*>(grad_scale->data_ptr());
+        const int pack_size = GetPackSize<scalar_t>(
+            cols, {dout_ptr, input_ptr, scale_ptr, grad_normalized_ptr, grad_scale_ptr});
+        DispatchPackSize<scalar_t>(pack_size, [&](auto pack) {
+            constexpr int PACK = decltype(pack)::value;
+            constexpr int kThreads = 256;
+            const long num_packs = long(rows) * (cols / PACK);
+            const long blocks = std::max(1L, std::min((num_packs + kThreads - 1) / kThreads,
+                                                      max_resident_blocks(kThreads)));
+            AdaLayerNormBackward<PACK, scalar_t><<<dim3(blocks), kThreads, 0, stream>>>(
+                dout_ptr, input_ptr, mean->data_ptr<float>(), invvar->data_ptr<float>(),
+                scale_ptr, long(rows), long(cols), grad_normalized_ptr, grad_scale_ptr);
+        });)
+    RecordLaunch("ada_backward");
+    C10_CUDA_KERNEL_LAUNCH_CHECK();
+}
+
+// Grouped LayerNorm: many small, independent norms over the last dimension, each with its
+// own width, gamma, beta and epsilon, in one launch. At small token counts these norms take a
+// few microseconds each, so one launch per norm is mostly launch overhead. The work
+// descriptors are passed by value as a kernel argument: a launch needs no host-to-device copy
+// and can be captured in a CUDA graph. Every row is handled by one warp.
+constexpr int kGroupedMaxTasks = 24;  // keeps GroupedLayerNormArgs well below 4 KB
+constexpr int kGroupedThreads = 256;
+constexpr int kGroupedWarps = kGroupedThreads / WarpSize;
+constexpr int kGroupedParamGradRows = 8;  // blockDim.y of the gamma/beta reduction
+
+template <typename T>
+struct GroupedLayerNormTask {
+    const T* input;
+    const T* dout;  // backward only
+    const T* gamma;
+    const T* beta;
+    T* output;  // forward output, or grad_input in the backward
+    T* grad_gamma;
+    T* grad_beta;
+    float* mean;
+    float* invvar;
+    long rows;
+    long cols;
+    long first_row;   // of this task in the rows of the whole launch
+    long first_tile;  // of this task in the column tiles of the gamma/beta reduction
+    float epsilon;
+};
+
+template <typename T>
+struct GroupedLayerNormArgs {
+    GroupedLayerNormTask<T> tasks[kGroupedMaxTasks];
+    int num_tasks;
+    long total_rows;
+    long total_tiles;
+};
+
+// The task owning work item `index`, where `first` gives the first item of every task.
+// Tasks without items share their offset with the next task and are skipped. There are few
+// tasks, so a linear scan is cheapest.
+template <typename T>
+__device__ __forceinline__ const GroupedLayerNormTask<T>& grouped_task(
+    const GroupedLayerNormArgs<T>& args, long GroupedLayerNormTask<T>::*first, long index) {
+    int t = 0;
+    while (t + 1 < args.num_tasks && index >= args.tasks[t + 1].*first) ++t;
+    return args.tasks[t];
+}
+
+template <typename T>
+__device__ __forceinline__ void GroupedRowStats(const T* x, long cols, float epsilon,
+                                                float* row_mean, float* row_invvar) {
+    float thread_mean = 0.f, thread_m2 = 0.f, thread_count = 0.f;
+    for (long c = threadIdx.x % WarpSize; c < cols; c += WarpSize) {
+        WelfordOnline(static_cast<float>(x[c]), &thread_mean, &thread_m2, &thread_count);
+    }
+    float m2, count;
+    WelfordWarpAllReduce(thread_mean, thread_m2, thread_count, row_mean, &m2, &count);
+    *row_invvar = rsqrtf(max(m2 / count, 0.f) + epsilon);
+}
+
+template <typename T>
+__global__ void __launch_bounds__(kGroupedThreads)
+GroupedLayerNormForward(const GroupedLayerNormArgs<T> args) {
+    const int lane = threadIdx.x % WarpSize;
+    for (long row = static_cast<long>(blockIdx.x) * kGroupedWarps + threadIdx.x / WarpSize;
+         row < args.total_rows; row += static_cast<long>(gridDim.x) * kGroupedWarps) {
+        const GroupedLayerNormTask<T>& task =
+            grouped_task(args, &GroupedLayerNormTask<T>::first_row, row);
+        const long r = row - task.first_row;
+        const T* x = task.input + r * task.cols;
+        T* y = task.output + r * task.cols;
+        float row_mean, row_invvar;
+        GroupedRowStats(x, task.cols, task.epsilon, &row_mean, &row_invvar);
+        if (lane == 0) {
+            task.mean[r] = row_mean;
+            task.invvar[r] = row_invvar;
+        }
+        for (long c = lane; c < task.cols; c += WarpSize) {
+            float v = (static_cast<float>(x[c]) - row_mean) * row_invvar;
+            if (task.gamma != nullptr) v *= static_cast<float>(task.gamma[c]);
+            if (task.beta != nullptr) v += static_cast<float>(task.beta[c]);
+            y[c] = static_cast<T>(v);
+        }
+    }
+}
+
+template <typename T>
+__global__ void __launch_bounds__(kGroupedThreads)
+GroupedLayerNormInputGrad(const GroupedLayerNormArgs<T> args) {
+    const int lane = threadIdx.x % WarpSize;
+    for (long row = static_cast<long>(blockIdx.x) * kGroupedWarps + threadIdx.x / WarpSize;
+         row < args.total_rows; row += static_cast<long>(gridDim.x) * kGroupedWarps) {
+        const GroupedLayerNormTask<T>& task =
+            grouped_task(args, &GroupedLayerNormTask<T>::first_row, row);
+        const long r = row - task.first_row;
+        const T* x = task.input + r * task.cols;
+        const T* dy = task.dout + r * task.cols;
+        T* dx = task.output + r * task.cols;
+        const float row_mean = task.mean[r];
+        const float row_invvar = task.invvar[r];
+        float sum_dy = 0.f, sum_dy_xhat = 0.f;
+        for (long c = lane; c < task.cols; c += WarpSize) {
+            float g = static_cast<float>(dy[c]);
+            if (task.gamma != nullptr) g *= static_cast<float>(task.gamma[c]);
+            sum_dy += g;
+            sum_dy_xhat += g * (static_cast<float>(x[c]) - row_mean) * row_invvar;
+        }
+        warp_sum_reduce(sum_dy, WarpSize);
+        warp_sum_reduce(sum_dy_xhat, WarpSize);
+        const float inv_cols = 1.f / task.cols;
+        for (long c = lane; c < task.cols; c += WarpSize) {
+            float g = static_cast<float>(dy[c]);
+            if (task.gamma != nullptr) g *= static_cast<float>(task.gamma[c]);
+            const float x_hat = (static_cast<float>(x[c]) - row_mean) * row_invvar;
+            dx[c] = static_cast<T>(row_invvar * (g - (sum_dy + x_hat * sum_dy_xhat) * inv_cols));
+        }
+    }
+}
+
+// grad_gamma and grad_beta of every task with parameters: one block per tile of WarpSize
+// columns sums all rows of its task. The grouped launch is meant for small norms, whose row
+// counts keep this single pass short.
+template <typename T>
+__global__ void GroupedLayerNormParamGrad(const GroupedLayerNormArgs<T> args) {
+    __shared__ float gamma_part[kGroupedParamGradRows][WarpSize + 1];
+    __shared__ float beta_part[kGroupedParamGradRows][WarpSize + 1];
+    for (long tile = blockIdx.x; tile < args.total_tiles; tile += gridDim.x) {
+        const GroupedLayerNormTask<T>& task =
+            grouped_task(args, &GroupedLayerNormTask<T>::first_tile, tile);
+        const long col = (tile - task.first_tile) * WarpSize + threadIdx.x;
+        float sum_gamma = 0.f, sum_beta = 0.f;
+        if (col < task.cols) {
+            for (long r = threadIdx.y; r < task.rows; r += blockDim.y) {
+                const long offset = r * task.cols + col;
+                const float dy = static_cast<float>(task.dout[offset]);
+                sum_beta += dy;
+                sum_gamma += dy * (static_cast<float>(task.input[offset]) - task.mean[r]) *
+                             task.invvar[r];
+            }
+        }
+        gamma_part[threadIdx.y][threadIdx.x] = sum_gamma;
+        beta_part[threadIdx.y][threadIdx.x] = sum_beta;
+        __syncthreads();
+        if (threadIdx.y == 0 && col < task.cols) {
+            for (int i = 1; i < blockDim.y; ++i) {
+                sum_gamma += gamma_part[i][threadIdx.x];
+                sum_beta += beta_part[i][threadIdx.x];
+            }
+            if (task.grad_gamma != nullptr) task.grad_gamma[col] = static_cast<T>(sum_gamma);
+            if (task.grad_beta != nullptr) task.grad_beta[col] = static_cast<T>(sum_beta);
+        }
+        __syncthreads();
+    }
+}
+
+// Fills the descriptors of tasks [begin, end) and returns them with their row and tile
+// offsets; pointer fields of tensors that are not given stay null.
+template <typename T>
+GroupedLayerNormArgs<T> MakeGroupedLayerNormArgs(const std::vector<at::Tensor>& inputs,
+                                                 const std::vector<double>& epsilons,
+                                                 size_t begin, size_t end) {
+    GroupedLayerNormArgs<T> args = {};
+    args.num_tasks = static_cast<int>(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+        GroupedLayerNormTask<T>& task = args.tasks[i - begin];
+        task.input = static_cast<const T*>(inputs[i].data_ptr());
+        task.cols = inputs[i].size(-1);
+        task.rows = task.cols == 0 ? 0 : inputs[i].numel() / task.cols;
+        task.first_row = args.total_rows;
+        task.epsilon = static_cast<float>(epsilons[i]);
+        args.total_rows += task.rows;
+    }
+    return args;
+}
+
+inline long grouped_blocks(long total_rows) {
+    return std::max(1L, std::min((total_rows + kGroupedWarps - 1) / kGroupedWarps,
+                                 max_resident_blocks(kGroupedThreads)));
+}
+
+template <typename T>
+const T* optional_ptr(const at::Tensor* t) {
+    return t != nullptr ? static_cast<const T*>(t->data_ptr()) : nullptr;
+}
+
+void cuda_grouped_layer_norm(const std::vector<at::Tensor>& inputs,
+                             const std::vector<at::Tensor*>& gammas,
+                             const std::vector<at::Tensor*>& betas,
+                             const std::vector<double>& epsilons, std::vector<at::Tensor>& outputs,
+                             std::vector<at::Tensor>& means, std::vector<at::Tensor>& invvars) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    RecordLaunch("grouped");
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        inputs[0].scalar_type(), "cuda_grouped_layer_norm",
+        for (size_t begin = 0; begin < inputs.size(); begin += kGroupedMaxTasks) {
+            const size_t end = std::min(inputs.size(), begin + kGroupedMaxTasks);
+            GroupedLayerNormArgs<scalar_t> args =
+                MakeGroupedLayerNormArgs<scalar_t>(inputs, epsilons, begin, end);
+            for (size_t i = begin; i < end; ++i) {
+                GroupedLayerNormTask<scalar_t>& task = args.tasks[i - begin];
+                task.gamma = optional_ptr<scalar_t>(gammas[i]);
+                task.beta = optional_ptr<scalar_t>(betas[i]);
+                task.output = static_cast<scalar_t*>(outputs[i].data_ptr());
+                task.mean = means[i].data_ptr<float>();
+                task.invvar = invvars[i].data_ptr<float>();
+            }
+            if (args.total_rows == 0) continue;
+            GroupedLayerNormForward<scalar_t>
+                <<<grouped_blocks(args.total_rows), kGroupedThreads, 0, stream>>>(args);
+            C10_CUDA_KERNEL_LAUNCH_CHECK();
+        })
+}
+
+// grad_gammas[i] / grad_betas[i] are null exactly when task i has no gamma / beta.
+void cuda_grouped_layer_norm_gradient(
+    const std::vector<at::Tensor>& douts, const std::vector<at::Tensor>& means,
+    const std::vector<at::Tensor>& invvars, const std::vector<at::Tensor>& inputs,
+    const std::vector<at::Tensor*>& gammas, const std::vector<double>& epsilons,
+    std::vector<at::Tensor>& grad_inputs, const std::vector<at::Tensor*>& grad_gammas,
+    const std::vector<at::Tensor*>& grad_betas) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    RecordLaunch("grouped");
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(
+        inputs[0].scalar_type(), "cuda_grouped_layer_norm_gradient",
+        for (size_t begin = 0; begin < inputs.size(); begin += kGroupedMaxTasks) {
+            const size_t end = std::min(inputs.size(), begin + kGroupedMaxTasks);
+            GroupedLayerNormArgs<scalar_t> args =
+                MakeGroupedLayerNormArgs<scalar_t>(inputs, epsilons, begin, end);
+            for (size_t i = begin; i < end; ++i) {
+                GroupedLayerNormTask<scalar_t>& task = args.tasks[i - begin];
+                task.dout = static_cast<const scalar_t*>(douts[i].data_ptr());
+                task.gamma = optional_ptr<scalar_t>(gammas[i]);
+                task.output = static_cast<scalar_t*>(grad_inputs[i].data_ptr());
+                task.grad_gamma = grad_gammas[i] != nullptr
+                                      ? static_cast<scalar_t*>(grad_gammas[i]->data_ptr())
+                                      : nullptr;
+                task.grad_beta = grad_betas[i] != nullptr
+                                     ? static_cast<scalar_t*>(grad_betas[i]->data_ptr())
+                                     : nullptr;
+                task.mean = const_cast<float*>(means[i].data_ptr<float>());
+                task.invvar = const_cast<float*>(invvars[i].data_ptr<float>());
+                task.first_tile = args.total_tiles;
+                if (task.grad_gamma != nullptr || task.grad_beta != nullptr) {
+                    args.total_tiles += (task.cols + WarpSize - 1) / WarpSize;
+                }
+            }
+            if (args.total_rows > 0) {
+                GroupedLayerNormInputGrad<scalar_t>
+                    <<<grouped_blocks(args.total_rows), kGroupedThreads, 0, stream>>>(args);
+                C10_CUDA_KERNEL_LAUNCH_CHECK();
+            }
+            // Also zero-fills the parameter gradients of tasks without rows.
+            if (args.total_tiles > 0) {
+                const long blocks = std::min(args.total_tiles,
+                                             max_resident_blocks(WarpSize * kGroupedParamGradRows));
+                GroupedLayerNormParamGrad<scalar_t>
+                    <<<blocks, dim3(WarpSize, kGroupedParamGradRows), 0, stream>>>(args);
+                C10_CUDA_KERNEL_LAUNCH_CHECK();
+            }
+        })
 }
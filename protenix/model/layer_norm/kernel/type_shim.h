@@ -33,6 +33,43 @@
             AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
     }
 
+#define DISPATCH_FLOAT_HALF_AND_BFLOAT(TYPE, NAME, ...)                     \
+    switch (TYPE) {                                                         \
+        case at::ScalarType::Float: {                                       \
+            using scalar_t = float;                                         \
+            __VA_ARGS__;                                                    \
+            break;                                                          \
+        }                                                                   \
+        case at::ScalarType::Half: {                                        \
+            using scalar_t = at::Half;                                      \
+            __VA_ARGS__;                                                    \
+            break;                                                          \
+        }                                                                   \
+        case at::ScalarType::BFloat16: {                                    \
+            using scalar_t = at::BFloat16;                                  \
+            __VA_ARGS__;                                                    \
+            break;                                                          \
+        }                                                                   \
+        default:                                                            \
+            AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
+    }
+
+// param_t is the type of gamma/beta: the activation type, or float for fp32 master
+// parameters next to half-precision activations.
+#define DISPATCH_FLOAT_HALF_AND_BFLOAT_WITH_PARAM_TYPE(TYPE, PARAM_TYPE, NAME, ...)      \
+    DISPATCH_FLOAT_HALF_AND_BFLOAT(TYPE, NAME, {                                        \
+        if (PARAM_TYPE == at::ScalarType::Float) {                                      \
+            using param_t = float;                                                      \
+            __VA_ARGS__;                                                                \
+        } else {                                                                        \
+            TORCH_CHECK(PARAM_TYPE == TYPE, #NAME, ": parameters of type '",            \
+                        toString(PARAM_TYPE), "' with input of type '", toString(TYPE), \
+                        "'");                                                           \
+            using param_t = scalar_t;                                                   \
+            __VA_ARGS__;                                                                \
+        }                                                                               \
+    })
+
 #define DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(TYPEIN, TYPEOUT, NAME, ...)         \
     switch (TYPEIN) {                                                                  \
         case at::ScalarType::Float: {                                                  \
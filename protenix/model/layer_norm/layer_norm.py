@@ -28,12 +28,15 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 import importlib
+import logging
+import math
 import numbers
 import os
 import sys
-from typing import Any, Optional, Union
+from typing import Any, Callable, Optional, Sequence, Union
 
 import torch
+from torch._prims_common import is_non_overlapping_and_dense
 from torch.nn.parameter import Parameter
 
 
@@ -51,19 +54,375 @@ if build_directory is None:
     sys.path.append(cache_dir)
 
 try:
-    fast_layer_norm_cuda_v2 = importlib.import_module("fast_layer_norm_cuda_v2")
+    # Built ahead of time by setup.py (pip install ., or setup.py build_ext --inplace).
+    fast_layer_norm_cuda_v2 = importlib.import_module(
+        "protenix.model.layer_norm.fast_layer_norm_cuda_v2"
+    )
 except ImportError:
-    from protenix.model.layer_norm.torch_ext_compile import compile
-
-    fast_layer_norm_cuda_v2 = compile(
-        name="fast_layer_norm_cuda_v2",
-        sources=[
-            os.path.join(f"{current_dir}/kernel", file)
-            for file in ["layer_norm_cuda.cpp", "layer_norm_cuda_kernel.cu"]
-        ],
-        extra_include_paths=[f"{current_dir}/kernel"],
-        build_directory=build_directory,
+    try:
+        # An earlier JIT build.
+        fast_layer_norm_cuda_v2 = importlib.import_module("fast_layer_norm_cuda_v2")
+    except ImportError:
+        from protenix.model.layer_norm.torch_ext_compile import (
+            EXTENSION_NAME,
+            KERNEL_DIR,
+            SOURCES,
+            compile,
+        )
+
+        logging.getLogger(__name__).warning(
+            "fast_layer_norm_cuda_v2 was not built at install time; compiling it now, "
+            "which takes a few minutes. Reinstall with CUDA available to prebuild it."
+        )
+        fast_layer_norm_cuda_v2 = compile(
+            name=EXTENSION_NAME,
+            sources=[os.path.join(KERNEL_DIR, file) for file in SOURCES],
+            extra_include_paths=[KERNEL_DIR],
+            build_directory=build_directory,
+        )
+
+from protenix.model.layer_norm.autotune import LayerNormAutotuner
+from protenix.model.layer_norm.layer_norm_linear import (
+    TRITON_LAYER_NORM_LINEAR_AVAILABLE,
+    layer_norm_linear_backward_weight,
+    layer_norm_linear_forward,
+)
+
+# Tuned launch choices live next to the compiled extension, one cache per build location.
+autotuner = LayerNormAutotuner(
+    fast_layer_norm_cuda_v2,
+    os.path.join(
+        build_directory if build_directory is not None else cache_dir,
+        "layer_norm_autotune.json",
+    ),
+)
+
+
+def _affine_params(
+    weight: Optional[torch.Tensor], bias: Optional[torch.Tensor], d: torch.dtype
+) -> tuple[Optional[torch.Tensor], Optional[torch.Tensor]]:
+    """weight and bias as the LayerNorm kernels take them.
+
+    fp32 parameters are passed as they are: the kernels read them natively next to
+    half-precision activations and return fp32 gradients. Anything else is cast to d.
+    """
+    params = [p for p in (weight, bias) if p is not None]
+    if all(p.dtype == torch.float32 for p in params):
+        return weight, bias
+    return (
+        None if weight is None else weight.to(dtype=d),
+        None if bias is None else bias.to(dtype=d),
+    )
+
+
+def _main_grads(
+    weight: Optional[torch.Tensor], bias: Optional[torch.Tensor]
+) -> Optional[tuple[Optional[torch.Tensor], Optional[torch.Tensor]]]:
+    """The fp32 main_grad buffers of weight and bias, if every given parameter has one.
+
+    Gradient-accumulation setups (Megatron-style) attach a float32 .main_grad of the
+    parameter's shape to each parameter; the backward then adds to it directly and
+    returns no gradient for the parameter, so .grad is never allocated or accumulated.
+    """
+    params = [p for p in (weight, bias) if p is not None]
+    if not params or not all(
+        getattr(p, "main_grad", None) is not None for p in params
+    ):
+        return None
+    return (
+        None if weight is None else weight.main_grad,
+        None if bias is None else bias.main_grad,
+    )
+
+
+def _accumulate_main_grads(
+    weight: Optional[torch.Tensor],
+    bias: Optional[torch.Tensor],
+    grad_weight: Optional[torch.Tensor],
+    grad_bias: Optional[torch.Tensor],
+) -> tuple[Optional[torch.Tensor], Optional[torch.Tensor]]:
+    """The weight/bias gradients a backward returns to autograd.
+
+    If the parameters have .main_grad buffers (see _main_grads), the gradients are
+    added to them here and None is returned for both; otherwise they pass through.
+    For the backward paths that do not fuse this into their final reduction.
+    """
+    main_grads = _main_grads(weight, bias)
+    if main_grads is None:
+        return grad_weight, grad_bias
+    for main_grad, grad in zip(main_grads, (grad_weight, grad_bias)):
+        if main_grad is not None:
+            main_grad.add_(grad)
+    return None, None
+
+
+def _call_partial_grad_hook(
+    hook: Callable,
+    grad_input: torch.Tensor,
+    grad_weight: Optional[torch.Tensor],
+    grad_bias: Optional[torch.Tensor],
+) -> tuple[None, None]:
+    """Hands the weight/bias gradients to a partial grad hook (see
+    FusedLayerNorm.register_partial_grad_hook) instead of to autograd."""
+    # There is no stream to wait on for CPU tensors, which are ready on return.
+    event = None
+    if grad_input.is_cuda:
+        event = torch.cuda.Event()
+        event.record()
+    hook(
+        None if grad_weight is None else grad_weight.float(),
+        None if grad_bias is None else grad_bias.float(),
+        event,
     )
+    return None, None
+
+
+def _has_dense_rows(t: torch.Tensor, normalized_ndim: int) -> bool:
+    """has_dense_rows of layer_norm_cuda.cpp: the normalized dimensions are packed
+    innermost and the rows tile the storage, in any order of the outer dimensions."""
+    if not is_non_overlapping_and_dense(t):
+        return False
+    expected_stride = 1
+    for dim in range(t.dim() - 1, t.dim() - 1 - normalized_ndim, -1):
+        if t.size(dim) != 1 and t.stride(dim) != expected_stride:
+            return False
+        expected_stride *= t.size(dim)
+    return True
+
+
+def _empty_in_layout_of(input: torch.Tensor, normalized_ndim: int) -> torch.Tensor:
+    """The layout the extension allocates its outputs in: that of input when its rows
+    are dense, contiguous otherwise (the kernels then work on a contiguous copy)."""
+    if _has_dense_rows(input, normalized_ndim):
+        return torch.empty_like(input, memory_format=torch.preserve_format)
+    return torch.empty_like(input, memory_format=torch.contiguous_format)
+
+
+# torch.ops.protenix_layer_norm.layer_norm{,_backward} are registered by the extension.
+# Their fake kernels (output shapes and strides for tracing) and the autograd formula
+# live here; FusedLayerNorm calls the op instead of FusedLayerNormAffineFunction under
+# torch.compile, so the Pairformer stack compiles without a graph break at every norm.
+@torch.library.register_fake("protenix_layer_norm::layer_norm")
+def _layer_norm_fake(
+    input: torch.Tensor,
+    normalized_shape: list[int],
+    weight: Optional[torch.Tensor],
+    bias: Optional[torch.Tensor],
+    eps: float,
+) -> tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+    rows = input.numel() // math.prod(normalized_shape)
+    mean = input.new_empty((rows,), dtype=torch.float32)
+    output = _empty_in_layout_of(input, len(normalized_shape))
+    return output, mean, torch.empty_like(mean)
+
+
+@torch.library.register_fake("protenix_layer_norm::layer_norm_backward")
+def _layer_norm_backward_fake(
+    dout: torch.Tensor,
+    mean: torch.Tensor,
+    invvar: torch.Tensor,
+    input: torch.Tensor,
+    normalized_shape: list[int],
+    weight: Optional[torch.Tensor],
+    bias: Optional[torch.Tensor],
+    eps: float,
+) -> tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+    grad_input = _empty_in_layout_of(input, len(normalized_shape))
+    grad_weight = input.new_empty((0,)) if weight is None else torch.empty_like(weight)
+    grad_bias = input.new_empty((0,)) if bias is None else torch.empty_like(bias)
+    return grad_input, grad_weight, grad_bias
+
+
+def _layer_norm_setup_context(ctx: Any, inputs: tuple, output: tuple) -> None:
+    input, normalized_shape, weight, bias, eps = inputs
+    _, mean, invvar = output
+    ctx.normalized_shape = normalized_shape
+    ctx.eps = eps
+    ctx.save_for_backward(input, weight, bias, mean, invvar)
+
+
+def _layer_norm_backward(
+    ctx: Any,
+    grad_output: torch.Tensor,
+    grad_mean: Optional[torch.Tensor],
+    grad_invvar: Optional[torch.Tensor],
+) -> tuple[Optional[torch.Tensor], ...]:
+    input, weight, bias, mean, invvar = ctx.saved_tensors
+    grad_input, grad_weight, grad_bias = (
+        torch.ops.protenix_layer_norm.layer_norm_backward(
+            grad_output.to(input.dtype),
+            mean,
+            invvar,
+            input,
+            ctx.normalized_shape,
+            weight,
+            bias,
+            ctx.eps,
+        )
+    )
+    return (
+        grad_input,
+        None,
+        None if weight is None else grad_weight,
+        None if bias is None else grad_bias,
+        None,
+    )
+
+
+torch.library.register_autograd(
+    "protenix_layer_norm::layer_norm",
+    _layer_norm_backward,
+    setup_context=_layer_norm_setup_context,
+)
+
+
+def fused_layer_norm(
+    input: torch.Tensor,
+    normalized_shape: Sequence[int],
+    weight: Optional[torch.Tensor] = None,
+    bias: Optional[torch.Tensor] = None,
+    eps: float = 1e-5,
+) -> torch.Tensor:
+    """LayerNorm through the registered custom op, traceable by torch.compile."""
+    weight, bias = _affine_params(weight, bias, input.dtype)
+    output, _, _ = torch.ops.protenix_layer_norm.layer_norm(
+        input, list(normalized_shape), weight, bias, eps
+    )
+    return output
+
+
+def fused_layer_norm_inference(
+    input: torch.Tensor,
+    normalized_shape: Sequence[int],
+    weight: Optional[torch.Tensor] = None,
+    bias: Optional[torch.Tensor] = None,
+    eps: float = 1e-5,
+    out: Optional[torch.Tensor] = None,
+) -> torch.Tensor:
+    """
+    Forward-only LayerNorm that stores no row statistics and, with out, allocates nothing.
+
+    Args:
+        out (torch.Tensor, optional) tensor the result is written into, e.g. a chunk of a
+            preallocated output; of the shape and dtype of input and, for a contiguous
+            input, contiguous. out=input normalizes in place.
+
+    Returns:
+        the normalized tensor (out, if given)
+    """
+    if torch.is_grad_enabled() and (
+        input.requires_grad
+        or any(p is not None and p.requires_grad for p in (weight, bias))
+    ):
+        raise RuntimeError("fused_layer_norm_inference does not support autograd")
+    weight, bias = _affine_params(weight, bias, input.dtype)
+    return fast_layer_norm_cuda_v2.forward_inference(
+        input, torch.Size(normalized_shape), weight, bias, eps, out
+    )
+
+
+def fused_layer_norm_streaming(
+    input: torch.Tensor,
+    normalized_shape: Sequence[int],
+    weight: Optional[torch.Tensor] = None,
+    bias: Optional[torch.Tensor] = None,
+    eps: float = 1e-5,
+    out: Optional[torch.Tensor] = None,
+    chunk_rows: Optional[int] = None,
+    device: Optional[torch.device] = None,
+) -> torch.Tensor:
+    """
+    Forward-only LayerNorm of a tensor in pinned host memory, which need not fit on the
+    GPU.
+
+    The rows are streamed through the GPU in chunks with two device buffers per
+    direction: while chunk i is normalized on the current stream, chunk i + 1 is copied
+    in on one side stream and chunk i - 1 copied out on another, so for large chunks
+    the run time approaches that of the host-device transfers.
+
+    Args:
+        input (torch.Tensor) contiguous tensor in pinned CPU memory
+        out (torch.Tensor, optional) contiguous tensor of the shape and dtype of input,
+            in pinned CPU memory or on the GPU, the result is written into; defaults to
+            a new pinned CPU tensor. out=input normalizes in place.
+        chunk_rows (int, optional) rows per chunk; defaults to about 64 MiB of input
+        device (torch.device, optional) GPU to run on; defaults to the current device
+
+    Returns:
+        the normalized tensor (out, if given). It is complete when the call returns if
+        it is in host memory; on the GPU, it is ready for work on the current stream.
+    """
+    if input.device.type != "cpu" or not input.is_pinned():
+        raise ValueError("fused_layer_norm_streaming expects a pinned CPU tensor")
+    if not input.is_contiguous():
+        raise ValueError("fused_layer_norm_streaming expects a contiguous input")
+    device = torch.device("cuda" if device is None else device)
+    if device.index is None:
+        device = torch.device("cuda", torch.cuda.current_device())
+    if out is None:
+        out = torch.empty_like(input, pin_memory=True)
+    if out.shape != input.shape or out.dtype != input.dtype or not out.is_contiguous():
+        raise ValueError("out must be contiguous, of the shape and dtype of input")
+    if out.device.type == "cpu" and not out.is_pinned():
+        raise ValueError("a host out has to be pinned")
+    out_on_host = out.device.type == "cpu"
+    if not out_on_host and out.device != device:
+        raise ValueError(f"out is on {out.device}, the LayerNorm runs on {device}")
+
+    cols = math.prod(normalized_shape)
+    rows = input.numel() // cols if cols else 0
+    if chunk_rows is None:
+        chunk_rows = max(1, (64 << 20) // max(1, cols * input.element_size()))
+    src = input.view(rows, cols)
+    dst = out.view(rows, cols)
+
+    with torch.cuda.device(device), torch.no_grad():
+        if weight is not None:
+            weight = weight.to(device, non_blocking=True)
+        if bias is not None:
+            bias = bias.to(device, non_blocking=True)
+        compute = torch.cuda.current_stream()
+        copy_in = torch.cuda.Stream()
+        copy_out = torch.cuda.Stream() if out_on_host else None
+        chunk = min(chunk_rows, rows)
+        # Allocated on the compute stream, which outlives every use of them below.
+        in_bufs = [
+            torch.empty(chunk, cols, dtype=input.dtype, device=device) for _ in range(2)
+        ]
+        if out_on_host:
+            out_bufs = [torch.empty_like(buf) for buf in in_bufs]
+        copied_in = [torch.cuda.Event() for _ in range(2)]
+        normalized = [torch.cuda.Event() for _ in range(2)]
+        copied_out = [torch.cuda.Event() for _ in range(2)]
+        for i, start in enumerate(range(0, rows, chunk_rows)):
+            b = i % 2
+            n = min(chunk_rows, rows - start)
+            with torch.cuda.stream(copy_in):
+                # in_bufs[b] is free once chunk i - 2 has been normalized.
+                if i >= 2:
+                    copy_in.wait_event(normalized[b])
+                in_bufs[b][:n].copy_(src[start : start + n], non_blocking=True)
+                copied_in[b].record()
+            compute.wait_event(copied_in[b])
+            if out_on_host:
+                # out_bufs[b] is free once chunk i - 2 has been copied out.
+                if i >= 2:
+                    compute.wait_event(copied_out[b])
+                target = out_bufs[b][:n]
+            else:
+                target = dst[start : start + n]
+            fused_layer_norm_inference(
+                in_bufs[b][:n], normalized_shape, weight, bias, eps, out=target
+            )
+            normalized[b].record(compute)
+            if out_on_host:
+                with torch.cuda.stream(copy_out):
+                    copy_out.wait_event(normalized[b])
+                    dst[start : start + n].copy_(out_bufs[b][:n], non_blocking=True)
+                    copied_out[b].record()
+        if out_on_host:
+            copy_out.synchronize()
+    return out
 
 
 class FusedLayerNormAffineFunction(torch.autograd.Function):
@@ -75,12 +434,20 @@ class FusedLayerNormAffineFunction(torch.autograd.Function):
         bias: Optional[torch.Tensor],
         normalized_shape: torch.Size,
         eps: float,
+        save_stats: bool = True,
+        partial_grad_hook: Optional[Callable] = None,
     ) -> torch.Tensor:
         d = input.dtype
+        autotuner.maybe_tune(input, weight, bias, normalized_shape, eps)
 
         ctx.normalized_shape = normalized_shape
         ctx.eps = eps
-        input_ = input.contiguous()
+        ctx.save_stats = save_stats
+        ctx.partial_grad_hook = partial_grad_hook
+        # No .contiguous(): the extension accepts permuted views whose normalized dims are
+        # unit-stride as they are, and copies any other layout itself.
+        input_ = input
+        weight_, bias_ = _affine_params(weight, bias, d)
 
         if weight is None:
             if bias is None:
@@ -89,7 +456,7 @@ class FusedLayerNormAffineFunction(torch.autograd.Function):
                 )
             else:
                 output, mean, invvar = fast_layer_norm_cuda_v2.forward_with_bias_affine(
-                    input_, ctx.normalized_shape, bias.to(d), ctx.eps
+                    input_, ctx.normalized_shape, bias_, ctx.eps
                 )
         else:
             if bias is None:
@@ -98,27 +465,104 @@ class FusedLayerNormAffineFunction(torch.autograd.Function):
                     mean,
                     invvar,
                 ) = fast_layer_norm_cuda_v2.forward_with_weight_affine(
-                    input_, ctx.normalized_shape, weight.to(d), ctx.eps
+                    input_, ctx.normalized_shape, weight_, ctx.eps
                 )
             else:
                 output, mean, invvar = fast_layer_norm_cuda_v2.forward_with_both_affine(
                     input_,
                     ctx.normalized_shape,
-                    weight.to(d),
-                    bias.to(d),
+                    weight_,
+                    bias_,
                     ctx.eps,
                 )
-        ctx.save_for_backward(input_, weight, bias, mean, invvar)
+        if save_stats:
+            ctx.save_for_backward(input_, weight, bias, mean, invvar)
+        else:
+            ctx.save_for_backward(input_, weight, bias)
         return output
 
+    @staticmethod
+    def _backward_outputs(
+        ctx: Any,
+        grad_input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        grad_weight: Optional[torch.Tensor],
+        grad_bias: Optional[torch.Tensor],
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        grad_weight = None if weight is None else grad_weight
+        grad_bias = None if bias is None else grad_bias
+        if ctx.partial_grad_hook is not None:
+            grad_weight, grad_bias = _call_partial_grad_hook(
+                ctx.partial_grad_hook, grad_input, grad_weight, grad_bias
+            )
+        else:
+            grad_weight, grad_bias = _accumulate_main_grads(
+                weight, bias, grad_weight, grad_bias
+            )
+        return grad_input, grad_weight, grad_bias, None, None, None, None
+
     @staticmethod
     def backward(
         ctx: Any, grad_output: torch.Tensor
     ) -> tuple[Optional[torch.Tensor], ...]:
         d = grad_output.dtype
-        input_, weight_, bias_, mean, invvar = ctx.saved_tensors
         grad_input = grad_weight = grad_bias = None
 
+        if not ctx.save_stats:
+            # Only the input was saved; the kernel recomputes the row statistics.
+            input_, weight_, bias_ = ctx.saved_tensors
+            gamma, beta = _affine_params(weight_, bias_, d)
+            (
+                grad_input,
+                grad_weight,
+                grad_bias,
+            ) = fast_layer_norm_cuda_v2.backward_recompute_stats(
+                grad_output,
+                input_,
+                ctx.normalized_shape,
+                gamma,
+                beta,
+                ctx.eps,
+            )
+            return FusedLayerNormAffineFunction._backward_outputs(
+                ctx, grad_input, weight_, bias_, grad_weight, grad_bias
+            )
+
+        input_, weight_, bias_, mean, invvar = ctx.saved_tensors
+        gamma, beta = _affine_params(weight_, bias_, d)
+        if ctx.partial_grad_hook is not None and d == input_.dtype and input_.is_cuda:
+            (
+                grad_input,
+                grad_weight,
+                grad_bias,
+            ) = fast_layer_norm_cuda_v2.backward_partial(
+                grad_output,
+                mean,
+                invvar,
+                input_,
+                ctx.normalized_shape,
+                gamma,
+                beta,
+                ctx.eps,
+            )
+            return FusedLayerNormAffineFunction._backward_outputs(
+                ctx, grad_input, weight_, bias_, grad_weight, grad_bias
+            )
+        main_grads = _main_grads(weight_, bias_)
+        if main_grads is not None and d == input_.dtype and input_.is_cuda:
+            grad_input = fast_layer_norm_cuda_v2.backward_main_grad(
+                grad_output,
+                mean,
+                invvar,
+                input_,
+                ctx.normalized_shape,
+                gamma,
+                beta,
+                *main_grads,
+                ctx.eps,
+            )
+            return grad_input, None, None, None, None, None, None
         if weight_ is None:
             if bias_ is None:
                 (
@@ -126,7 +570,7 @@ class FusedLayerNormAffineFunction(torch.autograd.Function):
                     grad_weight,
                     grad_bias,
                 ) = fast_layer_norm_cuda_v2.backward_none_affine(
-                    grad_output.contiguous(),
+                    grad_output,
                     mean,
                     invvar,
                     input_,
@@ -139,12 +583,12 @@ class FusedLayerNormAffineFunction(torch.autograd.Function):
                     grad_weight,
                     grad_bias,
                 ) = fast_layer_norm_cuda_v2.backward_with_bias_affine(
-                    grad_output.contiguous(),
+                    grad_output,
                     mean,
                     invvar,
                     input_,
                     ctx.normalized_shape,
-                    bias_.to(dtype=d),
+                    beta,
                     ctx.eps,
                 )
         else:
@@ -154,12 +598,12 @@ class FusedLayerNormAffineFunction(torch.autograd.Function):
                     grad_weight,
                     grad_bias,
                 ) = fast_layer_norm_cuda_v2.backward_with_weight_affine(
-                    grad_output.contiguous(),
+                    grad_output,
                     mean,
                     invvar,
                     input_,
                     ctx.normalized_shape,
-                    weight_.to(dtype=d),
+                    gamma,
                     ctx.eps,
                 )
             else:
@@ -168,21 +612,414 @@ class FusedLayerNormAffineFunction(torch.autograd.Function):
                     grad_weight,
                     grad_bias,
                 ) = fast_layer_norm_cuda_v2.backward_with_both_affine(
-                    grad_output.contiguous(),
+                    grad_output,
                     mean,
                     invvar,
                     input_,
                     ctx.normalized_shape,
-                    weight_.to(dtype=d),
-                    bias_.to(dtype=d),
+                    gamma,
+                    beta,
                     ctx.eps,
                 )
+        return FusedLayerNormAffineFunction._backward_outputs(
+            ctx, grad_input, weight_, bias_, grad_weight, grad_bias
+        )
+
+
+class FusedLayerNormInplaceFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        normalized_shape: torch.Size,
+        eps: float,
+    ) -> torch.Tensor:
+        d = input.dtype
+
+        ctx.normalized_shape = normalized_shape
+        ctx.eps = eps
+        mean, invvar = fast_layer_norm_cuda_v2.forward_inplace_affine(
+            input,
+            ctx.normalized_shape,
+            None if weight is None else weight.to(d),
+            None if bias is None else bias.to(d),
+            ctx.eps,
+        )
+        ctx.mark_dirty(input)
+        # input now holds the output; the backward reconstructs x_hat from it.
+        ctx.save_for_backward(input, weight, bias, mean, invvar)
+        return input
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        d = grad_output.dtype
+        output, weight_, bias_, mean, invvar = ctx.saved_tensors
+        (
+            grad_input,
+            grad_weight,
+            grad_bias,
+        ) = fast_layer_norm_cuda_v2.backward_from_output_affine(
+            grad_output.contiguous(),
+            mean,
+            invvar,
+            output,
+            ctx.normalized_shape,
+            None if weight_ is None else weight_.to(dtype=d),
+            None if bias_ is None else bias_.to(dtype=d),
+            ctx.eps,
+        )
+        grad_weight, grad_bias = _accumulate_main_grads(
+            weight_,
+            bias_,
+            None if weight_ is None else grad_weight,
+            None if bias_ is None else grad_bias,
+        )
+        return grad_input, grad_weight, grad_bias, None, None
+
+
+class FusedLayerNormSavedXHatFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        normalized_shape: torch.Size,
+        eps: float,
+        xhat_dtype: torch.dtype,
+    ) -> torch.Tensor:
+        ctx.normalized_shape = normalized_shape
+        ctx.input_dtype = input.dtype
+        weight_, bias_ = _affine_params(weight, bias, input.dtype)
+        output, invvar, xhat = fast_layer_norm_cuda_v2.forward_save_xhat(
+            input, normalized_shape, weight_, bias_, eps, xhat_dtype
+        )
+        # x_hat in xhat_dtype stands in for the input; the mean is not needed.
+        ctx.save_for_backward(xhat, invvar, weight, bias)
+        return output
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        xhat, invvar, weight_, bias_ = ctx.saved_tensors
+        d = ctx.input_dtype
+        gamma, beta = _affine_params(weight_, bias_, d)
+        grad_input, grad_weight, grad_bias = fast_layer_norm_cuda_v2.backward_from_xhat(
+            grad_output.to(d), invvar, xhat, ctx.normalized_shape, gamma, beta
+        )
+        grad_weight, grad_bias = _accumulate_main_grads(
+            weight_,
+            bias_,
+            None if weight_ is None else grad_weight,
+            None if bias_ is None else grad_bias,
+        )
+        return grad_input, grad_weight, grad_bias, None, None, None
+
+
+class FusedLayerNormTransposedFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        eps: float,
+    ) -> torch.Tensor:
+        weight_, bias_ = _affine_params(weight, bias, input.dtype)
+        output, mean, invvar = fast_layer_norm_cuda_v2.forward_transposed(
+            input, weight_, bias_, eps
+        )
+        ctx.save_for_backward(input.contiguous(), weight, bias, mean, invvar)
+        return output
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        input_, weight_, bias_, mean, invvar = ctx.saved_tensors
+        gamma, beta = _affine_params(weight_, bias_, input_.dtype)
+        # grad_output is read in its [*, J, I, C] order; no transposed copy is made.
+        (
+            grad_input,
+            grad_weight,
+            grad_bias,
+        ) = fast_layer_norm_cuda_v2.backward_transposed(
+            grad_output, mean, invvar, input_, gamma, beta
+        )
+        grad_weight, grad_bias = _accumulate_main_grads(
+            weight_,
+            bias_,
+            None if weight_ is None else grad_weight,
+            None if bias_ is None else grad_bias,
+        )
+        return grad_input, grad_weight, grad_bias, None
+
+
+class FusedAddLayerNormFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        residual: torch.Tensor,
+        update: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        normalized_shape: torch.Size,
+        eps: float,
+    ) -> tuple[torch.Tensor, torch.Tensor]:
+        d = residual.dtype
+
+        ctx.normalized_shape = normalized_shape
+        ctx.eps = eps
+        output, sum_, mean, invvar = fast_layer_norm_cuda_v2.forward_add_layer_norm(
+            residual.contiguous(),
+            update.to(d).contiguous(),
+            ctx.normalized_shape,
+            None if weight is None else weight.to(d),
+            None if bias is None else bias.to(d),
+            ctx.eps,
+        )
+        ctx.update_dtype = update.dtype
+        ctx.save_for_backward(sum_, weight, bias, mean, invvar)
+        return sum_, output
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_sum: Optional[torch.Tensor], grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        d = grad_output.dtype
+        sum_, weight_, bias_, mean, invvar = ctx.saved_tensors
+        (
+            grad_input,
+            grad_weight,
+            grad_bias,
+        ) = fast_layer_norm_cuda_v2.backward_add_layer_norm(
+            grad_output.contiguous(),
+            None if grad_sum is None else grad_sum.to(sum_.dtype).contiguous(),
+            mean,
+            invvar,
+            sum_,
+            ctx.normalized_shape,
+            None if weight_ is None else weight_.to(dtype=d),
+            None if bias_ is None else bias_.to(dtype=d),
+            ctx.eps,
+        )
+        grad_weight, grad_bias = _accumulate_main_grads(
+            weight_,
+            bias_,
+            None if weight_ is None else grad_weight,
+            None if bias_ is None else grad_bias,
+        )
+        return (
+            grad_input,
+            grad_input.to(ctx.update_dtype),
+            grad_weight,
+            grad_bias,
+            None,
+            None,
+        )
+
+
+class FusedLayerNormEpilogueFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        mask: Optional[torch.Tensor],
+        gate: Optional[torch.Tensor],
+        dropout_p: float,
+        normalized_shape: torch.Size,
+        eps: float,
+        partial_grad_hook: Optional[Callable] = None,
+    ) -> torch.Tensor:
+        d = input.dtype
+
+        ctx.normalized_shape = normalized_shape
+        ctx.eps = eps
+        ctx.dropout_p = dropout_p
+        ctx.partial_grad_hook = partial_grad_hook
+        input_ = input.contiguous()
+        if mask is not None:
+            mask = mask.to(d).expand(input_.shape[:-1]).contiguous()
+        gate_ = None if gate is None else gate.to(d).contiguous()
+        output, mean, invvar, rng_state = fast_layer_norm_cuda_v2.forward_epilogue(
+            input_,
+            ctx.normalized_shape,
+            None if weight is None else weight.to(d),
+            None if bias is None else bias.to(d),
+            mask,
+            gate_,
+            dropout_p,
+            ctx.eps,
+        )
+        ctx.gate_dtype = None if gate is None else gate.dtype
+        # Only the Philox seed/offset are saved for dropout, not a mask.
+        ctx.save_for_backward(
+            input_, weight, bias, mask, gate_, mean, invvar, rng_state
+        )
+        return output
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        input_, weight_, bias_, mask, gate_, mean, invvar, rng_state = ctx.saved_tensors
+        d = input_.dtype
+        (
+            grad_input,
+            grad_weight,
+            grad_bias,
+            grad_gate,
+        ) = fast_layer_norm_cuda_v2.backward_epilogue(
+            grad_output.to(d).contiguous(),
+            mean,
+            invvar,
+            input_,
+            ctx.normalized_shape,
+            None if weight_ is None else weight_.to(d),
+            None if bias_ is None else bias_.to(d),
+            mask,
+            gate_,
+            ctx.dropout_p,
+            rng_state,
+            ctx.eps,
+        )
+        grad_weight = None if weight_ is None else grad_weight
+        grad_bias = None if bias_ is None else grad_bias
+        if ctx.partial_grad_hook is not None:
+            grad_weight, grad_bias = _call_partial_grad_hook(
+                ctx.partial_grad_hook, grad_input, grad_weight, grad_bias
+            )
+        else:
+            grad_weight, grad_bias = _accumulate_main_grads(
+                weight_, bias_, grad_weight, grad_bias
+            )
         return (
             grad_input,
+            grad_weight,
+            grad_bias,
+            None,
+            None if gate_ is None else grad_gate.to(ctx.gate_dtype),
+            None,
+            None,
+            None,
+            None,
+        )
+
+
+class FusedLayerNormLinearFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        linear_weight: torch.Tensor,
+        linear_bias: Optional[torch.Tensor],
+        normalized_shape: torch.Size,
+        eps: float,
+    ) -> torch.Tensor:
+        d = input.dtype
+
+        ctx.normalized_shape = normalized_shape
+        ctx.eps = eps
+        input_ = input.contiguous().view(-1, normalized_shape[-1])
+        output, mean, invvar = layer_norm_linear_forward(
+            input_,
+            None if weight is None else weight.to(d),
+            None if bias is None else bias.to(d),
+            linear_weight.to(d).contiguous(),
+            None if linear_bias is None else linear_bias.to(d),
+            ctx.eps,
+        )
+        ctx.input_shape = input.shape
+        ctx.has_linear_bias = linear_bias is not None
+        # The normalized input is never materialized; backward renormalizes on the fly.
+        ctx.save_for_backward(input_, weight, bias, linear_weight, mean, invvar)
+        return output.view(*input.shape[:-1], -1)
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        input_, weight_, bias_, linear_weight_, mean, invvar = ctx.saved_tensors
+        d = input_.dtype
+        gamma = None if weight_ is None else weight_.to(d)
+        beta = None if bias_ is None else bias_.to(d)
+        grad_output_ = grad_output.to(d).contiguous().view(input_.shape[0], -1)
+
+        grad_linear_weight = layer_norm_linear_backward_weight(
+            grad_output_, input_, gamma, beta, mean, invvar
+        )
+        grad_linear_bias = grad_output_.sum(0) if ctx.has_linear_bias else None
+        grad_normalized = grad_output_.mm(linear_weight_.to(d))
+        (
+            grad_input,
+            grad_weight,
+            grad_bias,
+        ) = torch.ops.protenix_layer_norm.layer_norm_backward(
+            grad_normalized,
+            mean,
+            invvar,
+            input_,
+            ctx.normalized_shape,
+            gamma,
+            beta,
+            ctx.eps,
+        )
+        return (
+            grad_input.view(ctx.input_shape),
             None if weight_ is None else grad_weight,
             None if bias_ is None else grad_bias,
+            grad_linear_weight,
+            grad_linear_bias,
             None,
             None,
+        )
+
+
+class FusedRMSNormFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        normalized_shape: torch.Size,
+        eps: float,
+    ) -> torch.Tensor:
+        d = input.dtype
+
+        ctx.normalized_shape = normalized_shape
+        input_ = input.contiguous()
+        output, invvar = fast_layer_norm_cuda_v2.forward_rms_norm(
+            input_, ctx.normalized_shape, None if weight is None else weight.to(d), eps
+        )
+        ctx.save_for_backward(input_, weight, invvar)
+        return output
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        input_, weight_, invvar = ctx.saved_tensors
+        d = input_.dtype
+        grad_input, grad_weight = fast_layer_norm_cuda_v2.backward_rms_norm(
+            grad_output.to(d).contiguous(),
+            invvar,
+            input_,
+            ctx.normalized_shape,
+            None if weight_ is None else weight_.to(d),
+        )
+        return (
+            grad_input,
+            None if weight_ is None else grad_weight,
+            None,
             None,
         )
 
@@ -194,6 +1031,32 @@ class FusedLayerNorm(torch.nn.Module):
         create_scale (bool) If set to False, the layer will not learn an additive weight, Default: True
         create_offset (bool) If set to False, the layer will not learn an additive bias, Default: True
         eps (float) a value added to the denominator for numerical stability. Default: 1e-5
+        save_stats (bool) If set to False, the row mean/invvar are not kept for backward but
+            recomputed from the input there, Default: True
+        inplace (bool) If set to True, a contiguous input is overwritten with the output and
+            the backward works from the output, so the input is not kept alive for it. The
+            input must not be needed elsewhere afterwards. Default: False
+        saved_xhat_dtype (torch.dtype, optional) If set (torch.bfloat16, torch.float16,
+            torch.float8_e4m3fn or torch.float8_e5m2), the forward also writes the
+            normalized x_hat in this dtype, and the backward works from it and the row
+            invvar instead of the input. This shrinks the saved activation 2-4x (e.g.
+            bf16 input, fp8 x_hat) at the cost of rounding x_hat in the gradients. Rows
+            of at most 6144 elements; not combined with a partial grad hook.
+            Default: None
+
+    CPU tensors run the extension's multi-threaded CPU kernels; mask/gate/dropout and
+    inplace are fused on CUDA only and applied as separate ops on CPU.
+
+    All kernels run on the current CUDA stream, and neither forward nor backward
+    queries the device or synchronizes with the host, so the module can be captured
+    and replayed with torch.cuda.graph (after the usual warm-up on a side stream).
+
+    For gradient accumulation, give weight and bias a float32 .main_grad buffer of
+    their shape: every backward then adds the parameter gradients to it and leaves
+    .grad untouched, the regular CUDA backward in its final reduction, the others
+    afterwards (see _main_grads). torch.compile does not support it and raises.
+
+    For inputs sharded by rows across ranks, see register_partial_grad_hook.
     """
 
     def __init__(
@@ -202,6 +1065,9 @@ class FusedLayerNorm(torch.nn.Module):
         create_scale: bool = True,
         create_offset: bool = True,
         eps: float = 1e-5,
+        save_stats: bool = True,
+        inplace: bool = False,
+        saved_xhat_dtype: Optional[torch.dtype] = None,
     ) -> None:
         super(FusedLayerNorm, self).__init__()
 
@@ -209,6 +1075,10 @@ class FusedLayerNorm(torch.nn.Module):
             normalized_shape = (normalized_shape,)
         self.normalized_shape = torch.Size(normalized_shape)
         self.eps = eps
+        self.save_stats = save_stats
+        self.inplace = inplace
+        self.saved_xhat_dtype = saved_xhat_dtype
+        self.partial_grad_hook = None
         if create_scale:
             self.weight = Parameter(torch.ones(*normalized_shape))
         else:
@@ -227,12 +1097,596 @@ class FusedLayerNorm(torch.nn.Module):
         if self.bias is not None:
             torch.nn.init.zeros_(self.bias)
 
+    def register_partial_grad_hook(self, hook: Optional[Callable]) -> None:
+        """
+        Hands the weight/bias gradients to hook instead of to autograd, for inputs
+        sharded by rows across ranks (DAP / sequence parallelism), whose weight/bias
+        gradients are partial sums.
+
+        hook(grad_weight, grad_bias, event) is called from the backward with the fp32
+        gradients of this rank's rows (None for an absent parameter) and a CUDA event
+        recorded on the current stream once they are written (None on CPU). It can
+        make a communication stream wait on the event and start an asynchronous
+        all-reduce or reduce-scatter, which then overlaps with the backward of the next
+        layers; it is responsible for adding the reduced result to .grad (or
+        .main_grad). Pass None to go back to regular gradients.
+
+        The hook covers forward, with or without mask/gate/dropout, but not forward_add
+        or forward_transposed; under torch.compile, forward raises while a hook is
+        registered. inplace is ignored while a hook is registered.
+        """
+        self.partial_grad_hook = hook
+
+    def forward(
+        self,
+        input: torch.Tensor,
+        mask: Optional[torch.Tensor] = None,
+        gate: Optional[torch.Tensor] = None,
+        dropout: float = 0.0,
+    ) -> torch.Tensor:
+        """
+        Args:
+            input (torch.Tensor) tensor to normalize over its trailing normalized_shape
+            mask (torch.Tensor, optional) per-row multiplier broadcastable to
+                input.shape[:-1] (e.g. a pair mask), applied to the normalized output;
+                treated as a constant by autograd
+            gate (torch.Tensor, optional) tensor of the input's shape the output is
+                multiplied with elementwise
+            dropout (float) dropout probability applied to the output in training mode;
+                the mask is regenerated from a Philox seed in backward, never stored
+
+        The optional ops run inside the LayerNorm kernel instead of as separate passes.
+        """
+        dropout_p = dropout if self.training else 0.0
+        if mask is None and gate is None and dropout_p == 0.0:
+            if torch.compiler.is_compiling():
+                if _main_grads(self.weight, self.bias) is not None:
+                    raise RuntimeError(
+                        "FusedLayerNorm: main_grad accumulation is not supported "
+                        "under torch.compile"
+                    )
+                if self.partial_grad_hook is not None:
+                    raise RuntimeError(
+                        "FusedLayerNorm: partial grad hooks are not supported under "
+                        "torch.compile"
+                    )
+                return fused_layer_norm(
+                    input, self.normalized_shape, self.weight, self.bias, self.eps
+                )
+            if not torch.is_grad_enabled():
+                # Nothing is saved for a backward, so the statistics are not stored.
+                inplace = self.inplace and input.is_contiguous()
+                return fused_layer_norm_inference(
+                    input,
+                    self.normalized_shape,
+                    self.weight,
+                    self.bias,
+                    self.eps,
+                    out=input if inplace else None,
+                )
+            if (
+                self.saved_xhat_dtype is not None
+                and input.is_cuda
+                and self.partial_grad_hook is None
+            ):
+                return FusedLayerNormSavedXHatFunction.apply(
+                    input,
+                    self.weight,
+                    self.bias,
+                    self.normalized_shape,
+                    self.eps,
+                    self.saved_xhat_dtype,
+                )
+            if (
+                self.inplace
+                and input.is_cuda
+                and input.is_contiguous()
+                and self.partial_grad_hook is None
+            ):
+                return FusedLayerNormInplaceFunction.apply(
+                    input, self.weight, self.bias, self.normalized_shape, self.eps
+                )
+            return FusedLayerNormAffineFunction.apply(
+                input,
+                self.weight,
+                self.bias,
+                self.normalized_shape,
+                self.eps,
+                self.save_stats,
+                self.partial_grad_hook,
+            )
+        if not input.is_cuda:
+            return self._forward_unfused_epilogue(input, mask, gate, dropout_p)
+        return FusedLayerNormEpilogueFunction.apply(
+            input,
+            self.weight,
+            self.bias,
+            mask,
+            gate,
+            dropout_p,
+            self.normalized_shape,
+            self.eps,
+            self.partial_grad_hook,
+        )
+
+    def _forward_unfused_epilogue(
+        self,
+        input: torch.Tensor,
+        mask: Optional[torch.Tensor],
+        gate: Optional[torch.Tensor],
+        dropout_p: float,
+    ) -> torch.Tensor:
+        """The mask/dropout/gate epilogue as separate ops, in the kernel's order."""
+        output = FusedLayerNormAffineFunction.apply(
+            input,
+            self.weight,
+            self.bias,
+            self.normalized_shape,
+            self.eps,
+            self.save_stats,
+            self.partial_grad_hook,
+        )
+        if mask is not None:
+            output = output * mask.detach().to(output.dtype).unsqueeze(-1)
+        if dropout_p > 0.0:
+            output = torch.nn.functional.dropout(output, dropout_p, training=True)
+        if gate is not None:
+            output = output * gate.to(output.dtype)
+        return output
+
+    def forward_add(
+        self, residual: torch.Tensor, update: torch.Tensor
+    ) -> tuple[torch.Tensor, torch.Tensor]:
+        """Pre-norm residual step: returns (residual + update, its LayerNorm).
+
+        The sum and the normalized output are written in one pass, so the updated
+        residual stream is not read back from memory to be normalized. The sum has the
+        dtype of residual.
+        """
+        return FusedAddLayerNormFunction.apply(
+            residual, update, self.weight, self.bias, self.normalized_shape, self.eps
+        )
+
+    def forward_transposed(self, input: torch.Tensor) -> torch.Tensor:
+        """LayerNorm of an [*, I, J, C] input returned as a contiguous [*, J, I, C].
+
+        Equivalent to self(input).transpose(-3, -2).contiguous() without the transposed
+        copy: the kernel writes each normalized row to its transposed position, and the
+        backward reads the gradient in that order. For the column-wise ops (ending-node
+        triangle attention). Needs a 1-D normalized_shape and a CUDA input.
+        """
+        if (
+            len(self.normalized_shape) != 1
+            or not input.is_cuda
+            or torch.compiler.is_compiling()
+        ):
+            return self(input).transpose(-3, -2).contiguous()
+        return FusedLayerNormTransposedFunction.apply(
+            input, self.weight, self.bias, self.eps
+        )
+
+
+class FusedLayerNormLinear(torch.nn.Module):
+    """
+    LayerNorm followed by one or more linear projections of the normalized input, e.g.
+    the a/b/g projections of triangle multiplication or the q/k/v/g projections of
+    attention.
+
+    All projections run as a single Triton GEMM over the concatenated weights that
+    normalizes the input tiles in its prologue, so the normalized activation is never
+    written to memory, in the forward or in the backward. Without Triton, or off CUDA,
+    the module falls back to the LayerNorm followed by an ordinary linear.
+
+    Args:
+        normalized_shape (int) size of the normalized last dimension
+        out_features (int or list[int]) output size, or the sizes of the individual projections;
+            in the latter case forward returns a tuple of views, one per projection
+        bias (bool) If set to False, the projections have no additive bias, Default: True
+        create_scale (bool) If set to False, the LayerNorm will not learn a scale, Default: True
+        create_offset (bool) If set to False, the LayerNorm will not learn an offset, Default: True
+        eps (float) a value added to the denominator for numerical stability. Default: 1e-5
+    """
+
+    def __init__(
+        self,
+        normalized_shape: int,
+        out_features: Union[int, Sequence[int]],
+        bias: bool = True,
+        create_scale: bool = True,
+        create_offset: bool = True,
+        eps: float = 1e-5,
+    ) -> None:
+        super(FusedLayerNormLinear, self).__init__()
+
+        self.layer_norm = FusedLayerNorm(
+            normalized_shape,
+            create_scale=create_scale,
+            create_offset=create_offset,
+            eps=eps,
+        )
+        if isinstance(out_features, numbers.Integral):
+            self.split_sizes = None
+            total_out_features = out_features
+        else:
+            self.split_sizes = list(out_features)
+            total_out_features = sum(self.split_sizes)
+        self.linear_weight = Parameter(
+            torch.empty(total_out_features, normalized_shape)
+        )
+        if bias:
+            self.linear_bias = Parameter(torch.empty(total_out_features))
+        else:
+            self.linear_bias = None
+
+        self.reset_parameters()
+
+    def reset_parameters(self) -> None:
+        # Same initialization as torch.nn.Linear
+        self.layer_norm.reset_parameters()
+        torch.nn.init.kaiming_uniform_(self.linear_weight, a=math.sqrt(5))
+        if self.linear_bias is not None:
+            bound = 1 / math.sqrt(self.linear_weight.shape[1])
+            torch.nn.init.uniform_(self.linear_bias, -bound, bound)
+
+    @classmethod
+    def from_modules(
+        cls, layer_norm: FusedLayerNorm, linears: Sequence[torch.nn.Linear]
+    ) -> "FusedLayerNormLinear":
+        """Builds the fused module from an existing LayerNorm and the Linear layers that
+        consume its output, copying their parameters."""
+        has_bias = [linear.bias is not None for linear in linears]
+        assert all(has_bias) or not any(has_bias), "linears must agree on bias"
+        module = cls(
+            layer_norm.normalized_shape[-1],
+            [linear.out_features for linear in linears],
+            bias=has_bias[0],
+            create_scale=layer_norm.weight is not None,
+            create_offset=layer_norm.bias is not None,
+            eps=layer_norm.eps,
+        )
+        with torch.no_grad():
+            module.layer_norm.load_state_dict(layer_norm.state_dict())
+            module.linear_weight.copy_(torch.cat([linear.weight for linear in linears]))
+            if module.linear_bias is not None:
+                module.linear_bias.copy_(torch.cat([linear.bias for linear in linears]))
+        return module
+
+    def forward(
+        self, input: torch.Tensor
+    ) -> Union[torch.Tensor, tuple[torch.Tensor, ...]]:
+        if TRITON_LAYER_NORM_LINEAR_AVAILABLE and input.is_cuda:
+            output = FusedLayerNormLinearFunction.apply(
+                input,
+                self.layer_norm.weight,
+                self.layer_norm.bias,
+                self.linear_weight,
+                self.linear_bias,
+                self.layer_norm.normalized_shape,
+                self.layer_norm.eps,
+            )
+        else:
+            output = torch.nn.functional.linear(
+                self.layer_norm(input),
+                self.linear_weight.to(input.dtype),
+                None if self.linear_bias is None else self.linear_bias.to(input.dtype),
+            )
+        if self.split_sizes is None:
+            return output
+        return torch.split(output, self.split_sizes, dim=-1)
+
+
+class FusedRMSNorm(torch.nn.Module):
+    """
+    RMSNorm, y = x / sqrt(mean(x^2) + eps) * weight, as a drop-in alternative to
+    FusedLayerNorm. The kernel reduces only the sum of squares per row.
+
+    Args:
+        normalized_shape (int or list or torch.Size) input shape from an expected input of size
+        create_scale (bool) If set to False, the layer will not learn a weight, Default: True
+        eps (float) a value added to the denominator for numerical stability. Default: 1e-5
+    """
+
+    def __init__(
+        self,
+        normalized_shape: Union[int, list[int], torch.Size],
+        create_scale: bool = True,
+        eps: float = 1e-5,
+    ) -> None:
+        super(FusedRMSNorm, self).__init__()
+
+        if isinstance(normalized_shape, numbers.Integral):
+            normalized_shape = (normalized_shape,)
+        self.normalized_shape = torch.Size(normalized_shape)
+        self.eps = eps
+        if create_scale:
+            self.weight = Parameter(torch.ones(*normalized_shape))
+        else:
+            self.weight = None
+
+        self.reset_parameters()
+
+    def reset_parameters(self) -> None:
+        if self.weight is not None:
+            torch.nn.init.ones_(self.weight)
+
     def forward(self, input: torch.Tensor) -> torch.Tensor:
-        return FusedLayerNormAffineFunction.apply(
-            input, self.weight, self.bias, self.normalized_shape, self.eps
+        return FusedRMSNormFunction.apply(
+            input, self.weight, self.normalized_shape, self.eps
         )
 
 
+class FusedAdaLayerNormFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        scale: torch.Tensor,
+        shift: torch.Tensor,
+        eps: float,
+    ) -> torch.Tensor:
+        d = input.dtype
+        input_ = input.contiguous()
+        scale_ = scale.to(d).contiguous()
+        output, mean, invvar = fast_layer_norm_cuda_v2.forward_ada_layer_norm(
+            input_,
+            torch.Size(input_.shape[-1:]),
+            scale_,
+            shift.to(d).contiguous(),
+            eps,
+        )
+        ctx.eps = eps
+        ctx.save_for_backward(input_, scale_, mean, invvar)
+        return output
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        input_, scale_, mean, invvar = ctx.saved_tensors
+        grad_output = grad_output.to(input_.dtype).contiguous()
+        grad_input, grad_scale = fast_layer_norm_cuda_v2.backward_ada_layer_norm(
+            grad_output,
+            mean,
+            invvar,
+            input_,
+            torch.Size(input_.shape[-1:]),
+            scale_,
+            ctx.eps,
+        )
+        return grad_input, grad_scale, grad_output, None
+
+
+def fused_ada_layer_norm(
+    input: torch.Tensor, scale: torch.Tensor, shift: torch.Tensor, eps: float = 1e-5
+) -> torch.Tensor:
+    """
+    Adaptive LayerNorm (AF3 Algorithm 26) in one kernel:
+    sigmoid(scale) * LayerNorm(input) + shift, normalized over the last dimension
+    without a learned affine transform.
+
+    Args:
+        input (torch.Tensor) fp32/fp16/bf16 tensor to normalize
+        scale (torch.Tensor) pre-sigmoid scale of the shape of input, e.g. Linear(s)
+        shift (torch.Tensor) shift of the shape of input, e.g. LinearNoBias(s)
+        eps (float) a value added to the denominator for numerical stability. Default: 1e-5
+    """
+    return FusedAdaLayerNormFunction.apply(input, scale, shift, eps)
+
+
+class FusedLayerNormIndexedFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx: Any,
+        input: torch.Tensor,
+        weight: Optional[torch.Tensor],
+        bias: Optional[torch.Tensor],
+        row_index: torch.Tensor,
+        normalized_shape: torch.Size,
+        eps: float,
+    ) -> torch.Tensor:
+        input_ = input.contiguous()
+        weight_, bias_ = _affine_params(weight, bias, input.dtype)
+        output, mean, invvar = fast_layer_norm_cuda_v2.forward_indexed(
+            input_, normalized_shape, weight_, bias_, row_index, eps
+        )
+        ctx.normalized_shape = normalized_shape
+        ctx.eps = eps
+        ctx.save_for_backward(input_, weight_, bias_, row_index, mean, invvar)
+        return output
+
+    @staticmethod
+    def backward(
+        ctx: Any, grad_output: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        input_, weight_, bias_, row_index, mean, invvar = ctx.saved_tensors
+        grad_input, grad_weight, grad_bias = fast_layer_norm_cuda_v2.backward_indexed(
+            grad_output.to(input_.dtype),
+            mean,
+            invvar,
+            input_,
+            ctx.normalized_shape,
+            weight_,
+            bias_,
+            row_index,
+            ctx.eps,
+        )
+        return grad_input, grad_weight, grad_bias, None, None, None
+
+
+def fused_layer_norm_masked(
+    input: torch.Tensor,
+    normalized_shape: Union[int, list[int], torch.Size],
+    weight: Optional[torch.Tensor] = None,
+    bias: Optional[torch.Tensor] = None,
+    eps: float = 1e-5,
+    row_index: Optional[torch.Tensor] = None,
+    row_mask: Optional[torch.Tensor] = None,
+) -> torch.Tensor:
+    """
+    LayerNorm of the non-padding rows of a padded batch only. The kernels are launched
+    over the active rows, so padding costs neither bandwidth nor blocks; padding rows
+    of the output and of the input gradient are zero, and the weight/bias gradients
+    sum over the active rows only.
+
+    Args:
+        input (torch.Tensor) fp32/fp16/bf16 tensor to normalize
+        normalized_shape (int or list or torch.Size) trailing dimensions to normalize
+        weight, bias (torch.Tensor, optional) LayerNorm affine parameters
+        eps (float) a value added to the denominator for numerical stability. Default: 1e-5
+        row_index (torch.Tensor, optional) int64 indices of the active rows of input
+            flattened to [-1, *normalized_shape], each listed at most once
+        row_mask (torch.Tensor, optional) boolean mask of shape input.shape[:-len(
+            normalized_shape)], True for active rows. Converted to row_index with
+            nonzero(), which synchronizes with the host; pass row_index (e.g. computed
+            once per batch and reused by every layer) to avoid that
+    """
+    if isinstance(normalized_shape, numbers.Integral):
+        normalized_shape = (normalized_shape,)
+    normalized_shape = torch.Size(normalized_shape)
+    if (row_index is None) == (row_mask is None):
+        raise ValueError("Exactly one of row_index and row_mask must be given")
+    if row_index is None:
+        row_index = row_mask.reshape(-1).nonzero().squeeze(1)
+    return FusedLayerNormIndexedFunction.apply(
+        input, weight, bias, row_index.to(torch.long), normalized_shape, eps
+    )
+
+
+class FusedGroupedLayerNormFunction(torch.autograd.Function):
+    # autograd only tracks tensors passed directly, so the inputs, weights and biases
+    # arrive flattened: n inputs, then n weights, then n biases (None where absent).
+    @staticmethod
+    def forward(
+        ctx: Any, epsilons: tuple[float, ...], *tensors: Optional[torch.Tensor]
+    ) -> tuple[torch.Tensor, ...]:
+        n = len(epsilons)
+        inputs = list(tensors[:n])
+        d = inputs[0].dtype
+        weights = [None if w is None else w.to(d) for w in tensors[n : 2 * n]]
+        biases = [None if b is None else b.to(d) for b in tensors[2 * n :]]
+        outputs, means, invvars = fast_layer_norm_cuda_v2.forward_grouped(
+            inputs, weights, biases, list(epsilons)
+        )
+        ctx.epsilons = epsilons
+        ctx.has_weight = [w is not None for w in weights]
+        ctx.has_bias = [b is not None for b in biases]
+        ctx.save_for_backward(
+            *inputs,
+            *[w for w in weights if w is not None],
+            *[b for b in biases if b is not None],
+            *means,
+            *invvars,
+        )
+        return tuple(outputs)
+
+    @staticmethod
+    def backward(
+        ctx: Any, *grad_outputs: torch.Tensor
+    ) -> tuple[Optional[torch.Tensor], ...]:
+        n = len(ctx.epsilons)
+        saved = list(ctx.saved_tensors)
+        inputs = saved[:n]
+        rest = saved[n:]
+        weights = [rest.pop(0) if has else None for has in ctx.has_weight]
+        biases = [rest.pop(0) if has else None for has in ctx.has_bias]
+        means, invvars = rest[:n], rest[n:]
+        d = inputs[0].dtype
+        douts = [
+            torch.zeros_like(x) if g is None else g.to(d)
+            for g, x in zip(grad_outputs, inputs)
+        ]
+        grad_inputs, grad_weights, grad_biases = (
+            fast_layer_norm_cuda_v2.backward_grouped(
+                douts, means, invvars, inputs, weights, biases, list(ctx.epsilons)
+            )
+        )
+        return (None, *grad_inputs, *grad_weights, *grad_biases)
+
+
+def fused_grouped_layer_norm(
+    inputs: Sequence[torch.Tensor],
+    weights: Sequence[Optional[torch.Tensor]],
+    biases: Sequence[Optional[torch.Tensor]],
+    eps: Union[float, Sequence[float]] = 1e-5,
+) -> list[torch.Tensor]:
+    """
+    LayerNorm over the last dimension of several independent tensors in one launch.
+
+    Meant for the many small norms of a block at small token counts (e.g. the single and
+    pair inputs of AttentionPairBias, the per-block norms of the diffusion transformer),
+    where each separate launch would cost more than its few microseconds of work. Every
+    input keeps its own width, weight, bias and eps. Large tensors are better served by
+    separate FusedLayerNorm calls, whose kernels use the whole GPU for one row width.
+
+    Args:
+        inputs (list of torch.Tensor) fp32/fp16/bf16 tensors of one dtype and device
+        weights, biases (list of torch.Tensor or None) per-input affine parameters of the
+            input's last dimension, None where the input has none
+        eps (float or list of float) per-input (or shared) epsilon. Default: 1e-5
+
+    Returns:
+        list of normalized tensors, in the order of inputs
+    """
+    n = len(inputs)
+    if isinstance(eps, numbers.Number):
+        eps = [eps] * n
+    if not (len(weights) == len(biases) == len(eps) == n):
+        raise ValueError("expected one weight, bias and eps per input")
+    return list(
+        FusedGroupedLayerNormFunction.apply(
+            tuple(float(e) for e in eps), *inputs, *weights, *biases
+        )
+    )
+
+
+def fused_layer_norm_fp8(
+    input: torch.Tensor,
+    normalized_shape: Union[int, list[int], torch.Size],
+    weight: Optional[torch.Tensor] = None,
+    bias: Optional[torch.Tensor] = None,
+    eps: float = 1e-5,
+    fp8_dtype: torch.dtype = torch.float8_e4m3fn,
+    scale: Optional[torch.Tensor] = None,
+) -> tuple[torch.Tensor, torch.Tensor]:
+    """
+    Inference-only LayerNorm whose output is quantized to FP8 in the same kernel, so the
+    following FP8 GEMM does not need a separate amax/cast pass over the activation.
+
+    Args:
+        input (torch.Tensor) fp32/fp16/bf16 input; the last dimension is normalized and
+            must be one of 32, 64, 128, 256, 384, 512, 768, 1024
+        normalized_shape (int or list or torch.Size) size of the normalized last dimension
+        weight, bias (torch.Tensor, optional) LayerNorm affine parameters
+        eps (float) a value added to the denominator for numerical stability. Default: 1e-5
+        fp8_dtype (torch.dtype) torch.float8_e4m3fn or torch.float8_e5m2
+        scale (torch.Tensor, optional) float32 per-tensor scale of shape [1]. If None, every
+            row is scaled to the full FP8 range instead
+
+    Returns:
+        (output, scale_inv) with scale_inv of shape input.shape[:-1] such that
+        output.float() * scale_inv[..., None] dequantizes, if scale is None;
+        otherwise (output, amax) with amax of shape [1], the absolute maximum of the
+        unquantized output, for the caller's delayed-scaling history.
+    """
+    if isinstance(normalized_shape, numbers.Integral):
+        normalized_shape = (normalized_shape,)
+    d = input.dtype
+    input_ = input.contiguous()
+    output = torch.empty(input_.shape, dtype=fp8_dtype, device=input_.device)
+    output, _, _, scale_out = fast_layer_norm_cuda_v2.forward_fp8(
+        input_,
+        torch.Size(normalized_shape),
+        None if weight is None else weight.to(d),
+        None if bias is None else bias.to(d),
+        output,
+        None if scale is None else scale.float(),
+        eps,
+    )
+    if scale is None:
+        return output, scale_out.view(input_.shape[:-1])
+    return output, scale_out
+
+
 if __name__ == "__main__":
     dtype = torch.float32
     data = torch.rand(10, 10).cuda().to(dtype=dtype)
@@ -0,0 +1,313 @@
+# Copyright 2024 ByteDance and/or its affiliates.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Triton GEMMs with a LayerNorm prologue, for FusedLayerNormLinear.
+
+A small kernel first reduces each input row to its mean and inverse standard deviation
+(8 bytes per row). The GEMM then normalizes every input tile right after loading it and
+before feeding it to tl.dot, so the normalized activation only ever exists in registers:
+
+    y = ((x - mean) * invvar * gamma + beta) @ W^T + b
+
+The weight gradient of the backward uses the same prologue, dW = dy^T @ norm(x), so the
+normalized input is not materialized there either. Its reduction runs over M, so M is
+split across programs to fill the device, as a split-K GEMM would. The statistics have
+the layout of the CUDA extension's (fp32, one per row), so its LayerNorm backward
+consumes them directly.
+"""
+
+from typing import Optional
+
+import torch
+
+try:
+    import triton
+    import triton.language as tl
+
+    TRITON_LAYER_NORM_LINEAR_AVAILABLE = True
+except (ImportError, RuntimeError):
+    TRITON_LAYER_NORM_LINEAR_AVAILABLE = False
+
+
+if TRITON_LAYER_NORM_LINEAR_AVAILABLE:
+
+    @triton.jit
+    def _layer_norm_stats_kernel(
+        X_ptr,
+        MEAN_ptr,
+        INVVAR_ptr,
+        K,
+        eps,
+        BLOCK_K: tl.constexpr,
+    ):
+        """One program per row: mean and 1 / sqrt(var + eps), both in fp32."""
+        # 64-bit row offsets: M * K passes 2^31 for the pair tensors of large crops.
+        row = tl.program_id(0).to(tl.int64)
+        cols = tl.arange(0, BLOCK_K)
+        valid = cols < K
+
+        x = tl.load(X_ptr + row * K + cols, mask=valid, other=0.0).to(tl.float32)
+        mean = tl.sum(x, axis=0) / K
+        centered = tl.where(valid, x - mean, 0.0)
+        var = tl.sum(centered * centered, axis=0) / K
+        tl.store(MEAN_ptr + row, mean)
+        tl.store(INVVAR_ptr + row, 1.0 / tl.sqrt(var + eps))
+
+    @triton.jit
+    def _normalize_tile(
+        X_ptr,
+        GAMMA_ptr,
+        BETA_ptr,
+        mean,
+        invvar,
+        rm,
+        rk,
+        M,
+        K,
+        HAS_GAMMA: tl.constexpr,
+        HAS_BETA: tl.constexpr,
+    ):
+        """Loads the [rm, rk] tile of the input and applies the LayerNorm to it. Out of
+        range columns come out as zero, so they add nothing to the dot products. rm is
+        int64, so the row offsets do not overflow."""
+        mask_m = rm < M
+        mask_k = rk < K
+        x = tl.load(
+            X_ptr + rm[:, None] * K + rk[None, :],
+            mask=mask_m[:, None] & mask_k[None, :],
+            other=0.0,
+        ).to(tl.float32)
+        x = (x - mean[:, None]) * invvar[:, None]
+        if HAS_GAMMA:
+            gamma = tl.load(GAMMA_ptr + rk, mask=mask_k, other=0.0).to(tl.float32)
+            x = x * gamma[None, :]
+        if HAS_BETA:
+            beta = tl.load(BETA_ptr + rk, mask=mask_k, other=0.0).to(tl.float32)
+            x = x + beta[None, :]
+        return tl.where(mask_k[None, :], x, 0.0)
+
+    @triton.jit
+    def _layer_norm_linear_fwd_kernel(
+        X_ptr,
+        GAMMA_ptr,
+        BETA_ptr,
+        MEAN_ptr,
+        INVVAR_ptr,
+        W_ptr,
+        B_ptr,
+        Y_ptr,
+        M,
+        N,
+        K,
+        HAS_GAMMA: tl.constexpr,
+        HAS_BETA: tl.constexpr,
+        HAS_BIAS: tl.constexpr,
+        INPUT_PRECISION: tl.constexpr,
+        BLOCK_M: tl.constexpr,
+        BLOCK_N: tl.constexpr,
+        BLOCK_K: tl.constexpr,
+    ):
+        """Y[M, N] = norm(X)[M, K] @ W[N, K]^T (+ B), normalizing X in the prologue."""
+        rm = (tl.program_id(0) * BLOCK_M + tl.arange(0, BLOCK_M)).to(tl.int64)
+        rn = (tl.program_id(1) * BLOCK_N + tl.arange(0, BLOCK_N)).to(tl.int64)
+        mask_m = rm < M
+        mask_n = rn < N
+        mean = tl.load(MEAN_ptr + rm, mask=mask_m, other=0.0)
+        invvar = tl.load(INVVAR_ptr + rm, mask=mask_m, other=0.0)
+
+        acc = tl.zeros((BLOCK_M, BLOCK_N), dtype=tl.float32)
+        for k in range(0, K, BLOCK_K):
+            rk = k + tl.arange(0, BLOCK_K)
+            x = _normalize_tile(
+                X_ptr, GAMMA_ptr, BETA_ptr, mean, invvar, rm, rk, M, K, HAS_GAMMA,
+                HAS_BETA,
+            )
+            w = tl.load(
+                W_ptr + rn[None, :] * K + rk[:, None],
+                mask=(rk[:, None] < K) & mask_n[None, :],
+                other=0.0,
+            )
+            acc = tl.dot(x.to(w.dtype), w, acc, input_precision=INPUT_PRECISION)
+
+        if HAS_BIAS:
+            b = tl.load(B_ptr + rn, mask=mask_n, other=0.0).to(tl.float32)
+            acc = acc + b[None, :]
+        tl.store(
+            Y_ptr + rm[:, None] * N + rn[None, :],
+            acc.to(Y_ptr.dtype.element_ty),
+            mask=mask_m[:, None] & mask_n[None, :],
+        )
+
+    @triton.jit
+    def _layer_norm_linear_bwd_weight_kernel(
+        DY_ptr,
+        X_ptr,
+        GAMMA_ptr,
+        BETA_ptr,
+        MEAN_ptr,
+        INVVAR_ptr,
+        DW_ptr,
+        M,
+        N,
+        K,
+        ROWS_PER_SPLIT,
+        HAS_GAMMA: tl.constexpr,
+        HAS_BETA: tl.constexpr,
+        INPUT_PRECISION: tl.constexpr,
+        BLOCK_M: tl.constexpr,
+        BLOCK_N: tl.constexpr,
+        BLOCK_K: tl.constexpr,
+    ):
+        """DW[split, N, K] = DY[rows, N]^T @ norm(X)[rows, K] over the rows of one split
+        of M (program axis 2), in fp32, normalizing X in the prologue. The caller sums
+        the splits."""
+        rn = tl.program_id(0) * BLOCK_N + tl.arange(0, BLOCK_N)
+        rk = tl.program_id(1) * BLOCK_K + tl.arange(0, BLOCK_K)
+        split = tl.program_id(2)
+        mask_n = rn < N
+        m_start = split * ROWS_PER_SPLIT
+        m_end = tl.minimum(m_start + ROWS_PER_SPLIT, M)
+
+        acc = tl.zeros((BLOCK_N, BLOCK_K), dtype=tl.float32)
+        for m in range(m_start, m_end, BLOCK_M):
+            rm = (m + tl.arange(0, BLOCK_M)).to(tl.int64)
+            mask_m = rm < m_end
+            mean = tl.load(MEAN_ptr + rm, mask=mask_m, other=0.0)
+            invvar = tl.load(INVVAR_ptr + rm, mask=mask_m, other=0.0)
+            x = _normalize_tile(
+                X_ptr, GAMMA_ptr, BETA_ptr, mean, invvar, rm, rk, m_end, K, HAS_GAMMA,
+                HAS_BETA,
+            )
+            dy = tl.load(
+                DY_ptr + rm[None, :] * N + rn[:, None],
+                mask=mask_n[:, None] & mask_m[None, :],
+                other=0.0,
+            )
+            # Rows past the split load a zero gradient, so their (beta-valued) inputs
+            # drop out.
+            acc = tl.dot(dy, x.to(dy.dtype), acc, input_precision=INPUT_PRECISION)
+
+        tl.store(
+            DW_ptr + split.to(tl.int64) * N * K + rn[:, None] * K + rk[None, :],
+            acc,
+            mask=mask_n[:, None] & (rk[None, :] < K),
+        )
+
+
+_BLOCK_M = 64
+_BLOCK_N = 64
+_BLOCK_K = 32
+# Programs per SM the weight-gradient grid aims for once M is split.
+_WAVES_PER_SM = 4
+
+
+def _input_precision(dtype: torch.dtype) -> str:
+    # Keep fp32 GEMMs as exact as torch.nn.functional.linear would run them.
+    if dtype == torch.float32 and not torch.backends.cuda.matmul.allow_tf32:
+        return "ieee"
+    return "tf32"
+
+
+def layer_norm_linear_forward(
+    input: torch.Tensor,
+    gamma: Optional[torch.Tensor],
+    beta: Optional[torch.Tensor],
+    weight: torch.Tensor,
+    bias: Optional[torch.Tensor],
+    eps: float,
+) -> tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+    """LayerNorm over the last dimension of the contiguous 2-D input, followed by the
+    projection onto weight [N, K]. Returns the output and the fp32 row statistics."""
+    M, K = input.shape
+    N = weight.shape[0]
+    mean = input.new_empty((M,), dtype=torch.float32)
+    invvar = torch.empty_like(mean)
+    output = input.new_empty((M, N))
+    if M == 0:
+        return output, mean, invvar
+
+    _layer_norm_stats_kernel[(M,)](
+        input, mean, invvar, K, eps, BLOCK_K=triton.next_power_of_2(K)
+    )
+    grid = (triton.cdiv(M, _BLOCK_M), triton.cdiv(N, _BLOCK_N))
+    _layer_norm_linear_fwd_kernel[grid](
+        input,
+        input if gamma is None else gamma,
+        input if beta is None else beta,
+        mean,
+        invvar,
+        weight,
+        input if bias is None else bias,
+        output,
+        M,
+        N,
+        K,
+        HAS_GAMMA=gamma is not None,
+        HAS_BETA=beta is not None,
+        HAS_BIAS=bias is not None,
+        INPUT_PRECISION=_input_precision(input.dtype),
+        BLOCK_M=_BLOCK_M,
+        BLOCK_N=_BLOCK_N,
+        BLOCK_K=_BLOCK_K,
+    )
+    return output, mean, invvar
+
+
+def layer_norm_linear_backward_weight(
+    grad_output: torch.Tensor,
+    input: torch.Tensor,
+    gamma: Optional[torch.Tensor],
+    beta: Optional[torch.Tensor],
+    mean: torch.Tensor,
+    invvar: torch.Tensor,
+) -> torch.Tensor:
+    """Gradient of the projection weight, grad_output^T @ LayerNorm(input), for the
+    contiguous 2-D grad_output [M, N] and input [M, K]."""
+    M, K = input.shape
+    N = grad_output.shape[1]
+    if M == 0:
+        return input.new_zeros((N, K))
+
+    # [N, K] is a handful of tiles for a pair projection while M is N_token^2, so M is
+    # split over a third grid axis until the grid fills the device; each split writes
+    # its fp32 partial sum, and the partials are added in a fixed order.
+    tiles = triton.cdiv(N, _BLOCK_N) * triton.cdiv(K, _BLOCK_K)
+    sms = torch.cuda.get_device_properties(input.device).multi_processor_count
+    m_blocks = triton.cdiv(M, _BLOCK_M)
+    splits = max(1, min(m_blocks, triton.cdiv(_WAVES_PER_SM * sms, tiles)))
+    rows_per_split = triton.cdiv(m_blocks, splits) * _BLOCK_M
+    splits = triton.cdiv(M, rows_per_split)
+    partials = input.new_empty((splits, N, K), dtype=torch.float32)
+
+    grid = (triton.cdiv(N, _BLOCK_N), triton.cdiv(K, _BLOCK_K), splits)
+    _layer_norm_linear_bwd_weight_kernel[grid](
+        grad_output,
+        input,
+        input if gamma is None else gamma,
+        input if beta is None else beta,
+        mean,
+        invvar,
+        partials,
+        M,
+        N,
+        K,
+        rows_per_split,
+        HAS_GAMMA=gamma is not None,
+        HAS_BETA=beta is not None,
+        INPUT_PRECISION=_input_precision(input.dtype),
+        BLOCK_M=_BLOCK_M,
+        BLOCK_N=_BLOCK_N,
+        BLOCK_K=_BLOCK_K,
+    )
+    return partials.sum(0).to(input.dtype)
@@ -0,0 +1,106 @@
+# Copyright 2024 ByteDance and/or its affiliates.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Per-call profiling of the fused LayerNorm extension.
+
+With PROTENIX_LAYERNORM_PROFILE=1 (or set_profiling(True)), every LayerNorm forward and
+backward of the extension is wrapped in an NVTX range tagged with rows, cols and dtype,
+with a mark naming the kernel and launch shape it dispatched to, and is timed with CUDA
+events. The calls still do not synchronize; the events are read back here:
+
+    set_profiling(True)
+    train_step()
+    print(profile_summary())
+
+The summary groups the calls by shape and kernel, so badly shaped norms (odd widths that
+fall back to narrow vector access, too few rows to fill the GPU) stand out by their
+achieved bandwidth.
+"""
+
+from collections import defaultdict
+from typing import Optional
+
+from protenix.model.layer_norm.layer_norm import fast_layer_norm_cuda_v2
+
+FIELDS = ("op", "rows", "cols", "dtype", "kernel", "bytes", "elapsed_us")
+
+
+def set_profiling(enabled: bool) -> None:
+    """Turns profiling on or off, overriding PROTENIX_LAYERNORM_PROFILE."""
+    fast_layer_norm_cuda_v2.set_profiling(enabled)
+
+
+def reset_profile_stats() -> None:
+    fast_layer_norm_cuda_v2.reset_profile_stats()
+
+
+def profile_stats() -> list[dict]:
+    """One dict per profiled call since the last reset, oldest first.
+
+    Waits for the recorded calls to finish on the device. gbps is bytes (every operand
+    read or written once) over elapsed_us.
+    """
+    stats = []
+    for call in fast_layer_norm_cuda_v2.profile_stats():
+        entry = dict(zip(FIELDS, call))
+        entry["gbps"] = entry["bytes"] / max(entry["elapsed_us"], 1e-3) / 1e3
+        stats.append(entry)
+    return stats
+
+
+def profile_summary(
+    peak_gbps: Optional[float] = None, sort_by: str = "total_us"
+) -> str:
+    """
+    Table of the profiled calls grouped by (op, rows, cols, dtype, kernel).
+
+    Args:
+        peak_gbps (float, optional) device DRAM bandwidth; adds a %peak column
+        sort_by (str) column the groups are sorted by, descending. Default: total_us
+    """
+    groups = defaultdict(list)
+    for entry in profile_stats():
+        key = tuple(entry[field] for field in FIELDS[:5])
+        groups[key].append(entry)
+    rows = []
+    for (op, n_rows, cols, dtype, kernel), calls in groups.items():
+        total_us = sum(call["elapsed_us"] for call in calls)
+        total_bytes = sum(call["bytes"] for call in calls)
+        rows.append(
+            dict(
+                op=op,
+                rows=n_rows,
+                cols=cols,
+                dtype=dtype,
+                kernel=kernel,
+                calls=len(calls),
+                total_us=total_us,
+                mean_us=total_us / len(calls),
+                gbps=total_bytes / max(total_us, 1e-3) / 1e3,
+            )
+        )
+    rows.sort(key=lambda row: row[sort_by], reverse=True)
+
+    lines = [
+        f"{'op':>17} {'rows':>9} {'cols':>6} {'dtype':>9} {'calls':>6} "
+        f"{'total us':>10} {'mean us':>9} {'GB/s':>7} {'%peak':>6}  kernel"
+    ]
+    for row in rows:
+        peak = f"{100 * row['gbps'] / peak_gbps:6.1f}" if peak_gbps else f"{'-':>6}"
+        lines.append(
+            f"{row['op']:>17} {row['rows']:>9} {row['cols']:>6} {row['dtype']:>9} "
+            f"{row['calls']:>6} {row['total_us']:>10.1f} {row['mean_us']:>9.1f} "
+            f"{row['gbps']:>7.1f} {peak}  {row['kernel']}"
+        )
+    return "\n".join(lines)
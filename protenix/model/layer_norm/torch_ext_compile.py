@@ -13,24 +13,79 @@
 # limitations under the License.
 
 
+"""Build settings of the fused LayerNorm extension.
+
+setup.py compiles it ahead of time with these flags (build_extension); compile() is the
+import-time JIT fallback for installs that shipped without the prebuilt module. Without
+a CUDA toolkit both build a CPU-only CppExtension instead: layer_norm_cuda.cpp compiled
+without WITH_CUDA, which binds the plain LayerNorm forward and backward for CPU tensors.
+"""
+
 import os
+import re
+import shutil
+import subprocess
 from typing import Any, Optional
 
-from torch.utils.cpp_extension import load
+EXTENSION_NAME = "fast_layer_norm_cuda_v2"
+KERNEL_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "kernel")
+# setup.py's directory; setuptools wants the sources relative to it.
+PROJECT_ROOT = os.path.abspath(
+    os.path.join(os.path.dirname(__file__), "..", "..", "..")
+)
+SOURCES = ["layer_norm_cuda.cpp", "layer_norm_cuda_kernel.cu", "layer_norm_cpu.cpp"]
+CPU_SOURCES = [file for file in SOURCES if not file.endswith(".cu")]
 
+# (compute, sm) targets, oldest first.
+WANTED_ARCHS = [
+    ("70", "70"),
+    ("80", "80"),
+    ("86", "86"),
+    ("89", "89"),
+    ("90", "90"),
+    ("100", "100"),
+]
 
-def compile(
-    name: str,
-    sources: list[str],
-    extra_include_paths: list[str],
-    build_directory: Optional[str] = None,
-) -> Any:
+EXTRA_CFLAGS = [
+    "-O3",
+    "-DVERSION_GE_1_1",
+    "-DVERSION_GE_1_3",
+    "-DVERSION_GE_1_5",
+    # layer_norm_cpu.cpp vectorizes its row loops with omp simd.
+    "-fopenmp",
+]
+
+EXTRA_LDFLAGS = ["-fopenmp"]
+
+# Turns on the CUDA bindings of layer_norm_cuda.cpp.
+CUDA_CFLAGS = ["-DWITH_CUDA"]
+
+EXTRA_CUDA_CFLAGS = [
+    "-O3",
+    "--use_fast_math",
+    "-DVERSION_GE_1_1",
+    "-DVERSION_GE_1_3",
+    "-DVERSION_GE_1_5",
+    "-std=c++17",
+    "-maxrregcount=32",
+    "-U__CUDA_NO_HALF_OPERATORS__",
+    "-U__CUDA_NO_HALF_CONVERSIONS__",
+    "--expt-relaxed-constexpr",
+    "--expt-extended-lambda",
+]
+
+
+def cuda_toolkit_available() -> bool:
+    """Whether PyTorch found a CUDA toolkit (nvcc) to build the kernels with."""
+    from torch.utils.cpp_extension import CUDA_HOME
+
+    return CUDA_HOME is not None
+
+
+def supported_archs() -> list[tuple[str, str]]:
+    """The WANTED_ARCHS the installed nvcc can target."""
     # Query supported architectures from nvcc (resolved via PyTorch's
     # CUDA_HOME so we use the same toolchain as cpp_extension.load).
-    import re
-    import shutil
-    import subprocess
-
     from torch.utils.cpp_extension import CUDA_HOME
 
     _nvcc = shutil.which("nvcc")
@@ -47,50 +102,95 @@ def compile(
         _supported = set(re.findall(r"compute_(\d+)", out))
     except Exception:
         _supported = {"70", "80", "86", "90"}  # safe defaults
+    return [(compute, sm) for compute, sm in WANTED_ARCHS if compute in _supported]
+
+
+def gencode_flags(archs: list[tuple[str, str]], with_ptx: bool = False) -> list[str]:
+    """-gencode flags for archs; with_ptx also embeds PTX of the newest one, which the
+    driver JIT-compiles on GPUs newer than any of them."""
+    flags = []
+    for compute, sm in archs:
+        flags += ["-gencode", f"arch=compute_{compute},code=sm_{sm}"]
+    if not flags:
+        archs = [("80", "80")]
+        flags = ["-gencode", "arch=compute_80,code=sm_80"]
+    if with_ptx:
+        compute = archs[-1][0]
+        flags += ["-gencode", f"arch=compute_{compute},code=compute_{compute}"]
+    return flags
+
 
-    _wanted = [
-        ("70", "70"),
-        ("80", "80"),
-        ("86", "86"),
-        ("89", "89"),
-        ("90", "90"),
-        ("100", "100"),
-    ]
-    gencode_flags = []
-    for compute, sm in _wanted:
-        if compute in _supported:
-            gencode_flags += ["-gencode", f"arch=compute_{compute},code=sm_{sm}"]
-    if not gencode_flags:
-        gencode_flags = ["-gencode", "arch=compute_80,code=sm_80"]
+def torch_cuda_arch_list(archs: list[tuple[str, str]]) -> str:
+    """TORCH_CUDA_ARCH_LIST spelling of archs."""
+    _arch_list = [f"{int(c)//10}.{int(c)%10}" for c, _ in archs]
+    return ";".join(_arch_list) if _arch_list else "8.0"
 
+
+def build_extension(cpu_only: bool = False) -> Any:
+    """The ahead-of-time extension for setup.py: a CUDAExtension with SASS for every
+    supported arch plus PTX of the newest, or with cpu_only the CPU CppExtension."""
+    from torch.utils.cpp_extension import CppExtension, CUDAExtension
+
+    name = f"protenix.model.layer_norm.{EXTENSION_NAME}"
+
+    def relative(files: list[str]) -> list[str]:
+        return [
+            os.path.relpath(os.path.join(KERNEL_DIR, file), PROJECT_ROOT)
+            for file in files
+        ]
+
+    if cpu_only:
+        return CppExtension(
+            name=name,
+            sources=relative(CPU_SOURCES),
+            include_dirs=[KERNEL_DIR],
+            extra_compile_args={"cxx": EXTRA_CFLAGS},
+            extra_link_args=EXTRA_LDFLAGS,
+        )
+    archs = supported_archs()
+    return CUDAExtension(
+        name=name,
+        sources=relative(SOURCES),
+        include_dirs=[KERNEL_DIR],
+        extra_compile_args={
+            "cxx": EXTRA_CFLAGS + CUDA_CFLAGS,
+            "nvcc": EXTRA_CUDA_CFLAGS + gencode_flags(archs, with_ptx=True),
+        },
+        extra_link_args=EXTRA_LDFLAGS,
+    )
+
+
+def compile(
+    name: str,
+    sources: list[str],
+    extra_include_paths: list[str],
+    build_directory: Optional[str] = None,
+) -> Any:
+    from torch.utils.cpp_extension import load
+
+    if not cuda_toolkit_available():
+        # The CPU-only build: the .cu sources would make load() look for nvcc.
+        return load(
+            name=name,
+            sources=[file for file in sources if not file.endswith(".cu")],
+            extra_include_paths=extra_include_paths,
+            extra_cflags=EXTRA_CFLAGS,
+            extra_ldflags=EXTRA_LDFLAGS,
+            verbose=True,
+            build_directory=build_directory,
+        )
+
+    archs = supported_archs()
     # Build TORCH_CUDA_ARCH_LIST dynamically from supported architectures
-    _arch_list = [f"{int(c)//10}.{int(c)%10}" for c, _ in _wanted if c in _supported]
-    os.environ["TORCH_CUDA_ARCH_LIST"] = ";".join(_arch_list) if _arch_list else "8.0"
+    os.environ["TORCH_CUDA_ARCH_LIST"] = torch_cuda_arch_list(archs)
 
     return load(
         name=name,
         sources=sources,
         extra_include_paths=extra_include_paths,
-        extra_cflags=[
-            "-O3",
-            "-DVERSION_GE_1_1",
-            "-DVERSION_GE_1_3",
-            "-DVERSION_GE_1_5",
-        ],
-        extra_cuda_cflags=[
-            "-O3",
-            "--use_fast_math",
-            "-DVERSION_GE_1_1",
-            "-DVERSION_GE_1_3",
-            "-DVERSION_GE_1_5",
-            "-std=c++17",
-            "-maxrregcount=32",
-            "-U__CUDA_NO_HALF_OPERATORS__",
-            "-U__CUDA_NO_HALF_CONVERSIONS__",
-            "--expt-relaxed-constexpr",
-            "--expt-extended-lambda",
-        ]
-        + gencode_flags,
+        extra_cflags=EXTRA_CFLAGS + CUDA_CFLAGS,
+        extra_cuda_cflags=EXTRA_CUDA_CFLAGS + gencode_flags(archs),
+        extra_ldflags=EXTRA_LDFLAGS,
         verbose=True,
         build_directory=build_directory,
     )
@@ -20,7 +20,11 @@ import torch
 import torch.nn as nn
 import torch.nn.functional as F
 
-from protenix.model.triangular.layers import LayerNorm, trunc_normal_init_
+from protenix.model.triangular.layers import (
+    LayerNorm,
+    fastln_is_installed,
+    trunc_normal_init_,
+)
 from protenix.model.utils import (
     chunk_layer,
     flatten_final_dims,
@@ -29,6 +33,9 @@ from protenix.model.utils import (
     reshape_at_dim,
 )
 
+if fastln_is_installed:
+    from protenix.model.layer_norm.layer_norm import fused_ada_layer_norm
+
 
 class Linear(nn.Linear):
     """Linear module with customized initialization.
@@ -131,9 +138,14 @@ class AdaptiveLayerNorm(nn.Module):
             torch.Tensor: the updated a from AdaLN
                 [..., N_token, c_a]
         """
-        a = self.layernorm_a(a)
         s = self.layernorm_s(s)
-        a = torch.sigmoid(self.linear_s(s)) * a + self.linear_nobias_s(s)
+        scale = self.linear_s(s)
+        shift = self.linear_nobias_s(s)
+        if fastln_is_installed and a.is_cuda and scale.shape == a.shape:
+            # Normalization, sigmoid gate and shift in one kernel.
+            return fused_ada_layer_norm(a, scale, shift, self.layernorm_a.eps)
+        a = self.layernorm_a(a)
+        a = torch.sigmoid(scale) * a + shift
         return a
 
 
@@ -676,11 +676,15 @@ class TriangleAttention(nn.Module):
             )
 
         if not self.starting:
-            x = x.transpose(-2, -3)
             mask = mask.transpose(-1, -2)
-
-        # [*, I, J, C_in]
-        x = self.layer_norm(x)
+            if hasattr(self.layer_norm, "forward_transposed"):
+                # The fused LayerNorm writes the transposed layout itself.
+                x = self.layer_norm.forward_transposed(x)
+            else:
+                x = self.layer_norm(x.transpose(-2, -3))
+        else:
+            # [*, I, J, C_in]
+            x = self.layer_norm(x)
 
         # [*, I, 1, 1, J]
         mask_bias = (self.inf * (mask - 1))[..., :, None, None, :]
@@ -0,0 +1,333 @@
+# Copyright 2024 ByteDance and/or its affiliates.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Benchmark the fused LayerNorm extension.
+
+Sweeps rows, cols, dtype, affine mode and direction, and reports for every
+configuration the median time, the achieved bandwidth (against the device peak when
+known) and the speedup over torch.nn.functional.layer_norm and OpenFoldLayerNorm.
+
+    python scripts/benchmark_layer_norm.py --output ln_bench.jsonl
+
+With --linear-out-features it instead compares FusedLayerNormLinear against the
+unfused FusedLayerNorm followed by torch.nn.functional.linear, forward and backward.
+
+    python scripts/benchmark_layer_norm.py --linear-out-features 128 512
+
+Every result is one JSON object per line in --output, so runs on different GPUs and
+releases can be concatenated and compared.
+"""
+
+import argparse
+import itertools
+import json
+import logging
+import platform
+import statistics
+from typing import Callable, Optional
+
+import torch
+
+from protenix.model.layer_norm.layer_norm import FusedLayerNorm, FusedLayerNormLinear
+from protenix.model.triangular.layers import OpenFoldLayerNorm
+
+logger = logging.getLogger(__name__)
+
+DTYPES = {"fp32": torch.float32, "fp16": torch.float16, "bf16": torch.bfloat16}
+AFFINE_MODES = {
+    "scale+offset": (True, True),
+    "scale": (True, False),
+    "offset": (False, True),
+    "none": (False, False),
+}
+
+
+def device_peak_gbps() -> Optional[float]:
+    """Theoretical DRAM bandwidth of the current device from NVML, if available."""
+    try:
+        import pynvml
+
+        pynvml.nvmlInit()
+        handle = pynvml.nvmlDeviceGetHandleByIndex(torch.cuda.current_device())
+        mem_clock_mhz = pynvml.nvmlDeviceGetMaxClockInfo(handle, pynvml.NVML_CLOCK_MEM)
+        bus_width_bits = pynvml.nvmlDeviceGetMemoryBusWidth(handle)
+        # Double data rate.
+        return 2 * mem_clock_mhz * 1e6 * bus_width_bits / 8 / 1e9
+    except Exception:
+        return None
+
+
+def time_us(fn: Callable[[], object], warmup: int, iters: int) -> float:
+    """Median time of fn in microseconds, measured with CUDA events."""
+    for _ in range(warmup):
+        fn()
+    times = []
+    for _ in range(iters):
+        start = torch.cuda.Event(enable_timing=True)
+        end = torch.cuda.Event(enable_timing=True)
+        start.record()
+        fn()
+        end.record()
+        end.synchronize()
+        times.append(start.elapsed_time(end) * 1e3)
+    return statistics.median(times)
+
+
+def bytes_moved(
+    rows: int, cols: int, dtype: torch.dtype, scale: bool, offset: bool, direction: str
+) -> int:
+    """Minimum DRAM traffic of one call: every tensor read or written exactly once."""
+    elem = torch.tensor([], dtype=dtype).element_size()
+    activation = rows * cols * elem
+    params = (int(scale) + int(offset)) * cols * elem
+    stats = 2 * rows * 4
+    if direction == "forward":
+        # input, output, parameters, mean/invvar
+        return 2 * activation + params + stats
+    # dout, input, grad_input, parameters and their gradients, mean/invvar
+    return 3 * activation + 2 * params + stats
+
+
+def make_candidates(cols: int, scale: bool, offset: bool, dtype: torch.dtype) -> dict:
+    """name -> (callable, parameters) for every implementation being compared."""
+    fused = FusedLayerNorm(cols, create_scale=scale, create_offset=offset)
+    fused = fused.cuda().to(dtype)
+    openfold = OpenFoldLayerNorm(cols, scale, offset).cuda().to(dtype)
+
+    def torch_layer_norm(x):
+        return torch.nn.functional.layer_norm(
+            x, (cols,), openfold.weight, openfold.bias, openfold.eps
+        )
+
+    return {
+        "fused": (fused, list(fused.parameters())),
+        "torch": (torch_layer_norm, list(openfold.parameters())),
+        "openfold": (openfold, list(openfold.parameters())),
+    }
+
+
+def benchmark_config(
+    rows: int,
+    cols: int,
+    dtype_name: str,
+    affine: str,
+    direction: str,
+    warmup: int,
+    iters: int,
+) -> dict:
+    dtype = DTYPES[dtype_name]
+    scale, offset = AFFINE_MODES[affine]
+    candidates = make_candidates(cols, scale, offset, dtype)
+    x = torch.randn(rows, cols, device="cuda", dtype=dtype)
+    dout = torch.randn_like(x)
+
+    times = {}
+    for name, (fn, params) in candidates.items():
+        if direction == "forward":
+            with torch.no_grad():
+                times[name] = time_us(lambda: fn(x), warmup, iters)
+        else:
+            x_grad = x.detach().requires_grad_(True)
+            out = fn(x_grad)
+            inputs = [x_grad] + params
+            times[name] = time_us(
+                lambda: torch.autograd.grad(out, inputs, dout, retain_graph=True),
+                warmup,
+                iters,
+            )
+
+    nbytes = bytes_moved(rows, cols, dtype, scale, offset, direction)
+    gbps = nbytes / (times["fused"] * 1e-6) / 1e9
+    return {
+        "rows": rows,
+        "cols": cols,
+        "dtype": dtype_name,
+        "affine": affine,
+        "direction": direction,
+        "fused_us": times["fused"],
+        "torch_us": times["torch"],
+        "openfold_us": times["openfold"],
+        "bytes": nbytes,
+        "fused_gbps": gbps,
+        "speedup_vs_torch": times["torch"] / times["fused"],
+        "speedup_vs_openfold": times["openfold"] / times["fused"],
+    }
+
+
+def benchmark_linear_config(
+    rows: int,
+    cols: int,
+    out_features: int,
+    dtype_name: str,
+    direction: str,
+    warmup: int,
+    iters: int,
+) -> dict:
+    dtype = DTYPES[dtype_name]
+    fused = FusedLayerNormLinear(cols, out_features).cuda().to(dtype)
+    layer_norm = fused.layer_norm
+
+    def unfused(x):
+        return torch.nn.functional.linear(
+            layer_norm(x), fused.linear_weight, fused.linear_bias
+        )
+
+    x = torch.randn(rows, cols, device="cuda", dtype=dtype)
+    dout = torch.randn(rows, out_features, device="cuda", dtype=dtype)
+    params = list(fused.parameters())
+
+    times = {}
+    for name, fn in (("fused", fused), ("unfused", unfused)):
+        if direction == "forward":
+            with torch.no_grad():
+                times[name] = time_us(lambda: fn(x), warmup, iters)
+        else:
+            x_grad = x.detach().requires_grad_(True)
+            out = fn(x_grad)
+            inputs = [x_grad] + params
+            times[name] = time_us(
+                lambda: torch.autograd.grad(out, inputs, dout, retain_graph=True),
+                warmup,
+                iters,
+            )
+
+    flops = 2 * rows * cols * out_features * (1 if direction == "forward" else 2)
+    return {
+        "rows": rows,
+        "cols": cols,
+        "out_features": out_features,
+        "dtype": dtype_name,
+        "direction": direction,
+        "fused_us": times["fused"],
+        "unfused_us": times["unfused"],
+        "fused_tflops": flops / (times["fused"] * 1e-6) / 1e12,
+        "speedup_vs_unfused": times["unfused"] / times["fused"],
+    }
+
+
+def run_linear(args, environment: dict, output) -> None:
+    logger.info(
+        f"{'rows':>8} {'cols':>5} {'out':>5} {'dtype':>5} {'dir':>8} "
+        f"{'fused us':>9} {'TFLOP/s':>8} {'x unfused':>9}"
+    )
+    configs = itertools.product(
+        args.directions, args.dtypes, args.linear_out_features, args.cols, args.rows
+    )
+    for direction, dtype_name, out_features, cols, rows in configs:
+        result = benchmark_linear_config(
+            rows, cols, out_features, dtype_name, direction, args.warmup, args.iters
+        )
+        result.update(environment)
+        logger.info(
+            f"{rows:>8} {cols:>5} {out_features:>5} {dtype_name:>5} {direction:>8} "
+            f"{result['fused_us']:>9.1f} {result['fused_tflops']:>8.2f} "
+            f"{result['speedup_vs_unfused']:>9.2f}"
+        )
+        if output is not None:
+            output.write(json.dumps(result) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument(
+        "--rows", type=int, nargs="+", default=[4096, 65536, 384 * 384]
+    )
+    parser.add_argument(
+        "--cols", type=int, nargs="+", default=[64, 128, 256, 384, 768, 100, 257]
+    )
+    parser.add_argument(
+        "--dtypes", nargs="+", choices=list(DTYPES), default=list(DTYPES)
+    )
+    parser.add_argument(
+        "--affine", nargs="+", choices=list(AFFINE_MODES), default=list(AFFINE_MODES)
+    )
+    parser.add_argument(
+        "--directions",
+        nargs="+",
+        choices=["forward", "backward"],
+        default=["forward", "backward"],
+    )
+    parser.add_argument("--warmup", type=int, default=10)
+    parser.add_argument("--iters", type=int, default=50)
+    parser.add_argument(
+        "--peak-gbps",
+        type=float,
+        default=None,
+        help="Device DRAM bandwidth; queried from NVML when omitted.",
+    )
+    parser.add_argument(
+        "--linear-out-features",
+        type=int,
+        nargs="+",
+        default=None,
+        help="Benchmark FusedLayerNormLinear with these output sizes instead.",
+    )
+    parser.add_argument("--output", type=str, default=None, help="JSON lines file.")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO, format="%(message)s")
+
+    peak_gbps = args.peak_gbps or device_peak_gbps()
+    environment = {
+        "device": torch.cuda.get_device_name(),
+        "torch": torch.__version__,
+        "cuda": torch.version.cuda,
+        "host": platform.node(),
+        "peak_gbps": peak_gbps,
+    }
+    logger.info(json.dumps(environment))
+    if args.linear_out_features:
+        output = open(args.output, "a") if args.output else None
+        try:
+            run_linear(args, environment, output)
+        finally:
+            if output is not None:
+                output.close()
+        return
+
+    logger.info(
+        f"{'rows':>8} {'cols':>5} {'dtype':>5} {'affine':>12} {'dir':>8} "
+        f"{'fused us':>9} {'GB/s':>7} {'%peak':>6} {'x torch':>8} {'x openfold':>10}"
+    )
+
+    configs = itertools.product(
+        args.directions, args.dtypes, args.affine, args.cols, args.rows
+    )
+    output = open(args.output, "a") if args.output else None
+    try:
+        for direction, dtype_name, affine, cols, rows in configs:
+            result = benchmark_config(
+                rows, cols, dtype_name, affine, direction, args.warmup, args.iters
+            )
+            result["peak_fraction"] = (
+                result["fused_gbps"] / peak_gbps if peak_gbps else None
+            )
+            result.update(environment)
+            peak = (
+                f"{100 * result['peak_fraction']:6.1f}" if peak_gbps else f"{'-':>6}"
+            )
+            logger.info(
+                f"{rows:>8} {cols:>5} {dtype_name:>5} {affine:>12} {direction:>8} "
+                f"{result['fused_us']:>9.1f} {result['fused_gbps']:>7.1f} {peak} "
+                f"{result['speedup_vs_torch']:>8.2f} "
+                f"{result['speedup_vs_openfold']:>10.2f}"
+            )
+            if output is not None:
+                output.write(json.dumps(result) + "\n")
+    finally:
+        if output is not None:
+            output.close()
+
+
+if __name__ == "__main__":
+    main()
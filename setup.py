@@ -12,6 +12,8 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import importlib.util
+import os
 import sys
 from pathlib import Path
 
@@ -33,8 +35,39 @@ long_description = (this_directory / "README.md").read_text()
 with open("requirements.txt") as f:
     install_requires = f.read().splitlines()
 
+
+def layer_norm_extension(cpu_only: bool) -> tuple[list, dict]:
+    """The fused LayerNorm kernels as a prebuilt extension, so importing the model does
+    not JIT-compile them. With --cpu, or without a CUDA toolkit at install time, this is
+    the CPU-only CppExtension. Without torch at install time (or with
+    PROTENIX_SKIP_CUDA_BUILD=1) nothing is built and the kernels are compiled on first
+    use as before.
+    """
+    if os.environ.get("PROTENIX_SKIP_CUDA_BUILD", "0") == "1":
+        return [], {}
+    try:
+        from torch.utils.cpp_extension import CUDA_HOME, BuildExtension
+    except ImportError:
+        print("torch is not installed; the LayerNorm kernels are compiled on first use")
+        return [], {}
+    if CUDA_HOME is None and not cpu_only:
+        print("No CUDA toolkit found; building the CPU-only LayerNorm extension")
+        cpu_only = True
+    # Loaded by path: importing the protenix package would trigger the JIT build itself.
+    spec = importlib.util.spec_from_file_location(
+        "torch_ext_compile",
+        this_directory / "protenix" / "model" / "layer_norm" / "torch_ext_compile.py",
+    )
+    torch_ext_compile = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(torch_ext_compile)
+    return [torch_ext_compile.build_extension(cpu_only)], {"build_ext": BuildExtension}
+
+
+cpu_only = "--cpu" in sys.argv
+ext_modules, cmdclass = layer_norm_extension(cpu_only)
+
 # Check if the user specified the CPU option
-if "--cpu" in sys.argv:
+if cpu_only:
     # Remove the gpu packages
     try:
         to_drop = [x for x in install_requires if "nvidia" in x or "cuda" in x]
@@ -67,6 +100,8 @@ setup(
         "protenix": ["model/layer_norm/kernel/*"],
     },
     install_requires=install_requires,
+    ext_modules=ext_modules,
+    cmdclass=cmdclass,
     license="Apache 2.0 License",
     platforms="manylinux1",
     entry_points={
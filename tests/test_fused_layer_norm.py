@@ -0,0 +1,1447 @@
+# Copyright 2024 ByteDance and/or its affiliates.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Tests for the fused LayerNorm CUDA extension.
+
+Every kernel variant is compared against torch.nn.functional.layer_norm.
+"""
+
+import json
+import os
+import tempfile
+import unittest
+from unittest import mock
+
+import torch
+
+try:
+    from protenix.model.layer_norm import profiling
+    from protenix.model.layer_norm.autotune import LayerNormAutotuner
+    from protenix.model.layer_norm.layer_norm import (
+        FusedLayerNorm,
+        FusedLayerNormLinear,
+        FusedRMSNorm,
+        fast_layer_norm_cuda_v2,
+        fused_ada_layer_norm,
+        fused_grouped_layer_norm,
+        fused_layer_norm_fp8,
+        fused_layer_norm_inference,
+        fused_layer_norm_masked,
+        fused_layer_norm_streaming,
+    )
+
+    # The CPU tests only need the extension, which also builds without a CUDA toolkit.
+    FUSED_LN_IMPORTED = True
+except Exception:
+    FUSED_LN_IMPORTED = False
+FUSED_LN_AVAILABLE = FUSED_LN_IMPORTED and torch.cuda.is_available()
+
+TOLERANCES = {
+    torch.float32: dict(atol=1e-4, rtol=1e-4),
+    torch.float16: dict(atol=1e-2, rtol=1e-2),
+    torch.bfloat16: dict(atol=5e-2, rtol=5e-2),
+}
+
+AFFINE_MODES = [(True, True), (True, False), (False, True), (False, False)]
+
+
+def _reference(layer_norm, x):
+    weight = layer_norm.weight
+    bias = layer_norm.bias
+    return torch.nn.functional.layer_norm(
+        x.float(),
+        layer_norm.normalized_shape,
+        None if weight is None else weight.float(),
+        None if bias is None else bias.float(),
+        layer_norm.eps,
+    )
+
+
+def _random_layer_norm(cols, create_scale, create_offset, dtype):
+    layer_norm = FusedLayerNorm(
+        cols, create_scale=create_scale, create_offset=create_offset
+    ).cuda()
+    with torch.no_grad():
+        if layer_norm.weight is not None:
+            layer_norm.weight.normal_(1.0, 0.1)
+        if layer_norm.bias is not None:
+            layer_norm.bias.normal_(0.0, 0.1)
+    return layer_norm.to(dtype)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormForward(unittest.TestCase):
+    # Register-cached, block-per-row and generic-path widths.
+    COLS = [32, 64, 128, 256, 384, 768, 1024, 1536, 2048, 100, 200]
+    # Few rows select the block-per-row kernels for cols >= 384; odd counts exercise
+    # partially filled blocks.
+    ROWS = [37, 1031]
+
+    def test_forward_matches_torch(self):
+        torch.manual_seed(0)
+        for dtype, tol in TOLERANCES.items():
+            for rows in self.ROWS:
+                for cols in self.COLS:
+                    for create_scale, create_offset in AFFINE_MODES:
+                        with self.subTest(
+                            dtype=dtype,
+                            rows=rows,
+                            cols=cols,
+                            scale=create_scale,
+                            offset=create_offset,
+                        ):
+                            layer_norm = _random_layer_norm(
+                                cols, create_scale, create_offset, dtype
+                            )
+                            x = torch.randn(rows, cols, device="cuda", dtype=dtype)
+                            x = x * 3 + 1
+                            out = layer_norm(x)
+                            self.assertEqual(out.dtype, dtype)
+                            torch.testing.assert_close(
+                                out.float(), _reference(layer_norm, x), **tol
+                            )
+
+    def test_widest_cached_rows(self):
+        # The row cache alone is 48 KB at 12288 columns; with the reduction's static
+        # shared memory the launch needs the opt-in above the default limit.
+        torch.manual_seed(0)
+        for cols in [12160, 12200, 12288]:
+            with self.subTest(cols=cols):
+                layer_norm = _random_layer_norm(cols, True, True, torch.float32)
+                x = torch.randn(37, cols, device="cuda") * 3 + 1
+                out = layer_norm(x)
+                torch.testing.assert_close(
+                    out, _reference(layer_norm, x), **TOLERANCES[torch.float32]
+                )
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormBackward(unittest.TestCase):
+    COLS = [64, 128, 384, 2048, 100]
+
+    def test_backward_matches_torch(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            for create_scale, create_offset in AFFINE_MODES:
+                with self.subTest(cols=cols, scale=create_scale, offset=create_offset):
+                    layer_norm = _random_layer_norm(
+                        cols, create_scale, create_offset, torch.float32
+                    )
+                    x = torch.randn(53, cols, device="cuda", requires_grad=True)
+                    x_ref = x.detach().clone().requires_grad_(True)
+                    grad_out = torch.randn(53, cols, device="cuda")
+
+                    layer_norm(x).backward(grad_out)
+                    params = [
+                        p for p in (layer_norm.weight, layer_norm.bias) if p is not None
+                    ]
+                    ref_grads = torch.autograd.grad(
+                        _reference(layer_norm, x_ref), [x_ref] + params, grad_out
+                    )
+                    torch.testing.assert_close(
+                        x.grad, ref_grads[0], **TOLERANCES[torch.float32]
+                    )
+                    for p, ref in zip(params, ref_grads[1:]):
+                        torch.testing.assert_close(p.grad, ref, atol=1e-3, rtol=1e-3)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormBackwardManyRows(unittest.TestCase):
+    """Enough rows that the single-sweep backward walks several rows per row group
+    before the gamma/beta partials are reduced."""
+
+    def test_backward_matches_torch(self):
+        torch.manual_seed(0)
+        for dtype in [torch.float32, torch.bfloat16]:
+            for cols in [32, 128, 384]:
+                with self.subTest(dtype=dtype, cols=cols):
+                    layer_norm = _random_layer_norm(cols, True, True, dtype)
+                    x = torch.randn(20011, cols, device="cuda", dtype=dtype)
+                    x.requires_grad_(True)
+                    x_ref = x.detach().float().requires_grad_(True)
+                    grad_out = torch.randn(20011, cols, device="cuda", dtype=dtype)
+
+                    layer_norm(x).backward(grad_out)
+                    params = [layer_norm.weight, layer_norm.bias]
+                    ref_params = [
+                        p.detach().float().requires_grad_(True) for p in params
+                    ]
+                    ref_out = torch.nn.functional.layer_norm(
+                        x_ref, (cols,), *ref_params, layer_norm.eps
+                    )
+                    ref_grads = torch.autograd.grad(
+                        ref_out, [x_ref] + ref_params, grad_out.float()
+                    )
+                    torch.testing.assert_close(
+                        x.grad.float(), ref_grads[0], **TOLERANCES[dtype]
+                    )
+                    for p, ref in zip(params, ref_grads[1:]):
+                        # Sums over 20k rows; compare relative to the gradient scale.
+                        scale = ref.abs().max().item()
+                        torch.testing.assert_close(
+                            p.grad.float() / scale, ref / scale, atol=1e-2, rtol=1e-2
+                        )
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormStatsFree(unittest.TestCase):
+    # In-kernel recomputation (128) and the separate statistics pass (384 with few rows,
+    # 2048, 100).
+    COLS = [128, 384, 2048, 100]
+
+    def test_matches_backward_with_saved_stats(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            with self.subTest(cols=cols):
+                layer_norm = _random_layer_norm(cols, True, True, torch.float32)
+                x = torch.randn(53, cols, device="cuda") * 3 + 1
+                grad_out = torch.randn(53, cols, device="cuda")
+                grads = []
+                for save_stats in [True, False]:
+                    layer_norm.save_stats = save_stats
+                    layer_norm.zero_grad(set_to_none=True)
+                    x_ = x.clone().requires_grad_(True)
+                    layer_norm(x_).backward(grad_out)
+                    grads.append(
+                        [x_.grad, layer_norm.weight.grad, layer_norm.bias.grad]
+                    )
+                for saved, recomputed in zip(*grads):
+                    torch.testing.assert_close(recomputed, saved, atol=1e-4, rtol=1e-4)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormInference(unittest.TestCase):
+    COLS = [128, 2048, 100]
+
+    def test_matches_training_forward(self):
+        torch.manual_seed(0)
+        for dtype in TOLERANCES:
+            for cols in self.COLS:
+                with self.subTest(dtype=dtype, cols=cols):
+                    layer_norm = _random_layer_norm(cols, True, True, dtype)
+                    x = torch.randn(37, cols, device="cuda", dtype=dtype)
+                    expected = layer_norm(x)
+                    with torch.no_grad():
+                        out = layer_norm(x)
+                    torch.testing.assert_close(out, expected, atol=0, rtol=0)
+
+    def test_writes_into_out(self):
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(128, True, True, torch.float32)
+        x = torch.randn(4, 16, 128, device="cuda")
+        # Chunks of a preallocated output, with untouched slots on either side.
+        buffer = torch.full((6, 16, 128), float("nan"), device="cuda")
+        params = (layer_norm.weight, layer_norm.bias, layer_norm.eps)
+        with torch.no_grad():
+            for start in range(0, 4, 2):
+                chunk = slice(start, start + 2)
+                out_chunk = buffer[1 + start : 3 + start]
+                out = fused_layer_norm_inference(
+                    x[chunk], (128,), *params, out=out_chunk
+                )
+                self.assertEqual(out.data_ptr(), out_chunk.data_ptr())
+            # Rows in a different memory order than the input's.
+            transposed = torch.empty(16, 4, 128, device="cuda").transpose(0, 1)
+            with self.assertRaises(RuntimeError):
+                fused_layer_norm_inference(x, (128,), *params, out=transposed)
+        torch.testing.assert_close(
+            buffer[1:5], _reference(layer_norm, x), atol=1e-4, rtol=1e-4
+        )
+        self.assertTrue(buffer[0].isnan().all() and buffer[5].isnan().all())
+
+    def test_rejects_autograd(self):
+        layer_norm = _random_layer_norm(128, True, True, torch.float32)
+        x = torch.randn(4, 128, device="cuda")
+        with self.assertRaises(RuntimeError):
+            fused_layer_norm_inference(x, (128,), layer_norm.weight, layer_norm.bias)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormStreaming(unittest.TestCase):
+    def test_matches_device_forward(self):
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(128, True, True, torch.bfloat16)
+        params = (layer_norm.weight, layer_norm.bias, layer_norm.eps)
+        x = torch.randn(5, 41, 128, dtype=torch.bfloat16).pin_memory()
+        with torch.no_grad():
+            expected = layer_norm(x.cuda())
+        # One chunk, an uneven last chunk, and more chunks than buffers.
+        for chunk_rows in [None, 64, 7]:
+            with self.subTest(chunk_rows=chunk_rows):
+                out = fused_layer_norm_streaming(
+                    x, (128,), *params, chunk_rows=chunk_rows
+                )
+                self.assertEqual(out.device.type, "cpu")
+                self.assertTrue(out.is_pinned())
+                torch.testing.assert_close(out.cuda(), expected, atol=0, rtol=0)
+
+                out = torch.empty_like(expected)
+                fused_layer_norm_streaming(
+                    x, (128,), *params, out=out, chunk_rows=chunk_rows
+                )
+                torch.testing.assert_close(out, expected, atol=0, rtol=0)
+
+    def test_in_place_on_host(self):
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(100, False, True, torch.float32)
+        x = torch.randn(300, 100).pin_memory()
+        expected = _reference(layer_norm, x.cuda())
+        out = fused_layer_norm_streaming(
+            x, (100,), None, layer_norm.bias, layer_norm.eps, out=x, chunk_rows=32
+        )
+        self.assertEqual(out.data_ptr(), x.data_ptr())
+        torch.testing.assert_close(out.cuda(), expected, **TOLERANCES[torch.float32])
+
+    def test_rejects_pageable_input(self):
+        with self.assertRaises(ValueError):
+            fused_layer_norm_streaming(torch.randn(4, 128), (128,))
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormRowIndex(unittest.TestCase):
+    # Register-cached (128) and block-per-row (2048) kernels, unaligned rows (100) and
+    # the widest row-wise backward (6144).
+    COLS = [128, 2048, 100, 6144]
+
+    def test_matches_torch_on_active_rows(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            for create_scale, create_offset in AFFINE_MODES:
+                with self.subTest(cols=cols, scale=create_scale, offset=create_offset):
+                    layer_norm = _random_layer_norm(
+                        cols, create_scale, create_offset, torch.float32
+                    )
+                    params = (layer_norm.weight, layer_norm.bias)
+                    mask = torch.rand(3, 29, device="cuda") < 0.6
+                    x = torch.randn(3, 29, cols, device="cuda", requires_grad=True)
+                    x_ref = x.detach().clone().requires_grad_(True)
+                    grad_out = torch.randn(3, 29, cols, device="cuda")
+
+                    out = fused_layer_norm_masked(
+                        x, (cols,), *params, layer_norm.eps, row_mask=mask
+                    )
+                    out.backward(grad_out)
+                    grads = [p.grad for p in params if p is not None]
+                    for p in params:
+                        if p is not None:
+                            p.grad = None
+                    # Padding rows take no part in the reference backward.
+                    expected = _reference(layer_norm, x_ref) * mask[..., None]
+                    expected.backward(grad_out)
+                    expected_grads = [p.grad for p in params if p is not None]
+
+                    torch.testing.assert_close(out, expected, atol=1e-4, rtol=1e-4)
+                    self.assertTrue((out[~mask] == 0).all())
+                    torch.testing.assert_close(x.grad, x_ref.grad, atol=1e-4, rtol=1e-4)
+                    self.assertTrue((x.grad[~mask] == 0).all())
+                    for grad, expected_grad in zip(grads, expected_grads):
+                        torch.testing.assert_close(
+                            grad, expected_grad, atol=1e-3, rtol=1e-3
+                        )
+
+    def test_row_index_matches_row_mask(self):
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(128, True, True, torch.bfloat16)
+        params = (layer_norm.weight, layer_norm.bias, layer_norm.eps)
+        x = torch.randn(4, 16, 128, device="cuda", dtype=torch.bfloat16)
+        mask = torch.zeros(4, 16, dtype=torch.bool, device="cuda")
+        mask[:, :11] = True
+        row_index = mask.reshape(-1).nonzero().squeeze(1)
+        with torch.no_grad():
+            from_mask = fused_layer_norm_masked(x, 128, *params, row_mask=mask)
+            from_index = fused_layer_norm_masked(x, 128, *params, row_index=row_index)
+            none_active = fused_layer_norm_masked(
+                x, 128, *params, row_index=row_index[:0]
+            )
+        torch.testing.assert_close(from_index, from_mask, atol=0, rtol=0)
+        torch.testing.assert_close(
+            from_mask[mask], _reference(layer_norm, x)[mask], **TOLERANCES[x.dtype]
+        )
+        self.assertTrue((none_active == 0).all())
+        with self.assertRaises(ValueError):
+            fused_layer_norm_masked(x, 128, *params)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormInplace(unittest.TestCase):
+    # Fused backward from the output (128) and the rebuilt-input fallback (2048, 100).
+    COLS = [128, 2048, 100]
+
+    def test_inplace_matches_torch(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            for create_scale, create_offset in AFFINE_MODES:
+                with self.subTest(cols=cols, scale=create_scale, offset=create_offset):
+                    layer_norm = _random_layer_norm(
+                        cols, create_scale, create_offset, torch.float32
+                    )
+                    layer_norm.inplace = True
+                    x_leaf = torch.randn(53, cols, device="cuda", requires_grad=True)
+                    x_ref = x_leaf.detach().clone().requires_grad_(True)
+                    grad_out = torch.randn(53, cols, device="cuda")
+
+                    x = x_leaf * 3 + 1
+                    out = layer_norm(x)
+                    self.assertEqual(out.data_ptr(), x.data_ptr())
+                    out.backward(grad_out)
+                    params = [
+                        p for p in (layer_norm.weight, layer_norm.bias) if p is not None
+                    ]
+                    ref = _reference(layer_norm, x_ref * 3 + 1)
+                    torch.testing.assert_close(out, ref, **TOLERANCES[torch.float32])
+                    ref_grads = torch.autograd.grad(ref, [x_ref] + params, grad_out)
+                    torch.testing.assert_close(
+                        x_leaf.grad, ref_grads[0], atol=1e-3, rtol=1e-3
+                    )
+                    for p, ref_grad in zip(params, ref_grads[1:]):
+                        torch.testing.assert_close(
+                            p.grad, ref_grad, atol=1e-3, rtol=1e-3
+                        )
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormSavedXHat(unittest.TestCase):
+    # Register-cached (128) and block-per-row (100, 2048) forwards; 6144 is the widest
+    # row-wise backward, which needs more than the default 48 KB of shared memory.
+    COLS = [128, 2048, 100, 6144]
+
+    def _grads(self, layer_norm, x, grad_out):
+        x = x.detach().requires_grad_(True)
+        saved = []
+        with torch.autograd.graph.saved_tensors_hooks(
+            lambda t: saved.append(t.numel() * t.element_size()) or t, lambda t: t
+        ):
+            out = layer_norm(x)
+        out.backward(grad_out)
+        params = [p for p in (layer_norm.weight, layer_norm.bias) if p is not None]
+        grads = [x.grad] + [p.grad for p in params]
+        for p in params:
+            p.grad = None
+        return out, grads, sum(saved)
+
+    def test_matches_regular_backward(self):
+        torch.manual_seed(0)
+        # (input dtype, x_hat dtype, relative gradient error bound)
+        cases = [
+            (torch.float32, torch.bfloat16, 1e-2),
+            (torch.bfloat16, torch.float8_e4m3fn, 1e-1),
+        ]
+        for dtype, xhat_dtype, bound in cases:
+            for cols in self.COLS:
+                for create_scale, create_offset in AFFINE_MODES:
+                    with self.subTest(
+                        dtype=dtype,
+                        xhat=xhat_dtype,
+                        cols=cols,
+                        affine=(create_scale, create_offset),
+                    ):
+                        layer_norm = _random_layer_norm(
+                            cols, create_scale, create_offset, dtype
+                        )
+                        x = torch.randn(67, cols, device="cuda", dtype=dtype) * 3 + 1
+                        grad_out = torch.randn_like(x)
+                        out, grads, saved = self._grads(layer_norm, x, grad_out)
+                        layer_norm.saved_xhat_dtype = xhat_dtype
+                        out_xhat, grads_xhat, saved_xhat = self._grads(
+                            layer_norm, x, grad_out
+                        )
+                        torch.testing.assert_close(out_xhat, out, **TOLERANCES[dtype])
+                        self.assertLess(saved_xhat, saved)
+                        for grad, grad_xhat in zip(grads, grads_xhat):
+                            self.assertEqual(grad_xhat.dtype, grad.dtype)
+                            error = (grad_xhat.float() - grad.float()).norm()
+                            self.assertLess(error, bound * grad.float().norm() + 1e-3)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormTransposed(unittest.TestCase):
+    # 6144 is the widest row-wise backward.
+    COLS = [128, 2048, 100, 6144]
+
+    def test_matches_transposed_torch(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            for create_scale, create_offset in AFFINE_MODES:
+                with self.subTest(cols=cols, scale=create_scale, offset=create_offset):
+                    layer_norm = _random_layer_norm(
+                        cols, create_scale, create_offset, torch.float32
+                    )
+                    x = torch.randn(2, 13, 17, cols, device="cuda") * 3 + 1
+                    x.requires_grad_(True)
+                    x_ref = x.detach().clone().requires_grad_(True)
+                    grad_out = torch.randn(2, 17, 13, cols, device="cuda")
+
+                    out = layer_norm.forward_transposed(x)
+                    self.assertEqual(out.shape, (2, 17, 13, cols))
+                    self.assertTrue(out.is_contiguous())
+                    ref = _reference(layer_norm, x_ref).transpose(-3, -2)
+                    torch.testing.assert_close(out, ref, **TOLERANCES[torch.float32])
+
+                    out.backward(grad_out)
+                    params = [
+                        p for p in (layer_norm.weight, layer_norm.bias) if p is not None
+                    ]
+                    ref_grads = torch.autograd.grad(ref, [x_ref] + params, grad_out)
+                    torch.testing.assert_close(
+                        x.grad, ref_grads[0], atol=1e-3, rtol=1e-3
+                    )
+                    for p, ref_grad in zip(params, ref_grads[1:]):
+                        torch.testing.assert_close(
+                            p.grad, ref_grad, atol=1e-3, rtol=1e-3
+                        )
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormStrided(unittest.TestCase):
+    COLS = [128, 2048, 100]
+
+    def _check(self, layer_norm, x):
+        x = x.detach().requires_grad_(True)
+        x_ref = x.detach().clone().requires_grad_(True)
+        grad_out = torch.randn_like(x)
+        out = layer_norm(x)
+        ref = _reference(layer_norm, x_ref)
+        torch.testing.assert_close(out, ref, **TOLERANCES[torch.float32])
+        out.backward(grad_out)
+        params = [layer_norm.weight, layer_norm.bias]
+        ref_grads = torch.autograd.grad(ref, [x_ref] + params, grad_out)
+        torch.testing.assert_close(x.grad, ref_grads[0], **TOLERANCES[torch.float32])
+        for p, ref_grad in zip(params, ref_grads[1:]):
+            torch.testing.assert_close(p.grad, ref_grad, atol=1e-3, rtol=1e-3)
+        return out
+
+    def test_permuted_view_keeps_layout(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            with self.subTest(cols=cols):
+                layer_norm = _random_layer_norm(cols, True, True, torch.float32)
+                # The "ending node" transpose of a [B, I, J, C] pair tensor.
+                x = torch.randn(2, 12, 9, cols, device="cuda").transpose(1, 2)
+                out = self._check(layer_norm, x)
+                self.assertEqual(out.stride(), x.stride())
+
+    def test_non_dense_view(self):
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(128, True, True, torch.float32)
+        x = torch.randn(2, 12, 9, 128, device="cuda")[:, ::2]
+        self._check(layer_norm, x)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormUnalignedRows(unittest.TestCase):
+    # Odd widths start consecutive rows at different alignments; a storage offset of 1
+    # also misaligns the first row.
+    COLS = [33, 101, 130]
+
+    def _check(self, dtype, cols, offset):
+        tol = TOLERANCES[dtype]
+        layer_norm = _random_layer_norm(cols, True, True, dtype)
+        storage = torch.randn(61 * cols + offset, device="cuda", dtype=dtype)
+        x = storage[offset:].view(61, cols).requires_grad_(True)
+        x_ref = x.detach().clone().requires_grad_(True)
+        grad_out = torch.randn_like(x)
+        out = layer_norm(x)
+        ref = _reference(layer_norm, x_ref)
+        torch.testing.assert_close(out.float(), ref, **tol)
+        out.backward(grad_out)
+        (ref_grad,) = torch.autograd.grad(ref, [x_ref], grad_out.float())
+        torch.testing.assert_close(x.grad.float(), ref_grad, **tol)
+
+    def test_matches_torch(self):
+        torch.manual_seed(0)
+        for dtype in TOLERANCES:
+            for cols in self.COLS:
+                for offset in [0, 1]:
+                    with self.subTest(dtype=dtype, cols=cols, offset=offset):
+                        self._check(dtype, cols, offset)
+
+
+# Register-cached fused backward (128), two-step reduction (2048, 100).
+PARAM_GRAD_COLS = [128, 2048, 100]
+# The affine modes with at least one parameter.
+PARAM_GRAD_AFFINE = [
+    dict(create_scale=scale, create_offset=offset) for scale, offset in AFFINE_MODES[:3]
+]
+
+
+def _sweep(test, check, dtypes, variants, cols=PARAM_GRAD_COLS):
+    """Runs check(dtype, cols, **variant) in a subTest for every combination."""
+    for dtype in dtypes:
+        for width in cols:
+            for variant in variants:
+                with test.subTest(dtype=dtype, cols=width, **variant):
+                    check(dtype, width, **variant)
+
+
+def _check_input_grad(test, layer_norm, dtype, cols, run, micro_batches=1):
+    """Runs the path under test, run(x, grad_out), on micro_batches random inputs,
+    checks grad_input against torch and returns the reference gradients of the
+    parameters present, summed over the micro-batches."""
+    tol = TOLERANCES[dtype]
+    params = [p for p in (layer_norm.weight, layer_norm.bias) if p is not None]
+    totals = [None] * len(params)
+    for _ in range(micro_batches):
+        x = torch.randn(257, cols, device="cuda", dtype=dtype).requires_grad_(True)
+        x_ref = x.detach().clone().requires_grad_(True)
+        grad_out = torch.randn_like(x)
+        out = run(x, grad_out)
+        ref = _reference(layer_norm, x_ref)
+        if out is not None:
+            test.assertEqual(out.dtype, dtype)
+            torch.testing.assert_close(out.float(), ref, **tol)
+        ref_grads = torch.autograd.grad(ref, [x_ref] + params, grad_out.float())
+        torch.testing.assert_close(x.grad.float(), ref_grads[0], **tol)
+        totals = [
+            ref_grad if total is None else total + ref_grad
+            for total, ref_grad in zip(totals, ref_grads[1:])
+        ]
+    return totals
+
+
+def _forward_backward(layer_norm, **kwargs):
+    def run(x, grad_out):
+        out = layer_norm(x, **kwargs)
+        out.backward(grad_out)
+        return out
+
+    return run
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormFp32Params(unittest.TestCase):
+    # fp32 master weights next to half-precision activations, without casting them.
+    def _check(self, dtype, cols, create_scale, create_offset):
+        layer_norm = _random_layer_norm(
+            cols, create_scale, create_offset, torch.float32
+        )
+        ref_grads = _check_input_grad(
+            self, layer_norm, dtype, cols, _forward_backward(layer_norm)
+        )
+        params = [p for p in (layer_norm.weight, layer_norm.bias) if p is not None]
+        for param, ref_grad in zip(params, ref_grads):
+            self.assertEqual(param.grad.dtype, torch.float32)
+            torch.testing.assert_close(param.grad, ref_grad, **TOLERANCES[dtype])
+
+    def test_matches_torch(self):
+        torch.manual_seed(0)
+        _sweep(self, self._check, [torch.float16, torch.bfloat16], PARAM_GRAD_AFFINE)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormMainGrad(unittest.TestCase):
+    def _check(self, dtype, cols, create_scale, create_offset):
+        layer_norm = _random_layer_norm(
+            cols, create_scale, create_offset, torch.float32
+        )
+        params = [p for p in (layer_norm.weight, layer_norm.bias) if p is not None]
+        for p in params:
+            p.main_grad = torch.randn_like(p)
+        initial = [p.main_grad.clone() for p in params]
+        # Two micro-batches accumulate into the same buffers.
+        ref_grads = _check_input_grad(
+            self, layer_norm, dtype, cols, _forward_backward(layer_norm), 2
+        )
+        for p, start, ref_grad in zip(params, initial, ref_grads):
+            self.assertIsNone(p.grad)
+            torch.testing.assert_close(
+                p.main_grad, start + ref_grad, **TOLERANCES[dtype]
+            )
+
+    def test_accumulates_into_main_grad(self):
+        torch.manual_seed(0)
+        _sweep(self, self._check, [torch.float32, torch.bfloat16], PARAM_GRAD_AFFINE)
+
+    def test_accumulates_on_every_backward_path(self):
+        torch.manual_seed(0)
+        cols = 128
+        ones = torch.ones(257, device="cuda")
+        paths = {
+            "recompute_stats": (dict(save_stats=False), {}),
+            "inplace": (dict(inplace=True), {}),
+            "epilogue": ({}, dict(mask=ones)),
+        }
+        for name, (options, call_kwargs) in paths.items():
+            with self.subTest(path=name):
+                layer_norm = FusedLayerNorm(cols, **options).cuda()
+                params = [layer_norm.weight, layer_norm.bias]
+                for p in params:
+                    p.main_grad = torch.zeros_like(p)
+                x = torch.randn(257, cols, device="cuda", requires_grad=True)
+                grad_out = torch.randn_like(x)
+                # The inplace path needs a non-leaf input it may overwrite.
+                layer_norm(x * 1.0, **call_kwargs).backward(grad_out)
+                ref_grads = torch.autograd.grad(
+                    _reference(layer_norm, x.detach()), params, grad_out
+                )
+                for p, ref_grad in zip(params, ref_grads):
+                    self.assertIsNone(p.grad)
+                    torch.testing.assert_close(
+                        p.main_grad, ref_grad, atol=1e-3, rtol=1e-3
+                    )
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormPartialGradHook(unittest.TestCase):
+    def _check(self, dtype, cols, save_stats, epilogue=False):
+        layer_norm = _random_layer_norm(cols, True, True, dtype)
+        layer_norm.save_stats = save_stats
+        received = []
+        layer_norm.register_partial_grad_hook(
+            lambda *grads_and_event: received.append(grads_and_event)
+        )
+        # An all-ones mask leaves the output as it is but takes the epilogue kernels.
+        mask = torch.ones(257, device="cuda") if epilogue else None
+        ref_grads = _check_input_grad(
+            self, layer_norm, dtype, cols, _forward_backward(layer_norm, mask=mask)
+        )
+        self.assertEqual(len(received), 1)
+        grad_weight, grad_bias, event = received[0]
+        event.synchronize()
+        params = [layer_norm.weight, layer_norm.bias]
+        for param, grad, ref_grad in zip(params, (grad_weight, grad_bias), ref_grads):
+            self.assertIsNone(param.grad)
+            self.assertEqual(grad.dtype, torch.float32)
+            torch.testing.assert_close(grad, ref_grad, **TOLERANCES[dtype])
+
+    def test_hook_receives_fp32_partials(self):
+        torch.manual_seed(0)
+        variants = [dict(save_stats=True), dict(save_stats=False)]
+        _sweep(self, self._check, [torch.float32, torch.bfloat16], variants)
+
+    def test_hook_covers_the_epilogue(self):
+        torch.manual_seed(0)
+        variants = [dict(save_stats=True, epilogue=True)]
+        _sweep(self, self._check, [torch.float32, torch.bfloat16], variants, [128])
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormProfiling(unittest.TestCase):
+    def setUp(self):
+        profiling.set_profiling(True)
+        profiling.reset_profile_stats()
+
+    def tearDown(self):
+        profiling.set_profiling(False)
+        profiling.reset_profile_stats()
+
+    def test_records_every_call(self):
+        layer_norm = _random_layer_norm(128, True, True, torch.bfloat16)
+        x = torch.randn(4, 64, 128, device="cuda", dtype=torch.bfloat16)
+        layer_norm(x.requires_grad_(True)).sum().backward()
+        with torch.no_grad():
+            layer_norm(x)
+        stats = profiling.profile_stats()
+        self.assertEqual(
+            [call["op"] for call in stats], ["forward", "backward", "forward_inference"]
+        )
+        for call in stats:
+            self.assertEqual((call["rows"], call["cols"]), (256, 128))
+            self.assertEqual(call["dtype"], "BFloat16")
+            self.assertNotEqual(call["kernel"], "none")
+            self.assertGreater(call["elapsed_us"], 0)
+            self.assertGreater(call["bytes"], 2 * x.numel() * x.element_size())
+        self.assertIn("forward_inference", profiling.profile_summary(peak_gbps=1000))
+
+    def test_records_the_specialized_paths(self):
+        ext = fast_layer_norm_cuda_v2
+        x = torch.randn(256, 128, device="cuda", dtype=torch.bfloat16)
+        gamma = torch.randn(128, device="cuda", dtype=torch.bfloat16)
+        beta = torch.randn_like(gamma)
+        dout = torch.randn_like(x)
+        _, invvar = ext.forward_rms_norm(x, [128], gamma, 1e-5)
+        ext.backward_rms_norm(dout, invvar, x, [128], gamma)
+        _, _, mean, invvar = ext.forward_add_layer_norm(x, x, [128], gamma, beta, 1e-5)
+        main_grad = torch.zeros(128, device="cuda")
+        ext.backward_main_grad(
+            dout, mean, invvar, x, [128], gamma, beta, main_grad, main_grad.clone(), 1e-5
+        )
+        ext.forward_save_xhat(x, [128], gamma, beta, 1e-5, torch.bfloat16)
+        ext.forward_grouped([x, x[:64]], [gamma, None], [beta, None], [1e-5, 1e-5])
+        stats = profiling.profile_stats()
+        self.assertEqual(
+            [call["op"] for call in stats],
+            [
+                "forward_rms",
+                "backward_rms",
+                "forward_add",
+                "backward_fp32_param_grads",
+                "forward_save_xhat",
+                "forward_grouped",
+            ],
+        )
+        self.assertEqual(stats[0]["kernel"].split()[0], "rms_v2")
+        self.assertEqual(stats[-1]["kernel"], "grouped")
+        self.assertEqual(stats[-1]["rows"], 320)
+        for call in stats:
+            self.assertNotEqual(call["kernel"], "none")
+            self.assertGreater(call["bytes"], 2 * x.numel() * x.element_size())
+
+    def test_off_records_nothing(self):
+        profiling.set_profiling(False)
+        layer_norm = _random_layer_norm(128, True, True, torch.float32)
+        layer_norm(torch.randn(8, 128, device="cuda"))
+        self.assertEqual(profiling.profile_stats(), [])
+
+
+@unittest.skipUnless(FUSED_LN_IMPORTED, "fused LayerNorm extension required")
+class TestFusedLayerNormCpu(unittest.TestCase):
+    COLS = [64, 100, 384, 1000]
+
+    def _layer_norm(self, cols, create_scale, create_offset, save_stats=True):
+        layer_norm = FusedLayerNorm(
+            cols,
+            create_scale=create_scale,
+            create_offset=create_offset,
+            save_stats=save_stats,
+        )
+        with torch.no_grad():
+            if layer_norm.weight is not None:
+                layer_norm.weight.normal_(1.0, 0.1)
+            if layer_norm.bias is not None:
+                layer_norm.bias.normal_(0.0, 0.1)
+        return layer_norm
+
+    def test_forward_backward_match_reference(self):
+        torch.manual_seed(0)
+        for dtype in [torch.float32, torch.bfloat16]:
+            for cols in self.COLS:
+                for create_scale, create_offset in AFFINE_MODES:
+                    with self.subTest(
+                        dtype=dtype, cols=cols, affine=(create_scale, create_offset)
+                    ):
+                        # fp32 parameters next to bf16 activations.
+                        layer_norm = self._layer_norm(cols, create_scale, create_offset)
+                        x = torch.randn(3, 41, cols, dtype=dtype) * 3 + 1
+                        x.requires_grad_(True)
+                        x_ref = x.detach().float().requires_grad_(True)
+                        grad_out = torch.randn(3, 41, cols, dtype=dtype)
+
+                        out = layer_norm(x)
+                        self.assertEqual(out.device.type, "cpu")
+                        self.assertEqual(out.dtype, dtype)
+                        ref = _reference(layer_norm, x_ref)
+                        torch.testing.assert_close(
+                            out.float(), ref, **TOLERANCES[dtype]
+                        )
+
+                        out.backward(grad_out)
+                        params = [
+                            p
+                            for p in (layer_norm.weight, layer_norm.bias)
+                            if p is not None
+                        ]
+                        ref_grads = torch.autograd.grad(
+                            ref, [x_ref] + params, grad_out.float()
+                        )
+                        torch.testing.assert_close(
+                            x.grad.float(), ref_grads[0], **TOLERANCES[dtype]
+                        )
+                        for p, ref_grad in zip(params, ref_grads[1:]):
+                            torch.testing.assert_close(
+                                p.grad, ref_grad, atol=5e-2, rtol=5e-2
+                            )
+
+    def test_recomputed_stats_and_inference(self):
+        torch.manual_seed(0)
+        x = torch.randn(64, 256) * 2 - 1
+        for save_stats in [True, False]:
+            layer_norm = self._layer_norm(256, True, True, save_stats=save_stats)
+            x_grad = x.clone().requires_grad_(True)
+            layer_norm(x_grad).sum().backward()
+            x_ref = x.clone().requires_grad_(True)
+            _reference(layer_norm, x_ref).sum().backward()
+            torch.testing.assert_close(
+                x_grad.grad, x_ref.grad, **TOLERANCES[torch.float32]
+            )
+        with torch.no_grad():
+            torch.testing.assert_close(
+                layer_norm(x), _reference(layer_norm, x), **TOLERANCES[torch.float32]
+            )
+
+    def test_epilogue_is_composed(self):
+        torch.manual_seed(0)
+        layer_norm = self._layer_norm(128, True, True)
+        x = torch.randn(2, 16, 128)
+        mask = (torch.rand(2, 16) > 0.3).float()
+        gate = torch.sigmoid(torch.randn(2, 16, 128))
+        expected = _reference(layer_norm, x) * mask.unsqueeze(-1) * gate
+        torch.testing.assert_close(
+            layer_norm(x, mask=mask, gate=gate),
+            expected,
+            **TOLERANCES[torch.float32],
+        )
+
+
+def _rms_reference(rms_norm, x):
+    x = x.float()
+    out = x * torch.rsqrt(x.pow(2).mean(-1, keepdim=True) + rms_norm.eps)
+    if rms_norm.weight is not None:
+        out = out * rms_norm.weight.float()
+    return out
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedRMSNorm(unittest.TestCase):
+    COLS = [64, 128, 384, 2048, 100, 200]
+
+    def test_forward_matches_reference(self):
+        torch.manual_seed(0)
+        for dtype, tol in TOLERANCES.items():
+            for cols in self.COLS:
+                for create_scale in [True, False]:
+                    with self.subTest(dtype=dtype, cols=cols, scale=create_scale):
+                        rms_norm = FusedRMSNorm(cols, create_scale=create_scale).cuda()
+                        if rms_norm.weight is not None:
+                            with torch.no_grad():
+                                rms_norm.weight.normal_(1.0, 0.1)
+                        rms_norm = rms_norm.to(dtype)
+                        x = torch.randn(37, cols, device="cuda", dtype=dtype) * 3 + 1
+                        out = rms_norm(x)
+                        self.assertEqual(out.dtype, dtype)
+                        torch.testing.assert_close(
+                            out.float(), _rms_reference(rms_norm, x), **tol
+                        )
+
+    def test_backward_matches_reference(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            for create_scale in [True, False]:
+                with self.subTest(cols=cols, scale=create_scale):
+                    rms_norm = FusedRMSNorm(cols, create_scale=create_scale).cuda()
+                    x = torch.randn(53, cols, device="cuda", requires_grad=True)
+                    x_ref = x.detach().clone().requires_grad_(True)
+                    grad_out = torch.randn(53, cols, device="cuda")
+
+                    rms_norm(x).backward(grad_out)
+                    params = [] if rms_norm.weight is None else [rms_norm.weight]
+                    ref_grads = torch.autograd.grad(
+                        _rms_reference(rms_norm, x_ref), [x_ref] + params, grad_out
+                    )
+                    torch.testing.assert_close(
+                        x.grad, ref_grads[0], **TOLERANCES[torch.float32]
+                    )
+                    for p, ref in zip(params, ref_grads[1:]):
+                        torch.testing.assert_close(p.grad, ref, atol=1e-3, rtol=1e-3)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestLayerNormAutotuner(unittest.TestCase):
+    def tearDown(self):
+        fast_layer_norm_cuda_v2.clear_tuned_launches()
+
+    def test_tunes_once_and_reloads_from_cache(self):
+        torch.manual_seed(0)
+        with tempfile.TemporaryDirectory() as tmp:
+            cache_path = os.path.join(tmp, "layer_norm_autotune.json")
+            tuner = LayerNormAutotuner(
+                fast_layer_norm_cuda_v2, cache_path, enabled=True
+            )
+            layer_norm = _random_layer_norm(100, True, True, torch.float32)
+            x = torch.randn(257, 100, device="cuda")
+            tuner.maybe_tune(x, layer_norm.weight, layer_norm.bias, (100,), 1e-5)
+            with open(cache_path) as f:
+                cache = json.load(f)
+            self.assertEqual(len(cache), 2)
+            self.assertEqual(
+                sorted(entry["backward"] for entry in cache.values()), [False, True]
+            )
+            self.assertEqual({entry["rows_bucket"] for entry in cache.values()}, {8})
+
+            # The tuned launch must still compute LayerNorm.
+            x.requires_grad_(True)
+            x_ref = x.detach().clone().requires_grad_(True)
+            grad_out = torch.randn_like(x)
+            out = layer_norm(x)
+            ref = _reference(layer_norm, x_ref)
+            torch.testing.assert_close(out, ref, **TOLERANCES[torch.float32])
+            out.backward(grad_out)
+            (ref_grad,) = torch.autograd.grad(ref, [x_ref], grad_out)
+            torch.testing.assert_close(x.grad, ref_grad, **TOLERANCES[torch.float32])
+
+            # A new process starts from the cache and does not benchmark again.
+            reloaded = LayerNormAutotuner(
+                fast_layer_norm_cuda_v2, cache_path, enabled=True
+            )
+            with mock.patch.object(reloaded, "_time_us", side_effect=AssertionError):
+                reloaded.maybe_tune(
+                    x.detach(), layer_norm.weight, layer_norm.bias, (100,), 1e-5
+                )
+                # Nor for another row count of the same log2 bucket.
+                reloaded.maybe_tune(
+                    torch.randn(500, 100, device="cuda"),
+                    layer_norm.weight,
+                    layer_norm.bias,
+                    (100,),
+                    1e-5,
+                )
+
+            # Many more rows are tuned on their own.
+            reloaded.maybe_tune(
+                torch.randn(4096, 100, device="cuda"),
+                layer_norm.weight,
+                layer_norm.bias,
+                (100,),
+                1e-5,
+            )
+            with open(cache_path) as f:
+                cache = json.load(f)
+            self.assertEqual(
+                sorted({entry["rows_bucket"] for entry in cache.values()}), [8, 12]
+            )
+            self.assertEqual(len(cache), 4)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormCudaGraph(unittest.TestCase):
+    """Forward and backward must be capturable; a launch on the legacy default stream
+    would invalidate the capture."""
+
+    def test_capture_and_replay(self):
+        torch.manual_seed(0)
+        # 128 takes the warp-per-row kernels, 2048 the block-per-row kernels.
+        for cols in [128, 2048]:
+            with self.subTest(cols=cols):
+                layer_norm = _random_layer_norm(cols, True, True, torch.float32)
+                static_x = torch.randn(64, cols, device="cuda", requires_grad=True)
+                static_grad = torch.randn(64, cols, device="cuda")
+
+                side_stream = torch.cuda.Stream()
+                side_stream.wait_stream(torch.cuda.current_stream())
+                with torch.cuda.stream(side_stream):
+                    for _ in range(3):
+                        layer_norm(static_x).backward(static_grad)
+                torch.cuda.current_stream().wait_stream(side_stream)
+
+                layer_norm.zero_grad(set_to_none=True)
+                static_x.grad = None
+                graph = torch.cuda.CUDAGraph()
+                with torch.cuda.graph(graph):
+                    static_out = layer_norm(static_x)
+                    static_out.backward(static_grad)
+
+                for _ in range(2):
+                    x = torch.randn(64, cols, device="cuda")
+                    with torch.no_grad():
+                        static_x.copy_(x)
+                    graph.replay()
+
+                    x_ref = x.clone().requires_grad_(True)
+                    params = [layer_norm.weight, layer_norm.bias]
+                    ref_out = _reference(layer_norm, x_ref)
+                    ref_grads = torch.autograd.grad(
+                        ref_out, [x_ref] + params, static_grad
+                    )
+                    torch.testing.assert_close(
+                        static_out, ref_out, atol=1e-4, rtol=1e-4
+                    )
+                    torch.testing.assert_close(
+                        static_x.grad, ref_grads[0], atol=1e-4, rtol=1e-4
+                    )
+                    for p, ref in zip(params, ref_grads[1:]):
+                        torch.testing.assert_close(p.grad, ref, atol=1e-3, rtol=1e-3)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormCustomOp(unittest.TestCase):
+    def test_opcheck(self):
+        torch.manual_seed(0)
+        # Contiguous, a permuted view with dense rows (normalized in place) and a view
+        # whose rows are not dense (copied, contiguous output).
+        inputs = {
+            "contiguous": lambda: torch.randn(9, 128, device="cuda"),
+            "permuted": lambda: torch.randn(5, 9, 128, device="cuda").transpose(0, 1),
+            "sliced": lambda: torch.randn(9, 256, device="cuda")[:, :128],
+        }
+        for layout, make_input in inputs.items():
+            for create_scale, create_offset in AFFINE_MODES:
+                with self.subTest(
+                    layout=layout, scale=create_scale, offset=create_offset
+                ):
+                    layer_norm = _random_layer_norm(
+                        128, create_scale, create_offset, torch.float32
+                    )
+                    x = make_input().requires_grad_(True)
+                    params = (layer_norm.weight, layer_norm.bias)
+                    args = (x, [128], *params, layer_norm.eps)
+                    torch.library.opcheck(
+                        torch.ops.protenix_layer_norm.layer_norm, args
+                    )
+
+    def test_keeps_the_layout_of_dense_rows(self):
+        x = torch.randn(5, 9, 128, device="cuda").transpose(0, 1)
+        out, _, _ = torch.ops.protenix_layer_norm.layer_norm(x, [128], None, None, 1e-5)
+        self.assertEqual(out.stride(), x.stride())
+        torch.testing.assert_close(
+            out, torch.nn.functional.layer_norm(x, (128,)), atol=1e-4, rtol=1e-4
+        )
+
+    def test_compiles_without_graph_break(self):
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(128, True, True, torch.float32)
+
+        def block(x):
+            return torch.sigmoid(layer_norm(x * 2.0)) + x
+
+        compiled = torch.compile(block, fullgraph=True)
+        x = torch.randn(37, 128, device="cuda", requires_grad=True)
+        x_ref = x.detach().clone().requires_grad_(True)
+        grad_out = torch.randn_like(x)
+        out = compiled(x)
+        out.backward(grad_out)
+        grads = [x.grad, layer_norm.weight.grad, layer_norm.bias.grad]
+
+        layer_norm.zero_grad(set_to_none=True)
+        ref = block(x_ref)
+        ref.backward(grad_out)
+        ref_grads = [x_ref.grad, layer_norm.weight.grad, layer_norm.bias.grad]
+        torch.testing.assert_close(out, ref, atol=1e-4, rtol=1e-4)
+        for grad, ref_grad in zip(grads, ref_grads):
+            torch.testing.assert_close(grad, ref_grad, atol=1e-3, rtol=1e-3)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedGroupedLayerNorm(unittest.TestCase):
+    def _check(self, dtype, shapes):
+        tol = TOLERANCES[dtype]
+        affine = [AFFINE_MODES[i % len(AFFINE_MODES)] for i in range(len(shapes))]
+        norms = [
+            _random_layer_norm(shape[-1], scale, offset, dtype)
+            for shape, (scale, offset) in zip(shapes, affine)
+        ]
+        for i, norm in enumerate(norms):
+            norm.eps = 10.0 ** -(5 - i % 3)
+        xs = [
+            torch.randn(shape, device="cuda", dtype=dtype, requires_grad=True)
+            for shape in shapes
+        ]
+        outs = fused_grouped_layer_norm(
+            xs,
+            [n.weight for n in norms],
+            [n.bias for n in norms],
+            [n.eps for n in norms],
+        )
+        grad_outs = [torch.randn_like(out) for out in outs]
+        torch.autograd.backward(outs, grad_outs)
+        for norm, x, out, grad_out in zip(norms, xs, outs, grad_outs):
+            x_ref = x.detach().clone().requires_grad_(True)
+            ref = _reference(norm, x_ref)
+            torch.testing.assert_close(out.float(), ref, **tol)
+            params = [p for p in (norm.weight, norm.bias) if p is not None]
+            ref_grads = torch.autograd.grad(ref, [x_ref] + params, grad_out.float())
+            torch.testing.assert_close(x.grad.float(), ref_grads[0], **tol)
+            for p, ref_grad in zip(params, ref_grads[1:]):
+                torch.testing.assert_close(
+                    p.grad.float(), ref_grad, atol=5e-2, rtol=5e-2
+                )
+
+    def test_mixed_widths(self):
+        torch.manual_seed(0)
+        shapes = [(2, 17, 64), (33, 100), (5, 384), (1, 33), (0, 128)]
+        for dtype in TOLERANCES:
+            with self.subTest(dtype=dtype):
+                self._check(dtype, shapes)
+
+    def test_more_tasks_than_one_launch_holds(self):
+        torch.manual_seed(0)
+        # Split across several launches.
+        shapes = [(7 + i, 32 + 8 * i) for i in range(50)]
+        self._check(torch.float32, shapes)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedAddLayerNorm(unittest.TestCase):
+    # Register-cached, block-per-row (100 has no register-cached kernel) and the
+    # add-then-normalize fallback for rows too wide to cache.
+    COLS = [128, 2048, 100, 12500]
+
+    def test_matches_add_then_layer_norm(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            for create_scale, create_offset in AFFINE_MODES:
+                with self.subTest(cols=cols, scale=create_scale, offset=create_offset):
+                    layer_norm = _random_layer_norm(
+                        cols, create_scale, create_offset, torch.float32
+                    )
+                    residual = torch.randn(53, cols, device="cuda", requires_grad=True)
+                    update = torch.randn(53, cols, device="cuda", requires_grad=True)
+                    residual_ref = residual.detach().clone().requires_grad_(True)
+                    update_ref = update.detach().clone().requires_grad_(True)
+
+                    sum_, out = layer_norm.forward_add(residual, update)
+                    sum_ref = residual_ref + update_ref
+                    out_ref = _reference(layer_norm, sum_ref)
+                    torch.testing.assert_close(sum_, sum_ref)
+                    torch.testing.assert_close(
+                        out, out_ref, **TOLERANCES[torch.float32]
+                    )
+
+                    grad_sum = torch.randn_like(sum_ref)
+                    grad_out = torch.randn_like(out_ref)
+                    params = [
+                        p for p in (layer_norm.weight, layer_norm.bias) if p is not None
+                    ]
+                    torch.autograd.backward([sum_, out], [grad_sum, grad_out])
+                    grads = [p.grad for p in params]
+                    for p in params:
+                        p.grad = None
+                    torch.autograd.backward([sum_ref, out_ref], [grad_sum, grad_out])
+                    for grad in (residual.grad, update.grad):
+                        torch.testing.assert_close(
+                            grad, residual_ref.grad, **TOLERANCES[torch.float32]
+                        )
+                    for p, grad in zip(params, grads):
+                        torch.testing.assert_close(grad, p.grad, atol=1e-3, rtol=1e-3)
+
+    def test_uncached_widths_stay_fused(self):
+        # Many rows of a width without a register-cached kernel: block-per-row, not the
+        # separate add.
+        residual = torch.randn(4096, 100, device="cuda")
+        update = torch.randn_like(residual)
+        profiling.set_profiling(True)
+        profiling.reset_profile_stats()
+        try:
+            fast_layer_norm_cuda_v2.forward_add_layer_norm(
+                residual, update, [100], None, None, 1e-5
+            )
+            stats = profiling.profile_stats()
+        finally:
+            profiling.set_profiling(False)
+            profiling.reset_profile_stats()
+        self.assertEqual(
+            [(call["op"], call["kernel"]) for call in stats],
+            [("forward_add", "block_per_row")],
+        )
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormEpilogue(unittest.TestCase):
+    # Register-cached and block-per-row widths; 100 only has the block-per-row path. The
+    # backward is fused into the LayerNorm backward to 6144 columns, two-pass at 8192.
+    COLS = [128, 2048, 100, 8192]
+
+    def _check(self, layer_norm, x, mask, gate, dropout):
+        x = x.detach().clone().requires_grad_(True)
+        x_ref = x.detach().clone().requires_grad_(True)
+        gate_ref = gate.detach().clone().requires_grad_(True)
+        gate = gate.detach().clone().requires_grad_(True)
+        params = [p for p in (layer_norm.weight, layer_norm.bias) if p is not None]
+
+        out = layer_norm(x, mask=mask, gate=gate, dropout=dropout)
+        grad_out = torch.randn_like(out)
+        out.backward(grad_out)
+        grads = [p.grad for p in params]
+        for p in params:
+            p.grad = None
+
+        # Dropped elements are exactly zero; the reference reuses the kernel's mask.
+        keep = (out != 0).float() / (1 - dropout)
+        ref = _reference(layer_norm, x_ref) * mask[..., None] * gate_ref * keep
+        ref.backward(grad_out)
+        tol = TOLERANCES[torch.float32]
+        torch.testing.assert_close(out, ref, **tol)
+        torch.testing.assert_close(x.grad, x_ref.grad, **tol)
+        torch.testing.assert_close(gate.grad, gate_ref.grad, **tol)
+        for p, grad in zip(params, grads):
+            torch.testing.assert_close(grad, p.grad, atol=1e-3, rtol=1e-3)
+        return out
+
+    def test_mask_gate_dropout_match_torch(self):
+        torch.manual_seed(0)
+        for cols in self.COLS:
+            for dropout in [0.0, 0.25]:
+                with self.subTest(cols=cols, dropout=dropout):
+                    layer_norm = _random_layer_norm(cols, True, True, torch.float32)
+                    x = torch.randn(4, 13, cols, device="cuda")
+                    mask = (torch.rand(4, 13, device="cuda") > 0.2).float()
+                    gate = torch.sigmoid(torch.randn(4, 13, cols, device="cuda"))
+                    out = self._check(layer_norm, x, mask, gate, dropout)
+                    if dropout > 0:
+                        kept = (out != 0).sum() / (mask.sum() * cols)
+                        self.assertAlmostEqual(kept.item(), 1 - dropout, delta=0.05)
+
+    def test_dropout_only_in_training(self):
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(128, True, True, torch.float32)
+        x = torch.randn(64, 128, device="cuda")
+        first = layer_norm(x, dropout=0.5)
+        second = layer_norm(x, dropout=0.5)
+        self.assertFalse(torch.equal(first != 0, second != 0))
+        layer_norm.eval()
+        torch.testing.assert_close(layer_norm(x, dropout=0.5), layer_norm(x))
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedAdaLayerNorm(unittest.TestCase):
+    # Register-cached (128, 768) and block-per-row (100) widths; the backward is one
+    # sweep up to 6144 columns and two-pass at 8192.
+    COLS = [128, 768, 100, 8192]
+
+    def _check(self, dtype, cols):
+        tol = TOLERANCES[dtype]
+        tensors = [
+            torch.randn(3, 41, cols, device="cuda", dtype=dtype, requires_grad=True)
+            for _ in range(3)
+        ]
+        refs = [t.detach().float().requires_grad_(True) for t in tensors]
+        grad_out = torch.randn(3, 41, cols, device="cuda", dtype=dtype)
+
+        out = fused_ada_layer_norm(*tensors, eps=1e-5)
+        self.assertEqual(out.dtype, dtype)
+        out.backward(grad_out)
+        x, scale, shift = refs
+        ref = torch.sigmoid(scale) * torch.nn.functional.layer_norm(
+            x, (cols,), eps=1e-5
+        ) + shift
+        ref.backward(grad_out.float())
+        torch.testing.assert_close(out.float(), ref, **tol)
+        for t, r in zip(tensors, refs):
+            torch.testing.assert_close(t.grad.float(), r.grad, **tol)
+
+    def test_matches_torch(self):
+        torch.manual_seed(0)
+        for dtype in TOLERANCES:
+            for cols in self.COLS:
+                with self.subTest(dtype=dtype, cols=cols):
+                    self._check(dtype, cols)
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormLinear(unittest.TestCase):
+    def test_matches_layer_norm_then_linears(self):
+        torch.manual_seed(0)
+        for bias in [True, False]:
+            with self.subTest(bias=bias):
+                layer_norm = _random_layer_norm(128, True, True, torch.float32)
+                linears = [
+                    torch.nn.Linear(128, n, bias=bias).cuda() for n in (32, 32, 128)
+                ]
+                fused = FusedLayerNormLinear.from_modules(layer_norm, linears)
+
+                x = torch.randn(2, 17, 128, device="cuda", requires_grad=True)
+                x_ref = x.detach().clone().requires_grad_(True)
+                outs = fused(x)
+                normalized = _reference(layer_norm, x_ref)
+                ref_outs = [linear(normalized) for linear in linears]
+                self.assertEqual(len(outs), 3)
+                for out, ref in zip(outs, ref_outs):
+                    torch.testing.assert_close(out, ref, atol=1e-4, rtol=1e-4)
+
+                grads = [torch.randn_like(ref) for ref in ref_outs]
+                torch.autograd.backward(outs, grads)
+                torch.autograd.backward(ref_outs, grads)
+                torch.testing.assert_close(x.grad, x_ref.grad, atol=1e-4, rtol=1e-4)
+                torch.testing.assert_close(
+                    fused.linear_weight.grad,
+                    torch.cat([linear.weight.grad for linear in linears]),
+                    atol=1e-3,
+                    rtol=1e-3,
+                )
+                torch.testing.assert_close(
+                    fused.layer_norm.weight.grad,
+                    layer_norm.weight.grad,
+                    atol=1e-3,
+                    rtol=1e-3,
+                )
+                if bias:
+                    torch.testing.assert_close(
+                        fused.linear_bias.grad,
+                        torch.cat([linear.bias.grad for linear in linears]),
+                        atol=1e-3,
+                        rtol=1e-3,
+                    )
+
+    def test_partial_tiles_without_affine(self):
+        # Neither the rows, the output features nor the normalized width are multiples
+        # of the GEMM tiles.
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(100, False, False, torch.float32)
+        linear = torch.nn.Linear(100, 70).cuda()
+        fused = FusedLayerNormLinear.from_modules(layer_norm, [linear])
+
+        x = torch.randn(67, 100, device="cuda", requires_grad=True)
+        x_ref = x.detach().clone().requires_grad_(True)
+        (out,) = fused(x)
+        ref = linear(_reference(layer_norm, x_ref))
+        torch.testing.assert_close(out, ref, atol=1e-4, rtol=1e-4)
+
+        grad = torch.randn_like(ref)
+        out.backward(grad)
+        ref.backward(grad)
+        torch.testing.assert_close(x.grad, x_ref.grad, atol=1e-4, rtol=1e-4)
+        torch.testing.assert_close(
+            fused.linear_weight.grad, linear.weight.grad, atol=1e-3, rtol=1e-3
+        )
+
+    def test_weight_gradient_split_over_rows(self):
+        # Enough rows for the weight gradient to split M, with a partial last split.
+        torch.manual_seed(0)
+        layer_norm = _random_layer_norm(128, True, True, torch.float32)
+        linear = torch.nn.Linear(128, 64).cuda()
+        fused = FusedLayerNormLinear.from_modules(layer_norm, [linear])
+
+        x = torch.randn(64 * 37 + 5, 128, device="cuda")
+        (out,) = fused(x)
+        ref = linear(_reference(layer_norm, x))
+        grad = torch.randn_like(ref)
+        out.backward(grad)
+        ref.backward(grad)
+        scale = linear.weight.grad.abs().max().item()
+        torch.testing.assert_close(
+            fused.linear_weight.grad / scale,
+            linear.weight.grad / scale,
+            atol=1e-4,
+            rtol=1e-4,
+        )
+
+
+@unittest.skipUnless(FUSED_LN_AVAILABLE, "CUDA + fused LayerNorm extension required")
+class TestFusedLayerNormFp8(unittest.TestCase):
+    def test_dequantized_output_matches_torch(self):
+        torch.manual_seed(0)
+        for fp8_dtype, rtol in [(torch.float8_e4m3fn, 0.07), (torch.float8_e5m2, 0.13)]:
+            for cols in [128, 384]:
+                with self.subTest(fp8_dtype=fp8_dtype, cols=cols):
+                    layer_norm = _random_layer_norm(cols, True, True, torch.bfloat16)
+                    x = torch.randn(3, 67, cols, device="cuda", dtype=torch.bfloat16)
+                    ref = _reference(layer_norm, x)
+                    atol = rtol * ref.abs().amax().item() / 16
+
+                    out, scale_inv = fused_layer_norm_fp8(
+                        x, cols, layer_norm.weight, layer_norm.bias, fp8_dtype=fp8_dtype
+                    )
+                    self.assertEqual(out.dtype, fp8_dtype)
+                    self.assertEqual(scale_inv.shape, x.shape[:-1])
+                    torch.testing.assert_close(
+                        out.float() * scale_inv[..., None], ref, atol=atol, rtol=rtol
+                    )
+
+                    scale = torch.full((1,), 8.0, device="cuda")
+                    out, amax = fused_layer_norm_fp8(
+                        x,
+                        cols,
+                        layer_norm.weight,
+                        layer_norm.bias,
+                        fp8_dtype=fp8_dtype,
+                        scale=scale,
+                    )
+                    torch.testing.assert_close(
+                        amax, ref.abs().amax().view(1), atol=1e-2, rtol=1e-2
+                    )
+                    torch.testing.assert_close(
+                        out.float() / scale, ref, atol=atol, rtol=rtol
+                    )
+
+
+if __name__ == "__main__":
+    unittest.main()